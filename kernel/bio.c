@@ -1,13 +1,30 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups of different blocks don't contend.
+// A buffer with refcnt == 0 remembers when it was last released
+// (b->lastuse, in ticks); a cache miss recycles the unused buffer
+// with the oldest timestamp, whichever bucket it lives in.
+//
+// binit() sizes the cache to a fraction of the memory kinit()
+// found, rather than a compile-time count: the first nbuf of
+// the MAXNBUF buffers are used, with their data blocks packed
+// PGSIZE/BSIZE to a page.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to write it to disk,
+//     or bwritev to write several buffers at once.
+// * To overwrite a whole block without reading it, call bnew.
+// * breadstart and bwritestart start the disk I/O and return;
+//     bwait waits for it, so many blocks can be in flight at once.
+// * breadahead starts reading a block into the cache and forgets
+//     about it; the buffer is released when the read completes.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -22,70 +39,313 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "biostat.h"
+#include "bootparam.h"
+
+// max breadahead() reads in flight, so that readahead
+// can't take all the buffers the log needs.
+#define NAHEAD (RAMAX*2)
 
 struct {
+  // serializes cache misses, so that only one CPU at a time
+  // moves buffers between buckets.
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf buf[MAXNBUF];
+  int nbuf;            // buffers in use
+
+  // per-bucket doubly-linked lists of buffers, through prev/next.
+  struct {
+    struct spinlock lock;
+    struct buf head;
+  } bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  int nahead;          // breadahead() reads in flight
+  struct biostat stat; // updated with __sync_fetch_and_add()
 } bcache;
 
+#define BSTAT(f) __sync_fetch_and_add(&bcache.stat.f, 1)
+#define BKSTAT(f, b) __sync_fetch_and_add(&bcache.stat.f[blockkind((b)->dev, (b)->blockno)], 1)
+
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// unlink b from whatever bucket list it is on.
+// caller holds that bucket's lock.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// insert b at the front of bucket id.
+// caller holds bcache.bucket[id].lock.
+static void
+binsert(int id, struct buf *b)
+{
+  struct buf *head = &bcache.bucket[id].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  char *data = 0;
+  uint64 n;
+  int i;
+
+  // the cache's blocks get 1/BCACHEMEM of free memory, but
+  // there are at least NBUF of them; or as many as nbuf= says.
+  n = nfreepages() * PGSIZE / BCACHEMEM / BSIZE;
+  if(bootparam.nbuf)
+    n = bootparam.nbuf;
+  if(n < NBUF)
+    n = NBUF;
+  if(n > MAXNBUF)
+    n = MAXNBUF;
+  bcache.nbuf = n;
+  bcache.stat.nbuf = n;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // spread the buffers over the buckets.
+  for(b = bcache.buf, i = 0; b < bcache.buf+bcache.nbuf; b++, i++){
+    if(i % (PGSIZE/BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit");
+    b->data = (uchar*)data + (i % (PGSIZE/BSIZE)) * BSIZE;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = 0;
+    binsert(i % NBUCKET, b);
+  }
+}
+
+// look for block (dev, blockno) in bucket id.
+// caller holds the bucket's lock.
+static struct buf*
+blookup(int id, uint dev, uint blockno)
+{
+  struct buf *b, *head = &bcache.bucket[id].head;
+
+  for(b = head->next; b != head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For readahead, return 0 instead if the block is already
+// cached or if there is no free buffer.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  int id = bhash(dev, blockno);
+  int i, vid;
 
+  // Is the block already cached?
+  acquire(&bcache.bucket[id].lock);
+  if((b = blookup(id, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[id].lock);
+      return 0;
+    }
+    b->refcnt++;
+    release(&bcache.bucket[id].lock);
+    if(b->lock.locked)
+      BKSTAT(wait, b);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bcache.bucket[id].lock);
+
+  // Not cached. Only one CPU at a time may recycle buffers,
+  // so that two misses on the same block don't both insert it,
+  // and so that holding two bucket locks below can't deadlock.
   acquire(&bcache.lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  // Another CPU may have cached the block while we
+  // weren't holding the bucket lock.
+  acquire(&bcache.bucket[id].lock);
+  if((b = blookup(id, dev, blockno)) != 0){
+    if(ahead){
+      release(&bcache.bucket[id].lock);
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    release(&bcache.bucket[id].lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bcache.bucket[id].lock);
+
+  // Recycle the least recently used unused buffer.
+  // Keep holding the lock of the bucket that contains
+  // the best candidate so far, so it can't be taken.
+  victim = 0;
+  vid = -1;
+  for(i = 0; i < NBUCKET; i++){
+    struct buf *head = &bcache.bucket[i].head;
+    int found = 0;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+    acquire(&bcache.bucket[i].lock);
+    for(b = head->next; b != head; b = b->next){
+      if(b->refcnt == 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(vid >= 0)
+        release(&bcache.bucket[vid].lock);
+      vid = i;
+    } else {
+      release(&bcache.bucket[i].lock);
+    }
+  }
+  if(victim == 0){
+    if(ahead){
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    panic("bget: no buffers");
+  }
+
+  // move the victim into bucket id.
+  if(victim->ahead)
+    BSTAT(ra_unused); // read ahead for nothing
+  if(victim->valid)
+    BKSTAT(evict, victim);
+  victim->ahead = 0;
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  if(vid != id){
+    bunlink(victim);
+    release(&bcache.bucket[vid].lock);
+    acquire(&bcache.bucket[id].lock);
+    binsert(id, victim);
+  }
+  release(&bcache.bucket[id].lock);
+  release(&bcache.lock);
+
+  acquiresleep(&victim->lock);
+  return victim;
+}
+
+// Return a locked buf for the indicated block, with the
+// disk read of its contents started if it isn't cached.
+// Call bwait() before looking at b->data.
+struct buf*
+breadstart(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  if(!b->valid){
+    BSTAT(nmiss);
+    BKSTAT(miss, b);
+    virtio_disk_submit(b, 0);
+  } else {
+    BSTAT(nhit);
+    BKSTAT(hit, b);
+    if(b->ahead)
+      BSTAT(ra_hit);
+  }
+  b->ahead = 0;
+  return b;
+}
+
+// Start reading the indicated block into the cache, but don't
+// wait for it or keep the buffer: virtio_disk_intr() calls
+// bdone() when the read finishes. Does nothing if the block
+// is already cached, or if buffers or readahead slots are short.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if(__sync_add_and_fetch(&bcache.nahead, 1) > NAHEAD){
+    __sync_sub_and_fetch(&bcache.nahead, 1);
+    return;
   }
-  panic("bget: no buffers");
+  if((b = bget(dev, blockno, 1)) == 0){
+    __sync_sub_and_fetch(&bcache.nahead, 1);
+    return;
+  }
+  BSTAT(ra_issued);
+  b->ahead = 1;
+  b->async = 1;
+  virtio_disk_submit(b, 0);
+}
+
+// Drop one reference to b, stamping it with the release
+// time for bget()'s LRU recycling if it's no longer used.
+static void
+bput(struct buf *b)
+{
+  int id;
+
+  // b can't move to another bucket while refcnt > 0.
+  id = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[id].lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    b->lastuse = ticks;
+  }
+  release(&bcache.bucket[id].lock);
+}
+
+// Finish a breadahead(): b's contents are valid now.
+// Called by virtio_disk_intr(), on behalf of whoever
+// called breadahead().
+void
+bdone(struct buf *b)
+{
+  b->async = 0;
+  b->valid = 1;
+  __sync_sub_and_fetch(&bcache.nahead, 1);
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start writing b's contents to disk.  Must be locked.
+// Call bwait() before changing b->data or releasing b.
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  virtio_disk_submit(b, 1);
+}
+
+// Wait for the disk I/O started on locked buffer b to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+  b->valid = 1;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,11 +354,8 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
-  if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
-  }
+  b = breadstart(dev, blockno);
+  bwait(b);
   return b;
 }
 
@@ -106,13 +363,40 @@ bread(uint dev, uint blockno)
 void
 bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("bwrite");
-  virtio_disk_rw(b, 1);
+  bwritestart(b);
+  bwait(b);
+}
+
+// Write the contents of n locked buffers to disk,
+// with all the writes in flight together.
+void
+bwritev(struct buf **bufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    bwritestart(bufs[i]);
+  for(i = 0; i < n; i++)
+    bwait(bufs[i]);
+}
+
+// Return a locked buf for a block whose old contents the
+// caller is going to overwrite completely, without reading
+// it from disk first.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  b->ahead = 0;
+  return b;
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If nobody else holds it, stamp it with the release time
+// for bget()'s LRU recycling.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +404,30 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+// copy out the buffer cache counters.
+void
+biostat(struct biostat *st)
+{
+  *st = bcache.stat;
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int id = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[id].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[id].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int id = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[id].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[id].lock);
 }
-
-
@@ -0,0 +1,21 @@
+// kinds of block, for the per-kind buffer cache counters.
+#define BIO_LOG    0  // the log, header included
+#define BIO_INODE  1  // inode blocks
+#define BIO_BITMAP 2  // free block bitmap
+#define BIO_DATA   3  // file and directory contents, indirect blocks
+#define BIO_OTHER  4  // boot block, superblock, other devices
+#define NBIO       5
+
+struct biostat {
+  uint64 nhit;       // bread()s of cached blocks
+  uint64 nmiss;      // bread()s that had to read the disk
+  uint64 ra_issued;  // blocks read ahead
+  uint64 ra_hit;     // read-ahead blocks later bread()
+  uint64 ra_unused;  // read-ahead blocks recycled without being used
+  uint nbuf;         // buffers in the cache
+  // the same broken down by kind of block, and also:
+  uint64 hit[NBIO];
+  uint64 miss[NBIO];
+  uint64 evict[NBIO];  // cached blocks recycled for another block
+  uint64 wait[NBIO];   // bget()s that found the buffer locked and waited
+};
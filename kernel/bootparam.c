@@ -0,0 +1,139 @@
+// Boot parameters.
+//
+// The sizes of the process table, the inode cache and the
+// block cache are set at boot, from the kernel command line
+// (make qemu BOOTARGS="nproc=1024 ninode=2000"), rather than
+// compiled in. qemu hands hart 0 a flattened device tree, and
+// the command line is its /chosen node's bootargs property.
+//
+// bootparaminit() runs before kinit(): the tables are carved
+// out of the memory just after the kernel with bootalloc(), and
+// qemu puts the device tree at the top of RAM, which kinit() is
+// about to hand to the page allocator.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "bootparam.h"
+
+extern uint64 bootdtb;  // start.c
+
+struct bootparam bootparam = {
+  .nproc = NPROC,
+  .ninode = NINODE,
+  .nbuf = 0,
+};
+
+#define MINNINODE 50  // fewest inode cache entries
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+// device tree words are big-endian.
+static uint
+be32(void *p)
+{
+  uchar *b = p;
+
+  return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static char*
+skipname(char *s)
+{
+  while(*s)
+    s++;
+  return (char*)(((uint64)s + 1 + 3) & ~3UL);
+}
+
+// the bootargs property of the device tree at dtb, or 0.
+static char*
+bootargs(uint64 dtb)
+{
+  char *p, *strs, *name;
+  int depth = 0, inchosen = 0;
+  uint len;
+
+  if(dtb == 0 || dtb % 4 != 0 || be32((void*)dtb) != FDT_MAGIC)
+    return 0;
+  p = (char*)dtb + be32((char*)dtb + 8);
+  strs = (char*)dtb + be32((char*)dtb + 12);
+  for(;;){
+    switch(be32(p)){
+    case FDT_BEGIN_NODE:
+      name = p + 4;
+      depth++;
+      inchosen = depth == 2 && strncmp(name, "chosen", 7) == 0;
+      p = skipname(name);
+      break;
+    case FDT_END_NODE:
+      depth--;
+      inchosen = 0;
+      p += 4;
+      break;
+    case FDT_PROP:
+      len = be32(p + 4);
+      name = strs + be32(p + 8);
+      if(inchosen && strncmp(name, "bootargs", 9) == 0)
+        return p + 12;
+      p += 12 + ((len + 3) & ~3);
+      break;
+    case FDT_NOP:
+      p += 4;
+      break;
+    default:  // FDT_END, or garbage
+      return 0;
+    }
+  }
+}
+
+// parse "name=value" at s; return the value if the
+// name matches, else -1.
+static int
+param(char *s, char *name)
+{
+  int n = strlen(name), v = 0;
+
+  if(strncmp(s, name, n) != 0 || s[n] != '=')
+    return -1;
+  for(s += n + 1; *s >= '0' && *s <= '9'; s++)
+    v = v*10 + *s - '0';
+  return v;
+}
+
+static int
+clamp(int v, int lo, int hi)
+{
+  return v < lo ? lo : v > hi ? hi : v;
+}
+
+void
+bootparaminit(void)
+{
+  char *s;
+  int v;
+
+  if((s = bootargs(bootdtb)) != 0){
+    while(*s){
+      while(*s == ' ')
+        s++;
+      if((v = param(s, "nproc")) >= 0)
+        bootparam.nproc = clamp(v, NCPU, MAXNPROC);
+      else if((v = param(s, "ninode")) >= 0)
+        bootparam.ninode = clamp(v, MINNINODE, MAXNINODE);
+      else if((v = param(s, "nbuf")) >= 0)
+        bootparam.nbuf = clamp(v, NBUF, MAXNBUF);
+      while(*s && *s != ' ')
+        s++;
+    }
+  }
+
+  procalloc(bootparam.nproc);
+  icachealloc(bootparam.ninode);
+}
@@ -0,0 +1,8 @@
+// sizes set at boot; see bootparam.c.
+struct bootparam {
+  int nproc;    // process table slots
+  int ninode;   // inode cache entries
+  int nbuf;     // block cache buffers; 0 to size it to memory
+};
+
+extern struct bootparam bootparam;
@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int vq;      // virtio queue it was submitted to
+  int async;   // release buf when the disk is done (breadahead)
+  int ahead;   // read ahead, and not bread() since
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse;     // ticks at last brelse(), for LRU recycling
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes
 };
 
@@ -35,9 +35,9 @@ consputc(int c)
 {
   if(c == BACKSPACE){
     // if the user typed backspace, overwrite with a space.
-    uartputc_sync('\b'); uartputc_sync(' '); uartputc_sync('\b');
+    uartputc_nosleep('\b'); uartputc_nosleep(' '); uartputc_nosleep('\b');
   } else {
-    uartputc_sync(c);
+    uartputc_nosleep(c);
   }
 }
 
@@ -53,21 +53,25 @@ struct {
 } cons;
 
 //
-// user write()s to the console go here.
+// user write()s to the console go here,
+// copied a chunk at a time into a kernel buffer and handed
+// to the uart in bulk. cons.lock only guards input, and isn't
+// held: uartwrite() may sleep.
 //
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
-
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  char buf[128];
+  int i, m;
+
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
-  release(&cons.lock);
 
   return i;
 }
@@ -77,17 +81,21 @@ consolewrite(int user_src, uint64 src, int n)
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
 // or kernel address.
+// bytes are taken from cons.buf into a kernel
+// buffer under cons.lock, and copied out in bulk
+// after releasing it.
 //
 int
 consoleread(int user_dst, uint64 dst, int n)
 {
   uint target;
-  int c;
-  char cbuf;
+  int c, m, done;
+  char buf[128];
 
   target = n;
-  acquire(&cons.lock);
-  while(n > 0){
+  done = 0;
+  while(n > 0 && !done){
+    acquire(&cons.lock);
     // wait until interrupt handler has put some
     // input into cons.buffer.
     while(cons.r == cons.w){
@@ -98,32 +106,38 @@ consoleread(int user_dst, uint64 dst, int n)
       sleep(&cons.r, &cons.lock);
     }
 
-    c = cons.buf[cons.r++ % INPUT_BUF];
+    m = 0;
+    while(m < n && m < sizeof(buf) && cons.r != cons.w){
+      c = cons.buf[cons.r++ % INPUT_BUF];
+
+      if(c == C('D')){  // end-of-file
+        if(n - m < target){
+          // Save ^D for next time, to make sure
+          // caller gets a 0-byte result.
+          cons.r--;
+        }
+        done = 1;
+        break;
+      }
+
+      buf[m++] = c;
 
-    if(c == C('D')){  // end-of-file
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        cons.r--;
+      if(c == '\n'){
+        // a whole line has arrived, return to
+        // the user-level read().
+        done = 1;
+        break;
       }
-      break;
     }
+    release(&cons.lock);
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    // copy the input bytes to the user-space buffer.
+    if(either_copyout(user_dst, dst, buf, m) == -1)
       break;
 
-    dst++;
-    --n;
-
-    if(c == '\n'){
-      // a whole line has arrived, return to
-      // the user-level read().
-      break;
-    }
+    dst += m;
+    n -= m;
   }
-  release(&cons.lock);
 
   return target - n;
 }
@@ -0,0 +1,175 @@
+// Directory name cache.
+//
+// Remembers the result of dirlookup(): which inode a name in
+// a directory refers to, and where its entry is, or that the
+// directory has no entry with that name (a negative entry).
+// Path name lookup then doesn't have to read through each
+// directory on the way.
+//
+// Entries are hashed by (dev, directory inum, name) into
+// NDHASH chains, and recycled least recently used first.
+//
+// A directory's entries may only be looked up or changed
+// while holding that directory's ip->lock, as dirlookup()'s
+// caller does; dirlink() and unlink() update the cache while
+// they hold it, so it is never out of date. dcache.lock only
+// protects the cache's own lists.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDHASH 67  // prime
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory inum, 0 if the entry is unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if dinum has no entry called name
+  uint off;             // byte offset of the entry in the directory
+  struct dentry *hnext; // hash chain
+  struct dentry *prev;  // LRU list, most recently used first
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+  struct dentry *hash[NDHASH];
+  struct dentry lru;
+} dcache;
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// move d to the front of the LRU list.
+static void
+dtouch(struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = dcache.lru.next;
+  d->prev = &dcache.lru;
+  dcache.lru.next->prev = d;
+  dcache.lru.next = d;
+}
+
+// take d off its hash chain, if it is on one.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  if(d->dinum == 0)
+    return;
+  for(pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->dinum = 0;
+}
+
+void
+dcacheinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.prev = &dcache.lru;
+  dcache.lru.next = &dcache.lru;
+  for(d = dcache.dentry; d < dcache.dentry+NDCACHE; d++){
+    d->next = dcache.lru.next;
+    d->prev = &dcache.lru;
+    dcache.lru.next->prev = d;
+    dcache.lru.next = d;
+  }
+}
+
+// find the entry for name in directory (dev, dinum).
+// caller holds dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->hnext){
+    if(d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Look name up in directory (dev, dinum). Returns 0 if the
+// cache doesn't know; otherwise 1, with the inum in *inum
+// (0 if there is no such entry) and the entry's offset in *off.
+int
+dcache_lookup(uint dev, uint dinum, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  dtouch(d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory (dev, dinum) refers to inum,
+// in the entry at offset off; inum 0 records that there is no
+// such entry.
+void
+dcache_enter(uint dev, uint dinum, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    // recycle the least recently used entry.
+    d = dcache.lru.prev;
+    dunhash(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(dev, dinum, d->name);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Forget all entries of directory (dev, dinum), which is
+// being freed and whose inum may be reused.
+void
+dcache_purge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry+NDCACHE; d++){
+    if(d->dinum == dinum && d->dev == dev)
+      dunhash(d);
+  }
+  release(&dcache.lock);
+}
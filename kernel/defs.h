@@ -1,19 +1,35 @@
 struct buf;
 struct context;
+struct fdtable;
 struct file;
 struct inode;
+struct kmemstat;
+struct kmem_cache;
+struct biostat;
 struct pipe;
 struct proc;
+struct rwlock;
+struct seqlock;
+struct shmseg;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vmacct;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     breadstart(uint, uint);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
+void            biostat(struct biostat*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+struct buf*     bnew(uint, uint);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -22,59 +38,145 @@ void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*, uint*);
+void            dcache_enter(uint, uint, char*, uint, uint);
+void            dcache_purge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
+int             execload(struct proc*, char*, char**);
+int             execfault(struct proc*, uint64, uint64*, int*);
 
 // file.c
+int             fdalloc(struct fdtable*, struct file*);
+void            fdcloseall(struct fdtable*);
+int             fdcopy(struct fdtable*, struct fdtable*);
+struct file*    fdget(struct fdtable*, int, int);
+int             fdinstall(struct fdtable*, int, struct file*);
+struct file*    fdremove(struct fdtable*, int);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             filegetdents(struct file*, uint64, int n);
+int             filepread(struct file*, uint64, int n, uint off);
+int             filepwrite(struct file*, uint64, int n, uint off);
 int             fileread(struct file*, uint64, int n);
+int             filesendfile(struct file*, struct file*, int off, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
+
 // fs.c
 void            fsinit(int);
+void            ballocdelayed(void);
+int             blockkind(uint, uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
+void            icachealloc(int);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             mount(struct inode*, char*);
+int             mountpoint(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
+struct inode*   nameiat(struct inode*, char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readiblk(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
+// tmpfs.c
+void            tmpfsinit(void);
+
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// bootparam.c
+void            bootparaminit(void);
+
 // kalloc.c
+void*           bootalloc(uint64);
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_pages(int);
 void            kfree(void *);
+void            kfree_pages(void *, int);
 void            kinit(void);
+void            kinithart(void);
+void            kmemstat(struct kmemstat*);
+void            krefinc(void*);
+int             krefcnt(void*);
+uint64          nfreepages(void);
+int             kreserve(uint64);
+void            kunreserve(uint64);
+int             kzerofill(void);
+
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
+// pcache.c
+void            pcacheinit(void);
+char*           pcache_get(struct inode*, uint);
+void            pcache_update(struct inode*, uint, void*, uint);
+void            pcache_inval(struct inode*);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+int             log_delay(void);
+void            log_undelay(void);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            log_sync(void);
+
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+int             mmapfault(struct proc*, uint64, uint64*, int*);
+int             mmapcopy(struct proc*, struct proc*);
+void            mmapclear(struct proc*, pagetable_t);
+uint64          mmapbase(struct proc*);
+uint64          uvmend(struct proc*, uint64);
+int             imapped(struct proc*, struct inode*);
+uint64          mmapshm(struct shmseg*);
+int             munmapshm(uint64);
+
+// shm.c
+void            shminit(void);
+int             shmcreate(uint64);
+struct shmseg*  shmget(int);
+void            shmdup(struct shmseg*);
+void            shmput(struct shmseg*);
+uint64          shmsize(struct shmseg*);
+void*           shmpage(struct shmseg*, uint64);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -82,9 +184,14 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+void            procalloc(int);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             clone(uint64, uint64, uint64);
+int             spawn(char*, char**, struct fdtable*);
+int             procreclaim(void);
+int             getpriority(int);
 int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -95,15 +202,23 @@ struct proc*    myproc();
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setpriority(int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+struct proc*    wakeupone(void*);
+uint            wakeupticks(uint);
 void            yield(void);
+int             kthread(void (*)(void), char*);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             procinfo(uint64, int);
+void            tlbshootdown(void);
+void            tlbsync(struct proc*);
+void            tlbwait(struct proc*, uint64);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -111,11 +226,27 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
+int             lockstat(uint64, int, int);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// rwlock.c
+void            acquireread(struct rwlock*);
+void            acquirewrite(struct rwlock*);
+void            initrwlock(struct rwlock*, char*);
+void            releaseread(struct rwlock*);
+void            releasewrite(struct rwlock*);
+
+// seqlock.c
+void            initseqlock(struct seqlock*, char*);
+uint            seqreadbegin(struct seqlock*);
+int             seqreadretry(struct seqlock*, uint);
+void            seqwritebegin(struct seqlock*);
+void            seqwriteend(struct seqlock*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -131,16 +262,44 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+uint64          swapavail(void);
+void            swapdup(pte_t);
+void            swapput(pte_t);
+void            swapfree(void*);
+int             swapin(struct proc*, uint64);
+int             swapreclaim(int);
+void            swapstat(struct kmemstat*);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
 int             argaddr(int, uint64 *);
 int             fetchstr(uint64, char*, int);
+int             syshist(uint64, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// prof.c
+void            profinit(void);
+int             profstart(int);
+int             profintr(void);
+int             profread(uint64, int);
+
+// trace.c
+void            traceinit(void);
+int             traceread(uint64, int);
+void            tracerec(int, uint64, uint64, uint64, uint64);
+
 // trap.c
 extern uint     ticks;
+uint            getticks(void);
+void            sleepuntil(uint, struct spinlock*);
+void            timerbusy(void);
+void            timerinterval(uint64);
+void            timeridle(void);
+void            timerkick(int);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -150,23 +309,42 @@ void            usertrapret(void);
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
+void            uartwrite(char*, int);
+void            uartputc_nosleep(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// vmcopyin.c
+int             copyin_new(pagetable_t, char *, uint64, uint64);
+int             copyinstr_new(pagetable_t, char *, uint64, uint64);
+int             copyinfault(uint64);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            ukvmswitch(struct proc*);
+void            ukvmclear(pagetable_t);
+void            ukvmfree(pagetable_t);
+void            kvmswitch(void);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
-pagetable_t     uvmcreate(void);
+pagetable_t     uvmcreate(struct vmacct*);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             cowfault(pagetable_t, uint64);
+int             lazyfault(pagetable_t, uint64, uint64);
+void            uvmtouch(uint64, uint64);
+uint64          uvmhold(pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
+void            uvmreset(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+uint64          uvmunmapsync(struct proc*, uint64, uint64);
+int             uvmresolved(pagetable_t, uint64, uint64);
 void            uvmclear(pagetable_t, uint64);
+void            vmrss(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -182,7 +360,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_intr(int);
+uint64          virtio_disk_size(int);
+void            virtio_disk_rwraw(int, void*, uint, uint64, int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,25 +3,47 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
 int pagecopy(pagetable_t oldpage, pagetable_t newpage, uint64 begin, uint64 end);
+void ukvminithard(pagetable_t page);
 
 int
 exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+  int argc;
+
+  // the other threads would be left running in the old image.
+  if(p->leader != p || p->nthread > 1)
+    return -1;
+  if((argc = execload(p, path, argv)) < 0)
+    return -1;
+  // 因为load进来了新的program, 刷新一下内存映射
+  ukvminithard(p->kpagetable);
+  return argc; // this ends up in a0, the first argument to main(argc, argv)
+}
+
+// Replace p's user image with the program at path, for exec()
+// and for spawn(), whose p is a new child, not the caller;
+// path is looked up in the caller's current directory.
+// Returns argc, or -1.
+int
+execload(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg, r;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *oldip;
   struct proghdr ph;
+  struct execseg seg[NEXECSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -40,7 +62,11 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Don't load the program: remember where its segments are,
+  // and let execfault() page them in from ip as they are used.
+  // Their pages are reserved like those sbrk() adds.
+  memset(seg, 0, sizeof(seg));
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -50,25 +76,32 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || nseg >= NEXECSEG)
+      goto bad;
+    if(ph.vaddr + ph.memsz >= PLIC)
       goto bad;
+    if(kreserve((PGROUNDUP(ph.vaddr + ph.memsz) - PGROUNDUP(sz)) / PGSIZE) != 0)
+      goto bad;
+    sz = ph.vaddr + ph.memsz;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    seg[nseg].flags = ph.flags;
+    nseg++;
   }
-  iunlockput(ip);
+  iunlock(ip);
   end_op();
-  ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
+  if(sz + 2*PGSIZE >= PLIC) // 用户地址不能覆盖PLIC，见ukvminit()
+    goto bad;
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
@@ -111,59 +144,125 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  // swapreclaim() looks at p's page tables holding pglock,
+  // so switch them and rebuild the kernel page table mirror
+  // under it too.
+  acquire(&p->leader->pglock);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  // 复制新的kernel page并刷新TLB
+  // 新程序的段还没有映射，pagecopy()会跳过它们，先清除旧程序留下的映射
+  uvmunmap(p->kpagetable, 0, PGROUNDUP(oldsz) / PGSIZE, 0);
+  r = pagecopy(p->pagetable, p->kpagetable, 0, p->sz);
+  release(&p->leader->pglock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  oldip = p->execip;
+  p->execip = ip;
+  memmove(p->execseg, seg, sizeof(seg));
+  ip = 0;
+  pagetable = 0; // p's now; freed with p
+  mmapclear(p, oldpagetable);
   proc_freepagetable(oldpagetable, oldsz);
-
-    // 复制新的kernel page并刷新TLB
-  if (pagecopy(p->pagetable, p->kpagetable, 0, p->sz) != 0) {
-    goto bad;
+  if(oldip){
+    begin_op();
+    iput(oldip);
+    end_op();
   }
-  // 因为load进来了新的program, 刷新一下内存映射
-  w_satp(MAKE_SATP(p->kpagetable));
-  sfence_vma();
+  if(r != 0)
+    goto bad;
 
   if(p->pid==1) vmprint(p->pagetable, 0);
 
-  return argc; // this ends up in a0, the first argument to main(argc, argv)
+  return argc;
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    if(holdingsleep(&ip->lock)){
+      iunlockput(ip);
+    } else {
+      begin_op();
+      iput(ip);
+    }
     end_op();
   }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Find the page of p's program that belongs at va, for
+// lazyfault(). Returns 1 if va isn't backed by the file
+// (so it's bss, heap, or not p's at all), -1 if the page
+// can't be had, or 0 with a page for the caller to map
+// in *pa and the PTE flags to map it with in *perm.
+//
+// Pages wholly within the file come from the page cache
+// and are shared with every other process running the
+// program. Writable ones are mapped copy-on-write, so a
+// store gets a private copy from cowfault() and the cached
+// page is left alone. A page that ends part way through the
+// file is read into a private page, since the rest of it
+// must read as zero; so is one at an offset in the file that
+// isn't page-aligned, which the cache can't hold (user.ld
+// lays programs out so that doesn't happen).
+//
+// A thread's program is its leader's.
+int
+execfault(struct proc *p, uint64 va, uint64 *pa, int *perm)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  struct execseg *s;
+  struct inode *ip;
+  uint64 off, len;
+  char *mem;
+  int n;
+
+  p = p->leader;
+  if((ip = p->execip) == 0)
+    return 1;
+  for(s = p->execseg; s < p->execseg + NEXECSEG; s++){
+    if(s->memsz != 0 && va >= s->va && va < s->va + s->memsz)
+      break;
+  }
+  if(s == p->execseg + NEXECSEG)
+    return 1;
+  off = PGROUNDDOWN(va) - s->va;
+  if(off >= s->filesz)
+    return 1;
+
+  // reading ip may sleep, and needs ip->lock; the caller
+  // may be copying to or from a buffer in ip with it held.
+  if(holdingany() || holdingsleep(&ip->lock))
+    return -1;
+
+  *perm = PTE_U|PTE_R;
+  if(s->flags & ELF_PROG_FLAG_EXEC)
+    *perm |= PTE_X;
+  ilock(ip);
+  if(s->filesz - off >= PGSIZE && (s->off + off) % PGSIZE == 0){
+    mem = pcache_get(ip, s->off + off);
+    if(s->flags & ELF_PROG_FLAG_WRITE)
+      *perm |= PTE_COW;
+  } else {
+    len = s->filesz - off;
+    if(len > PGSIZE)
+      len = PGSIZE;
+    if((mem = kalloc()) != 0){
+      n = readi(ip, 0, (uint64)mem, s->off + off, len);
+      if(n != len){
+        kfree(mem);
+        mem = 0;
+      } else {
+        memset(mem + n, 0, PGSIZE - n);
+      }
+    }
+    if(s->flags & ELF_PROG_FLAG_WRITE)
+      *perm |= PTE_W;
   }
-  
+  iunlock(ip);
+  if(mem == 0)
+    return -1;
+  *pa = (uint64)mem;
   return 0;
 }
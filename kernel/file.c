@@ -12,17 +12,20 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
-struct {
-  struct spinlock lock;
-  struct file file[NFILE];
-} ftable;
+
+// struct files come from a slab cache, and are freed when
+// their last reference is closed. references are counted
+// with atomic instructions, so no lock is shared by all
+// open(), dup() and close() calls.
+static struct kmem_cache filecache;
 
 void
 fileinit(void)
 {
-  initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&filecache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,27 +34,19 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&ftable.lock);
-  if(f->ref < 1)
+  if(__sync_fetch_and_add(&f->ref, 1) < 1)
     panic("filedup");
-  f->ref++;
-  release(&ftable.lock);
   return f;
 }
 
@@ -60,18 +55,14 @@ void
 fileclose(struct file *f)
 {
   struct file ff;
+  int ref;
 
-  acquire(&ftable.lock);
-  if(f->ref < 1)
-    panic("fileclose");
-  if(--f->ref > 0){
-    release(&ftable.lock);
+  if((ref = __sync_sub_and_fetch(&f->ref, 1)) > 0)
     return;
-  }
+  if(ref < 0)
+    panic("fileclose");
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
-  release(&ftable.lock);
+  kmem_cache_free(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -82,6 +73,189 @@ fileclose(struct file *f)
   }
 }
 
+// Per-process file descriptor tables.
+//
+// The first NOFILE descriptors are kept in struct fdtable
+// itself, the rest, up to MAXOFILE, in pages of FDPERPAGE
+// pointers allocated when first used and freed by
+// fdcloseall(). used[] has a bit for each descriptor in use,
+// so that fdalloc() finds the lowest free one a word at a
+// time. Threads made by clone() share their leader's table,
+// so t->lock protects it; it is never held while closing a
+// file, which may sleep.
+
+// the slot for fd in t, allocating its page if alloc is set.
+// 0 if fd is out of range, or its page isn't there.
+// caller holds t->lock.
+static struct file**
+fdslot(struct fdtable *t, int fd, int alloc)
+{
+  struct file ***pg;
+
+  if(fd < 0 || fd >= MAXOFILE)
+    return 0;
+  if(fd < NOFILE)
+    return &t->ofile[fd];
+  fd -= NOFILE;
+  pg = &t->page[fd / FDPERPAGE];
+  if(*pg == 0 && (!alloc || (*pg = kalloc_zeroed()) == 0))
+    return 0;
+  return &(*pg)[fd % FDPERPAGE];
+}
+
+// the number of the lowest bit set in w, which isn't 0.
+static int
+lowbit(uint64 w)
+{
+  int b = 0;
+
+  if((w & 0xffffffff) == 0){ w >>= 32; b += 32; }
+  if((w & 0xffff) == 0){ w >>= 16; b += 16; }
+  if((w & 0xff) == 0){ w >>= 8; b += 8; }
+  if((w & 0xf) == 0){ w >>= 4; b += 4; }
+  if((w & 0x3) == 0){ w >>= 2; b += 2; }
+  if((w & 0x1) == 0)
+    b += 1;
+  return b;
+}
+
+// make fd in t refer to f, which may be 0, putting the file
+// fd referred to before in *old for the caller to close.
+// returns 0, or -1 if fd is out of range or there's no
+// memory for its page. caller holds t->lock.
+static int
+fdset(struct fdtable *t, int fd, struct file *f, struct file **old)
+{
+  struct file **s;
+
+  *old = 0;
+  if((s = fdslot(t, fd, f != 0)) == 0)
+    return f ? -1 : 0;
+  *old = *s;
+  *s = f;
+  if(f)
+    t->used[fd / 64] |= 1UL << (fd % 64);
+  else
+    t->used[fd / 64] &= ~(1UL << (fd % 64));
+  return 0;
+}
+
+// the file open as fd in t, or 0. if ref is set, with a
+// reference of the caller's own, so that another thread
+// closing fd can't free the file from under it.
+struct file*
+fdget(struct fdtable *t, int fd, int ref)
+{
+  struct file **s, *f = 0;
+
+  acquire(&t->lock);
+  if((s = fdslot(t, fd, 0)) != 0 && (f = *s) != 0 && ref)
+    filedup(f);
+  release(&t->lock);
+  return f;
+}
+
+// make fd in t refer to f, which may be 0, closing the file
+// fd referred to before. takes over the caller's reference
+// to f on success. returns 0, or -1 if fd is out of range or
+// there's no memory for its page.
+int
+fdinstall(struct fdtable *t, int fd, struct file *f)
+{
+  struct file *old;
+  int r;
+
+  acquire(&t->lock);
+  r = fdset(t, fd, f, &old);
+  release(&t->lock);
+  if(old)
+    fileclose(old);
+  return r;
+}
+
+// Allocate the lowest free file descriptor in t for f.
+// Takes over file reference from caller on success.
+int
+fdalloc(struct fdtable *t, struct file *f)
+{
+  struct file *old;
+  uint64 w;
+  int i, fd = -1;
+
+  acquire(&t->lock);
+  for(i = 0; i < NELEM(t->used); i++){
+    if((w = ~t->used[i]) == 0)
+      continue;
+    fd = i * 64 + lowbit(w);
+    if(fd >= MAXOFILE || fdset(t, fd, f, &old) < 0)
+      fd = -1;
+    break;
+  }
+  release(&t->lock);
+  return fd;
+}
+
+// take the file open as fd out of t, without closing it.
+// returns the file, or 0 if fd isn't open.
+struct file*
+fdremove(struct fdtable *t, int fd)
+{
+  struct file **s, *f = 0;
+
+  acquire(&t->lock);
+  if((s = fdslot(t, fd, 0)) != 0 && (f = *s) != 0){
+    *s = 0;
+    t->used[fd / 64] &= ~(1UL << (fd % 64));
+  }
+  release(&t->lock);
+  return f;
+}
+
+// give to, an empty table nobody else uses yet, another
+// reference to each of from's files, for fork(). returns 0,
+// or -1 if out of memory, having copied some; the caller
+// must fdcloseall(to).
+int
+fdcopy(struct fdtable *from, struct fdtable *to)
+{
+  struct file *f, *old;
+  uint64 w;
+  int i, fd, r = 0;
+
+  acquire(&from->lock);
+  for(i = 0; i < NELEM(from->used) && r == 0; i++){
+    for(w = from->used[i]; w; w &= w - 1){
+      fd = i * 64 + lowbit(w);
+      f = *fdslot(from, fd, 0);
+      if((r = fdset(to, fd, f, &old)) < 0)
+        break;
+      filedup(f);
+    }
+  }
+  release(&from->lock);
+  return r;
+}
+
+// close all of t's files and free its pages. the last thread
+// using t is exiting, so nobody else looks at it.
+void
+fdcloseall(struct fdtable *t)
+{
+  uint64 w;
+  int i;
+
+  for(i = 0; i < NELEM(t->used); i++){
+    for(w = t->used[i]; w; w &= w - 1)
+      fileclose(fdremove(t, i * 64 + lowbit(w)));
+  }
+  for(i = 0; i < NFDPAGE; i++){
+    if(t->page[i]){
+      kfree(t->page[i]);
+      t->page[i] = 0;
+    }
+  }
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -118,6 +292,8 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    if(imapped(myproc(), f->ip))
+      uvmtouch(addr, n); // a fault on addr couldn't read f->ip's pages with it locked
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -129,50 +305,70 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
-// Write to file f.
-// addr is a user virtual address.
-int
-filewrite(struct file *f, uint64 addr, int n)
+// Write n bytes at addr, a user virtual address if user_src==1,
+// a kernel address otherwise, to inode file f at offset *off,
+// advancing *off, a few blocks at a time.
+static int
+writeat(struct file *f, int user_src, uint64 addr, int n, uint *off)
 {
-  int r, ret = 0;
+  int r;
 
-  if(f->writable == 0)
-    return -1;
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // each op reserves only the log space its blocks
+  // need, so that several writers can share the log.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((LOGSIZE/2-1-1-2) / 2) * BSIZE;
+  int i = 0;
+  // fault addr in before starting a transaction: a fault on
+  // a lazy page waits for the vmlock, and mustn't hold up the
+  // log. a page of f->ip itself couldn't be read with it
+  // locked, as in fileread().
+  if(user_src)
+    uvmtouch(addr, n);
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    // a data and a bitmap block for each block touched
+    // (one more if unaligned), plus the i-node, and up to
+    // four indirect blocks with their bitmap blocks.
+    int nb = n1 / BSIZE + 2;
+
+    begin_opn(2*nb + 1 + 2*4);
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if(r < 0)
+      break;
+    if(r != n1)
+      panic("short filewrite");
+    i += r;
+  }
+  return (i == n ? n : -1);
+}
+
+// Write n bytes at addr to writable file f, as filewrite(),
+// or from the kernel if user_src==0.
+static int
+writefile(struct file *f, int user_src, uint64 addr, int n)
+{
+  int ret = 0;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, user_src, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r < 0)
-        break;
-      if(r != n1)
-        panic("short filewrite");
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = writeat(f, user_src, addr, n, &f->off);
   } else {
     panic("filewrite");
   }
@@ -180,3 +376,151 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  if(f->writable == 0)
+    return -1;
+  return writefile(f, 1, addr, n);
+}
+
+// Copy up to n bytes of inode file in to out without going
+// through user space, from offset off of in, or from in->off
+// on, advancing it, if off is -1. A page at a time, each is
+// written to out straight from the page cache page holding
+// it; files not in the page cache are read into a page of
+// the kernel's first. Returns the bytes copied, or -1 if none
+// could be written. in->off can't be both where the bytes come
+// from and where they go, so out == in needs an off.
+int
+filesendfile(struct file *out, struct file *in, int off, int n)
+{
+  struct inode *ip = in->ip;
+  char *pa, *copy = 0, *src;
+  uint o, m;
+  int w = 0, tot = 0;
+
+  if(in->readable == 0 || in->type != FD_INODE || out->writable == 0)
+    return -1;
+  if(out == in && off < 0)
+    return -1;
+  while(tot < n){
+    ilock(ip);
+    o = off < 0 ? in->off : off + tot;
+    if(o >= ip->size){
+      iunlock(ip);
+      break;
+    }
+    m = PGSIZE - o % PGSIZE;
+    if(m > n - tot)
+      m = n - tot;
+    if(m > ip->size - o)
+      m = ip->size - o;
+    pa = 0;
+    if(ip->type == T_FILE && ip->ops->pcache)
+      pa = pcache_get(ip, PGROUNDDOWN(o));
+    if(pa){
+      src = pa + o % PGSIZE;
+    } else {
+      // not cached, or out of memory for the page cache.
+      if(copy == 0 && (copy = kalloc()) == 0){
+        iunlock(ip);
+        break;
+      }
+      if((w = readi(ip, 0, (uint64)copy, o, m)) <= 0){
+        iunlock(ip);
+        break;
+      }
+      m = w;
+      src = copy;
+    }
+    iunlock(ip);
+    // no lock held: a pipe's reader, or the log, may make us wait.
+    w = writefile(out, 0, (uint64)src, m);
+    if(pa)
+      kfree(pa);
+    if(w <= 0)
+      break;
+    if(off < 0){
+      ilock(ip);
+      in->off += w;
+      iunlock(ip);
+    }
+    tot += w;
+    if(w != m)
+      break;
+  }
+  if(copy)
+    kfree(copy);
+  return tot == 0 && w < 0 ? -1 : tot;
+}
+
+// Read as many of directory f's entries, from f->off on, as
+// fit in n bytes at user address addr, skipping empty ones,
+// and advance f->off past them. returns the number of bytes
+// of struct dirent copied out, 0 at the end of the directory.
+int
+filegetdents(struct file *f, uint64 addr, int n)
+{
+  struct dirent de[32];
+  struct inode *ip = f->ip;
+  int nde, tot = 0;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  if(imapped(myproc(), ip))
+    uvmtouch(addr, n); // as in fileread()
+  ilock(ip);
+  if(ip->type != T_DIR){
+    iunlock(ip);
+    return -1;
+  }
+  // up to NELEM(de) entries per copyout().
+  while(n - tot >= sizeof(de[0]) && f->off < ip->size){
+    nde = 0;
+    while(nde < NELEM(de) && (nde+1) * sizeof(de[0]) <= n - tot && f->off < ip->size){
+      if(readi(ip, 0, (uint64)&de[nde], f->off, sizeof(de[0])) != sizeof(de[0]))
+        panic("filegetdents");
+      f->off += sizeof(de[0]);
+      if(de[nde].inum != 0)
+        nde++;
+    }
+    if(copyout(myproc()->pagetable, addr + tot, (char*)de, nde * sizeof(de[0])) < 0){
+      tot = -1;
+      break;
+    }
+    tot += nde * sizeof(de[0]);
+  }
+  iunlock(ip);
+  return tot;
+}
+
+// Read from file f at offset off, leaving f->off alone, so
+// that processes sharing f can read it at once. Only for
+// files with an inode; pipes and devices have no offsets.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  if(imapped(myproc(), f->ip))
+    uvmtouch(addr, n); // as in fileread()
+  ilock(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// Write to file f at offset off, as filepread() reads.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return writeat(f, 1, addr, n, &off);
+}
+
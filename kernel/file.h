@@ -17,18 +17,46 @@ struct file {
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
+  struct fsops *ops;  // dev's file system
   int ref;            // Reference count
+  struct inode *hprev; // icache hash bucket list
+  struct inode *hnext;
+  struct inode *lprev; // icache LRU list of free entries
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ranext;        // block readi() expects next if reading sequentially
+  uint raend;         // first block not yet read ahead
+  uint rawin;         // readahead window, in blocks
+  int pcached;        // may have pages in the page cache?
+  int dirty;          // iupdate()d, and not yet written back
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  uint allocnext;     // where bmap() looks for the next free block
+  int ndelay;         // data blocks waiting for commit to allocate them
 };
 
+// what a file system type does underneath the inode layer in
+// fs.c. the caller holds ip->lock, except for ialloc and mount.
+struct fsops {
+  char *name;         // for mount()
+  int pcache;         // read files through the page cache?
+  int (*mount)(uint dev);  // make an empty file system for device dev
+  struct inode* (*ialloc)(uint dev, short type);
+  void (*iread)(struct inode *ip);    // fill in ip for ilock()
+  void (*iupdate)(struct inode *ip);
+  void (*itrunc)(struct inode *ip);
+  int (*read)(struct inode *ip, int user_dst, uint64 dst, uint off, uint n);
+  int (*write)(struct inode *ip, int user_src, uint64 src, uint off, uint n);
+};
+
+extern struct fsops tmpfsops;
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
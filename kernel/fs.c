@@ -8,6 +8,13 @@
 // This file contains the low-level file system manipulation
 // routines.  The (higher-level) system call implementations
 // are in sysfile.c.
+//
+// Other file systems (tmpfs.c) can be mounted on directories.
+// Each device's inodes go through the struct fsops of its file
+// system for the parts that touch the store underneath: inode
+// allocation, reading and writing inodes, and file contents.
+// Directories and path names are the same everywhere, since
+// every file system keeps directories as files of dirents.
 
 #include "types.h"
 #include "riscv.h"
@@ -15,17 +22,76 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "biostat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
 
+// in-memory state of the free bitmap, so that balloc()
+// doesn't have to rescan it from block 0.
+struct {
+  struct spinlock lock;
+  uint hint;   // every block below hint is in use
+  uint nfree;  // number of free blocks
+} bfreemap;
+
+// in-memory copy of which inodes are in use, so that ialloc()
+// needn't read the inode blocks one by one from inode 1 on.
+// dirents hold 16-bit inode numbers, so there are at most
+// 65536 inodes.
+struct {
+  struct spinlock lock;
+  uint hint;   // every inode below hint is in use
+  uint64 used[65536/64];
+} imap;
+
+// data blocks of files whose allocation writes have put off
+// until the log commits, so that a transaction's appends get
+// their blocks all at once, one file's after another's, and a
+// file removed before the commit never gets any. bmap() gives
+// such a block the placeholder number DELAYBLK+k for entry k;
+// its buffer stays pinned in the cache, holding the data, until
+// ballocdelayed() moves it to the block it allocates and fixes
+// up the entry that pointed to the placeholder.
+#define NDELAY (LOGSIZE/2)
+#define DELAYBLK 0xffff0000
+#define isdelayed(b) ((b) >= DELAYBLK)
+
+struct {
+  struct spinlock lock;
+  struct {
+    struct inode *ip; // 0 if the entry is free
+    uint ind;         // indirect block pointing to it, 0 for ip->addrs[]
+    uint i;           // index in ind or in ip->addrs[]
+  } d[NDELAY];
+} delayed;
+
+static void bcount(int);
+static void icount(int);
+static struct fsops diskops;
+
+// Mounted file systems. A path that reaches a directory
+// something is mounted on continues in the root of the mounted
+// file system, and ".." in that root goes back up to the
+// directory's parent. Mounts are never undone.
+struct mount {
+  uint dev;           // device of the mounted file system, 0 if unused
+  struct fsops *ops;
+  struct inode *ip;   // directory it is mounted on, referenced
+};
+
+struct {
+  struct spinlock lock;
+  struct mount m[NMOUNT];
+} mtab;
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -43,16 +109,37 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  initlock(&delayed.lock, "delayed");
   initlog(dev, &sb);
+  bcount(dev);
+  icount(dev);
+}
+
+// what kind of block blockno of dev is, BIO_LOG &c, for the
+// buffer cache's counters. everything is BIO_OTHER until
+// fsinit() has read the superblock.
+int
+blockkind(uint dev, uint blockno)
+{
+  if(dev != ROOTDEV || sb.size == 0 || blockno < sb.logstart)
+    return BIO_OTHER;
+  if(blockno < sb.logstart + sb.nlog)
+    return BIO_LOG;
+  if(blockno < sb.bmapstart)
+    return sb.inodestart <= blockno ? BIO_INODE : BIO_OTHER;
+  if(blockno < sb.bmapstart + sb.size/BPB + 1)
+    return BIO_BITMAP;
+  return BIO_DATA;
 }
 
-// Zero a block.
+// Zero a block. Its old contents don't matter, so it isn't
+// read from the disk.
 static void
 bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -60,28 +147,120 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+// Count the free blocks and find the first one, for bfreemap.
+static void
+bcount(int dev)
 {
-  int b, bi, m;
+  uint b;
   struct buf *bp;
 
-  bp = 0;
+  initlock(&bfreemap.lock, "bfreemap");
+  bfreemap.hint = sb.size;
+  bfreemap.nfree = 0;
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+    for(int bi = 0; bi < BPB && b + bi < sb.size; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+        if(bfreemap.hint == sb.size)
+          bfreemap.hint = b + bi;
+        bfreemap.nfree++;
       }
     }
     brelse(bp);
   }
+}
+
+// Fill in imap from the inode blocks.
+static void
+icount(int dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  if(sb.ninodes > NELEM(imap.used) * 64)
+    panic("icount: too many inodes");
+  initlock(&imap.lock, "imap");
+  imap.used[0] = 1; // there's no inode 0
+  imap.hint = 1;
+  for(inum = 0; inum < sb.ninodes; inum += IPB){
+    bp = bread(dev, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data;
+    for(int i = 0; i < IPB && inum + i < sb.ninodes; i++){
+      if(dip[i].type != 0)
+        imap.used[(inum + i) / 64] |= 1UL << ((inum + i) % 64);
+    }
+    brelse(bp);
+  }
+}
+
+// Return the first clear bit at or after bit bi of a bitmap
+// block, or BPB if there is none. Looks at 64 bits at a time.
+static int
+bfirstzero(uchar *data, int bi)
+{
+  uint64 *w = (uint64*)data;
+  uint64 x;
+  int i;
+
+  for(i = bi / 64; i < BPB / 64; i++){
+    x = ~w[i];  // set bits are free blocks
+    if(i == bi / 64)
+      x &= ~0UL << (bi % 64);
+    if(x){
+      for(bi = i * 64; (x & 1) == 0; bi++)
+        x >>= 1;
+      return bi;
+    }
+  }
+  return BPB;
+}
+
+// Allocate a disk block: the first free block at or after
+// goal, wrapping around to the start of the disk. Passing the
+// block after the one allocated last keeps a file that grows
+// sequentially contiguous on disk. With no goal, start at
+// bfreemap.hint.
+// The block is not zeroed: writei() is about to overwrite most
+// new blocks, and bmap() zeroes the others.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, n, base, hint;
+  int bi;
+  struct buf *bp;
+
+  acquire(&bfreemap.lock);
+  if(bfreemap.nfree == 0)
+    panic("balloc: out of blocks");
+  hint = bfreemap.hint;
+  release(&bfreemap.lock);
+  if(goal == 0 || goal >= sb.size || goal < hint)
+    goal = hint;
+
+  b = goal < sb.size ? goal : 0;
+  for(n = 0; n < sb.size + BPB; ){
+    base = b - b % BPB;
+    bp = bread(dev, BBLOCK(b, sb));
+    bi = bfirstzero(bp->data, b % BPB);
+    if(bi < BPB && base + bi < sb.size){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      b = base + bi;
+      acquire(&bfreemap.lock);
+      bfreemap.nfree--;
+      if(goal == bfreemap.hint && b >= goal)
+        bfreemap.hint = b + 1;  // searched from the hint up to b
+      release(&bfreemap.lock);
+      return b;
+    }
+    brelse(bp);
+    n += base + BPB - b;
+    b = base + BPB;
+    if(b >= sb.size)
+      b = 0;
+  }
   panic("balloc: out of blocks");
 }
 
@@ -100,6 +279,12 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+
+  acquire(&bfreemap.lock);
+  bfreemap.nfree++;
+  if(b < bfreemap.hint)
+    bfreemap.hint = b;
+  release(&bfreemap.lock);
 }
 
 // Inodes.
@@ -132,13 +317,15 @@ bfree(int dev, uint b)
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. A free entry keeps its inode until
+//   iget() recycles it, least recently freed first, so
+//   iget() of a recently used inode needs no disk read.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,68 +349,291 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries are hashed by (dev, inum) into NIHASH buckets. A
+// bucket's spin-lock protects ip->ref, ip->dev and ip->inum of
+// the entries in it, so iget() and iput() of in-use inodes only
+// take that lock. icache.lock protects the LRU list of free
+// entries, and is also held, outside the bucket locks, whenever
+// ip->ref goes from 0 to 1 or back and whenever an entry moves
+// between buckets.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 97  // prime
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *inode;  // ninode of them, from icachealloc()
+  int ninode;
+  struct inode lru;  // free entries, through lprev/lnext; most recently freed first
+
+  struct {
+    struct spinlock lock;
+    struct inode head; // through hprev/hnext
+  } bucket[NIHASH];
 } icache;
 
+static uint
+ihash(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % NIHASH;
+}
+
+// add free entry ip at the most recently used end of the LRU.
+// caller holds icache.lock.
+static void
+lrupush(struct inode *ip)
+{
+  ip->lnext = icache.lru.lnext;
+  ip->lprev = &icache.lru;
+  icache.lru.lnext->lprev = ip;
+  icache.lru.lnext = ip;
+}
+
+// take ip off the LRU. caller holds icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+}
+
+// called at boot before kinit(): allocate n inode cache entries.
+void
+icachealloc(int n)
+{
+  icache.ninode = n;
+  icache.inode = bootalloc(n * sizeof(struct inode));
+}
+
 void
 iinit()
 {
   int i = 0;
   
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
+  initlock(&mtab.lock, "mtab");
+  icache.lru.lprev = icache.lru.lnext = &icache.lru;
+  for(i = 0; i < NIHASH; i++){
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+    icache.bucket[i].head.hprev = &icache.bucket[i].head;
+    icache.bucket[i].head.hnext = &icache.bucket[i].head;
+  }
+  for(i = 0; i < icache.ninode; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
+    icache.inode[i].hnext = 0; // in no bucket yet
+    lrupush(&icache.inode[i]);
+  }
+}
+
+// file system types mount() knows.
+static struct fsops *fstypes[] = { &tmpfsops };
+
+// the operations of device dev's file system.
+static struct fsops*
+fsops(uint dev)
+{
+  struct fsops *ops = 0;
+  struct mount *m;
+
+  if(dev == ROOTDEV)
+    return &diskops;
+  acquire(&mtab.lock);
+  for(m = mtab.m; m < mtab.m + NMOUNT; m++){
+    if(m->dev == dev){
+      ops = m->ops;
+      break;
+    }
+  }
+  release(&mtab.lock);
+  if(ops == 0)
+    panic("fsops");
+  return ops;
+}
+
+// mount a new file system of type type on directory ip,
+// which the mount table keeps the caller's reference to.
+// returns 0, or -1 if there's no such type, the table is
+// full, or something is already mounted on ip.
+int
+mount(struct inode *ip, char *type)
+{
+  struct fsops *ops = 0;
+  struct mount *m, *free = 0;
+  int i, busy = 0;
+
+  for(i = 0; i < NELEM(fstypes); i++){
+    if(strncmp(type, fstypes[i]->name, DIRSIZ) == 0)
+      ops = fstypes[i];
+  }
+  if(ops == 0)
+    return -1;
+
+  acquire(&mtab.lock);
+  for(m = mtab.m; m < mtab.m + NMOUNT; m++){
+    if(m->dev == 0 && free == 0)
+      free = m;
+    if(m->dev != 0 && m->ip == ip)
+      busy = 1;
+  }
+  if(free == 0 || busy){
+    release(&mtab.lock);
+    return -1;
+  }
+  free->dev = ROOTDEV + 1 + (free - mtab.m);
+  free->ops = ops;
+  free->ip = ip;
+  release(&mtab.lock);
+
+  if(ops->mount(free->dev) < 0){
+    acquire(&mtab.lock);
+    free->dev = 0;
+    release(&mtab.lock);
+    return -1;
+  }
+  return 0;
+}
+
+// is something mounted on ip?
+int
+mountpoint(struct inode *ip)
+{
+  struct mount *m;
+  int r = 0;
+
+  acquire(&mtab.lock);
+  for(m = mtab.m; m < mtab.m + NMOUNT; m++){
+    if(m->dev != 0 && m->ip == ip)
+      r = 1;
+  }
+  release(&mtab.lock);
+  return r;
+}
+
+// namex() has reached ip: if ip is mounted on, give up the
+// reference to it for one to the mounted root.
+static struct inode*
+mountenter(struct inode *ip)
+{
+  struct mount *m;
+  uint dev = 0;
+
+  acquire(&mtab.lock);
+  for(m = mtab.m; m < mtab.m + NMOUNT; m++){
+    if(m->dev != 0 && m->ip == ip)
+      dev = m->dev;
   }
+  release(&mtab.lock);
+  if(dev == 0)
+    return ip;
+  iput(ip);
+  return iget(dev, ROOTINO);
 }
 
-static struct inode* iget(uint dev, uint inum);
+// namex() is about to look up ".." in ip: if ip is the root of
+// a mounted file system, look it up in the directory mounted
+// on instead.
+static struct inode*
+mountleave(struct inode *ip)
+{
+  struct mount *m;
+  struct inode *mp = 0;
+
+  if(ip->dev == ROOTDEV || ip->inum != ROOTINO)
+    return ip;
+  acquire(&mtab.lock);
+  for(m = mtab.m; m < mtab.m + NMOUNT; m++){
+    if(m->dev == ip->dev)
+      mp = m->ip;
+  }
+  release(&mtab.lock);
+  if(mp == 0)
+    panic("mountleave");
+  idup(mp);
+  iput(ip);
+  return mp;
+}
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
-// Returns an unlocked but allocated and referenced inode.
+// Returns an unlocked but allocated and referenced inode,
+// or 0 if the file system has none left.
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  return fsops(dev)->ialloc(dev, type);
+}
+
+// ialloc() for the disk.
+static struct inode*
+diskialloc(uint dev, short type)
+{
+  uint inum;
+  uint64 x;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
+  // find a free inode in imap, 64 at a time.
+  acquire(&imap.lock);
+  for(inum = imap.hint; inum < sb.ninodes; inum = (inum / 64 + 1) * 64){
+    x = ~imap.used[inum / 64] & (~0UL << (inum % 64));
+    if(x){
+      while((x & (1UL << (inum % 64))) == 0)
+        inum++;
+      break;
     }
-    brelse(bp);
   }
-  panic("ialloc: no inodes");
+  if(inum >= sb.ninodes)
+    panic("ialloc: no inodes");
+  imap.used[inum / 64] |= 1UL << (inum % 64);
+  imap.hint = inum + 1;
+  release(&imap.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: imap");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
 // Must be called after every change to an ip->xxx field
 // that lives on disk, since i-node cache is write-through.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, and the disk inode is written
+// when it is released: a system call usually updates the same
+// inode several times (the size, then the block list, then
+// the link count), and only the last copy matters.
 void
 iupdate(struct inode *ip)
+{
+  ip->ops->iupdate(ip);
+}
+
+static void
+diskupdate(struct inode *ip)
+{
+  ip->dirty = 1;
+}
+
+// write ip's disk inode if iupdate() was called since it was
+// last written; inside the transaction of the iupdate().
+// caller holds ip->lock.
+static void
+iflush(struct inode *ip)
 {
   struct buf *bp;
   struct dinode *dip;
 
+  if(!ip->dirty)
+    return;
+  ip->dirty = 0;
+
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
@@ -234,39 +644,94 @@ iupdate(struct inode *ip)
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
+
+  if(ip->type == 0){
+    // iput() freed it.
+    acquire(&imap.lock);
+    imap.used[ip->inum / 64] &= ~(1UL << (ip->inum % 64));
+    if(ip->inum < imap.hint)
+      imap.hint = ip->inum;
+    release(&imap.lock);
+  }
+}
+
+// look for (dev, inum) in bucket id.
+// caller holds the bucket's lock.
+static struct inode*
+ilookup(int id, uint dev, uint inum)
+{
+  struct inode *ip, *head = &icache.bucket[id].head;
+
+  for(ip = head->hnext; ip != head; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  }
+  return 0;
 }
 
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  int id = ihash(dev, inum), vid;
+
+  // Is the inode cached and in use?
+  acquire(&icache.bucket[id].lock);
+  if((ip = ilookup(id, dev, inum)) != 0 && ip->ref > 0){
+    ip->ref++;
+    release(&icache.bucket[id].lock);
+    return ip;
+  }
+  release(&icache.bucket[id].lock);
 
+  // Cached but free, or not cached: the entry has to
+  // come off the LRU, under icache.lock.
   acquire(&icache.lock);
-
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&icache.bucket[id].lock);
+  if((ip = ilookup(id, dev, inum)) != 0){
+    if(ip->ref == 0)
+      lruremove(ip);
+    ip->ref++;
+    release(&icache.bucket[id].lock);
+    release(&icache.lock);
+    return ip;
   }
-
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  release(&icache.bucket[id].lock);
+
+  // Recycle the least recently freed entry. Nobody else can
+  // take it: that needs icache.lock. Skip entries whose data
+  // blocks the next commit has yet to allocate; ballocdelayed()
+  // needs them.
+  ip = icache.lru.lprev;
+  while(ip != &icache.lru && ip->ndelay > 0)
+    ip = ip->lprev;
+  if(ip == &icache.lru)
     panic("iget: no inodes");
+  lruremove(ip);
+  if(ip->hnext){
+    vid = ihash(ip->dev, ip->inum);
+    acquire(&icache.bucket[vid].lock);
+    ip->hnext->hprev = ip->hprev;
+    ip->hprev->hnext = ip->hnext;
+    release(&icache.bucket[vid].lock);
+  }
 
-  ip = empty;
+  acquire(&icache.bucket[id].lock);
   ip->dev = dev;
   ip->inum = inum;
+  ip->ops = fsops(dev);
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->raend = ip->rawin = 0;
+  ip->allocnext = 0;
+  ip->hnext = icache.bucket[id].head.hnext;
+  ip->hprev = &icache.bucket[id].head;
+  icache.bucket[id].head.hnext->hprev = ip;
+  icache.bucket[id].head.hnext = ip;
+  release(&icache.bucket[id].lock);
   release(&icache.lock);
 
   return ip;
@@ -277,9 +742,12 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  int id = ihash(ip->dev, ip->inum);
+
+  // the caller's reference keeps ip in bucket id.
+  acquire(&icache.bucket[id].lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&icache.bucket[id].lock);
   return ip;
 }
 
@@ -288,30 +756,40 @@ idup(struct inode *ip)
 void
 ilock(struct inode *ip)
 {
-  struct buf *bp;
-  struct dinode *dip;
-
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
-    dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
-    ip->major = dip->major;
-    ip->minor = dip->minor;
-    ip->nlink = dip->nlink;
-    ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
-    brelse(bp);
+    ip->ops->iread(ip);
     ip->valid = 1;
+    // pages of the file may still be cached from
+    // before the inode was last evicted.
+    ip->pcached = (ip->type == T_FILE);
     if(ip->type == 0)
       panic("ilock: no type");
   }
 }
 
+// fill in ip from its disk inode, for ilock().
+static void
+diskiread(struct inode *ip)
+{
+  struct buf *bp;
+  struct dinode *dip;
+
+  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  dip = (struct dinode*)bp->data + ip->inum%IPB;
+  ip->type = dip->type;
+  ip->major = dip->major;
+  ip->minor = dip->minor;
+  ip->nlink = dip->nlink;
+  ip->size = dip->size;
+  memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+  brelse(bp);
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -319,6 +797,7 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  iflush(ip);
   releasesleep(&ip->lock);
 }
 
@@ -332,7 +811,19 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  int id = ihash(ip->dev, ip->inum);
+
+  // not the last reference: only the bucket lock is needed.
+  acquire(&icache.bucket[id].lock);
+  if(ip->ref > 1){
+    ip->ref--;
+    release(&icache.bucket[id].lock);
+    return;
+  }
+  release(&icache.bucket[id].lock);
+
   acquire(&icache.lock);
+  acquire(&icache.bucket[id].lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,19 +832,27 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
+    release(&icache.bucket[id].lock);
     release(&icache.lock);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    iflush(ip);
     ip->valid = 0;
 
     releasesleep(&ip->lock);
 
     acquire(&icache.lock);
+    acquire(&icache.bucket[id].lock);
   }
 
   ip->ref--;
+  if(ip->ref == 0)
+    lrupush(ip);
+  release(&icache.bucket[id].lock);
   release(&icache.lock);
 }
 
@@ -370,19 +869,163 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// blocks are listed in the NINDIRECT blocks listed in block
+// ip->addrs[NDIRECT+1].
+
+// Put off allocating the data block for entry i of indirect
+// block ind (of ip->addrs[] if ind is 0) until the commit.
+// Returns the block's placeholder number, or 0 if it has to
+// be allocated now.
+static uint
+bdelay(struct inode *ip, uint ind, uint i)
+{
+  int k;
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+  if(ip->type != T_FILE)
+    return 0;
+  acquire(&delayed.lock);
+  for(k = 0; k < NDELAY; k++){
+    if(delayed.d[k].ip == 0)
+      break;
+  }
+  if(k == NDELAY || log_delay() < 0){
+    release(&delayed.lock);
+    return 0;
+  }
+  delayed.d[k].ip = ip;
+  delayed.d[k].ind = ind;
+  delayed.d[k].i = i;
+  release(&delayed.lock);
+  ip->ndelay++;
+  return DELAYBLK + k;
+}
+
+// Truncation found placeholder addr: the block is never
+// allocated, and its data is dropped.
+static void
+bundelay(struct inode *ip, uint addr)
+{
+  struct buf *bp;
+
+  bp = bread(ip->dev, addr);
+  bunpin(bp);
+  brelse(bp);
+  acquire(&delayed.lock);
+  delayed.d[addr - DELAYBLK].ip = 0;
+  release(&delayed.lock);
+  ip->ndelay--;
+  log_undelay();
+}
+
+// Allocate the blocks bdelay() put off, for commit(), which
+// has every FS system call waiting. Each block's data moves
+// from its placeholder's pinned buffer to the block, and the
+// entry that held the placeholder, in the inode or in an
+// indirect block the transaction has logged, gets the block.
+void
+ballocdelayed(void)
+{
+  struct inode *ip;
+  struct buf *from, *to, *bp;
+  uint addr, ind, i;
+  int k;
+
+  for(k = 0; k < NDELAY; k++){
+    if((ip = delayed.d[k].ip) == 0)
+      continue;
+    ind = delayed.d[k].ind;
+    i = delayed.d[k].i;
+
+    // ip may have no references left; iget() leaves it
+    // alone while ip->ndelay > 0.
+    acquiresleep(&ip->lock);
+    addr = balloc(ip->dev, ip->allocnext);
+    ip->allocnext = addr + 1;
+    from = bread(ip->dev, DELAYBLK + k);
+    to = bnew(ip->dev, addr);
+    memmove(to->data, from->data, BSIZE);
+    log_write(to);
+    brelse(to);
+    bunpin(from);
+    brelse(from);
+    if(ind == 0){
+      ip->addrs[i] = addr;
+      iupdate(ip);
+      iflush(ip);
+    } else {
+      bp = bread(ip->dev, ind);
+      ((uint*)bp->data)[i] = addr;
+      log_write(bp);
+      brelse(bp);
+    }
+    ip->ndelay--;
+    releasesleep(&ip->lock);
+
+    acquire(&delayed.lock);
+    delayed.d[k].ip = 0;
+    release(&delayed.lock);
+  }
+}
+
+// Allocate a block for entry i of indirect block ind, or of
+// ip->addrs[] if ind is 0, right after the one ip got last.
+// If fresh is 0 the block is zeroed; otherwise *fresh is set,
+// and the caller is to fill it in. A file's fresh block may
+// get just a placeholder, for the commit to allocate; see
+// bdelay().
+static uint
+bmapalloc(struct inode *ip, uint ind, uint i, int *fresh)
+{
+  uint addr;
+
+  if(fresh){
+    *fresh = 1;
+    if((addr = bdelay(ip, ind, i)) != 0)
+      return addr;
+  }
+  addr = balloc(ip->dev, ip->allocnext);
+  ip->allocnext = addr + 1;
+  if(!fresh)
+    bzero(ip->dev, addr);
+  return addr;
+}
+
+// Return the address of entry i in indirect block addr,
+// allocating a block for the entry if it is empty.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapind(struct inode *ip, uint addr, uint i, int *fresh)
 {
-  uint addr, *a;
+  uint *a;
   struct buf *bp;
 
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = bmapalloc(ip, bp->blockno, i, fresh);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one. A new data
+// block is zeroed, unless fresh is given: then *fresh says
+// whether the block is new, and a new one's contents are
+// garbage the caller must overwrite, without reading it.
+// Such a block may be a placeholder until the next commit:
+// its buffer is cached, and it must not be log_write()n.
+static uint
+bmap(struct inode *ip, uint bn, int *fresh)
+{
+  uint addr;
+
+  if(fresh)
+    *fresh = 0;
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = bmapalloc(ip, 0, bn, fresh);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,50 +1033,85 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+      ip->addrs[NDIRECT] = addr = bmapalloc(ip, 0, NDIRECT, 0);
+    return bmapind(ip, addr, bn, fresh);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the doubly-indirect block, then the
+    // indirect block it points to.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = bmapalloc(ip, 0, NDIRECT+1, 0);
+    addr = bmapind(ip, addr, bn / NINDIRECT, 0);
+    return bmapind(ip, addr, bn % NINDIRECT, fresh);
   }
 
   panic("bmap: out of range");
 }
 
+// Free indirect block addr and the blocks it lists.
+// With depth 2, the listed blocks are indirect blocks too.
+static void
+itruncind(struct inode *ip, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      itruncind(ip, a[j], depth - 1);
+    else if(isdelayed(a[j]))
+      bundelay(ip, a[j]);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  ip->ops->itrunc(ip);
+}
+
+static void
+disktrunc(struct inode *ip)
+{
+  int i;
 
   for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
+    if(isdelayed(ip->addrs[i])){
+      bundelay(ip, ip->addrs[i]);
+      ip->addrs[i] = 0;
+    } else if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
       ip->addrs[i] = 0;
     }
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    itruncind(ip, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
+  ip->allocnext = 0;
   ip->size = 0;
   iupdate(ip);
+  pcache_inval(ip);
 }
 
 // Copy stat information from inode.
@@ -448,12 +1126,58 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
+// Sequential readahead for readi(), which is about to read
+// block bn of ip. While ip is read front to back, keep the
+// blocks after bn on their way into the buffer cache; each
+// time the reader gets halfway through what was read ahead,
+// read ahead more and double the window, up to RAMAX blocks.
+// Any other access pattern closes the window.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint nblock, end, b;
+
+  if(bn + 1 == ip->ranext)
+    return; // rest of the same block
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->raend = bn + 1;
+    ip->rawin = 0;
+    return;
+  }
+  ip->ranext = bn + 1;
+  if(ip->raend < bn + 1)
+    ip->raend = bn + 1;
+  if(ip->raend - (bn + 1) > ip->rawin / 2)
+    return; // enough still in flight or cached
+
+  if(ip->rawin == 0)
+    ip->rawin = 2;
+  else if(ip->rawin < RAMAX)
+    ip->rawin *= 2;
+  nblock = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(bn + 1 + ip->rawin, nblock);
+  for(b = ip->raend; b < end; b++)
+    breadahead(ip->dev, bmap(ip, b, 0));
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
+// Read data from inode straight from its file system,
+// bypassing the page cache; pcache_get() fills pages this way.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
-readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+readiblk(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  return ip->ops->read(ip, user_dst, dst, off, n);
+}
+
+// readiblk() for the disk, through the buffer cache.
+static int
+diskread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
@@ -464,7 +1188,9 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = breadstart(ip->dev, bmap(ip, off/BSIZE, 0));
+    readahead(ip, off/BSIZE);
+    bwait(bp);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -475,6 +1201,44 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Read data from inode.
+// Caller must hold ip->lock.
+// If user_dst==1, then dst is a user virtual address;
+// otherwise, dst is a kernel address.
+// Disk files are read a page at a time from the page cache;
+// directories, devices and files whose file system holds
+// them in memory anyway straight from the file system.
+int
+readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+  int r;
+
+  if(ip->type != T_FILE || !ip->ops->pcache)
+    return readiblk(ip, user_dst, dst, off, n);
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pa = pcache_get(ip, PGROUNDDOWN(off))) == 0){
+      // out of memory: read around the page cache.
+      if(readiblk(ip, user_dst, dst, off, m) != m)
+        break;
+      continue;
+    }
+    r = either_copyout(user_dst, dst, pa + off%PGSIZE, m);
+    kfree(pa);
+    if(r == -1)
+      break;
+  }
+  return tot;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -482,8 +1246,15 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  return ip->ops->write(ip, user_src, src, off, n);
+}
+
+static int
+diskwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  uint tot, m, addr;
   struct buf *bp;
+  int fresh;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -491,13 +1262,32 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    addr = bmap(ip, off/BSIZE, &fresh);
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(fresh){
+      // a block just allocated: there's nothing on the disk
+      // to read, and it needn't be zeroed and logged before
+      // the data goes in. zero what the write leaves.
+      bp = bnew(ip->dev, addr);
+      if(m < BSIZE)
+        memset(bp->data, 0, BSIZE);
+      if(isdelayed(addr))
+        bpin(bp); // the data stays cached until the commit
+    } else {
+      bp = bread(ip->dev, addr);
+    }
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
+      if(fresh){
+        memset(bp->data, 0, BSIZE); // no garbage left in the file's block
+        if(!isdelayed(addr))
+          log_write(bp);
+      }
       brelse(bp);
       break;
     }
-    log_write(bp);
+    pcache_update(ip, off, bp->data + (off % BSIZE), m);
+    if(!isdelayed(addr))
+      log_write(bp); // else ballocdelayed() logs it
     brelse(bp);
   }
 
@@ -513,6 +1303,17 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return n;
 }
 
+static struct fsops diskops = {
+  .name = "disk",
+  .pcache = 1,
+  .ialloc = diskialloc,
+  .iread = diskiread,
+  .iupdate = diskupdate,
+  .itrunc = disktrunc,
+  .read = diskread,
+  .write = diskwrite,
+};
+
 // Directories
 
 int
@@ -523,6 +1324,7 @@ namecmp(const char *s, const char *t)
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// The answer, found or not, is remembered in the dcache.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -532,6 +1334,14 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcache_lookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -542,10 +1352,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp->dev, dp->inum, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
@@ -575,6 +1387,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -623,16 +1436,18 @@ skipelem(char *path, char *name)
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
 static struct inode*
-namex(char *path, int nameiparent, char *name)
+namex(struct inode *dp, char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(dp ? dp : myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    if(namecmp(name, "..") == 0)
+      ip = mountleave(ip);
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -648,7 +1463,7 @@ namex(char *path, int nameiparent, char *name)
       return 0;
     }
     iunlockput(ip);
-    ip = next;
+    ip = mountenter(next);
   }
   if(nameiparent){
     iput(ip);
@@ -661,11 +1476,20 @@ struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
-  return namex(path, 0, name);
+  return namex(0, path, 0, name);
+}
+
+// Look up path relative to directory dp instead of the
+// current directory, as fstatat() does.
+struct inode*
+nameiat(struct inode *dp, char *path)
+{
+  char name[DIRSIZ];
+  return namex(dp, path, 0, name);
 }
 
 struct inode*
 nameiparent(char *path, char *name)
 {
-  return namex(path, 1, name);
+  return namex(0, path, 1, name);
 }
@@ -0,0 +1,120 @@
+// Futexes.
+//
+// futex_wait(addr, val) sleeps as long as the word at addr
+// holds val; futex_wake(addr, n) wakes up to n processes
+// sleeping on addr. The mutexes and condition variables in
+// user/thread.c are built on them: they only come into the
+// kernel to block, or to wake somebody who has.
+//
+// Waiters sleep on the physical address of the word, so that
+// threads made by clone() and processes sharing the page
+// through MAP_SHARED mappings of the same file find each
+// other. A copy-on-write page is copied first: the waker is
+// about to store to the word, which would give it a different
+// page from the waiter's.
+//
+// The waiter checks the word and goes to sleep holding the
+// lock of the word's bucket, and the waker takes the same
+// lock, so a wakeup can't slip in between the check and the
+// sleep.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NFUTEX 31  // prime
+
+pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
+
+struct {
+  struct spinlock lock;
+} futexq[NFUTEX];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct spinlock*
+futexlock(uint64 pa)
+{
+  return &futexq[(pa / 4) % NFUTEX].lock;
+}
+
+// the physical address of the word at user address addr,
+// faulting the page in and copying it if it is copy-on-write.
+// 0 if addr isn't a mapped, aligned word of the current process.
+static uint64
+futexpa(uint64 addr)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  uint64 va = PGROUNDDOWN(addr), pa;
+  pte_t *pte;
+
+  if(addr % sizeof(int) != 0 || addr >= MAXVA)
+    return 0;
+  if((pa = walkaddr(pagetable, va)) == 0)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(*pte & PTE_COW){
+    if(cowfault(pagetable, va) != 0 || (pa = walkaddr(pagetable, va)) == 0)
+      return 0;
+  }
+  return pa + (addr - va);
+}
+
+// sleep until woken by futexwake(addr), unless the word at
+// addr doesn't hold val. returns 0, or -1 if addr is bad or
+// the process was killed. like a condition variable's wait,
+// the caller must check its condition again on return.
+int
+futexwait(uint64 addr, int val)
+{
+  struct spinlock *lk;
+  uint64 pa;
+
+  if((pa = futexpa(addr)) == 0)
+    return -1;
+  lk = futexlock(pa);
+  acquire(lk);
+  if(*(volatile int*)pa != val){
+    release(lk);
+    return 0;
+  }
+  sleep((void*)pa, lk);
+  release(lk);
+  if(myproc()->killed)
+    return -1;
+  return 0;
+}
+
+// wake up to n processes sleeping in futexwait(addr), those
+// that have waited longest first. returns how many woke, or
+// -1 if addr is bad.
+int
+futexwake(uint64 addr, int n)
+{
+  struct spinlock *lk;
+  uint64 pa;
+  int woken;
+
+  if((pa = futexpa(addr)) == 0)
+    return -1;
+  lk = futexlock(pa);
+  acquire(lk);
+  for(woken = 0; woken < n; woken++){
+    if(wakeupone((void*)pa) == 0)
+      break;
+  }
+  release(lk);
+  return woken;
+}
@@ -1,5 +1,13 @@
 // 实现物理内存分配器，用于用户进程、内核栈、页表页和管道缓冲区。
-// 分配整个4096字节的页面。
+// 空闲内存由伙伴系统管理，kalloc_pages()可以分配2^order个物理上连续的页面（order为0..NBUDDY-1）。
+// 单页的分配和释放走每个CPU自己的空闲链表，作为伙伴系统前面的缓存：
+// 链表为空时从伙伴系统批量取一些页，太长时批量还回去，伙伴系统的锁因此很少被争用，
+// 还回去的页又能和伙伴合并成大块。伙伴系统也没有页时再从其他CPU窃取一批页面。
+// 每个物理页有一个引用计数，COW fork 共享的页面在最后一个引用释放时才真正回收。
+// sbrk()懒分配的页面先通过kreserve()预留，首次访问时才真正分配。
+// 空闲的CPU在调度循环中预先把一些页面清零，放入清零页池，kalloc_zeroed()直接从池中取。
+// 用make KPOISON=1编译时，kfree()和kalloc()用垃圾数据填充页面，用于调试。
+// 启动时所有CPU一起把物理内存放入伙伴系统，见kinit()。
 
 #include "types.h" // 包含类型定义
 #include "param.h" // 包含参数定义
@@ -7,54 +15,376 @@
 #include "spinlock.h" // 包含自旋锁定义
 #include "riscv.h" // 包含RISC-V架构相关定义
 #include "defs.h" // 包含通用定义
+#include "kmemstat.h" // 包含分配器统计信息定义
 
-void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // 内核结束后的第一个地址，由kernel.ld定义。
 
+// bootalloc()分配到的位置，kinit()从这里之后开始放入空闲链表
+static char *bootend = end;
+
+// 一次从其他CPU窃取的最大页面数
+#define KMEM_STEAL_BATCH 64
+
+// 每CPU空闲链表一次从伙伴系统取回或还回的页数，以及链表最多保留的页数
+#define KMEM_BATCH 64
+#define KMEM_HIGH  (4*KMEM_BATCH)
+
 // 定义链表节点结构run，用于记录空闲内存页
 struct run {
   struct run *next; // 指向下一空闲页
 };
 
-// 定义管理内存分配的结构kmem，包含一个自旋锁和一个空闲内存页的链表
-struct {
+// 定义每个CPU管理内存分配的结构kmem，包含一个自旋锁和一个空闲内存页的链表
+// 统计计数只在持有对应CPU的锁时修改
+struct kmem {
   struct spinlock lock; // 用于保护链表的锁
   struct run *freelist; // 空闲内存页的链表
-} kmem;
+  uint64 npage;         // 链表中的空闲页数，供acquire_freemem()无锁读取
+  uint64 nalloc;        // 本CPU上kalloc()成功的次数
+  uint64 nfree;         // 本CPU上kfree()的次数
+  uint64 nsteal;        // 从其他CPU窃取到的页面数
+};
+
+struct kmem kmem[NCPU];
+
+// 伙伴系统中空闲块的链表节点，放在块的第一页里。双向链表，合并时可以直接摘下伙伴
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+// 伙伴系统：free[o]是2^o页大小的空闲块的循环链表，块按从KERNBASE起的2^o页对齐
+struct {
+  struct spinlock lock;
+  struct bnode free[NBUDDY]; // 链表头
+  uint64 nblock[NBUDDY];     // 每个链表中的块数
+  uint64 npage;              // 所有空闲块的页数之和，供nfreepages()无锁读取
+} buddy;
+
+static struct run *kzeroget(void);
+
+// 清零页池最多保留的页数
+#define KZERO_TARGET 64
+
+// 清零页池：已经清零、可以直接交给kalloc_zeroed()的空闲页
+// npage包括正在被清零、暂时不在链表中的页，这些页仍算作空闲内存
+struct {
+  struct spinlock lock;
+  struct run *list;
+  uint64 npage;
+  uint64 nhit;  // kalloc_zeroed()直接从池中得到页面的次数
+} kzero;
+
+// 每个物理页的引用计数，用原子操作维护，不需要锁
+#define NPHYSPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i) ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+static int pageref[NPHYSPAGE];
+
+// 伙伴系统中空闲块的第一页记录块的阶加1，其他页为0，由buddy.lock保护
+static uchar freeorder[NPHYSPAGE];
+
+// 启动时把物理内存分成KBOOT_CHUNK大小的块，所有CPU抢着领取，
+// 各自放入自己的空闲链表
+#define KBOOT_CHUNK (4*1024*1024)
+
+struct {
+  char *start;      // 第一块的起始地址
+  int nchunk;       // 块数
+  int next;         // 下一个还没人领取的块
+  int ndone;        // 已经放入空闲链表的块数
+  volatile int go;  // 锁都初始化好了，其他CPU可以开始领取
+} kboot;
+
+// 已经承诺给懒分配用户页、但还没有真正分配出去的页数
+struct {
+  struct spinlock lock;
+  uint64 npage;
+} kreserved;
+
+/**
+  * void *bootalloc(uint64 n)
+  * @brief： 启动时为大小在启动时才确定的表分配n字节清零的内存，永不释放
+  * @brief： 从内核结束处往后分配，是物理上连续的，只能在kinit()之前调用
+  * @param： n - 字节数
+  * @retval： 分配的内存
+  */
+void*
+bootalloc(uint64 n)
+{
+  char *p = (char*)(((uint64)bootend + 63) & ~63UL); // 按缓存行对齐
+
+  if(kboot.go)
+    panic("bootalloc");
+  if((uint64)p + n > PHYSTOP)
+    panic("bootalloc: too big");
+  bootend = p + n;
+  memset(p, 0, n);
+  return p;
+}
 
 /**
   * void kinit()
-  * @brief： 初始化内存分配器
+  * @brief： 初始化内存分配器，由CPU 0调用
+  * @brief： 其他CPU在kinithart()中帮着把内存放入空闲链表，返回时所有内存都已放入
   * @param： NULL
   * @retval：NULL
   */
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem"); // 初始化kmem的锁
-  freerange(end, (void*)PHYSTOP); // 释放从内核结束地址end之后直到物理内存终止地址PHYSTOP的这段内存页
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem"); // 初始化每个CPU的kmem锁
+  initlock(&kreserved.lock, "kreserved");
+  initlock(&kzero.lock, "kzero");
+  initlock(&buddy.lock, "buddy");
+  for(int o = 0; o < NBUDDY; o++)
+    buddy.free[o].next = buddy.free[o].prev = &buddy.free[o];
+
+  // 内核和bootalloc()分配的表之后直到物理内存终止地址PHYSTOP的内存页
+  kboot.start = (char*)PGROUNDUP((uint64)bootend);
+  kboot.nchunk = (PHYSTOP - (uint64)kboot.start + KBOOT_CHUNK - 1) / KBOOT_CHUNK;
+  __sync_synchronize();
+  kboot.go = 1;
+
+  kinithart();
+  // 等其他CPU领走的块也放完，之后nfreepages()才是准确的
+  while(__atomic_load_n(&kboot.ndone, __ATOMIC_SEQ_CST) < kboot.nchunk)
+    ;
+  __sync_synchronize();
+}
+
+/**
+  * static void bfree(uint64 i, int order)
+  * @brief： 把从第i页开始的2^order页的块放回伙伴系统，伙伴也空闲时合并成更大的块
+  * @brief： 调用者持有buddy.lock
+  * @param： i - 块第一页的编号（PA2REF），按2^order对齐
+  * @param： order - 块的阶
+  * @retval： NULL
+  */
+static void
+bfree(uint64 i, int order)
+{
+  struct bnode *b;
+  uint64 bi;
+
+  buddy.npage += 1UL << order;
+  for(; order < NBUDDY-1; order++){
+    bi = i ^ (1UL << order);
+    if(bi >= NPHYSPAGE || freeorder[bi] != order+1)
+      break; // 伙伴不是同样大小的空闲块
+    // 把伙伴从它的链表上摘下来，合并
+    b = REF2PA(bi);
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    buddy.nblock[order]--;
+    freeorder[bi] = 0;
+    i &= ~(1UL << order);
+  }
+  b = REF2PA(i);
+  b->next = buddy.free[order].next;
+  b->prev = &buddy.free[order];
+  b->next->prev = b;
+  buddy.free[order].next = b;
+  buddy.nblock[order]++;
+  freeorder[i] = order+1;
+}
+
+/**
+  * static void *balloc(int order)
+  * @brief： 从伙伴系统分配2^order页的块，没有这么大的空闲块时把更大的块一分为二
+  * @brief： 调用者持有buddy.lock
+  * @param： order - 块的阶
+  * @retval： 块的起始地址，没有足够大的空闲块返回 NULL
+  */
+static void *
+balloc(int order)
+{
+  struct bnode *b, *h;
+  uint64 i;
+  int o;
+
+  for(o = order; o < NBUDDY && buddy.free[o].next == &buddy.free[o]; o++)
+    ;
+  if(o == NBUDDY)
+    return 0;
+  b = buddy.free[o].next;
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nblock[o]--;
+  i = PA2REF(b);
+  freeorder[i] = 0;
+  // 分出来的后一半放回低一阶的链表，直到剩下的正好是要的大小
+  while(o > order){
+    o--;
+    h = REF2PA(i + (1UL << o));
+    h->next = buddy.free[o].next;
+    h->prev = &buddy.free[o];
+    h->next->prev = h;
+    buddy.free[o].next = h;
+    buddy.nblock[o]++;
+    freeorder[i + (1UL << o)] = o+1;
+  }
+  buddy.npage -= 1UL << order;
+  return b;
+}
+
+/**
+  * static void bputlist(struct run *r)
+  * @brief： 把一串单页放回伙伴系统，只取一次锁
+  * @param： r - 页面链表
+  * @retval： NULL
+  */
+static void
+bputlist(struct run *r)
+{
+  struct run *next;
+
+  acquire(&buddy.lock);
+  for(; r; r = next){
+    next = r->next;
+    bfree(PA2REF(r), 0);
+  }
+  release(&buddy.lock);
+}
+
+/**
+  * static struct run *bgetlist(int n, int *np)
+  * @brief： 从伙伴系统取最多n个单页，给每CPU空闲链表补充页面，只取一次锁
+  * @param： n - 最多取的页数
+  * @param： np - 返回取到的页数
+  * @retval： 页面链表，伙伴系统为空返回 NULL
+  */
+static struct run *
+bgetlist(int n, int *np)
+{
+  struct run *head = 0, *r;
+  int i;
+
+  acquire(&buddy.lock);
+  for(i = 0; i < n && (r = balloc(0)) != 0; i++){
+    r->next = head;
+    head = r;
+  }
+  release(&buddy.lock);
+  *np = i;
+  return head;
 }
 
 /**
-  * void freerange(void *pa_start, void *pa_end)
-  * @brief： 释放从 pa_start 到 pa_end 范围内的物理内存页
-  * @param： pa_start - 内存范围的起始地址
+  * static void freerange(void *pa_start, void *pa_end)
+  * @brief： 把 pa_start 到 pa_end 范围内的物理内存页放入伙伴系统
+  * @brief： 按对齐允许的最大的块放入，一块只需一次bfree()，只取一次锁
+  * @param： pa_start - 内存范围的起始地址，按页对齐
   * @param： pa_end - 内存范围的结束地址
   * @retval： NULL
   */
-void
+static void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p; // 指针p用于迭代内存页
-  p = (char*)PGROUNDUP((uint64)pa_start); // 将起始地址向上取整至页边界，以确保从完整的页开始释放
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE) // 遍历每个页，直到结束地址
-    kfree(p); // 释放当前页并加入到空闲链表中
+  uint64 i, e;
+  char *p;
+  int o;
+
+  for(p = (char*)pa_start; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    pageref[PA2REF(p)] = 0;
+#ifdef KPOISON
+    memset(p, 1, PGSIZE);
+#endif
+  }
+
+  i = PA2REF(pa_start);
+  e = ((uint64)pa_end - KERNBASE) / PGSIZE;
+  acquire(&buddy.lock);
+  while(i < e){
+    for(o = NBUDDY-1; (i & ((1UL << o) - 1)) != 0 || i + (1UL << o) > e; o--)
+      ;
+    bfree(i, o);
+    i += 1UL << o;
+  }
+  release(&buddy.lock);
+}
+
+/**
+  * void kinithart()
+  * @brief： 启动时每个CPU调用一次：领取还没人领的内存块，初始化其中页面的元数据后放入伙伴系统，
+  *          这样启动时间不随PHYSTOP由一个CPU独自承担
+  * @brief： 其他CPU此时还没有开启分页，访问的都是物理地址
+  * @param： NULL
+  * @retval： NULL
+  */
+void
+kinithart(void)
+{
+  char *s, *e;
+  int i;
+
+  while(kboot.go == 0)
+    ;
+  __sync_synchronize();
+  while((i = __sync_fetch_and_add(&kboot.next, 1)) < kboot.nchunk){
+    s = kboot.start + (uint64)i * KBOOT_CHUNK;
+    e = s + KBOOT_CHUNK;
+    if((uint64)e > PHYSTOP)
+      e = (char*)PHYSTOP;
+    freerange(s, e);
+    __sync_fetch_and_add(&kboot.ndone, 1);
+  }
+}
+
+/**
+  * static struct run *ktake(struct kmem *km, int n)
+  * @brief： 从km的空闲链表前面截取最多n个页面
+  * @brief： 调用者持有km->lock
+  * @param： km - 每CPU的空闲链表
+  * @param： n - 最多截取的页数
+  * @retval： 截取的页面链表，链表为空返回 NULL
+  */
+static struct run *
+ktake(struct kmem *km, int n)
+{
+  struct run *head, *tail;
+  int i;
+
+  if((head = km->freelist) == 0)
+    return 0;
+  tail = head;
+  for(i = 1; i < n && tail->next; i++)
+    tail = tail->next;
+  km->freelist = tail->next;
+  km->npage -= i;
+  tail->next = 0;
+  return head;
+}
+
+/**
+  * static void kput(struct kmem *km, struct run *r, int n)
+  * @brief： 在km的空闲链表中放入n个页面的链表，第一个页面除外，它直接分配出去
+  * @brief： 调用者持有km->lock
+  * @param： km - 每CPU的空闲链表
+  * @param： r - 页面链表
+  * @param： n - 链表中的页数
+  * @retval： NULL
+  */
+static void
+kput(struct kmem *km, struct run *r, int n)
+{
+  struct run *rest = r->next, *next;
+
+  while(rest){
+    next = rest->next;
+    rest->next = km->freelist;
+    km->freelist = rest;
+    rest = next;
+  }
+  km->npage += n - 1;
 }
 
 /**
   * void kfree(void *pa)
-  * @brief： 释放一页物理内存
+  * @brief： 释放对一页物理内存的一个引用，最后一个引用释放时放入当前CPU的空闲链表，
+  *          交换区中这一页的副本（如果有）也一起作废
   * @param： pa - 要释放的物理内存页的起始地址
   * @retval： NULL
   */
@@ -62,24 +392,75 @@ void
 kfree(void *pa)
 {
   struct run *r; // 定义运行链表节点
+  struct kmem *km;
 
   // 检查页面地址是否按页大小对齐，且地址在合法范围内
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree"); // 不符合条件则触发panic
 
+  int ref = __sync_sub_and_fetch(&pageref[PA2REF(pa)], 1);
+  if(ref > 0)
+    return; // 页面仍被其他页表共享
+  if(ref < 0)
+    panic("kfree: ref");
+  swapfree(pa);
+
+#ifdef KPOISON
   memset(pa, 1, PGSIZE);// 用垃圾数据填充，用于在调试时发现潜在的内存问题（例如悬挂指针）
+#endif
 
   r = (struct run*)pa; // 将pa强制转换为run结构体指针
 
-  acquire(&kmem.lock); // 获取锁以保护共享资源
-  r->next = kmem.freelist; // 新释放的节点指向当前空闲链表头
-  kmem.freelist = r; // 链表头更新为新释放节点
-  release(&kmem.lock); // 释放锁
+  push_off(); // 关中断，保证cpuid()在使用期间有效
+  km = &kmem[cpuid()];
+  acquire(&km->lock); // 获取本CPU的锁
+  r->next = km->freelist; // 新释放的节点指向当前空闲链表头
+  km->freelist = r; // 链表头更新为新释放节点
+  km->npage++;
+  km->nfree++;
+  r = 0;
+  if(km->npage > KMEM_HIGH)
+    r = ktake(km, KMEM_BATCH); // 链表太长，还一批给伙伴系统
+  release(&km->lock); // 释放锁
+  pop_off();
+  if(r)
+    bputlist(r);
+}
+
+/**
+  * static struct run *ksteal(int self, int *np)
+  * @brief： 从其他CPU的空闲链表中窃取最多KMEM_STEAL_BATCH个页面
+  * @brief： 调用者不能持有任何kmem锁，避免两个CPU互相窃取时死锁
+  * @param： self - 当前CPU的编号
+  * @param： np - 返回窃取到的页面数
+  * @retval： 窃取到的页面链表，失败返回 NULL
+  */
+static struct run *
+ksteal(int self, int *np)
+{
+  struct run *head;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(self + i) % NCPU];
+
+    acquire(&victim->lock);
+    n = victim->npage;
+    head = ktake(victim, KMEM_STEAL_BATCH); // 截取链表前面的一段
+    n -= victim->npage;
+    release(&victim->lock);
+    if(head == 0)
+      continue;
+    *np = n;
+    return head;
+  }
+  return 0;
 }
 
 /**
   * void *kalloc()
-  * @brief： 分配一个 4096 字节的物理页
+  * @brief： 分配一个 4096 字节的物理页，优先使用当前CPU的空闲链表，
+  *          链表为空时从伙伴系统补充一批，伙伴系统也空了再从其他CPU窃取
   * @param： NULL
   * @retval： 返回分配的物理页的指针，若分配失败返回 NULL
   */
@@ -87,36 +468,367 @@ void *
 kalloc(void)
 {
   struct run *r; // 定义运行链表节点
+  struct kmem *km;
+  int id, n;
 
-  acquire(&kmem.lock); // 获取锁以保护共享资源
-  r = kmem.freelist; // 从空闲链表中取出一个页面
-  if(r)
-    kmem.freelist = r->next; // 更新空闲链表头为下一个空闲页
-  release(&kmem.lock); // 释放锁
+  push_off(); // 关中断，保证cpuid()在使用期间有效
+  id = cpuid();
+  km = &kmem[id];
+  acquire(&km->lock); // 获取本CPU的锁
+  r = km->freelist; // 从空闲链表中取出一个页面
+  if(r){
+    km->freelist = r->next; // 更新空闲链表头为下一个空闲页
+    km->npage--;
+    km->nalloc++;
+  }
+  release(&km->lock); // 释放锁
 
-  if(r)
+  if(r == 0 && (r = bgetlist(KMEM_BATCH, &n)) != 0){
+    // 第一个页面直接返回，其余页面放入本CPU的链表
+    acquire(&km->lock);
+    kput(km, r, n);
+    km->nalloc++;
+    release(&km->lock);
+  }
+
+  if(r == 0 && (r = ksteal(id, &n)) != 0){
+    acquire(&km->lock);
+    kput(km, r, n);
+    km->nsteal += n;
+    km->nalloc++;
+    release(&km->lock);
+  }
+  pop_off();
+
+  // 各CPU的链表都空了，清零页池中的页也是空闲页
+  if(r == 0)
+    r = kzeroget();
+
+  // 没有空闲页时，收回空闲进程槽位留着复用的页再试一次
+  if(r == 0 && !holdingany() && procreclaim() > 0)
+    return kalloc();
+
+  // 还是没有，把一批用户页换出到交换区
+  if(r == 0 && !holdingany() && swapreclaim(KMEM_STEAL_BATCH) > 0)
+    return kalloc();
+
+  if(r){
+    pageref[PA2REF(r)] = 1; // 新页面只有一个引用
+#ifdef KPOISON
     memset((char*)r, 5, PGSIZE); // 用垃圾数据5填充，也是为了捕获潜在的内存问题
+#endif
+  }
   return (void*)r; // 返回分配的内存页
 }
 
+/**
+  * static struct run *kzeroget()
+  * @brief： 从清零页池中取出一页
+  * @param： NULL
+  * @retval： 清零的页面，池为空返回 NULL
+  */
+static struct run *
+kzeroget(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.list) != 0){
+    kzero.list = r->next;
+    __sync_fetch_and_sub(&kzero.npage, 1);
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0; // 清零时被链表指针占用的第一个字
+  return r;
+}
+
+/**
+  * void *kalloc_zeroed()
+  * @brief： 分配一个清零的物理页，优先使用清零页池，池为空时分配后再清零
+  * @brief： 用于页表页、用户内存等必须从零开始的页面
+  * @param： NULL
+  * @retval： 返回分配的物理页的指针，若分配失败返回 NULL
+  */
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+#ifndef KPOISON
+  if((r = kzeroget()) != 0){
+    pageref[PA2REF(r)] = 1;
+    __sync_fetch_and_add(&kzero.nhit, 1);
+    return (void*)r;
+  }
+#endif
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+/**
+  * static void kdrain()
+  * @brief： 把所有CPU空闲链表中的页面还给伙伴系统，让它们能和伙伴合并成大块
+  * @param： NULL
+  * @retval： NULL
+  */
+static void
+kdrain(void)
+{
+  struct run *r;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    r = ktake(&kmem[i], kmem[i].npage);
+    release(&kmem[i].lock);
+    bputlist(r);
+  }
+}
+
+/**
+  * void *kalloc_pages(int order)
+  * @brief： 分配2^order个物理上连续的页面，起始地址按其大小对齐，
+  *          用于DMA缓冲区、大页等需要连续物理内存的地方
+  * @brief： 没有足够大的空闲块时，先把各CPU空闲链表中的页还给伙伴系统合并，再试一次
+  * @brief： 只有第一页有引用计数，要用kfree_pages()以同样的order释放
+  * @param： order - 0到NBUDDY-1
+  * @retval： 返回分配的内存的起始地址，失败返回 NULL
+  */
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order >= NBUDDY)
+    return 0;
+
+  acquire(&buddy.lock);
+  pa = balloc(order);
+  release(&buddy.lock);
+  if(pa == 0){
+    kdrain();
+    acquire(&buddy.lock);
+    pa = balloc(order);
+    release(&buddy.lock);
+  }
+  if(pa){
+    pageref[PA2REF(pa)] = 1;
+#ifdef KPOISON
+    memset(pa, 5, PGSIZE << order);
+#endif
+  }
+  return pa;
+}
+
+/**
+  * void kfree_pages(void *pa, int order)
+  * @brief： 释放kalloc_pages()分配的块的一个引用，最后一个引用释放时放回伙伴系统
+  * @param： pa - 块的起始地址
+  * @param： order - 分配时的order
+  * @retval： NULL
+  */
+void
+kfree_pages(void *pa, int order)
+{
+  int ref;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order >= NBUDDY || (PA2REF(pa) & ((1UL << order) - 1)) != 0 ||
+     ((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+  ref = __sync_sub_and_fetch(&pageref[PA2REF(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree_pages: ref");
+
+#ifdef KPOISON
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  bfree(PA2REF(pa), order);
+  release(&buddy.lock);
+}
+
+/**
+  * int kzerofill()
+  * @brief： 由空闲的CPU在调度循环中调用，从本CPU的空闲链表（为空时从伙伴系统）取一页清零后放入清零页池
+  * @brief： 清零时不持有锁、不关中断，页面在此期间仍计入kzero.npage
+  * @param： NULL
+  * @retval： 清零了一页返回1，池已满或没有空闲页返回0
+  */
+int
+kzerofill(void)
+{
+#ifdef KPOISON
+  return 0; // 调试模式下不预先清零，保留垃圾数据
+#else
+  struct run *r;
+  struct kmem *km;
+
+  if(kzero.npage >= KZERO_TARGET)
+    return 0;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  if((r = km->freelist) != 0){
+    km->freelist = r->next;
+    km->npage--;
+    __sync_fetch_and_add(&kzero.npage, 1); // 在释放km->lock之前计入，空闲页总数不变
+  }
+  release(&km->lock);
+  pop_off();
+  if(r == 0){
+    // 本CPU链表为空，直接从伙伴系统取一页
+    acquire(&buddy.lock);
+    if((r = balloc(0)) != 0)
+      __sync_fetch_and_add(&kzero.npage, 1);
+    release(&buddy.lock);
+  }
+  if(r == 0)
+    return 0;
+
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.list;
+  kzero.list = r;
+  release(&kzero.lock);
+  return 1;
+#endif
+}
+
+/**
+  * void krefinc(void *pa)
+  * @brief： 增加物理页的引用计数，用于COW共享
+  * @param： pa - 由kalloc()分配的物理页
+  * @retval： NULL
+  */
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&pageref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+/**
+  * int krefcnt(void *pa)
+  * @brief： 返回物理页当前的引用计数
+  * @param： pa - 由kalloc()分配的物理页
+  * @retval： 引用计数
+  */
+int
+krefcnt(void *pa)
+{
+  return pageref[PA2REF(pa)];
+}
+
+/**
+  * void kmemstat(struct kmemstat *st)
+  * @brief： 收集每个CPU的分配、释放和窃取计数，以及交换区的统计
+  * @param： st - 保存统计结果的结构体
+  * @retval： NULL
+  */
+void
+kmemstat(struct kmemstat *st)
+{
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    st->nalloc[i] = kmem[i].nalloc;
+    st->nfree[i] = kmem[i].nfree;
+    st->nsteal[i] = kmem[i].nsteal;
+    st->npage[i] = kmem[i].npage;
+    release(&kmem[i].lock);
+  }
+  acquire(&buddy.lock);
+  for(int o = 0; o < NBUDDY; o++)
+    st->nbuddy[o] = buddy.nblock[o];
+  release(&buddy.lock);
+  st->nzero = kzero.npage;
+  st->nzerohit = kzero.nhit;
+  swapstat(st);
+}
+
+// 伙伴系统、所有CPU空闲链表和清零页池中的页数之和
+uint64
+nfreepages(void)
+{
+  uint64 cnt = buddy.npage; // 用于计数空闲页数量
+
+  for(int i = 0; i < NCPU; i++)
+    cnt += kmem[i].npage; // 64位对齐读取是原子的
+  return cnt + kzero.npage;
+}
+
 /**
   * uint64 acquire_freemem()
   * @brief： 计算当前系统中剩余的空闲内存量
+  * @brief： 只读取每个CPU的空闲页计数，不遍历链表也不加锁，
+  *          因此是O(NCPU)的并且不会阻塞kalloc()/kfree()。
+  *          结果是一个近似的快照：窃取过程中被搬运的页面可能暂时未被计入。
+  *          已为懒分配预留的页面不计入空闲内存。
   * @param： NULL
   * @retval： 返回剩余的空闲内存大小（单位为字节）
   */
 uint64
 acquire_freemem(){
-  struct run *r; // 定义运行链表节点
-  uint64 cnt = 0; // 用于计数空闲页数量
+  uint64 cnt = nfreepages();
+  uint64 res = kreserved.npage;
 
-  acquire(&kmem.lock); // 获取锁以保护共享资源
-  r = kmem.freelist; // 从空闲链表头开始
-  while(r){ // 遍历空闲链表
-    r = r->next; // 移动到下一个节点
-    cnt++; // 增加计数
+  // 预留给懒分配的页面不算空闲
+  if(cnt < res)
+    return 0;
+  return (cnt - res) * PGSIZE; // 返回总空闲字节数
+}
+
+/**
+  * int kreserve(uint64 npages)
+  * @brief： 为懒分配的用户页预留npages个物理页
+  * @brief： 只做记账，不分配页面；页表页和其他内核分配不预留。
+  *          交换区中还能用的槽也算作可以预留的页。
+  * @param： npages - 预留的页数
+  * @retval： 成功返回0，空闲页不足返回-1
+  */
+int
+kreserve(uint64 npages)
+{
+  uint64 avail = swapavail();
+  int r = -1;
+
+  acquire(&kreserved.lock);
+  if(kreserved.npage + npages <= nfreepages() + avail){
+    kreserved.npage += npages;
+    r = 0;
   }
-  release(&kmem.lock); // 释放锁
+  release(&kreserved.lock);
+  if(r < 0 && !holdingany() && procreclaim() > 0)
+    return kreserve(npages);
+  return r;
+}
 
-  return cnt * 4096; // 返回总空闲字节数
-}
\ No newline at end of file
+/**
+  * void kunreserve(uint64 npages)
+  * @brief： 归还kreserve()预留的页，用于页面被真正分配或懒分配区域被释放
+  * @param： npages - 归还的页数
+  * @retval： NULL
+  */
+void
+kunreserve(uint64 npages)
+{
+  acquire(&kreserved.lock);
+  if(npages > kreserved.npage)
+    panic("kunreserve");
+  kreserved.npage -= npages;
+  release(&kreserved.lock);
+}
@@ -0,0 +1,13 @@
+struct kmemstat {
+  uint64 nalloc[NCPU];  // kalloc() calls served on each cpu
+  uint64 nfree[NCPU];   // kfree() calls on each cpu
+  uint64 nsteal[NCPU];  // pages each cpu stole from other cpus
+  uint64 npage[NCPU];   // pages currently on each cpu's freelist
+  uint64 nbuddy[NBUDDY]; // free blocks of 2^order pages in the buddy allocator
+  uint64 nzero;         // pages in the pool of pre-zeroed pages
+  uint64 nzerohit;      // kalloc_zeroed() calls the pool served
+  uint64 nswap;         // pages of swap space, 0 if there's no swap disk
+  uint64 nswapfree;     // of those, not in use
+  uint64 nswapin;       // pages read back from swap
+  uint64 nswapout;      // pages swapped out
+};
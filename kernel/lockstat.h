@@ -0,0 +1,12 @@
+#define NLOCKSTAT 64  // lock names with statistics
+
+// spin lock statistics, returned by lockstat(), one per lock
+// name: all locks initialized with the same name are counted
+// together (all the "proc" locks, say).
+struct lockstat {
+  char name[16];
+  uint64 nacquire;      // acquire() calls
+  uint64 ncontend;      // acquire() calls that found the lock held
+  uint64 nspin;         // times those calls looked at the lock again
+  uint64 maxhold;       // longest time held, in time CSR cycles
+};
@@ -6,6 +6,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -16,10 +17,29 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves log
+// space for the call and returns. But if the log is close to
+// running out, it sleeps until the last outstanding end_op()
+// commits. begin_op() reserves MAXOPBLOCKS; a call that knows
+// how many blocks it will write can reserve just that many
+// with begin_opn().
+//
+// Commits are normally done by the log writer thread, not by
+// end_op(). It waits LOGDELAY ticks after a transaction gets its
+// first block, so that the updates of several system calls are
+// committed together, and commits once no FS system call is
+// active. Only when somebody needs the commit now -- begin_op()
+// short of log space, or log_sync() for fsync() -- does the
+// last end_op() commit synchronously, as it always used to.
+// An FS system call that returned may therefore be lost in a
+// crash until the next commit; it is never partially applied.
+//
+// Writes that append to a file don't allocate the new data
+// blocks: bmap() gives them placeholder numbers, and commit()
+// allocates them all, just before writing the log (see
+// ballocdelayed() in fs.c). The log space such a block and its
+// bitmap block will take moves from the writer's reservation
+// to log.delayed, which begin_op() counts as used.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -42,14 +62,24 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by outstanding FS sys calls.
+  int delayed;     // log blocks kept for data blocks commit() allocates.
   int committing;  // in commit(), please wait.
+  int draining;    // a commit is wanted now; hold off new FS sys calls.
   int dev;
+  uint dirtytick;  // ticks when the open transaction got its first block.
+  uint ncommit;    // number of commits done.
   struct logheader lh;
 };
 struct log log;
 
+// blocks written to disk together by write_log() and install_trans().
+#define LOGBATCH 16
+
 static void recover_from_log(void);
 static void commit();
+static void logwriter(void);
+static void commit_locked(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -60,24 +90,46 @@ initlog(int dev, struct superblock *sb)
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  if(log.size > LOGSIZE+1)
+    log.size = LOGSIZE+1; // header block + LOGSIZE blocks
   log.dev = dev;
   recover_from_log();
+  if(kthread(logwriter, "logwriter") < 0)
+    panic("initlog: logwriter");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// During a normal commit the pinned cache blocks already hold
+// what was logged; only recovery must read the log blocks.
 static void
-install_trans(void)
-{
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+install_trans(int recovering)
+{
+  struct buf *dbuf[LOGBATCH], *lbuf[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      dbuf[i] = breadstart(log.dev, log.lh.block[tail+i]); // read dst
+      if(recovering)
+        lbuf[i] = breadstart(log.dev, log.start+tail+i+1); // read log block
+    }
+    for (i = 0; i < n; i++) {
+      bwait(dbuf[i]);
+      if(recovering){
+        bwait(lbuf[i]);
+        memmove(dbuf[i]->data, lbuf[i]->data, BSIZE);  // copy block to dst
+        brelse(lbuf[i]);
+      }
+    }
+    bwritev(dbuf, n);  // write dst to disk
+    for (i = 0; i < n; i++) {
+      if(!recovering)
+        bunpin(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -116,7 +168,7 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
+  install_trans(1); // if committed, copy from log to disk
   log.lh.n = 0;
   write_head(); // clear the log
 }
@@ -125,51 +177,156 @@ recover_from_log(void)
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// like begin_op(), for an FS system call that writes
+// at most n distinct blocks.
+void
+begin_opn(int n)
+{
+  if(n > log.size - 1)
+    panic("begin_opn: too big");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    if(log.committing || log.draining){
       sleep(&log, &log.lock);
+    } else if(log.lh.n + log.reserved + log.delayed + n > log.size - 1){
+      // this op might exhaust log space; commit now, or
+      // have the last outstanding end_op() do it.
+      if(log.outstanding == 0)
+        commit_locked();
+      else {
+        log.draining = 1;
+        sleep(&log, &log.lock);
+      }
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// commit the open transaction.
+// caller holds log.lock and no FS sys call is outstanding;
+// log.lock is released while the blocks are written.
+static void
+commit_locked(void)
+{
+  log.committing = 1;
+  log.draining = 0;
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  release(&log.lock);
+  commit();
+  acquire(&log.lock);
+  log.committing = 0;
+  log.ncommit++;
+  wakeup(&log);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and a commit is wanted now; otherwise leaves it to
+// the log writer.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
+  myproc()->logres = 0;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  if(log.outstanding == 0 && log.draining){
+    commit_locked();
   } else {
+    if(log.outstanding == 0 && log.lh.n > 0)
+      wakeup(&log.lh); // the log writer may be idle
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and this call's reservation has been given back.
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+// the caller's FS system call puts off allocating a data block
+// until commit: move the log space for the block and for its
+// bitmap block from the call's reservation to log.delayed.
+// returns -1 if the reservation can't spare them; then the
+// block has to be allocated now.
+int
+log_delay(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&log.lock);
+  if(p->logres < 2){
     release(&log.lock);
+    return -1;
+  }
+  p->logres -= 2;
+  log.reserved -= 2;
+  log.delayed += 2;
+  release(&log.lock);
+  return 0;
+}
+
+// a block log_delay() was called for was truncated away
+// before commit allocated it.
+void
+log_undelay(void)
+{
+  acquire(&log.lock);
+  log.delayed -= 2;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// wait until every FS system call that has already
+// returned is on disk. used by fsync().
+void
+log_sync(void)
+{
+  uint target;
+
+  acquire(&log.lock);
+  target = log.ncommit;
+  if(log.lh.n > 0 || log.committing)
+    target++;
+  while((int)(log.ncommit - target) < 0){
+    if(log.committing){
+      sleep(&log, &log.lock);
+    } else if(log.outstanding == 0){
+      commit_locked();
+    } else {
+      log.draining = 1;
+      sleep(&log, &log.lock);
+    }
+  }
+  release(&log.lock);
+}
+
+// the log writer thread: group-commits transactions in the
+// background, LOGDELAY ticks after they start collecting blocks.
+static void
+logwriter(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(log.lh.n == 0){
+      sleep(&log.lh, &log.lock); // woken by end_op()
+    } else if(log.committing || log.outstanding > 0){
+      sleepuntil(ticks + 1, &log.lock); // check again next tick
+    } else if(ticks - log.dirtytick < LOGDELAY){
+      sleepuntil(log.dirtytick + LOGDELAY, &log.lock);
+    } else {
+      commit_locked();
+    }
   }
 }
 
@@ -177,25 +334,38 @@ end_op(void)
 static void
 write_log(void)
 {
-  int tail;
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      to[i] = bnew(log.dev, log.start+tail+i+1); // log block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bwritev(to, n);  // write the log
+    for (i = 0; i < n; i++)
+      brelse(to[i]);
   }
 }
 
 static void
 commit()
 {
+  if (log.delayed > 0) {
+    ballocdelayed(); // give put-off data blocks their blocks
+    acquire(&log.lock);
+    log.delayed = 0;
+    release(&log.lock);
+  }
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+    install_trans(0); // Now install writes to home locations
     log.lh.n = 0;
     write_head();    // Erase the transaction from the log
   }
@@ -217,7 +387,8 @@ log_write(struct buf *b)
 
   if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  // commit() writes too, in ballocdelayed().
+  if (log.outstanding < 1 && !log.committing)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
@@ -228,6 +399,8 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    if(log.lh.n == 0)
+      log.dirtytick = ticks;
     log.lh.n++;
   }
   release(&log.lock);
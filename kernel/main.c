@@ -16,22 +16,32 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    bootparaminit(); // table sizes from the kernel command line
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
+    traceinit();     // syscall trace rings
+    profinit();      // profiler sample rings
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    dcacheinit();    // directory name cache
+    pcacheinit();    // file page cache
+    tmpfsinit();     // in-memory file system
     fileinit();      // file table
+    pipeinit();      // pipe slab cache
+    futexinit();     // futex wait queues
+    shminit();       // shared memory segments
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
   } else {
+    kinithart();     // help kinit() fill the free lists
     while(started == 0)
       ;
     __sync_synchronize();
@@ -24,12 +24,20 @@
 // virtio mmio interface
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define VIRTIO1 0x10002000  // swap disk, if any
+#define VIRTIO1_IRQ 2
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
+// the CLINT again, just below KERNBASE, outside the first 1GB that
+// per-process kernel page tables keep for their copy of user memory,
+// so the kernel can reach it on any kernel page table; see timerkick().
+#define KCLINT (KERNBASE - 0x10000)
+#define KCLINT_MTIMECMP(hartid) (KCLINT + 0x4000 + 8*(hartid))
+
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -62,6 +70,22 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   THREADTF (the trapframes of threads made by clone())
+//   USYSCALL (p->usyscall, read-only to the process)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
-#define TRAPFRAME (TRAMPOLINE - PGSIZE)
\ No newline at end of file
+#define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define USYSCALL (TRAPFRAME - PGSIZE)
+
+// the trapframe of the thread in proc slot i, in the page table
+// it shares with its leader, whose own is at TRAPFRAME.
+#define THREADTF(i) (USYSCALL - ((i)+1)*PGSIZE)
+
+// the start of the USYSCALL page, which the kernel keeps up to
+// date so that user code can read these without a syscall;
+// see ugetpid() and uuptime() in ulib.c.
+struct usyscall {
+  int pid;      // process ID
+  uint ticks;   // ticks, as of the last return to user space
+  int cpu;      // CPU the process (some thread of it) last returned to user space on
+};
\ No newline at end of file
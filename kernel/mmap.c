@@ -0,0 +1,469 @@
+// Memory-mapped files.
+//
+// mmap() records a mapping in a free slot of p->vma[] and maps
+// nothing; mmapfault() maps each page on first touch, straight
+// from the page cache. A MAP_SHARED page is the cached page
+// itself, so stores to it are seen at once by read() and by
+// every other mapping of the file, and munmap() writes the
+// pages the hardware marked dirty back to the file. A writable
+// MAP_PRIVATE page is mapped copy-on-write, so the first store
+// gets a private copy from cowfault().
+//
+// Mappings are placed downwards from PLIC, below which the
+// per-process kernel page table mirrors user memory, so that
+// system calls can read them as they read [0, sz). The heap
+// grows up to the lowest of them; see mmapbase().
+//
+// Shared memory segments (see shm.c) are attached as mappings
+// too, with v->shm set instead of v->f.
+//
+// Threads made by clone() share their leader's vma[]. mmap()
+// and munmap() change it holding the leader's vmlock, and its
+// pglock as well, so that lazyfault() can check a page is
+// still mapped just before mapping it. Nothing that starts a
+// log transaction runs with the vmlock held: a thread in
+// filewrite() may fault on its buffer inside one.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "stat.h"
+
+int umappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm);
+pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
+
+// the mapping of p that contains va, or 0.
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  p = p->leader;
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len != 0 && va >= v->va && va < v->va + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// the lowest address mapped by mmap(), which the heap
+// mustn't grow into.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = PLIC;
+
+  p = p->leader;
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len != 0 && v->va < base)
+      base = v->va;
+  }
+  return base;
+}
+
+// the end of the region of p's memory that contains va:
+// sz for the heap, the end of the mapping for an mmap()ed
+// file. 0 if va isn't p's.
+uint64
+uvmend(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  if(va < p->sz)
+    return p->sz;
+  if((v = findvma(p, va)) != 0)
+    return v->va + v->len;
+  return 0;
+}
+
+// does p have ip mapped, as its program or with mmap()?
+// a fault on such a page while ip is locked can't be served.
+int
+imapped(struct proc *p, struct inode *ip)
+{
+  struct vma *v;
+
+  p = p->leader;
+  if(p->execip == ip)
+    return 1;
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len != 0 && v->f && v->f->ip == ip)
+      return 1;
+  }
+  return 0;
+}
+
+// another reference to what v maps, for a copy of v.
+static void
+vmadup(struct vma *v)
+{
+  if(v->shm)
+    shmdup(v->shm);
+  else
+    filedup(v->f);
+}
+
+// drop v's reference to what it maps.
+static void
+vmaclose(struct vma *v)
+{
+  if(v->shm)
+    shmput(v->shm);
+  else
+    fileclose(v->f);
+}
+
+// add a mapping of len bytes of f, or of shared memory segment
+// s, from offset off to the current process. the mapping takes
+// a reference to f of its own, but takes over the caller's
+// reference to s. returns the address, or -1.
+static uint64
+vmaadd(uint64 len, int prot, int flags, struct file *f, struct shmseg *s, uint off)
+{
+  struct proc *p = myproc(), *l = p->leader;
+  struct vma *v, *u;
+  uint64 va;
+
+  acquiresleep(&l->vmlock);
+  for(v = l->vma; v < l->vma + NVMA; v++){
+    if(v->len == 0)
+      break;
+  }
+  if(v == l->vma + NVMA)
+    goto bad;
+
+  // the highest gap below PLIC that fits.
+  len = PGROUNDUP(len);
+  va = PLIC - len;
+ again:
+  for(u = l->vma; u < l->vma + NVMA; u++){
+    if(u->len != 0 && va < u->va + u->len && va + len > u->va){
+      if(u->va < len)
+        goto bad;
+      va = u->va - len;
+      goto again;
+    }
+  }
+  if(va < PGROUNDUP(p->sz))
+    goto bad;
+
+  acquire(&l->pglock);
+  v->va = va;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->shm = s;
+  v->off = off;
+  v->len = len;
+  release(&l->pglock);
+  releasesleep(&l->vmlock);
+  return va;
+
+ bad:
+  releasesleep(&l->vmlock);
+  return -1;
+}
+
+// map len bytes of f from offset off into the current
+// process. returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  int type;
+
+  if(len == 0 || len >= PLIC || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  ilock(f->ip);
+  type = f->ip->type;
+  iunlock(f->ip);
+  if(type != T_FILE)
+    return -1;
+  return vmaadd(len, prot, flags, f, 0, off);
+}
+
+// attach shared memory segment s to the current process,
+// readable and writable. the mapping takes over the caller's
+// reference to s. returns the address, or -1.
+uint64
+mmapshm(struct shmseg *s)
+{
+  return vmaadd(shmsize(s), PROT_READ|PROT_WRITE, MAP_SHARED, 0, s, 0);
+}
+
+// write the pages in [va, va+len) of mapping v that the
+// hardware marked dirty in pagetable back to the file, if v
+// is a writable MAP_SHARED mapping. each page is held with
+// uvmhold() while it's written, in case another thread
+// unmaps it. the caller mustn't hold the vmlock: a thread
+// in filewrite() with log space may be waiting for it in
+// lazyfault().
+static void
+vmasync(pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip;
+  uint64 a, pa;
+  uint off, n;
+  pte_t *pte;
+
+  if(v->f == 0 || !(v->flags & MAP_SHARED) || !(v->prot & PROT_WRITE))
+    return;
+  ip = v->f->ip;
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+    if((pa = uvmhold(pagetable, a, 0)) == 0)
+      continue;
+    off = v->off + (a - v->va);
+    begin_opn(PGSIZE/BSIZE + 1);
+    ilock(ip);
+    if(off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      writei(ip, 0, pa, off, n);
+    }
+    iunlock(ip);
+    end_op();
+    kfree((void*)pa);
+  }
+}
+
+// unmap [va, va+len) of mapping v from pagetable and the
+// kernel page table mirror, writing dirty shared pages back.
+// only when no other thread can be using pagetable.
+static void
+vmaunmap(struct proc *p, pagetable_t pagetable, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+
+  vmasync(pagetable, v, va, len);
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    kfree((void*)PTE2PA(*pte));
+    *pte = 0;
+    vmrss(pagetable, a, -1);
+  }
+  uvmunmap(p->kpagetable, va, len / PGSIZE, 0);
+  sfence_vma();
+}
+
+// unmap [va, va+len) from the current process. the range
+// must lie within one mapping; it may leave a hole in the
+// middle of it. dirty shared pages are written back, and the
+// mapping's file closed, with the vmlock released; see
+// vmasync().
+int
+munmap(uint64 va, uint64 len)
+{
+  struct proc *p = myproc(), *l = p->leader;
+  struct vma *v, *w, old;
+  int last;
+
+  if(va % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(va + len < va)
+    return -1;
+
+  // write back before the range goes: other threads may still
+  // store to it until it's unmapped, but those stores race
+  // with the munmap() anyway.
+  acquiresleep(&l->vmlock);
+  if((v = findvma(p, va)) == 0 || va + len > v->va + v->len)
+    goto bad;
+  old = *v;
+  vmadup(&old);
+  releasesleep(&l->vmlock);
+  vmasync(p->pagetable, &old, va, len);
+  vmaclose(&old);
+
+  // another thread may have changed the mapping meanwhile.
+  acquiresleep(&l->vmlock);
+  if((v = findvma(p, va)) == 0 || va + len > v->va + v->len)
+    goto bad;
+  w = 0;
+  if(va > v->va && va + len < v->va + v->len){
+    for(w = l->vma; w < l->vma + NVMA; w++){
+      if(w->len == 0)
+        break;
+    }
+    if(w == l->vma + NVMA)
+      goto bad;
+  }
+
+  old = *v;
+  acquire(&l->pglock);
+  if(w){
+    // split: w gets the part above the hole.
+    *w = *v;
+    w->va = va + len;
+    w->len = v->va + v->len - w->va;
+    w->off = v->off + (w->va - v->va);
+    vmadup(w);
+    v->len = va - v->va;
+  } else if(va == v->va){
+    v->va += len;
+    v->off += len;
+    v->len -= len;
+  } else {
+    v->len -= len;
+  }
+  last = v->len == 0;
+  if(last){
+    v->f = 0;
+    v->shm = 0;
+  }
+  release(&l->pglock);
+  uvmunmapsync(p, va, len / PGSIZE);
+  releasesleep(&l->vmlock);
+  if(last)
+    vmaclose(&old);
+  return 0;
+
+ bad:
+  releasesleep(&l->vmlock);
+  return -1;
+}
+
+// detach the shared memory segment attached at va from the
+// current process: the whole of the mapping containing va,
+// which may be a part of the segment if munmap() split it.
+int
+munmapshm(uint64 va)
+{
+  struct proc *p = myproc(), *l = p->leader;
+  struct vma *v;
+  uint64 start, len;
+
+  acquiresleep(&l->vmlock);
+  if((v = findvma(p, va)) == 0 || v->shm == 0){
+    releasesleep(&l->vmlock);
+    return -1;
+  }
+  start = v->va;
+  len = v->len;
+  releasesleep(&l->vmlock);
+  return munmap(start, len);
+}
+
+// find the page of a file p has mapped at va, for lazyfault().
+// returns 1 if va isn't in one of p's mappings, -1 if the page
+// can't be had, or 0 with a page for the caller to map in *pa
+// and the PTE flags to map it with in *perm.
+int
+mmapfault(struct proc *p, uint64 va, uint64 *pa, int *perm)
+{
+  struct vma *v;
+  struct inode *ip;
+  char *mem;
+
+  if((v = findvma(p, va)) == 0)
+    return 1;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  if(v->shm){
+    // a segment's pages are always there, and always shared.
+    *perm = PTE_U|PTE_R;
+    if(v->prot & PROT_WRITE)
+      *perm |= PTE_W;
+    if((mem = shmpage(v->shm, v->off + (PGROUNDDOWN(va) - v->va))) == 0)
+      return -1;
+    *pa = (uint64)mem;
+    return 0;
+  }
+  ip = v->f->ip;
+  // reading ip may sleep, and needs ip->lock; see execfault().
+  if(holdingany() || holdingsleep(&ip->lock))
+    return -1;
+
+  *perm = PTE_U|PTE_R;
+  if(v->prot & PROT_EXEC)
+    *perm |= PTE_X;
+  if(v->prot & PROT_WRITE)
+    *perm |= (v->flags & MAP_SHARED) ? PTE_W : PTE_COW;
+  ilock(ip);
+  mem = pcache_get(ip, v->off + (PGROUNDDOWN(va) - v->va));
+  iunlock(ip);
+  if(mem == 0)
+    return -1;
+  *pa = (uint64)mem;
+  return 0;
+}
+
+// give fork()'s child np the parent p's mappings. pages the
+// parent has faulted in are shared with the child, private
+// writable ones copy-on-write, as uvmcopy() does.
+// on failure the caller must mmapclear() np. the caller holds
+// the vmlock and pglock of p's leader, whose vma[] p shares.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct proc *l = p->leader;
+  struct vma *v;
+  uint64 a, pa;
+  pte_t *pte;
+  uint flags;
+
+  for(v = l->vma; v < l->vma + NVMA; v++){
+    if(v->len == 0)
+      continue;
+    np->vma[v - l->vma] = *v;
+    vmadup(v);
+  }
+  for(v = l->vma; v < l->vma + NVMA; v++){
+    for(a = v->va; a < v->va + v->len; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if((v->flags & MAP_PRIVATE) && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if(mappages(np->pagetable, a, PGSIZE, pa, flags) != 0){
+        sfence_vma();
+        return -1;
+      }
+      krefinc((void*)pa);
+      if(umappages(np->kpagetable, a, PGSIZE, pa, flags & ~(PTE_U|PTE_W|PTE_COW)) != 0){
+        sfence_vma();
+        return -1;
+      }
+    }
+  }
+  sfence_vma(); // the parent's private pages are read-only now
+  return 0;
+}
+
+// unmap all of p's mappings from pagetable, which is p's
+// page table, or its old one in exec().
+void
+mmapclear(struct proc *p, pagetable_t pagetable)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++){
+    if(v->len == 0)
+      continue;
+    vmaunmap(p, pagetable, v, v->va, v->len);
+    vmaclose(v);
+    v->f = 0;
+    v->shm = 0;
+    v->len = 0;
+  }
+}
@@ -1,13 +1,37 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       256  // processes, unless the nproc= boot parameter says otherwise
+#define MAXNPROC   4096  // most processes nproc= can ask for
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NBUDDY       10  // buddy allocator orders: blocks of 1 to 512 pages
+#define NOFILE       16  // open files per process kept in struct proc
+#define MAXOFILE   4096  // open files per process
+#define NINODE      500  // active i-nodes, unless ninode= says otherwise
+#define MAXNINODE 65536  // most i-nodes ninode= can ask for
+#define NDCACHE     256  // entries in the directory name cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  20  // max # of blocks any FS op writes
+#define LOGSIZE      126  // max data blocks in on-disk log (header fits a block)
+#define LOGDELAY     1  // ticks the log writer lets a transaction grow
+#define RAMAX        16  // max readahead window, in blocks
+#define NBUF         (LOGSIZE+MAXOPBLOCKS*3+RAMAX*2)  // fewest buffers in the disk block cache
+#define BCACHEMEM    32    // at boot, give the block cache 1/BCACHEMEM of free memory
+#define MAXNBUF      2048  // but no more buffers than this
+#define NBUCKET      127 // buffer cache hash buckets (prime); scale with MAXNBUF
+#define FSSIZE       100000  // default size of file system in blocks, for mkfs
 #define MAXPATH      128   // maximum file path name
+#define NPIPEPAGE    2     // buffer pages per pipe (power of 2)
+#define TICKCYCLES   1000000  // timer cycles per tick; about 1/10th second in qemu
+#define NPRIO        4     // scheduling levels, 0 runs first
+#define DEFPRIO      1     // initial priority; children inherit their parent's
+#define BOOSTTICKS   10    // ticks between resets of every level to its priority
+#define NTRACE       256   // trace ring entries per CPU
+#define NPROF        512   // profiler samples per CPU
+#define NPCACHE      128   // pages in the file page cache
+#define NEXECSEG     4     // loadable segments exec() can demand-page
+#define NVMA         16    // mmap()ed regions per process
+#define NSHM         16    // shared memory segments
+#define SHMMAXPG     512   // pages in a shared memory segment
+#define NSWAP        8192  // most swap slots (pages) used on the swap disk
+#define NMOUNT       4     // mounted file systems
+#define NTMPINODE    200   // inodes in the tmpfs
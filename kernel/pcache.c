@@ -0,0 +1,215 @@
+// Page cache.
+//
+// Holds file contents a page at a time, above the buffer
+// cache. readi() copies file data out of it, writei() updates
+// the pages it holds as it writes the blocks beneath them, and
+// exec() and mmap() map its pages straight into user memory,
+// so processes running the same program or mapping the same
+// file share the same physical pages.
+//
+// Pages are hashed by (dev, inum, page of the file) into NPHASH
+// chains, and recycled least recently used first. The cache
+// holds one reference to each page (see krefinc()), and gives
+// each caller of pcache_get() another. A page somebody else
+// still holds a reference to is never recycled: it may be
+// mapped MAP_SHARED, and the next reader must see the stores
+// made through the mapping. If every page is in use like
+// that, pcache_get() returns a page that isn't cached.
+//
+// A file's pages may only be looked up, filled, updated or
+// dropped while holding its ip->lock, so there's at most one
+// reader filling a given page. pcache.lock only protects the
+// cache's own lists. ip->pcached says the file may have pages
+// in the cache, so that writei() needn't look when it has none.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPHASH 61  // prime
+
+struct pcpage {
+  uint dev;
+  uint inum;
+  uint pgno;            // page of the file, off / PGSIZE
+  char *pa;             // the page, 0 if the entry is unused
+  struct pcpage *hnext; // hash chain
+  struct pcpage *prev;  // LRU list, most recently used first
+  struct pcpage *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct pcpage page[NPCACHE];
+  struct pcpage *hash[NPHASH];
+  struct pcpage lru;
+} pcache;
+
+static uint
+phash(uint dev, uint inum, uint pgno)
+{
+  return ((dev * 31 + inum) * 31 + pgno) % NPHASH;
+}
+
+// move pg to the front of the LRU list.
+static void
+ptouch(struct pcpage *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+  pg->next = pcache.lru.next;
+  pg->prev = &pcache.lru;
+  pcache.lru.next->prev = pg;
+  pcache.lru.next = pg;
+}
+
+// take pg off its hash chain and return its page, if it has one.
+static char*
+punhash(struct pcpage *pg)
+{
+  struct pcpage **pp;
+  char *pa;
+
+  if((pa = pg->pa) == 0)
+    return 0;
+  for(pp = &pcache.hash[phash(pg->dev, pg->inum, pg->pgno)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->pa = 0;
+  return pa;
+}
+
+// find ip's page pgno. caller holds pcache.lock.
+static struct pcpage*
+pfind(struct inode *ip, uint pgno)
+{
+  struct pcpage *pg;
+
+  for(pg = pcache.hash[phash(ip->dev, ip->inum, pgno)]; pg; pg = pg->hnext){
+    if(pg->dev == ip->dev && pg->inum == ip->inum && pg->pgno == pgno)
+      return pg;
+  }
+  return 0;
+}
+
+void
+pcacheinit(void)
+{
+  struct pcpage *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.prev = &pcache.lru;
+  pcache.lru.next = &pcache.lru;
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    pg->next = pcache.lru.next;
+    pg->prev = &pcache.lru;
+    pcache.lru.next->prev = pg;
+    pcache.lru.next = pg;
+  }
+}
+
+// return the page holding the contents of ip at offset off
+// (page-aligned), reading it if it isn't cached, with a
+// reference for the caller to kfree(). bytes beyond the end
+// of the file read as zero. caller holds ip->lock.
+// returns 0 if out of memory or the read fails.
+char*
+pcache_get(struct inode *ip, uint off)
+{
+  struct pcpage *pg;
+  char *pa, *old;
+  uint pgno = off / PGSIZE;
+  uint h;
+  int n;
+
+  acquire(&pcache.lock);
+  if((pg = pfind(ip, pgno)) != 0){
+    ptouch(pg);
+    pa = pg->pa;
+    krefinc(pa);
+    release(&pcache.lock);
+    return pa;
+  }
+  release(&pcache.lock);
+
+  if((pa = kalloc()) == 0)
+    return 0;
+  if((n = readiblk(ip, 0, (uint64)pa, off, PGSIZE)) < 0){
+    kfree(pa);
+    return 0;
+  }
+  memset(pa + n, 0, PGSIZE - n);
+  ip->pcached = 1;
+
+  // recycle the least recently used entry nobody else holds.
+  acquire(&pcache.lock);
+  for(pg = pcache.lru.prev; pg != &pcache.lru; pg = pg->prev){
+    if(pg->pa == 0 || krefcnt(pg->pa) == 1)
+      break;
+  }
+  if(pg == &pcache.lru){
+    release(&pcache.lock);
+    return pa;
+  }
+  old = punhash(pg);
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->pgno = pgno;
+  pg->pa = pa;
+  h = phash(ip->dev, ip->inum, pgno);
+  pg->hnext = pcache.hash[h];
+  pcache.hash[h] = pg;
+  ptouch(pg);
+  krefinc(pa); // one for the cache, one for the caller
+  release(&pcache.lock);
+  if(old)
+    kfree(old);
+  return pa;
+}
+
+// writei() has just written the n bytes at src to ip at
+// offset off; update the cached page that holds them.
+// the bytes must not cross a page boundary. caller holds
+// ip->lock.
+void
+pcache_update(struct inode *ip, uint off, void *src, uint n)
+{
+  struct pcpage *pg;
+
+  if(!ip->pcached)
+    return;
+  acquire(&pcache.lock);
+  if((pg = pfind(ip, off / PGSIZE)) != 0)
+    memmove(pg->pa + off % PGSIZE, src, n);
+  release(&pcache.lock);
+}
+
+// drop ip's pages from the cache, since it is being
+// truncated. pages that are still mapped stay with their
+// mappers. caller holds ip->lock.
+void
+pcache_inval(struct inode *ip)
+{
+  struct pcpage *pg;
+  char *pa;
+
+  if(!ip->pcached)
+    return;
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->pa && pg->inum == ip->inum && pg->dev == ip->dev){
+      pa = punhash(pg);
+      kfree(pa);
+    }
+  }
+  release(&pcache.lock);
+  ip->pcached = 0;
+}
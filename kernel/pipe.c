@@ -3,22 +3,49 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// the ring is NPIPEPAGE physically contiguous pages from
+// kalloc_pages(); PIPESIZE must divide 2^32 so that nread and
+// nwrite can wrap.
+#define PIPESIZE (NPIPEPAGE*PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+// struct pipe is small; take it from a slab cache rather
+// than giving each one a page.
+static struct kmem_cache pipecache;
+
+// NPIPEPAGE is 1 << pipeorder.
+static int pipeorder;
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe));
+  while((1 << pipeorder) < NPIPEPAGE)
+    pipeorder++;
+}
+
+static void
+pipefree(struct pipe *pi)
+{
+  if(pi->data)
+    kfree_pages(pi->data, pipeorder);
+  kmem_cache_free(&pipecache, pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +55,9 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(&pipecache)) == 0)
+    goto bad;
+  if((pi->data = kalloc_pages(pipeorder)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +76,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,43 +97,91 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// bytes that can be copied in one piece starting at ring offset
+// off: at most n, and never across the end of the ring.
+static uint
+pipechunk(uint off, uint n)
+{
+  uint m = PIPESIZE - off;
+  return n < m ? n : m;
+}
+
+// write n bytes from addr, a user virtual address if
+// user_src==1, a kernel address otherwise (sendfile()).
+// user pages are copied from one at a time, held by
+// uvmhold() with pi->lock released: they can't be paged
+// in with it held, and kswapd leaves them alone while the
+// writer sleeps.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 addr, int n)
 {
   int i;
-  char ch;
+  uint off, m;
+  uint64 pa = 0, pinva = ~0UL;
+  char *src;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
+  for(i = 0; i < n; i += m){
+    m = 0;
+    if(user_src && PGROUNDDOWN(addr + i) != pinva){
+      // the next user page.
+      wakeup(&pi->nread);
+      release(&pi->lock);
+      if(pa)
+        kfree((void*)pa);
+      pinva = PGROUNDDOWN(addr + i);
+      pa = uvmhold(pr->pagetable, pinva, 0);
+      acquire(&pi->lock);
+      if(pa == 0)
+        break;
+      continue;
+    }
     while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
         release(&pi->lock);
+        if(pa)
+          kfree((void*)pa);
         return -1;
       }
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-      break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    off = pi->nwrite % PIPESIZE;
+    m = pipechunk(off, n - i);
+    if(m > PIPESIZE - (pi->nwrite - pi->nread))
+      m = PIPESIZE - (pi->nwrite - pi->nread);
+    if(user_src){
+      if(m > PGSIZE - (addr + i) % PGSIZE)
+        m = PGSIZE - (addr + i) % PGSIZE;
+      src = (char*)pa + (addr + i) % PGSIZE;
+    } else {
+      src = (char*)addr + i;
+    }
+    memmove(pi->data + off, src, m);
+    pi->nwrite += m;
   }
   wakeup(&pi->nread);
   release(&pi->lock);
+  if(pa)
+    kfree((void*)pa);
   return i;
 }
 
+// read up to n bytes to user address addr, holding each
+// user page with uvmhold() like pipewrite().
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint off, m;
+  uint64 pa = 0, pinva = ~0UL;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -114,14 +191,33 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    m = 0;
+    if(PGROUNDDOWN(addr + i) != pinva){
+      // the next user page. another reader may
+      // empty the pipe meanwhile.
+      release(&pi->lock);
+      if(pa)
+        kfree((void*)pa);
+      pinva = PGROUNDDOWN(addr + i);
+      pa = uvmhold(pr->pagetable, pinva, 1);
+      acquire(&pi->lock);
+      if(pa == 0)
+        break;
+      continue;
+    }
+    off = pi->nread % PIPESIZE;
+    m = pipechunk(off, n - i);
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m > PGSIZE - (addr + i) % PGSIZE)
+      m = PGSIZE - (addr + i) % PGSIZE;
+    memmove((char*)pa + (addr + i) % PGSIZE, pi->data + off, m);
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
+  if(pa)
+    kfree((void*)pa);
   return i;
 }
@@ -16,6 +16,7 @@
 #include "proc.h"
 
 volatile int panicked = 0;
+volatile int panicking = 0; // a panic message is being printed
 
 // lock to avoid interleaving concurrent printf's.
 static struct {
@@ -118,6 +119,7 @@ void
 panic(char *s)
 {
   pr.locking = 0;
+  panicking = 1; // print synchronously, not through uart_tx_buf
   printf("panic: ");
   printf(s);
   printf("\n");
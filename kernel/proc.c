@@ -3,30 +3,79 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "rwlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "procinfo.h"
 
 struct cpu cpus[NCPU];// CPU 结构数组
 
-struct proc proc[NPROC];// 进程结构数组
+struct proc *proc;// 进程结构数组，启动时由procalloc()分配
+int nproc;// 进程表的槽位数
 
 struct proc *initproc;// 初始化进程指针
 
+// 每个CPU的就绪队列：通过p->rqnext链接的RUNNABLE进程，先进先出。
+// 调度器只看自己的队列，队列空时从其他CPU的队列中窃取，
+// 所以调度开销与进程表大小无关。持有p->lock时可以获取q->lock，反之不行。
+//
+// 调度策略是多级反馈队列：每个队列按级别p->level（0最先运行）分成NPRIO个
+// 先进先出链表，总是运行级别最高的进程。进程从setpriority()设置的基础优先级
+// p->priority开始，每用完一个时间片被时钟抢占就降一级，所以交互式进程
+// 总是比计算密集的进程先运行；每BOOSTTICKS个tick所有进程回到自己的基础
+// 优先级，低级别的进程不会饿死。
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n; // 队列长度，不加锁读取只用于判断是否值得去窃取
+  uint boosted; // 上一次提升时的 ticks/BOOSTTICKS
+} runq[NCPU];
+
 int nextpid = 1;// 下一个进程 ID
 struct spinlock pid_lock;// PID 锁
 
+// 保护所有进程的parent、children/sib*和zombies/znext，
+// 并保证wait()不会错过子进程exit()的唤醒。
+// 需要同时持有时，先获取wait_lock再获取p->lock。
+struct spinlock wait_lock;
+
+// 保护进程槽位的占用情况：p->state离开或变回UNUSED时，
+// 在持有p->lock的同时获取写锁，acquire_nproc()只需获取读锁，
+// 不必逐个获取p->lock，多个CPU上的读者也不互相等待。
+struct rwlock proctab;
+
 extern void forkret(void);// fork 后的返回函数
-static void wakeup1(struct proc *chan);// 唤醒单个进程
+static void kthreadret(void);// 内核线程的入口
+static void addchild(struct proc *parent, struct proc *p);// 加入子进程链表
 static void freeproc(struct proc *p);// 释放进程结构
-
-pagetable_t ukvminit();
-void ukvmmap(pagetable_t kpagetable, uint64 va, uint64 pa, uint64 sz, int perm);
-void freeprockvm(struct proc* p);
+static void threadkill(struct proc *l);// 组长退出前结束其他线程
+static void setrunnable(struct proc *p);// 设为可运行并放入就绪队列
+static struct proc *runqget(void);// 取出下一个要运行的进程
+static int cpuidle(struct cpu *c);// 没有可运行的进程时标记本CPU空闲
+static void runqput(struct runq *q, struct proc *p);// 放到队列中p->level级别的末尾
+static void sleepqinit(void);// 初始化等待队列
+
+pagetable_t ukvminit(struct vmacct *a);
 int pagecopy(pagetable_t oldpage, pagetable_t newpage, uint64 begin, uint64 end);
 void ukvminithard(pagetable_t page);
 
 extern char trampoline[]; // trampoline.S
 
+/**
+  * void procalloc(int n)
+  * @brief： 启动时在kinit()之前调用，为n个槽位的进程表分配内存
+  * @param： n：槽位数，由启动参数nproc=决定
+  * @retval： NULL
+  */
+void
+procalloc(int n)
+{
+  nproc = n;
+  proc = bootalloc(n * sizeof(struct proc));
+}
+
 /**
   * void procinit()
   * @brief: 初始化进程表，在引导时调用。
@@ -39,8 +88,16 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");// 初始化 PID 锁
-  for(p = proc; p < &proc[NPROC]; p++) {
+  initlock(&wait_lock, "wait_lock");
+  initrwlock(&proctab, "proctab");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");// 初始化每个CPU的就绪队列
+  sleepqinit();// 初始化等待队列
+  for(p = proc; p < &proc[nproc]; p++) {
       initlock(&p->lock, "proc");// 初始化每个进程的锁
+      initlock(&p->pglock, "pglock");
+      initsleeplock(&p->vmlock, "vmlock");
+      initlock(&p->fdtab.lock, "fdtable");
 
       // 为进程的内核栈分配一个页面。
       // 将其映射到高地址内存，后面跟着一个无效的保护页面。
@@ -133,10 +190,17 @@ static struct proc*
 allocproc(void)
 {
   struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
+  int i, start;
+
+  // 各CPU从进程表中不同的位置开始找，同时fork()的CPU不会争抢同一批槽位的锁
+  push_off();
+  start = cpuid() * (nproc / NCPU);
+  pop_off();
+  // fork()和spawn()会暂时放开新进程的锁，那时它仍是UNUSED，但已经有了PID
+  for(i = 0; i < nproc; i++) {
+    p = &proc[(start + i) % nproc];
     acquire(&p->lock);// 获取进程锁
-    if(p->state == UNUSED) {// 如果进程状态为未使用
+    if(p->state == UNUSED && p->pid == 0) {// 如果进程状态为未使用
       goto found;// 跳转到找到的标记
     } else {
       release(&p->lock);// 释放锁
@@ -146,36 +210,52 @@ allocproc(void)
 
 found:
   p->pid = allocpid();// 分配进程 ID
+  p->priority = DEFPRIO;// 默认优先级，fork()会改成父进程的
+  p->level = DEFPRIO;
+  p->runtime = p->waittime = 0;// 清零统计
+  p->cycles = p->instret = 0;
+  p->nvcsw = p->nivcsw = p->npgfault = 0;
+  p->leader = p;// 自己是一个线程组的组长，clone()创建的线程会改掉
+  p->nthread = 1;
+  p->tlbseen = p->tlbgen;
+  p->tfva = TRAPFRAME;
+  p->fdt = &p->fdtab;
+
+  // trapframe页、usyscall页、用户页表和专属内核页表的骨架在freeproc()之后
+  // 仍留在槽位里，下一个使用这个槽位的进程直接接着用；只有第一次使用时才分配
 
   // 分配一个 trapframe 页
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+  if(p->trapframe == 0 && (p->trapframe = (struct trapframe *)kalloc()) == 0){
     release(&p->lock);// 分配失败，释放锁
     return 0;// 返回 NULL
   }
 
+  // 分配与用户空间共享的只读页，用户不陷入内核就能读到pid和ticks
+  if(p->usyscall == 0 && (p->usyscall = (struct usyscall *)kalloc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  p->usyscall->pid = p->pid;
+  p->usyscall->ticks = 0;
+
   // 初始化空的用户页表
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  if(p->pagetable == 0 && (p->pagetable = proc_pagetable(p)) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
   }
 
   // 为这个进程分配并初始化一个新的专属内核页
-  p->kpagetable = ukvminit();
-  if(p->pagetable == 0){
+  p->asid_cpu = -1; // 第一次调度时分配ASID，复用的内核页表不会用到旧的TLB项
+  if(p->kpagetable == 0 && (p->kpagetable = ukvminit(&p->vmacct)) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
   }
 
-  // 每个kernel stack的虚拟地址va是已经提前决定好的 直接算出它对应的pa
-  // 然后把这个映射加入到新的专属内核页里
-  uint64 va = KSTACK((int) (p - proc)); // 计算每个进程的内核栈的虚拟地址
-  pte_t pa = kvmpa(va); //找到虚拟地址 va 对应的物理地址 pa
-  memset((void *)pa, 0, PGSIZE); // 刷新清空pa地址对应的kernel stack
-  ukvmmap(p->kpagetable, va, (uint64)pa, PGSIZE, PTE_R | PTE_W); //创建映射关系
-  p->kstack = va; // 设置进程的内核栈
+  // 内核栈在procinit()中映射到kernel_pagetable，专属内核页共享这部分子树
+  p->kstack = KSTACK((int) (p - proc)); // 设置进程的内核栈
 
   // 设置新的上下文以开始执行 forkret
   // 该函数返回到用户空间
@@ -192,36 +272,80 @@ found:
   * @brief： free a proc structure and the data hanging from it,
              including user pages.
              p->lock must be held.
+  * @brief： trapframe页、usyscall页以及用户页表和专属内核页表的骨架留在槽位中，
+  *          由下一次allocproc()复用，fork()和exit()频繁时省去大部分分配、释放和
+  *          建立页表的开销。槽位最多占用nproc组这样的页。
   * @param： p：待释放的进程指针
   * @retval： NULL
   */
 static void
 freeproc(struct proc *p)
 {
-  if(p->trapframe)
-    kfree((void*)p->trapframe); // 释放 trapframe
-  p->trapframe = 0; // 设置为 NULL
   if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz); // 释放页表
-  p->pagetable = 0; // 设置为 NULL
+    uvmreset(p->pagetable, p->sz); // 释放用户内存，保留页表骨架
   p->sz = 0; // 用户内存大小设为 0
   p->pid = 0; // 设置 PID 为 0
   p->parent = 0; // 设置父进程为 0
+  p->children = p->zombies = 0;
   p->name[0] = 0; // 清空进程名称
   p->chan = 0; // 设置通道为 0
   p->killed = 0; // 设置被杀标志为 0
   p->xstate = 0; // 清空退出状态
+  acquirewrite(&proctab);
   p->state = UNUSED; // 设置状态为未使用
+  releasewrite(&proctab);
   p->trace_mask = 0; // 清空跟踪掩码
-  if (p->kpagetable) {
-    freeprockvm(p);
-    p->kpagetable = 0;
-  }
+  p->kfn = 0;
+  p->leader = 0;
+  if (p->kpagetable)
+    ukvmclear(p->kpagetable); // 清除用户镜像，保留内核页表骨架
   if (p->kstack) {
     p->kstack = 0;
   }
 }
 
+/**
+  * int procreclaim(void)
+  * @brief： 内存不足时，释放未使用的进程槽位中留着复用的页（见freeproc()）。
+  *          会获取每个槽位的p->lock，调用者不能持有任何自旋锁。
+  * @param： NULL
+  * @retval： 释放的页数
+  */
+int
+procreclaim(void)
+{
+  struct proc *p;
+  int n = 0;
+
+  for(p = proc; p < &proc[nproc]; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED && p->pid == 0){
+      if(p->pagetable){
+        proc_freepagetable(p->pagetable, 0);
+        p->pagetable = 0;
+        n += 3;
+      }
+      if(p->kpagetable){
+        ukvmfree(p->kpagetable);
+        p->kpagetable = 0;
+        n += 2;
+      }
+      if(p->trapframe){
+        kfree((void*)p->trapframe);
+        p->trapframe = 0;
+        n++;
+      }
+      if(p->usyscall){
+        kfree((void*)p->usyscall);
+        p->usyscall = 0;
+        n++;
+      }
+    }
+    release(&p->lock);
+  }
+  return n;
+}
+
 /**
   * pagetable_t proc_pagetable(struct proc *p)
   * @brief： 为给定进程创建用户页表，初始无用户内存，但包含 trampoline 页面
@@ -236,7 +360,7 @@ proc_pagetable(struct proc *p)
   pagetable_t pagetable;
 
   // 创建空的页表
-  pagetable = uvmcreate();
+  pagetable = uvmcreate(&p->vmacct);
   if(pagetable == 0)
     return 0;
 
@@ -256,6 +380,15 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // 将 usyscall 页只读映射到 TRAPFRAME 下面，ulib.c 直接读取
+  if(mappages(pagetable, USYSCALL, PGSIZE,
+              (uint64)(p->usyscall), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;// 返回创建的页表
 }
 
@@ -271,6 +404,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);// 取消映射 trampoline
   uvmunmap(pagetable, TRAPFRAME, 1, 0);// 取消映射 trapframe
+  uvmunmap(pagetable, USYSCALL, 1, 0);// 取消映射 usyscall 页
   uvmfree(pagetable, sz);// 释放页表和引用的物理内存
 }
 
@@ -313,42 +447,75 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));// 进程名设为 "initcode"
   p->cwd = namei("/");// 设置当前工作目录为根目录
 
-  p->state = RUNNABLE;// 将进程状态设为可运行
+  setrunnable(p);// 将进程状态设为可运行
 
   release(&p->lock);// 释放进程锁
 }
 
+// 把线程组l中每个线程的sz都设为sz，调用者持有l->vmlock
+static void
+setsz(struct proc *l, uint64 sz)
+{
+  struct proc *t;
+
+  l->sz = sz;
+  if(l->nthread == 1)
+    return;
+  for(t = proc; t < &proc[nproc]; t++){
+    if(t->leader == l)
+      t->sz = sz;
+  }
+}
+
 /**
   * int growproc(int n)
   * @brief：增加或减少用户内存
+  * @brief：增长时只预留物理页并修改p->sz，页面在首次访问时由lazyfault()分配
+  * @brief：持有组长的vmlock，线程组中所有线程的sz一起修改；缩小时由uvmunmapsync()
+  *         等其他线程刷新TLB之后再释放物理页
   * @param：n：要增加或减少的字节数，正值增加，负值减少
   * @retval：成功返回 0，失败返回 -1
   */
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct proc *l = p->leader;
 
-  sz = p->sz;
+  acquiresleep(&l->vmlock);
+  oldsz = sz = p->sz;
   if(n > 0){
-    // 内核页的虚拟地址不能溢出PLIC
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // 内核页的虚拟地址不能溢出PLIC，也不能长进mmap()映射的文件
+    if(sz + n >= mmapbase(p) ||
+       kreserve((PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE) != 0){
+      releasesleep(&l->vmlock);
       return -1;
     }
-    if (pagecopy(p->pagetable, p->kpagetable, p->sz, sz) != 0) {
-      // 增量同步[old size, new size]
-      return -1;
+    setsz(l, sz + n);
+  } else if(n < 0 && sz + n < sz){
+    sz += n;
+    // 截断程序段，之后再增长时新的页应该是0，而不是程序文件的内容
+    for(struct execseg *s = l->execseg; s < l->execseg + NEXECSEG; s++){
+      if(s->memsz == 0)
+        continue;
+      if(s->va >= sz)
+        s->memsz = 0;
+      else if(s->va + s->memsz > sz)
+        s->memsz = sz - s->va;
+      if(s->filesz > s->memsz)
+        s->filesz = s->memsz;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);// 释放内存
-    if (sz != p->sz) {
-      // 缩量同步[new size, old size]
-      uvmunmap(p->kpagetable, PGROUNDUP(sz), (PGROUNDUP(p->sz) - PGROUNDUP(sz)) / PGSIZE, 0);
+    // 先改sz，lazyfault()就不会再映射[sz, oldsz)中的页
+    acquire(&l->pglock);
+    setsz(l, sz);
+    release(&l->pglock);
+    if(PGROUNDUP(sz) < PGROUNDUP(oldsz)){
+      // 释放内存，同步专属内核页表；从未访问过的页归还预留
+      kunreserve(uvmunmapsync(p, PGROUNDUP(sz), (PGROUNDUP(oldsz) - PGROUNDUP(sz)) / PGSIZE));
     }
   }
-  ukvminithard(p->kpagetable);
-  p->sz = sz;// 更新进程的内存大小
+  releasesleep(&l->vmlock);
   return 0;// 成功返回 0
 }
 
@@ -362,30 +529,79 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  // 线程组的其他线程不能同时改变内存的布局；它们仍可能缺页，
+  // 所以复制页表时还要持有pglock
+  acquiresleep(&l->vmlock);
 
   // 分配新进程结构体
   if((np = allocproc()) == 0){
+    releasesleep(&l->vmlock);
     return -1;
   }
 
   // 将父进程的用户内存复制到子进程
+  acquire(&l->pglock);
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+    release(&l->pglock);
     freeproc(np);
     release(&np->lock);
+    releasesleep(&l->vmlock);
     return -1;
   }
   np->sz = p->sz;
 
   // 复制用户页表到内核页表
   if (pagecopy(np->pagetable, np->kpagetable, 0, np->sz) != 0) {
+    release(&l->pglock);
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&l->vmlock);
+    return -1;
+  }
+  // 复制mmap()映射的文件
+  if(mmapcopy(p, np) != 0){
+    release(&l->pglock);
+    release(&np->lock);
+    releasesleep(&l->vmlock); // 关闭文件要开始日志事务，不能持有vmlock
+    mmapclear(np, np->pagetable);
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->parent = p;
+  release(&l->pglock);
+  if(l->nthread > 1){
+    // 父进程的可写页刚改成了COW，其他线程的TLB里可能还有可写的映射，
+    // 子进程运行之前要让它们刷新。np还是UNUSED，但有了PID，不会被别人分配
+    release(&np->lock);
+    tlbshootdown();
+    acquire(&np->lock);
+  }
+  // 增加打开文件的引用计数
+  if(fdcopy(p->fdt, np->fdt) != 0){
+    release(&np->lock);
+    releasesleep(&l->vmlock);
+    fdcloseall(np->fdt);
+    mmapclear(np, np->pagetable);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  if(l->execip){
+    // 子进程还没有访问过的程序页同样从程序文件读入
+    np->execip = idup(l->execip);
+    memmove(np->execseg, l->execseg, sizeof(l->execseg));
+  }
+  releasesleep(&l->vmlock);
+  acquire(&wait_lock);
+  addchild(p, np);
+  release(&wait_lock);
 
   // 复制保存的用户寄存器
   *(np->trapframe) = *(p->trapframe);
@@ -396,27 +612,232 @@ fork(void)
   // 在子进程中拷贝trace_mask
   np->trace_mask = p->trace_mask;
 
-  // 增加打开文件的引用计数
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);// 复制当前工作目录
 
   safestrcpy(np->name, p->name, sizeof(p->name));// 复制进程名
 
   pid = np->pid;// 获取子进程的 PID
 
-  np->state = RUNNABLE;// 设置子进程为可运行状态
+  np->rqcpu = p->rqcpu;// 先放在父进程所在CPU的队列，空闲CPU会来窃取
+  np->priority = p->priority;// 继承父进程的优先级
+  np->level = np->priority;
+  setrunnable(np);// 设置子进程为可运行状态
 
   release(&np->lock);// 释放子进程锁
 
   return pid;// 返回子进程的 PID
 }
+
+/**
+  * int clone(uint64 fn, uint64 arg, uint64 stack)
+  * @brief：创建一个与当前进程共享内存、打开的文件和映射的文件的线程，
+  *         在用户态从fn(arg)开始执行，栈顶为stack。fn不能返回，要调用exit()结束。
+  * @brief：线程有自己的内核栈和trapframe，使用组长的用户页表和专属内核页表，
+  *         trapframe映射在共享页表中的THREADTF处。线程是调用者的子进程，由wait()回收。
+  *         当前目录是各线程自己的。getpid()返回组长的PID。
+  * @param：fn - 入口地址；arg - 传给fn的参数；stack - 用户栈的栈顶，16字节对齐
+  * @retval：线程的 PID，失败返回 -1
+  */
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid, r;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if(stack % 16 != 0 || l->kfn)
+    return -1;
+
+  // 持有vmlock，growproc()不会漏掉新线程的sz
+  acquiresleep(&l->vmlock);
+  if((np = allocproc()) == 0){
+    releasesleep(&l->vmlock);
+    return -1;
+  }
+
+  // 槽位里留着复用的页表骨架用不上
+  proc_freepagetable(np->pagetable, 0);
+  ukvmfree(np->kpagetable);
+  np->pagetable = l->pagetable;
+  np->kpagetable = l->kpagetable;
+  np->tfva = THREADTF((int) (np - proc));
+  acquire(&l->pglock);
+  r = mappages(np->pagetable, np->tfva, PGSIZE, (uint64)np->trapframe, PTE_R | PTE_W);
+  release(&l->pglock);
+  if(r < 0){
+    np->pagetable = 0;
+    np->kpagetable = 0;
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&l->vmlock);
+    return -1;
+  }
+  np->sz = p->sz;
+  np->leader = l;
+  np->fdt = l->fdt;
+  np->tlbseen = l->tlbgen;
+
+  // 从fn(arg)开始，用调用者给的栈
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+
+  np->trace_mask = p->trace_mask;
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  acquire(&wait_lock);
+  addchild(p, np);
+  l->nthread++;
+  release(&wait_lock);
+
+  pid = np->pid;
+  np->rqcpu = p->rqcpu;
+  np->priority = p->priority;
+  np->level = np->priority;
+  setrunnable(np);
+  release(&np->lock);
+  releasesleep(&l->vmlock);
+
+  return pid;
+}
+
+/**
+  * int spawn(char *path, char **argv, struct fdtable *fdt)
+  * @brief：创建一个直接运行path的子进程，效果和fork()之后子进程立即exec()一样，
+  *         但不复制父进程的地址空间：子进程的页表由execload()直接从ELF文件建立。
+  * @param：path - 程序路径，在父进程的当前目录中查找
+  * @param：argv - 程序参数
+  * @param：fdt - 子进程的打开文件表；其中的引用和页交给子进程，*fdt被清空，失败时关闭
+  * @retval：子进程的 PID，失败返回 -1
+  */
+int
+spawn(char *path, char **argv, struct fdtable *fdt)
+{
+  int pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0){
+    fdcloseall(fdt);
+    return -1;
+  }
+  // 装入程序会睡眠，不能持有np->lock；np还不在运行队列和子进程链表里，
+  // 其他进程不会使用它
+  release(&np->lock);
+
+  np->fdtab = *fdt;
+  initlock(&np->fdtab.lock, "fdtable");
+  memset(fdt, 0, sizeof(*fdt));
+  np->cwd = idup(p->cwd);
+  np->trace_mask = p->trace_mask;
+  if((argc = execload(np, path, argv)) < 0){
+    fdcloseall(np->fdt);
+    begin_op();
+    iput(np->cwd);
+    if(np->execip)
+      iput(np->execip);
+    end_op();
+    np->cwd = 0;
+    np->execip = 0;
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  acquire(&np->lock);
+  acquire(&wait_lock);
+  addchild(p, np);
+  release(&wait_lock);
+
+  pid = np->pid;
+  np->rqcpu = p->rqcpu;
+  np->priority = p->priority;
+  np->level = np->priority;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+/**
+  * int kthread(void (*fn)(void), char *name)
+  * @brief：创建一个只在内核中运行的线程，从fn开始执行，fn不能返回
+  * @brief：线程没有用户内存，永远不会回到用户态，也不会退出。
+  *         必须在initproc创建之后调用。
+  * @param：fn：线程入口；name：线程名（调试用）
+  * @retval：线程的 PID，失败返回 -1
+  */
+int
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+  int pid;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  acquire(&wait_lock);
+  addchild(initproc, p);
+  release(&wait_lock);
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  setrunnable(p);
+  release(&p->lock);
+  return pid;
+}
+
+// 内核线程第一次被调度时从这里开始
+static void
+kthreadret(void)
+{
+  // 仍然持有 p->lock 来自调度程序。
+  release(&myproc()->lock);
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+/**
+  * static void addchild(struct proc *parent, struct proc *p)
+  * @brief： 让p成为parent的子进程
+  * @brief： 调用者必须持有 wait_lock
+  * @param： parent：父进程，p：子进程
+  * @retval： NULL
+  */
+static void
+addchild(struct proc *parent, struct proc *p)
+{
+  p->parent = parent;
+  p->sibprev = 0;
+  p->sibnext = parent->children;
+  if(parent->children)
+    parent->children->sibprev = p;
+  parent->children = p;
+}
+
+// 把p从父进程的子进程链表中取下，调用者必须持有 wait_lock
+static void
+delchild(struct proc *p)
+{
+  if(p->sibprev)
+    p->sibprev->sibnext = p->sibnext;
+  else
+    p->parent->children = p->sibnext;
+  if(p->sibnext)
+    p->sibnext->sibprev = p->sibprev;
+}
+
 /**
   * void reparent(struct proc *p)
   * @brief： 将进程 p 的孤儿进程转交给 init 进程
   * @brief： Pass p's abandoned children to init.
-  *          Caller must hold p->lock.
+  *          Caller must hold wait_lock.
+  * @brief： 只遍历p自己的子进程和僵尸子进程
   * @param： p：指向父进程的指针
   * @retval： NULL
   */
@@ -425,25 +846,53 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // 此代码在不持有 pp->lock 的情况下使用 pp->parent。
-    // 先获取锁可能会导致死锁
-    // 如果 pp 或 pp 的子进程也在 exit() 中
-    // 并且即将尝试锁住 p。
-    if(pp->parent == p){
-      // pp->parent 在检查与获取锁之间不能改变
-      // 因为只有父进程会改变它，而我们就是父进程。
-      acquire(&pp->lock);
-      pp->parent = initproc;// 更改父进程为 init
-      // 我们应该在这里唤醒 init，但那会需要
-      // initproc->lock，这将是死锁，因为我们持有
-      // init 的一个子进程的锁 (pp)。这就是
-      // exit() 始终在获取任何锁之前唤醒 init 的原因。
-      release(&pp->lock);
+  while((pp = p->children) != 0){
+    delchild(pp);
+    addchild(initproc, pp);// 更改父进程为 init
+  }
+  if(p->zombies){
+    // 僵尸子进程交给init回收
+    while((pp = p->zombies) != 0){
+      p->zombies = pp->znext;
+      pp->parent = initproc;
+      pp->znext = initproc->zombies;
+      initproc->zombies = pp;
     }
+    wakeup(initproc);
   }
 }
 
+/**
+  * static void threadkill(struct proc *l)
+  * @brief： 组长l退出前杀死线程组中的其他线程，等它们都退出
+  * @brief： 线程在下一次回到用户态之前退出，睡眠中的线程被唤醒，和kill()一样。
+  *          线程退出后是僵尸，由各自的父进程回收。
+  * @param： l：组长，即当前进程
+  * @retval： NULL
+  */
+static void
+threadkill(struct proc *l)
+{
+  struct proc *t;
+
+  acquire(&wait_lock);
+  while(l->nthread > 1){
+    for(t = proc; t < &proc[nproc]; t++){
+      if(t == l || t->leader != l)
+        continue;
+      acquire(&t->lock);
+      if(t->leader == l){
+        t->killed = 1;
+        if(t->state == SLEEPING)
+          setrunnable(t);
+      }
+      release(&t->lock);
+    }
+    sleep(&l->nthread, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
 /**
   * void exit(int status)
   * @brief： 退出当前进程，不返回
@@ -456,59 +905,70 @@ void
 exit(int status)
 {
   struct proc *p = myproc();// 获取当前进程
+  struct proc *l = p->leader;
 
   if(p == initproc)
     panic("init exiting");// 防止 init 进程退出
 
-  // 关闭所有打开的文件。
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);// 关闭文件
-      p->ofile[fd] = 0;
-    }
+  if(l == p){
+    // 先结束其他线程，之后内存和文件只有自己在用
+    if(p->nthread > 1)
+      threadkill(p);
+
+    // 解除mmap()映射，写回MAP_SHARED的脏页。
+    mmapclear(p, p->pagetable);
+
+    // 关闭所有打开的文件，释放文件描述符表的页。
+    fdcloseall(p->fdt);
   }
 
   begin_op();
   iput(p->cwd);// 释放当前工作目录
+  if(p->execip)
+    iput(p->execip);// 释放程序文件
   end_op();
   p->cwd = 0;
+  p->execip = 0;
 
-  // 我们可能会将一个子进程重新父化为 init。我们无法精确
-  // 唤醒 init，因为在获取任何其他进程锁后，我们不能获取
-  // 它的锁。因此无论是否需要，都唤醒 init。init 可能会
-  // 错过这个唤醒，但这似乎是无害的。
-  // harmless.
-  acquire(&initproc->lock);
-  wakeup1(initproc);// 唤醒 init 进程
-  release(&initproc->lock);
-
-  // 获取 p->parent 的副本，以确保我们解锁的
-  // 是我们锁定的相同父进程。在等待父进程锁时，
-  // 我们的父进程可能会把我们给 init。我们可能会与
-  // 一个正在退出的父进程竞争，但结果将是一个无害的
-  // 虚假唤醒到一个死掉或错误的进程；进程结构
-  // 永远不会被重新分配为其他任何东西。
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
-  // 我们需要父进程的锁以唤醒它
-  // 从 wait() 中返回。父-子规则规定我们必须先锁定它。
-  acquire(&original_parent->lock);
+  if(l != p){
+    // 线程只结束自己，共享的内存和文件留给组长退出时释放
+    acquire(&l->pglock);
+    uvmunmap(p->pagetable, p->tfva, 1, 0);
+    release(&l->pglock);
+  }
 
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
- // 将任何子进程交给 init。
+  if(l != p){
+    // 离开线程组。组长等到nthread为1就会释放共享的页表，
+    // 先换到kernel_pagetable；持有wait_lock时中断关闭，不会被切换回去
+    kvmswitch();
+    p->pagetable = 0;
+    p->kpagetable = 0;
+    p->tfva = TRAPFRAME;
+    p->fdt = &p->fdtab;
+    p->leader = p;
+    l->nthread--;
+    wakeup(&l->nthread);
+  }
+
+  // 将任何子进程交给 init。
   reparent(p);// 重新父化子进程
 
- // 父进程可能在 wait() 中处于休眠状态。
-  wakeup1(original_parent);// 唤醒父进程
+  // 父进程可能在 wait() 中处于休眠状态。
+  wakeup(p->parent);// 唤醒父进程
+
+  acquire(&p->lock);
 
   p->xstate = status;// 设置退出状态
   p->state = ZOMBIE;// 更改状态为僵尸
 
-  release(&original_parent->lock);
+  // 从父进程的子进程链表移到它的僵尸链表，等待父进程回收
+  delchild(p);
+  p->znext = p->parent->zombies;
+  p->parent->zombies = p;
+
+  release(&wait_lock);
 
   // 进入调度程序，永不返回。
   sched();
@@ -518,6 +978,7 @@ exit(int status)
 /**
   * int wait(uint64 addr)
   * @brief： 等待子进程退出并返回其 PID
+  * @brief： 直接从僵尸链表取出子进程，不扫描进程表
   * @param： addr：退出状态地址
   * @retval： 子进程的 PID，或 -1 如果没有子进程
   */
@@ -525,51 +986,43 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int pid;
   struct proc *p = myproc();
 
-  // 在整个过程中保持 p->lock 以避免
+  if(addr != 0)
+    uvmtouch(addr, sizeof(int)); // 持有锁时copyout()不能从程序文件读入页面
+
+  // 在整个过程中保持 wait_lock 以避免
   // 来自子进程退出的丢失唤醒。
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   for(;;){
-    // 扫描表以查找已退出的子进程。
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // 此代码在不持有 np->lock 的情况下使用 np->parent。
-      // 先获取锁将导致死锁，
-      // 因为 np 可能是祖先，我们已经持有 p->lock。
-      if(np->parent == p){
-        // np->parent 在检查与获取锁之间不能改变
-        // 因为只有父进程会改变它，而我们就是父进程。
-        acquire(&np->lock);
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // 找到一个僵尸进程
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);// 释放进程
-          release(&np->lock);
-          release(&p->lock);
-          return pid;// 返回子进程的 PID
-        }
+    if((np = p->zombies) != 0){
+      // 找到一个僵尸进程。它设置ZOMBIE时持有的np->lock
+      // 要等它切换出去之后才会释放。
+      acquire(&np->lock);
+      pid = np->pid;
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                              sizeof(np->xstate)) < 0) {
         release(&np->lock);
+        release(&wait_lock);
+        return -1;
       }
+      p->zombies = np->znext;
+      freeproc(np);// 释放进程
+      release(&np->lock);
+      release(&wait_lock);
+      return pid;// 返回子进程的 PID
     }
 
     // 如果没有子进程就没有必要等待。
-    if(!havekids || p->killed){
-      release(&p->lock);
+    if(p->children == 0 || p->killed){
+      release(&wait_lock);
       return -1;
     }
     
     // 等待子进程退出。
-    sleep(p, &p->lock);  //DOC: wait-sleep
+    sleep(p, &wait_lock);  //DOC: wait-sleep
   }
 }
 
@@ -598,37 +1051,208 @@ scheduler(void)
     // 避免死锁，确保设备可以中断。
     intr_on();
     
-    int found = 0;// 标记是否找到可运行的进程
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {// 如果进程状态可运行
-        // 切换到选定的进程。进程负责
-        // 释放其锁，然后在返回之前重新获取它。
-        p->state = RUNNING;// 设置状态为运行
-        c->proc = p;// 设置当前进程
-        
-        // 切换到要马上运行的新进程的内核页表
-        w_satp(MAKE_SATP(p->kpagetable));
-        sfence_vma();
-        swtch(&c->context, &p->context);// 切换上下文
-
-        // 切换回全局内核页表
-        kvminithart();
-        // 进程现在完成运行。
-        // 它应该在回来之前更改其 p->state。
-        c->proc = 0;
-
-        found = 1;// 找到一个可运行的进程
+    if((p = runqget()) == 0) {// 如果没有找到可运行的进程
+      // 先利用空闲时间为kalloc_zeroed()清零页面，每次一页，以便及时发现新的可运行进程
+      if(kzerofill())
+        continue;
+      // 关中断后把时钟中断推迟到下一个睡眠期限，再确认队列仍为空并
+      // 标记空闲，然后wfi。先推迟时钟，setrunnable()的timerkick()
+      // 才不会被覆盖。中断关闭时挂起的中断也能唤醒wfi，
+      // 回到循环开头开中断后再处理。
+      intr_off();
+      timeridle();
+      if(cpuidle(c)){
+        asm volatile("wfi");// 进入等待状态
+        c->idle = 0;
+      }
+      continue;
+    }
+
+    // p已经离开队列，只有本CPU会让它运行。
+    // 把p放入队列的CPU可能还没有切换出p，持有着p->lock，
+    // 获取锁就会等到它swtch()完成。
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    // 切换到选定的进程。进程负责
+    // 释放其锁，然后在返回之前重新获取它。
+    p->state = RUNNING;// 设置状态为运行
+    p->rqcpu = cpuid();// 以后回到这个CPU的队列
+    p->waittime += r_time() - p->tstamp;// 在队列中等待的时间
+    p->tstamp = r_time();
+    p->cstamp = r_cycle();
+    p->istamp = r_instret();
+    c->proc = p;// 设置当前进程
+    timerbusy();// 一个tick内要有时钟中断来抢占p
+    
+    // 切换到要马上运行的新进程的内核页表，ASID未回收时不刷新TLB
+    ukvmswitch(p);
+    swtch(&c->context, &p->context);// 切换上下文
+
+    // 切换回全局内核页表
+    kvmswitch();
+    p->runtime += r_time() - p->tstamp;// 这次运行的时间
+    // 计数器是每个CPU自己的，在同一个CPU上读的差值才有意义
+    p->cycles += r_cycle() - p->cstamp;
+    p->instret += r_instret() - p->istamp;
+    // 进程现在完成运行。
+    // 它应该在回来之前更改其 p->state。
+    c->proc = 0;
+    release(&p->lock);
+  }
+}
+
+/**
+  * static void setrunnable(struct proc *p)
+  * @brief： 将进程设为RUNNABLE并放到它上次运行的CPU的就绪队列末尾
+  * @brief： 那个CPU忙而有CPU空闲时改放到空闲CPU的队列，并用timerkick()唤醒它
+  * @brief： 调用者必须持有 p->lock
+  * @param： p：进程
+  * @retval： NULL
+  */
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q;
+  int i;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  if(p->state == UNUSED){
+    // 新进程第一次运行，槽位开始被占用
+    acquirewrite(&proctab);
+    p->state = RUNNABLE;
+    releasewrite(&proctab);
+  }
+  p->state = RUNNABLE;
+  p->tstamp = r_time();
+  if(p->boosted != ticks / BOOSTTICKS){
+    // 上次提升之后第一次入队，回到基础优先级
+    p->boosted = ticks / BOOSTTICKS;
+    p->level = p->priority;
+  }
+  if(!cpus[p->rqcpu].idle){
+    // 不加锁地找一个空闲的CPU，看错了也只是放到一个忙的队列里
+    for(i = 0; i < NCPU; i++){
+      if(cpus[i].idle){
+        p->rqcpu = i;
+        break;
       }
-      release(&p->lock);
     }
-    if(found == 0) {// 如果没有找到可运行的进程
-      intr_on();
-      asm volatile("wfi");// 进入等待状态
+  }
+  q = &runq[p->rqcpu];
+  acquire(&q->lock);
+  runqput(q, p);
+  q->n++;
+  // 那个CPU在wfi中，时钟可能要到很久以后的期限才响。
+  // cpuidle()在队列锁下标记空闲，这里看到的就不会漏掉
+  if(cpus[p->rqcpu].idle)
+    timerkick(p->rqcpu);
+  release(&q->lock);
+}
+
+// 把p放到队列q中p->level级别的末尾，调用者持有q->lock
+static void
+runqput(struct runq *q, struct proc *p)
+{
+  p->rqnext = 0;
+  if(q->tail[p->level])
+    q->tail[p->level]->rqnext = p;
+  else
+    q->head[p->level] = p;
+  q->tail[p->level] = p;
+}
+
+// 把队列q中的进程都放回自己基础优先级的级别，调用者持有q->lock。
+// 读p->priority不持有p->lock：setpriority()同时修改的话，
+// 下一次提升时就会用上新值。
+static void
+runqboost(struct runq *q)
+{
+  struct proc *p, *next;
+  int i;
+
+  q->boosted = ticks / BOOSTTICKS;
+  for(i = 1; i < NPRIO; i++){
+    p = q->head[i];
+    q->head[i] = q->tail[i] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      p->boosted = q->boosted;
+      p->level = p->priority;
+      runqput(q, p);
     }
   }
 }
 
+/**
+  * static int cpuidle(struct cpu *c)
+  * @brief： 本CPU的就绪队列为空时把它标记为空闲，之后setrunnable()往这里放进程时会唤醒它
+  * @brief： 与setrunnable()都在队列锁下检查，不会把进程放进一个不会醒来的CPU的队列
+  * @param： c：当前CPU，中断已关闭，时钟已由timeridle()推迟
+  * @retval： 标记为空闲返回1，队列中已有进程返回0
+  */
+static int
+cpuidle(struct cpu *c)
+{
+  struct runq *q = &runq[cpuid()];
+
+  acquire(&q->lock);
+  if(q->n == 0)
+    c->idle = 1;
+  release(&q->lock);
+  return c->idle;
+}
+
+// 从就绪队列q中取出级别最高的第一个进程，队列为空返回0
+static struct proc*
+runqpop(struct runq *q)
+{
+  struct proc *p = 0;
+  int i;
+
+  acquire(&q->lock);
+  if(q->boosted != ticks / BOOSTTICKS)
+    runqboost(q);
+  for(i = 0; i < NPRIO; i++){
+    if((p = q->head[i]) != 0){
+      q->head[i] = p->rqnext;
+      if(q->head[i] == 0)
+        q->tail[i] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+/**
+  * struct proc *runqget(void)
+  * @brief： 为当前CPU选择下一个要运行的进程
+  * @brief： 先取自己队列的队首；为空时从其他CPU的队列窃取
+  * @param： NULL
+  * @retval： 取出的进程（未加锁），没有可运行的进程时返回0
+  */
+static struct proc*
+runqget(void)
+{
+  struct proc *p;
+  int i, id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  if((p = runqpop(&runq[id])) != 0)
+    return p;
+  for(i = 1; i < NCPU; i++){
+    struct runq *q = &runq[(id + i) % NCPU];
+    if(q->n > 0 && (p = runqpop(q)) != 0)
+      return p;
+  }
+  return 0;
+}
+
 /**
   * void sched(void)
   * @brief： 切换到调度程序，必须持有 p->lock
@@ -666,6 +1290,8 @@ sched(void)
 /**
   * void yield(void)
   * @brief： 放弃 CPU 控制权，以便其他进程可以运行
+  * @brief： 在时钟中断时调用：进程用完了时间片，降低一级。
+  *          tlbshootdown()等待其他线程时也调用，忙等的进程同样该降级
   * @param： NULL
   * @retval： NULL
   */
@@ -674,11 +1300,100 @@ yield(void)
 {
   struct proc *p = myproc(); // 获取当前进程
   acquire(&p->lock); // 获取当前进程锁
-  p->state = RUNNABLE; // 设置状态为可运行
+  if(p->level < NPRIO-1)
+    p->level++;
+  p->nivcsw++;
+  setrunnable(p); // 设置状态为可运行
   sched(); // 调用调度程序
   release(&p->lock); // 释放锁
 }
 
+/**
+  * void tlbshootdown(void)
+  * @brief： 当前线程改动了线程组共享的页表（撤销或降低了映射的权限）后，
+  *          让组内其他线程都刷新TLB，再释放cowfault()和uvmunmapsync()留下的页。
+  * @brief： 没有核间中断：递增组长的tlbgen，然后等正在其他CPU上运行的线程在
+  *          tlbsync()中确认。线程在陷入内核、时钟中断和被调度运行
+  *          （ukvmswitch()）时确认，不在运行的线程下次运行前一定会刷新。
+  *          调用者不能持有自旋锁。
+  * @param： NULL
+  * @retval： NULL
+  */
+void
+tlbshootdown(void)
+{
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+  uint64 freed[NTLBFREE];
+  uint64 gen;
+  int i, n;
+
+  if(l->nthread == 1 && l->ntlbfree == 0){
+    sfence_vma();
+    return;
+  }
+
+  acquire(&l->pglock);
+  n = l->ntlbfree;
+  for(i = 0; i < n; i++)
+    freed[i] = l->tlbfree[i];
+  l->ntlbfree = 0;
+  gen = ++l->tlbgen;
+  release(&l->pglock);
+
+  tlbwait(l, gen);
+  for(i = 0; i < n; i++)
+    kfree((void*)freed[i]);
+}
+
+/**
+  * void tlbwait(struct proc *l, uint64 gen)
+  * @brief： 等线程组l中正在运行的线程都确认了第gen次页表改动，tlbshootdown()和
+  *          swapreclaim()使用。当前进程属于这个线程组时先刷新自己的TLB；
+  *          换出页面的可能是kswapd或者别的进程，不属于这个组。
+  *          确认只说明TLB里没有旧的映射了，内核通过物理地址访问的用户页
+  *          由uvmpin()的引用保护。
+  *          调用者已经递增了l->tlbgen，不能持有自旋锁。
+  * @param： l - 线程组的组长
+  * @param： gen - 递增之后的tlbgen
+  * @retval： NULL
+  */
+void
+tlbwait(struct proc *l, uint64 gen)
+{
+  struct proc *p = myproc();
+  struct proc *t;
+
+  if(p->leader == l){
+    sfence_vma();
+    p->tlbseen = gen;
+  }
+  for(t = proc; t < &proc[nproc]; t++){
+    if(t == p)
+      continue;
+    // 读state不加锁：线程一旦不在RUNNING，下次运行前就会刷新
+    while(t->leader == l && t->state == RUNNING && t->tlbseen < gen)
+      yield();
+  }
+}
+
+/**
+  * void tlbsync(struct proc *p)
+  * @brief： 线程组的页表在别的线程中改动过，就刷新本CPU的TLB，向tlbshootdown()确认
+  * @param： p：当前进程
+  * @retval： NULL
+  */
+void
+tlbsync(struct proc *p)
+{
+  uint64 gen = p->leader->tlbgen;
+
+  if(p->tlbseen != gen){
+    sfence_vma();
+    p->tlbseen = gen;
+  }
+}
+
 /**
   * void forkret(void)
   * @brief： fork 子进程首次调度时的返回
@@ -699,11 +1414,37 @@ forkret(void)
     // (例如，因为它调用 sleep)，因此不能从 main() 中运行。
     first = 0;
     fsinit(ROOTDEV); // 初始化文件系统
+    swapinit(); // 有交换盘的话启动kswapd
   }
 
   usertrapret(); // 返回用户态
 }
 
+// 按通道地址散列的等待队列，wakeup()只需查看同一个队列里的进程。
+// 进程从进入sleep()到醒来后自己离开之前都在队列中，通过p->sqprev/sqnext链接。
+// 锁的顺序：sleep()的lk，然后q->lock，然后p->lock。
+// sleep(chan, &p->lock)不进入队列，只能被kill()唤醒。
+#define NSLEEPQ 61 // 质数
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
+// 初始化等待队列，在引导时由procinit()调用
+static void
+sleepqinit(void)
+{
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+}
+
 /**
   * void sleep(void *chan, struct spinlock *lk)
   * @brief： 在指定通道上休眠
@@ -716,20 +1457,33 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc(); // 获取当前进程
+  struct sleepq *q = 0;
   
   // 必须获取 p->lock 以更改 p->state 然后调用 sched。
-  // 一旦我们持有 p->lock，我们就可以
+  // 一旦我们持有 q->lock，我们就可以
   // 确保不会错过任何唤醒
-  // (wakeup 锁定 p->lock)，
+  // (wakeup 锁定 q->lock)，
   // 所以释放 lk 是可以的。
   if(lk != &p->lock){  //DOC: sleeplock0
+    q = chanq(chan);
+    acquire(&q->lock);
     acquire(&p->lock);  //DOC: sleeplock1
     release(lk); // 释放自旋锁
+
+    // 加入等待队列
+    p->sqprev = 0;
+    p->sqnext = q->head;
+    if(q->head)
+      q->head->sqprev = p;
+    q->head = p;
   }
 
   // 进入休眠状态
   p->chan = chan; // 设置通道
   p->state = SLEEPING; // 设置状态为休眠
+  p->nvcsw++;
+  if(q)
+    release(&q->lock);
 
   sched(); // 调用调度程序
 
@@ -739,6 +1493,15 @@ sleep(void *chan, struct spinlock *lk)
   // 重新获取原始锁
   if(lk != &p->lock){
     release(&p->lock); // 释放当前进程锁
+    // 离开等待队列
+    acquire(&q->lock);
+    if(p->sqprev)
+      p->sqprev->sqnext = p->sqnext;
+    else
+      q->head = p->sqnext;
+    if(p->sqnext)
+      p->sqnext->sqprev = p->sqprev;
+    release(&q->lock);
     acquire(lk); // 重新获取自旋锁
   }
 }
@@ -747,39 +1510,92 @@ sleep(void *chan, struct spinlock *lk)
   * void wakeup(void *chan)
   * @brief： 唤醒所有在指定通道上等待的进程
   * @brief： Must be called without any p->lock.
+  * @brief： 只查看chan所在散列队列中的进程
   * @param： chan：通道指针
   * @retval： NULL
   */
 void
 wakeup(void *chan)
 {
+  struct sleepq *q = chanq(chan);
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p; p = p->sqnext) {
+    if(p->chan != chan)
+      continue; // 散列到同一队列的其他通道，或者已经醒来
     acquire(&p->lock); // 获取进程锁
     if(p->state == SLEEPING && p->chan == chan) { // 如果进程正在休眠且通道匹配
-      p->state = RUNNABLE; // 设置状态为可运行
+      setrunnable(p); // 设置状态为可运行
     }
     release(&p->lock); // 释放锁
   }
+  release(&q->lock);
 }
 
 /**
-  * static void wakeup1(struct proc *chan)
-  * @brief： 唤醒在指定通道上等待的单个进程
-  * @brief： Wake up p if it is sleeping in wait(); used by exit().
-             Caller must hold p->lock.
+  * struct proc *wakeupone(void *chan)
+  * @brief： 只唤醒在chan上等待最久的一个进程，用于把锁直接交给它（见releasesleep()）
+  * @brief： Must be called without any p->lock.
   * @param： chan：通道指针
-  * @retval： NULL
+  * @retval： 被唤醒的进程，没有进程在chan上睡眠则返回 NULL
   */
-static void
-wakeup1(struct proc *p)
+struct proc*
+wakeupone(void *chan)
 {
-  if(!holding(&p->lock))
-    panic("wakeup1"); // 锁错误
-  if(p->chan == p && p->state == SLEEPING) {// 如果进程正在休眠且通道匹配
-    p->state = RUNNABLE; // 设置状态为可运行
+  struct sleepq *q = chanq(chan);
+  struct proc *p, *last = 0;
+
+  acquire(&q->lock);
+  // 新的睡眠者加在队头，等待最久的是最后一个
+  for(p = q->head; p; p = p->sqnext) {
+    if(p->chan == chan)
+      last = p;
   }
+  for(p = last; p; p = p->sqprev) {
+    if(p->chan != chan)
+      continue;
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan) {
+      setrunnable(p);
+      release(&p->lock);
+      break;
+    }
+    release(&p->lock); // 已经被kill()唤醒，换下一个
+  }
+  release(&q->lock);
+  return p;
+}
+
+/**
+  * uint wakeupticks(uint now)
+  * @brief： 唤醒sleepuntil()中期限已到的进程，由clockintr()调用
+  * @brief： 调用者持有 tickslock
+  * @param： now：当前的ticks
+  * @retval： 仍在睡眠的进程中最早的期限，没有则返回~0
+  */
+uint
+wakeupticks(uint now)
+{
+  struct sleepq *q = chanq(&ticks);
+  struct proc *p;
+  uint next = ~0;
+
+  acquire(&q->lock);
+  for(p = q->head; p; p = p->sqnext) {
+    if(p->chan != &ticks)
+      continue;
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == &ticks) {
+      if(p->wakeat <= now)
+        setrunnable(p);
+      else if(p->wakeat < next)
+        next = p->wakeat;
+    }
+    release(&p->lock);
+  }
+  release(&q->lock);
+  return next;
 }
 
 /**
@@ -795,13 +1611,13 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = proc; p < &proc[nproc]; p++){
     acquire(&p->lock); // 获取进程锁
     if(p->pid == pid){ // 找到目标进程
       p->killed = 1; // 设置杀死标志
       if(p->state == SLEEPING){
         //从sleep()唤醒进程
-        p->state = RUNNABLE; // 设置状态为可运行
+        setrunnable(p); // 设置状态为可运行
       }
       release(&p->lock); // 释放锁
       return 0; // 返回成功
@@ -811,6 +1627,58 @@ kill(int pid)
   return -1; // 返回失败
 }
 
+/**
+  * int setpriority(int pid, int prio)
+  * @brief： 设置进程的基础优先级，0最高，NPRIO-1最低
+  * @brief： 在就绪队列中的进程等到下一次入队或者提升时才换级别
+  * @param： pid：进程 ID，prio：优先级
+  * @retval： 0 成功，-1 失败
+  */
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[nproc]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      p->priority = prio;
+      if(p->state != RUNNABLE)
+        p->level = prio; // 不在队列中，level由p->lock保护
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+/**
+  * int getpriority(int pid)
+  * @brief： 取得进程的基础优先级
+  * @param： pid：进程 ID
+  * @retval： 优先级，没有这个进程返回-1
+  */
+int
+getpriority(int pid)
+{
+  struct proc *p;
+  int prio;
+
+  for(p = proc; p < &proc[nproc]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      prio = p->priority;
+      release(&p->lock);
+      return prio;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 /**
   * int either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
   * @brief： 根据用户地址或内核地址复制
@@ -871,7 +1739,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = proc; p < &proc[nproc]; p++){
     if(p->state == UNUSED)
       continue; // 跳过未使用的进程
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -886,6 +1754,7 @@ procdump(void)
 /**
   * uint64 acquire_nproc(void)
   * @brief： 获取当前活动进程数量
+  * @brief： 持有proctab读锁时，没有进程能离开或变回UNUSED，不需要获取p->lock
   * @retval： 活动进程数量
   */
 uint64
@@ -894,12 +1763,66 @@ acquire_nproc(void)
   struct proc *p;
   int cnt = 0; // 计数器
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);// 获取进程锁
+  acquireread(&proctab);
+  for(p = proc; p < &proc[nproc]; p++) {
     if(p->state != UNUSED) {
       cnt++; // 计数
     }
-    release(&p->lock); // 释放锁
   }
+  releaseread(&proctab);
   return cnt; // 返回活动进程数量
-}
\ No newline at end of file
+}
+
+/**
+  * int procinfo(uint64 addr, int n)
+  * @brief： 把最多n个进程的统计信息（struct procinfo）复制到用户地址addr
+  * @param： addr：用户缓冲区地址，n：缓冲区能放下的项数
+  * @retval： 复制的项数，失败返回-1
+  */
+int
+procinfo(uint64 addr, int n)
+{
+  struct proc *p;
+  struct procinfo pi;
+  int i = 0;
+
+  for(p = proc; p < &proc[nproc] && i < n; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED){
+      release(&p->lock);
+      continue;
+    }
+    pi.pid = p->pid;
+    pi.state = p->state;
+    pi.priority = p->priority;
+    safestrcpy(pi.name, p->name, sizeof(pi.name));
+    pi.sz = p->sz;
+    pi.runtime = p->runtime;
+    pi.waittime = p->waittime;
+    if(p->state == RUNNING)
+      pi.runtime += r_time() - p->tstamp; // 算上正在运行的这段时间
+    else if(p->state == RUNNABLE)
+      pi.waittime += r_time() - p->tstamp;
+    pi.cycles = p->cycles;
+    pi.instret = p->instret;
+    if(p == myproc()){
+      // 正在本CPU上运行，算上这段的计数（别的CPU的计数器读不到）
+      pi.cycles += r_cycle() - p->cstamp;
+      pi.instret += r_instret() - p->istamp;
+    }
+    pi.nvcsw = p->nvcsw;
+    pi.nivcsw = p->nivcsw;
+    pi.npgfault = p->npgfault;
+    // 线程共享组长的页表，计数在组长的槽位里
+    pi.nrss = p->leader->vmacct.nrss;
+    pi.nupt = p->leader->vmacct.nupt;
+    pi.nkpt = p->leader->vmacct.nkpt;
+    pi.nkpages = 1 + (p->trapframe != 0) + (p->usyscall != 0); // 内核栈在procinit()中分配
+    release(&p->lock);
+    // 不持有锁时复制，copyout()可能要处理写时复制
+    if(copyout(myproc()->pagetable, addr + i*sizeof(pi), (char*)&pi, sizeof(pi)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asid_gen;            // ASID generation on this cpu
+  uint64 asid_next;           // Next ASID to hand out in this generation
+  int idle;                   // In wfi with its timer put off; timerkick() wakes it
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,28 +85,127 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+#define FDPERPAGE 512  // struct file pointers in a page
+#define NTLBFREE  8    // pages cowfault() may leave for the next tlbshootdown()
+#define NFDPAGE   ((MAXOFILE - NOFILE + FDPERPAGE - 1) / FDPERPAGE)
+
+// A process's open files, by file descriptor. see file.c.
+struct fdtable {
+  struct spinlock lock;           // threads made by clone() share the table
+  struct file *ofile[NOFILE];     // fds [0, NOFILE)
+  struct file **page[NFDPAGE];    // the rest, allocated when first used
+  uint64 used[(MAXOFILE + 63) / 64]; // a bit for each fd in use
+};
+
 // Per-process state
+// A program segment exec() left to be paged in from p->execip.
+struct execseg {
+  uint64 va;                   // Start, page-aligned; memsz 0 if unused
+  uint64 memsz;
+  uint64 filesz;               // Bytes backed by the file, the rest are zero
+  uint off;                    // File offset of va
+  int flags;                   // ELF_PROG_FLAG_*
+};
+
+// A file mapped by mmap(); its pages are faulted in by mmapfault().
+struct vma {
+  uint64 va;                   // Start, page-aligned; len 0 if unused
+  uint64 len;                  // Page multiple
+  int prot;                    // PROT_*
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file, with a reference of its own
+  struct shmseg *shm;          // Or attached shm segment, likewise
+  uint off;                    // File offset of va, page-aligned
+};
+
+// Pages a process's two page tables take, kept up to date as
+// they are mapped and freed; each table's root points here, see
+// vmbind() in vm.c. Threads share their leader's.
+struct vmacct {
+  uint64 nrss;                 // User pages mapped below PLIC
+  uint64 nupt;                 // Page-table pages of the user page table
+  uint64 nkpt;                 // Private page-table pages of the kernel page table
+};
+
 struct proc {
   struct spinlock lock;
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
+  uint wakeat;                 // Tick a sleepuntil() sleeper waits for
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int rqcpu;                   // Run queue to put the process on when RUNNABLE
+  int priority;                // Base scheduling level, set by setpriority()
+
+  // runq[rqcpu].lock must be held when using these while RUNNABLE,
+  // p->lock otherwise:
+  struct proc *rqnext;         // Next process in the run queue
+  int level;                   // Current level, priority..NPRIO-1
+  uint boosted;                // ticks/BOOSTTICKS when level was last reset
+
+  // accounting for procinfo(); p->lock must be held when using these,
+  // except npgfault, which only the process itself updates:
+  uint64 tstamp;               // time CSR when last made RUNNABLE or RUNNING
+  uint64 runtime;              // time spent RUNNING
+  uint64 waittime;             // time spent RUNNABLE
+  uint64 cstamp, istamp;       // cycle and instret CSRs when last made RUNNING
+  uint64 cycles;               // cycles spent RUNNING
+  uint64 instret;              // instructions retired RUNNING
+  uint nvcsw;                  // sleep()s
+  uint nivcsw;                 // preemptions by the timer
+  uint npgfault;               // page faults handled in usertrap()
+
+  // the lock of the sleep queue of chan must be held when using these:
+  struct proc *sqprev;         // Sleep queue links, while in sleep()
+  struct proc *sqnext;
+
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process
+  struct proc *children;       // Live children, through sibprev/sibnext
+  struct proc *sibprev;
+  struct proc *sibnext;
+  struct proc *zombies;        // Exited children not yet waited for, through znext
+  struct proc *znext;
+
+  // threads made by clone() share their leader's page tables, open
+  // files, mmap()ed files and program file; see clone(). the leader's
+  // vmlock must be held when changing where the group's memory is
+  // (sz, vma[], execseg[]), and its pglock when changing its PTEs.
+  struct proc *leader;         // Thread group leader, p itself for a process
+  int nthread;                 // In the leader: live threads, including itself; wait_lock protects it
+  struct sleeplock vmlock;     // In the leader
+  struct spinlock pglock;      // In the leader
+  uint64 tlbgen;               // In the leader: bumped by tlbshootdown()
+  uint64 tlbseen;              // leader->tlbgen when p last flushed its TLB
+  uint64 tlbfree[NTLBFREE];    // In the leader: pages to free at the next tlbshootdown()
+  int ntlbfree;
+  uint64 tfva;                 // Where trapframe is mapped in the user page table
+  struct file *fdhold;         // Reference argfd() took on a shared table, dropped after the system call
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
+  uint64 sz;                   // Size of process memory (bytes), the same in each thread
   pagetable_t pagetable;       // User page table
   pagetable_t kpagetable;      // 进程的专属内核页
+  uint64 asid;                 // ASID of kpagetable, valid on asid_cpu in asid_gen
+  uint64 asid_gen;
+  int asid_cpu;
+  struct vmacct vmacct;        // Of pagetable and kpagetable, while this slot's own
   struct trapframe *trapframe; // data page for trampoline.S
+  struct usyscall *usyscall;   // page user space reads pid and ticks from
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct fdtable *fdt;         // Open files, the leader's fdtab
+  struct fdtable fdtab;
   struct inode *cwd;           // Current directory
+  struct inode *execip;        // Program file, while execseg[] refers to it; leader's
+  struct execseg execseg[NEXECSEG]; // Parts of [0, sz) still backed by execip; leader's
+  struct vma vma[NVMA];        // mmap()ed files, above sz and below PLIC; leader's
+  int logres;                  // Log blocks reserved by begin_opn()
   char name[16];               // Process name (debugging)
   // for trace
   int trace_mask;
+  void (*kfn)(void);           // Entry of a kernel thread, 0 for user processes
 };
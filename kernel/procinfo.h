@@ -0,0 +1,22 @@
+// per-process accounting, returned by procinfo().
+// times are in time CSR cycles; TICKCYCLES of them make a tick.
+struct procinfo {
+  int pid;
+  int state;          // enum procstate in proc.h
+  int priority;       // base scheduling priority
+  char name[16];
+  uint64 sz;          // size of user memory (bytes)
+  uint64 runtime;     // time spent RUNNING
+  uint64 waittime;    // time spent RUNNABLE, waiting in a run queue
+  uint64 cycles;      // cycle CSR counts while RUNNING
+  uint64 instret;     // instructions retired while RUNNING
+  uint nvcsw;         // voluntary context switches (sleep)
+  uint nivcsw;        // involuntary context switches (preempted)
+  uint npgfault;      // copy-on-write and lazy allocation page faults
+  // memory, in pages; threads report their leader's
+  // address space, which they share.
+  uint64 nrss;        // resident user pages
+  uint64 nupt;        // user page-table pages
+  uint64 nkpt;        // private kernel page-table pages
+  uint64 nkpages;     // kernel stack, trapframe and usyscall pages
+};
@@ -0,0 +1,146 @@
+// Sampling profiler.
+//
+// profstart(rate) has each busy CPU take rate timer interrupts
+// a tick instead of one, and on each of them devintr() calls
+// profintr(), which records the interrupted pc, and whether it
+// was in user space, into a ring per CPU that profread()
+// drains. user/profile.c counts the samples by function using
+// kernel.sym.
+//
+// The rings work like the trace rings in trace.c: each has one
+// producer, its own CPU, which writes with interrupts off and
+// takes no lock, and readers serialize on prof.lock. When a ring
+// is full samples are dropped and counted, and the reader
+// reports the count in a PROF_LOST sample.
+//
+// Time slices stay a tick long while profiling: the extra
+// interrupts don't preempt the running process.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "prof.h"
+
+#define MAXPROFRATE 100  // samples a tick, at most
+
+struct profring {
+  struct profsample ent[NPROF];
+  uint64 head;     // next entry to fill; written only by this CPU
+  uint64 tail;     // next entry to read; written only by readers
+  uint64 lost;     // samples dropped since the last read
+  uint64 slice;    // time CSR at which to preempt next
+};
+
+struct {
+  struct spinlock lock;  // serializes readers and profstart()
+  int rate;              // samples a tick; 0 if off
+  struct profring ring[NCPU];
+} prof;
+
+void
+profinit(void)
+{
+  initlock(&prof.lock, "prof");
+}
+
+// start sampling rate times a tick on every CPU, or stop if
+// rate is 0. returns -1 if rate is out of range.
+int
+profstart(int rate)
+{
+  if(rate < 0 || rate > MAXPROFRATE)
+    return -1;
+  acquire(&prof.lock);
+  prof.rate = rate;
+  timerinterval(rate ? TICKCYCLES / rate : TICKCYCLES);
+  release(&prof.lock);
+  return 0;
+}
+
+// a timer interrupt on this CPU; record a sample if profiling.
+// returns 1 if the running process should be preempted, 0 if
+// this is one of the extra interrupts profiling asked for.
+// interrupts are off.
+int
+profintr(void)
+{
+  struct profring *r;
+  struct profsample *e;
+  struct proc *p = myproc();
+  uint64 now;
+
+  if(prof.rate == 0)
+    return 1;
+
+  r = &prof.ring[cpuid()];
+  if(r->head - r->tail >= NPROF){
+    __sync_fetch_and_add(&r->lost, 1);
+  } else {
+    e = &r->ent[r->head % NPROF];
+    e->pc = r_sepc();
+    e->pid = p ? p->pid : 0;
+    e->cpu = cpuid();
+    e->user = (r_sstatus() & SSTATUS_SPP) == 0;
+    __sync_synchronize(); // the entry is complete before head moves past it
+    r->head++;
+  }
+
+  now = r_time();
+  if(now < r->slice)
+    return 0;
+  r->slice = now + TICKCYCLES;
+  return 1;
+}
+
+// take up to n samples from ring r into ent[]. caller holds prof.lock.
+static int
+ringtake(struct profring *r, struct profsample *ent, int n)
+{
+  uint64 head, tail, lost;
+  int i = 0;
+
+  if((lost = __sync_lock_test_and_set(&r->lost, 0)) != 0 && n > 0){
+    memset(&ent[0], 0, sizeof(ent[0]));
+    ent[0].pc = PROF_LOST;
+    ent[0].pid = lost;
+    ent[0].cpu = r - prof.ring;
+    i = 1;
+  }
+  head = r->head;
+  __sync_synchronize(); // read entries only after seeing head
+  for(tail = r->tail; i < n && tail != head; i++, tail++)
+    ent[i] = r->ent[tail % NPROF];
+  __sync_synchronize(); // done with the entries before the producer reuses them
+  r->tail = tail;
+  return i;
+}
+
+// copy up to n samples to user address addr, draining them
+// from the rings. returns the number copied, or -1.
+int
+profread(uint64 addr, int n)
+{
+  struct profsample ent[16];
+  int c, m, total = 0;
+
+  for(c = 0; c < NCPU && total < n; ){
+    acquire(&prof.lock);
+    m = n - total;
+    if(m > NELEM(ent))
+      m = NELEM(ent);
+    m = ringtake(&prof.ring[c], ent, m);
+    release(&prof.lock);
+    if(m == 0){
+      c++;
+      continue;
+    }
+    if(copyout(myproc()->pagetable, addr + total*sizeof(ent[0]), (char*)ent, m*sizeof(ent[0])) < 0)
+      return -1;
+    total += m;
+  }
+  return total;
+}
@@ -0,0 +1,9 @@
+// one sample from the kernel profiler, returned by profread().
+struct profsample {
+  uint64 pc;        // sepc when the timer interrupt came
+  int pid;          // 0 if the CPU was in the scheduler
+  short cpu;
+  short user;       // 1 if pc is a user address in process pid
+};
+
+#define PROF_LOST  (~0UL)  // pc of a sample saying pid samples were dropped
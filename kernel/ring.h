@@ -0,0 +1,44 @@
+// Submission/completion rings for ring_enter().
+//
+// The ring lives in user memory. User code fills entries at
+// sq[sqtail % size] and advances sqtail; ring_enter() consumes
+// them from sqhead, and posts a completion for each at
+// cq[cqtail % size], which user code consumes from cqhead.
+// size must be a power of two.
+
+struct ring {
+  uint64 sq;        // address of struct ringsqe[size]
+  uint64 cq;        // address of struct ringcqe[size]
+  uint size;
+  uint sqhead;      // advanced by the kernel
+  uint sqtail;      // advanced by user code
+  uint cqhead;      // advanced by user code
+  uint cqtail;      // advanced by the kernel
+};
+
+struct ringsqe {
+  int op;           // RING_*
+  int flags;        // RING_FD_PREV, RING_N_PREV
+  int fd;
+  int n;            // byte count; mode for RING_OPEN
+  uint64 addr;      // buffer; path for RING_OPEN; struct stat for RING_FSTAT
+  uint64 data;      // copied to the completion
+};
+
+struct ringcqe {
+  uint64 data;
+  int res;          // what the equivalent syscall returns
+};
+
+#define RING_NOP    0
+#define RING_OPEN   1
+#define RING_READ   2
+#define RING_WRITE  3
+#define RING_FSTAT  4
+#define RING_CLOSE  5
+
+// within one ring_enter(), take fd from the previous operation
+// (the fd it opened or used), or n from its result: e.g. to fstat()
+// and close() a file just opened, or write what was just read.
+#define RING_FD_PREV 0x1
+#define RING_N_PREV  0x2
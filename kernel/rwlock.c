@@ -0,0 +1,82 @@
+// Reader-writer spin locks, for state that is read far more
+// often than it is written: readers on different CPUs don't
+// wait for each other, only for writers.
+//
+// Like spin locks, these keep interrupts off while held.
+// A waiting writer holds back new readers, so a CPU mustn't
+// take a read lock it already holds.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "rwlock.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+void
+initrwlock(struct rwlock *lk, char *name)
+{
+  lk->name = name;
+  lk->cnt = 0;
+  lk->wwait = 0;
+  lk->cpu = 0;
+}
+
+// Acquire the lock for reading.
+void
+acquireread(struct rwlock *lk)
+{
+  int c;
+
+  push_off(); // disable interrupts to avoid deadlock.
+  if(lk->cpu == mycpu())
+    panic("acquireread");
+  for(;;){
+    c = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+    if(c >= 0 && __atomic_load_n(&lk->wwait, __ATOMIC_RELAXED) == 0 &&
+       __sync_bool_compare_and_swap(&lk->cnt, c, c + 1))
+      break;
+  }
+  // the critical section's loads happen after the lock is held;
+  // see acquire().
+  __sync_synchronize();
+}
+
+void
+releaseread(struct rwlock *lk)
+{
+  __sync_synchronize();
+  if(__sync_fetch_and_sub(&lk->cnt, 1) <= 0)
+    panic("releaseread");
+  pop_off();
+}
+
+// Acquire the lock for writing, once the readers holding
+// it are done.
+void
+acquirewrite(struct rwlock *lk)
+{
+  push_off();
+  if(lk->cpu == mycpu())
+    panic("acquirewrite");
+  __sync_fetch_and_add(&lk->wwait, 1);
+  while(!__sync_bool_compare_and_swap(&lk->cnt, 0, -1))
+    ;
+  __sync_fetch_and_sub(&lk->wwait, 1);
+  __sync_synchronize();
+  lk->cpu = mycpu();
+}
+
+void
+releasewrite(struct rwlock *lk)
+{
+  if(lk->cnt != -1 || lk->cpu != mycpu())
+    panic("releasewrite");
+  lk->cpu = 0;
+  __sync_synchronize();
+  __atomic_store_n(&lk->cnt, 0, __ATOMIC_RELAXED);
+  pop_off();
+}
@@ -0,0 +1,10 @@
+// Reader-writer spin lock.
+// Any number of readers, or one writer, may hold it.
+struct rwlock {
+  int cnt;           // Readers holding the lock, or -1 if a writer does.
+  uint wwait;        // Writers waiting; new readers hold off for them.
+
+  // For debugging:
+  char *name;        // Name of lock.
+  struct cpu *cpu;   // The cpu of the writer holding the lock.
+};
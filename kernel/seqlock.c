@@ -0,0 +1,66 @@
+// Sequence locks, for small state read on hot paths and
+// written rarely: readers don't write anything shared, so
+// they never slow each other or the writer down.
+//
+// A reader copies the state out between seqreadbegin() and
+// seqreadretry(), and starts over if seqreadretry() says a
+// writer got in the way:
+//
+//   do {
+//     s = seqreadbegin(&sl);
+//     x = state;
+//   } while(seqreadretry(&sl, s));
+//
+// so it must only copy, not act on what it reads until then.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "seqlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+void
+initseqlock(struct seqlock *sl, char *name)
+{
+  initlock(&sl->lk, name);
+  sl->seq = 0;
+}
+
+// Start writing: readers that overlap the writes will retry.
+void
+seqwritebegin(struct seqlock *sl)
+{
+  acquire(&sl->lk);
+  sl->seq++;
+  __sync_synchronize(); // seq is odd before any of the writes land.
+}
+
+void
+seqwriteend(struct seqlock *sl)
+{
+  __sync_synchronize(); // the writes land before seq is even again.
+  sl->seq++;
+  release(&sl->lk);
+}
+
+// Start reading; returns the sequence number to hand to
+// seqreadretry(). waits while a writer is writing.
+uint
+seqreadbegin(struct seqlock *sl)
+{
+  uint s;
+
+  while((s = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED)) & 1)
+    ;
+  __sync_synchronize();
+  return s;
+}
+
+// Did a writer write since seqreadbegin() returned s?
+int
+seqreadretry(struct seqlock *sl, uint s)
+{
+  __sync_synchronize();
+  return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != s;
+}
@@ -0,0 +1,7 @@
+// Sequence lock.
+// Writers take lk and make seq odd while they write; readers
+// take nothing, and retry if seq was odd or changed meanwhile.
+struct seqlock {
+  uint seq;           // Odd while a writer is writing.
+  struct spinlock lk; // Serializes writers.
+};
@@ -0,0 +1,165 @@
+// Shared memory segments.
+//
+// shm_create() allocates a segment of zeroed pages and returns
+// its id; shm_attach() maps the whole segment into the calling
+// process, and shm_detach() unmaps it. Processes attached to
+// the same segment map the very same pages, so they can pass
+// data to each other with no copying by the kernel.
+//
+// An attachment is a mapping in p->vma[] with v->shm set
+// instead of v->f; mmapfault() maps its pages on first touch,
+// munmap() and exit() unmap them as they do a file's, and fork()
+// gives the child the parent's attachments.
+//
+// A segment holds one reference to each of its pages (see
+// krefinc()), as does each process that has faulted the page
+// in. The segment itself is counted by its attachments, and is
+// freed with the last of them. A segment that has just been
+// created counts as attached until its first shm_attach(), so
+// it must be attached once to go away.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+struct shmseg {
+  int ref;              // attachments, 0 if the slot is unused
+  int fresh;            // created, not yet attached
+  uint npages;
+  uint64 *pages;        // a page holding the segment's pages' addresses
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// free a segment's pages, once nothing refers to it.
+static void
+shmfree(uint npages, uint64 *pages)
+{
+  uint i;
+
+  for(i = 0; i < npages; i++)
+    kfree((void*)pages[i]);
+  kfree(pages);
+}
+
+// create a segment of size bytes. returns its id, or -1.
+int
+shmcreate(uint64 size)
+{
+  struct shmseg *s;
+  uint64 *pages;
+  uint i, npages;
+
+  npages = PGROUNDUP(size) / PGSIZE;
+  if(npages == 0 || npages > SHMMAXPG)
+    return -1;
+  if((pages = kalloc()) == 0)
+    return -1;
+  for(i = 0; i < npages; i++){
+    if((pages[i] = (uint64)kalloc_zeroed()) == 0){
+      shmfree(i, pages);
+      return -1;
+    }
+  }
+
+  acquire(&shm.lock);
+  for(s = shm.seg; s < shm.seg + NSHM; s++){
+    if(s->ref == 0){
+      s->ref = 1;
+      s->fresh = 1;
+      s->npages = npages;
+      s->pages = pages;
+      release(&shm.lock);
+      return s - shm.seg;
+    }
+  }
+  release(&shm.lock);
+  shmfree(npages, pages);
+  return -1;
+}
+
+// a reference to segment id for a new attachment, or 0.
+struct shmseg*
+shmget(int id)
+{
+  struct shmseg *s;
+
+  if(id < 0 || id >= NSHM)
+    return 0;
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if(s->ref == 0){
+    release(&shm.lock);
+    return 0;
+  }
+  if(s->fresh)
+    s->fresh = 0;  // the attachment takes over shmcreate()'s reference
+  else
+    s->ref++;
+  release(&shm.lock);
+  return s;
+}
+
+// another attachment of s, made by fork() or a split munmap().
+void
+shmdup(struct shmseg *s)
+{
+  acquire(&shm.lock);
+  if(s->ref < 1)
+    panic("shmdup");
+  s->ref++;
+  release(&shm.lock);
+}
+
+// drop an attachment of s, freeing it with the last one.
+void
+shmput(struct shmseg *s)
+{
+  uint64 *pages;
+  uint npages;
+
+  acquire(&shm.lock);
+  if(s->ref < 1)
+    panic("shmput");
+  if(--s->ref > 0){
+    release(&shm.lock);
+    return;
+  }
+  pages = s->pages;
+  npages = s->npages;
+  s->pages = 0;
+  s->npages = 0;
+  release(&shm.lock);
+  shmfree(npages, pages);
+}
+
+uint64
+shmsize(struct shmseg *s)
+{
+  return (uint64)s->npages * PGSIZE;
+}
+
+// the page of s at offset off, with a reference for the caller
+// to map, or 0 if off is beyond the end of s.
+void*
+shmpage(struct shmseg *s, uint64 off)
+{
+  void *pa;
+
+  if(off / PGSIZE >= s->npages)
+    return 0;
+  pa = (void*)s->pages[off / PGSIZE];
+  krefinc(pa);
+  return pa;
+}
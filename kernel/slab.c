@@ -0,0 +1,184 @@
+// 小对象分配器（slab），建立在kalloc()之上。
+// 每个kmem_cache管理一种大小固定的对象，对象从整页的slab中切出，
+// 页首是struct slab，记录所属的cache和页内的空闲对象链表，
+// 因此释放对象时按地址向下取整到页边界就能找到它的slab。
+// 每个CPU有一个弹匣（magazine）缓存最近释放的对象，分配和释放通常
+// 只在本CPU上关中断操作弹匣，不需要获取锁；弹匣空了或满了才
+// 获取cache->lock，与slab页之间成批地搬运SLAB_MAG/2个对象。
+// 完全空闲的slab页最多保留一个，其余还给kalloc()。
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;     // cache->partial链表
+  struct slab *prev;
+  void *free;            // 页内空闲对象的链表，对象的第一个字指向下一个
+  uint inuse;            // 已分配出去（包括在弹匣中）的对象数
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+/**
+  * void kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+  * @brief： 初始化一个大小为size字节的对象缓存
+  * @param： c - 缓存；name - 名字（调试用）；size - 对象大小，不能超过一页减去页首
+  * @retval： NULL
+  */
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 15) & ~15;
+  if(c->size < sizeof(void*) || c->size > PGSIZE - SLABHDR)
+    panic("kmem_cache_init");
+  c->perslab = (PGSIZE - SLABHDR) / c->size;
+}
+
+// 从partial链表中摘下s。调用者持有c->lock。
+static void
+slabunlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+// 把s放到partial链表头。调用者持有c->lock。
+static void
+slablink(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// 分配一个新的slab页并切分成对象。调用者持有c->lock。
+static struct slab*
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *p;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(p = (char*)s + SLABHDR + (c->perslab - 1) * c->size; p >= (char*)s + SLABHDR; p -= c->size){
+    *(void**)p = s->free;
+    s->free = p;
+  }
+  c->nslab++;
+  slablink(c, s);
+  return s;
+}
+
+// 从slab页中取出最多n个对象放进弹匣m。调用者持有c->lock。
+static void
+magfill(struct kmem_cache *c, struct kmag *m, int n)
+{
+  struct slab *s;
+  void *obj;
+
+  while(m->n < n){
+    if((s = c->partial) == 0){
+      if((s = c->empty) != 0){
+        c->empty = 0;
+        slablink(c, s);
+      } else if((s = slabgrow(c)) == 0){
+        return;
+      }
+    }
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    if(s->free == 0)
+      slabunlink(c, s); // 已经分配满
+    m->obj[m->n++] = obj;
+  }
+}
+
+// 把对象obj还给它的slab页。调用者持有c->lock。
+static void
+slabput(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free");
+  if(s->free == 0)
+    slablink(c, s); // 原来是满的
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    slabunlink(c, s);
+    if(c->empty){
+      kfree((void*)c->empty);
+      c->nslab--;
+    }
+    c->empty = s;
+  }
+}
+
+/**
+  * void *kmem_cache_alloc(struct kmem_cache *c)
+  * @brief： 分配一个对象。优先取本CPU弹匣中的；弹匣空时从slab页批量补充
+  * @param： c - 缓存
+  * @retval： 对象指针，内存不足时返回0
+  */
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmag *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    magfill(c, m, SLAB_MAG / 2);
+    release(&c->lock);
+  }
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+/**
+  * void kmem_cache_free(struct kmem_cache *c, void *obj)
+  * @brief： 释放一个对象，放进本CPU的弹匣；弹匣满时先把一半还给slab页
+  * @param： c - 缓存；obj - kmem_cache_alloc(c)分配的对象
+  * @retval： NULL
+  */
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct kmag *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == SLAB_MAG){
+    acquire(&c->lock);
+    while(m->n > SLAB_MAG / 2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
@@ -0,0 +1,20 @@
+// 小对象缓存（slab），建立在kalloc()之上，见slab.c。
+
+#define SLAB_MAG 16  // 每个CPU的弹匣最多缓存的空闲对象数
+
+// 每个CPU的空闲对象缓存，只在关中断时由本CPU访问
+struct kmag {
+  int n;
+  void *obj[SLAB_MAG];
+};
+
+struct kmem_cache {
+  struct spinlock lock;  // 保护partial链表和计数
+  char *name;
+  uint size;             // 对象大小，按16字节对齐
+  uint perslab;          // 每个slab页的对象数
+  struct slab *partial;  // 还有空闲对象的slab页
+  struct slab *empty;    // 留一个全空的slab页，避免在分配和释放之间反复kalloc()/kfree()
+  uint64 nslab;          // 当前占用的页数
+  struct kmag mag[NCPU];
+};
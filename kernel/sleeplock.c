@@ -1,4 +1,12 @@
 // Sleeping locks
+//
+// A process that finds the lock held spins for a while
+// first if the holder is running on another CPU, since
+// buffer and inode locks are mostly held briefly and the
+// holder may release before a sleep and wakeup would take.
+// releasesleep() hands the lock straight to the waiter that
+// has slept longest, rather than waking them all to race
+// for it.
 
 #include "types.h"
 #include "riscv.h"
@@ -6,8 +14,12 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
+
+// how many times acquiresleep() looks at a lock held by a
+// running process before going to sleep.
+#define SLEEPSPIN 10000
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -15,28 +27,63 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->nwaiting = 0;
+  lk->owner = 0;
   lk->pid = 0;
 }
 
+// wait, without holding lk->lk, while the lock is held by a
+// process running on another CPU. only a hint: the owner and
+// its state are read without their locks.
+static void
+spinsleep(struct sleeplock *lk)
+{
+  struct proc *o;
+  int i;
+
+  for(i = 0; i < SLEEPSPIN; i++){
+    if(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) == 0)
+      return;
+    o = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+    if(o == 0 || o == myproc() || o->state != RUNNING)
+      return;
+  }
+}
+
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *p = myproc();
+
+  spinsleep(lk);
   acquire(&lk->lk);
-  while (lk->locked) {
+  // releasesleep() may have made p the owner while p slept.
+  while (lk->locked && lk->owner != p) {
+    lk->nwaiting++;
     sleep(lk, &lk->lk);
+    lk->nwaiting--;
   }
   lk->locked = 1;
-  lk->pid = myproc()->pid;
+  lk->owner = p;
+  lk->pid = p->pid;
   release(&lk->lk);
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
+  struct proc *p;
+
   acquire(&lk->lk);
-  lk->locked = 0;
-  lk->pid = 0;
-  wakeup(lk);
+  if(lk->nwaiting > 0 && (p = wakeupone(lk)) != 0){
+    // hand off: the lock stays held, by p.
+    lk->owner = p;
+    lk->pid = p->pid;
+  } else {
+    lk->locked = 0;
+    lk->owner = 0;
+    lk->pid = 0;
+  }
   release(&lk->lk);
 }
 
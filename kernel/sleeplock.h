@@ -2,6 +2,8 @@
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  uint nwaiting;     // Processes asleep in acquiresleep()
+  struct proc *owner; // Process holding lock, for spinning waiters
   
   // For debugging:
   char *name;        // Name of lock.
@@ -0,0 +1,19 @@
+// File actions for spawn().
+//
+// The child starts with a copy of its parent's open files,
+// to which the actions are applied in order, as the child of
+// fork() would between fork() and exec().
+
+#define NSPAWNFA 16  // max actions per spawn()
+
+#define SPAWN_CLOSE 0  // close fd
+#define SPAWN_DUP   1  // make newfd refer to fd's file, closing newfd first
+#define SPAWN_OPEN  2  // open path with mode omode as fd, closing fd first
+
+struct spawnfa {
+  int op;           // SPAWN_*
+  int fd;
+  int newfd;
+  int omode;
+  uint64 path;      // for SPAWN_OPEN
+};
@@ -5,32 +5,84 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+// Statistics for each lock name, kept per CPU so that counting
+// needn't touch a cache line other CPUs write. Each CPU only
+// updates its own, with interrupts off. lsname[i] is the name
+// entry i was made for; entries are only ever added, under
+// lsbusy, and lsn published after the entry is filled in.
+static struct lockstat lstat[NCPU][NLOCKSTAT];
+static char *lsname[NLOCKSTAT];
+static int lsn;
+static uint lsbusy;
+
+// find or make the statistics entry for name. -1 if the
+// table is full.
+static int
+lockstatid(char *name)
+{
+  int i, n;
+
+  for(i = 0; i < lsn; i++){
+    if(lsname[i] == name || strncmp(lsname[i], name, sizeof(lstat[0][0].name)-1) == 0)
+      return i;
+  }
+
+  push_off();
+  while(__sync_lock_test_and_set(&lsbusy, 1) != 0)
+    ;
+  n = lsn;
+  for(; i < n; i++){
+    if(strncmp(lsname[i], name, sizeof(lstat[0][0].name)-1) == 0)
+      break;
+  }
+  if(i == n && n < NLOCKSTAT){
+    lsname[n] = name;
+    __sync_synchronize();
+    lsn = n + 1;
+  } else if(i == n){
+    i = -1;
+  }
+  __sync_lock_release(&lsbusy);
+  pop_off();
+  return i;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->stat = lockstatid(name);
 }
 
 // Acquire the lock.
-// Loops (spins) until the lock is acquired.
+// Takes a ticket, and loops (spins) until it is served.
 void
 acquire(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint ticket;
+  uint64 spins;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
+  //   amoadd.w a5, a5, (s1)
+  // waiters then only read lk->owner, so they share its cache
+  // line until release() writes it.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  spins = 0;
+  while(__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != ticket)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +92,35 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  if(lk->stat >= 0){
+    st = &lstat[cpuid()][lk->stat];
+    st->nacquire++;
+    if(spins){
+      st->ncontend++;
+      st->nspin += spins;
+    }
+    lk->tacquire = r_time();
+  }
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint64 t;
+
   if(!holding(lk))
     panic("release");
 
+  if(lk->stat >= 0){
+    st = &lstat[cpuid()][lk->stat];
+    t = r_time() - lk->tacquire;
+    if(t > st->maxhold)
+      st->maxhold = t;
+  }
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +131,9 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Serve the next ticket. Only the holder writes lk->owner,
+  // and an atomic store can't be split into several stores.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELAXED);
 
   pop_off();
 }
@@ -77,10 +144,23 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->owner != lk->next && lk->cpu == mycpu());
   return r;
 }
 
+// Check whether this cpu is holding any spinlock,
+// in which case it must not sleep.
+int
+holdingany(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n > 1;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
@@ -108,3 +188,34 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// copy the statistics of up to n lock names, summed over all
+// CPUs, to the struct lockstat array at user address addr.
+// then clear them if reset is set; acquires meanwhile may be
+// lost. returns how many were copied.
+int
+lockstat(uint64 addr, int n, int reset)
+{
+  struct lockstat st, *s;
+  int i, c;
+
+  if(n > lsn)
+    n = lsn;
+  for(i = 0; i < n; i++){
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, lsname[i], sizeof(st.name));
+    for(c = 0; c < NCPU; c++){
+      s = &lstat[c][i];
+      st.nacquire += s->nacquire;
+      st.ncontend += s->ncontend;
+      st.nspin += s->nspin;
+      if(s->maxhold > st.maxhold)
+        st.maxhold = s->maxhold;
+    }
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  if(reset)
+    memset(lstat, 0, sizeof(lstat));
+  return n;
+}
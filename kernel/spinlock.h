@@ -1,9 +1,15 @@
 // Mutual exclusion lock.
+// A ticket lock: acquire() takes the next ticket and waits
+// until owner reaches it, so waiters get the lock in order.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket now holding the lock; held if != next.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For lockstat():
+  int stat;          // Index of the statistics for the lock's name, or -1.
+  uint64 tacquire;   // When the holder got the lock, in time CSR cycles.
+};
@@ -16,10 +16,16 @@ uint64 mscratch0[NCPU * 32];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
+// the device tree qemu passed hart 0, for bootparaminit().
+uint64 bootdtb;
+
 // entry.S jumps here in machine mode on stack0.
 void
-start()
+start(uint64 hartid, uint64 dtb)
 {
+  if(hartid == 0)
+    bootdtb = dtb;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
@@ -38,6 +44,12 @@ start()
   w_mideleg(0xffff);
   w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the time CSR, for ticks, and
+  // the cycle and instret CSRs, for per-process counts;
+  // and let user mode read all three, for benchmarks.
+  w_mcounteren(r_mcounteren() | COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+  w_scounteren(COUNTEREN_CY | COUNTEREN_TM | COUNTEREN_IR);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -52,7 +64,7 @@ start()
 // set up to receive timer interrupts in machine mode,
 // which arrive at timervec in kernelvec.S,
 // which turns them into software interrupts for
-// devintr() in trap.c.
+// devintr() in trap.c once the CPU's deadline has passed.
 void
 timerinit()
 {
@@ -60,16 +72,22 @@ timerinit()
   int id = r_mhartid();
 
   // ask the CLINT for a timer interrupt.
-  int interval = 1000000; // cycles; about 1/10th second in qemu.
-  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME + interval;
+  uint64 deadline = *(uint64*)CLINT_MTIME + TICKCYCLES;
+  *(uint64*)CLINT_MTIMECMP(id) = deadline;
 
   // prepare information in scratch[] for timervec.
   // scratch[0..3] : space for timervec to save registers.
   // scratch[4] : address of CLINT MTIMECMP register.
-  // scratch[5] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : interval (in cycles) between timer interrupts
+  //              while the CPU is busy.
+  // scratch[6] : deadline: the time at which the kernel wants
+  //              its next interrupt; see timerset() in trap.c.
+  // scratch[7] : address of CLINT MTIME register.
   uint64 *scratch = &mscratch0[32 * id];
   scratch[4] = CLINT_MTIMECMP(id);
-  scratch[5] = interval;
+  scratch[5] = TICKCYCLES;
+  scratch[6] = deadline;
+  scratch[7] = CLINT_MTIME;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
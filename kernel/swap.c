@@ -0,0 +1,410 @@
+// Swap space.
+//
+// Given a second virtio disk (make SWAP=<megabytes>), user
+// pages are written out to it when memory runs short, and read
+// back when they are next touched, so a job that needs more
+// memory than there is slows down instead of failing.
+//
+// The disk is divided into page-sized slots. A page that has
+// been swapped out has a PTE with PTE_V clear and PTE_SWAP set,
+// its slot in the PPN field, and the flags it is to be mapped
+// with again. lazyfault() calls swapin() for such a PTE. fork()
+// shares the slot between parent and child, as it shares
+// pages, so each slot has a reference count.
+//
+// Pages are chosen by a clock that goes round the user memory
+// of each process in turn: kswapd moves it on when free pages
+// run low, and kalloc() when it finds none. A page whose PTE_A
+// bit is set has been used since the hand last passed; the bit
+// is cleared, and the page gets another chance. Only pages of
+// [0, sz) with no other reference are taken, not copy-on-write
+// pages still shared, the page cache's pages, or megapages.
+//
+// A page read back keeps its slot, remembered in cached[] by
+// physical page, until the page is freed. If the page is chosen
+// again before anything has stored to it (PTE_D clear), it
+// goes back to the same slot without being written.
+//
+// An evicted page's PTE and kernel page table mirror entry are
+// replaced holding the leader's pglock; then every CPU running
+// one of its threads is made to flush its TLB (see tlbwait()),
+// and only then is the page written and freed. swapin() waits
+// for a slot that is still being written.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "kmemstat.h"
+
+#define SWAPDISK  1    // virtio disk number
+#define SWAPSCAN  512  // pages of a process the hand looks at in one visit
+#define SWAPBATCH 16   // pages swapped out at a time
+#define SWAPLOW   64   // kswapd starts below this many free pages,
+#define SWAPHIGH  128  // and stops above this many
+#define SWAPTICKS 5    // kswapd checks free memory this often
+#define SWAPVISITS (4*nproc) // most processes the hand visits in one swapreclaim()
+
+extern struct proc *proc;
+extern int nproc;
+pte_t *walk(pagetable_t pagetable, uint64 va, int alloc);
+pte_t *walklevel(pagetable_t pagetable, uint64 va, int alloc, int level, int *lvl);
+int umappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm);
+static void kswapd(void);
+
+struct {
+  struct spinlock lock;
+  uint nslot;           // 0 if there's no swap disk
+  uint nfree;           // slots with no references, not being written
+  uint ncached;         // slots in cached[]
+  uint next;            // where to start looking for a free slot
+  ushort ref[NSWAP];    // swap PTEs and cached[] entries using each slot
+  uchar busy[NSWAP];    // being written
+  ushort cached[(PHYSTOP - KERNBASE) / PGSIZE]; // slot holding a copy of each page, or 0
+  uint64 nin, nout;
+
+  // the clock hand: a process slot, and an address in it.
+  // only one sweep at a time.
+  struct sleeplock clock;
+  int hand;
+  uint64 handva;
+} swap;
+
+#define PA2CACHE(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// find the swap disk, if any, and start kswapd.
+// runs in a process, since kthread() needs initproc.
+void
+swapinit(void)
+{
+  uint64 n;
+
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.clock, "swapclock");
+  n = virtio_disk_size(SWAPDISK) / PGSIZE;
+  if(n <= 1)
+    return;
+  if(n > NSWAP)
+    n = NSWAP;
+  swap.next = 1;
+  swap.nfree = n - 1; // slot 0 means "none" in cached[]
+  if(kthread(kswapd, "kswapd") < 0)
+    panic("swapinit");
+  swap.nslot = n;
+  printf("swap: %d pages\n", (int)(n - 1));
+}
+
+// slots new swapping could use: free ones, and those that
+// only hold copies of pages that are in memory.
+uint64
+swapavail(void)
+{
+  return swap.nslot ? swap.nfree + swap.ncached : 0;
+}
+
+// drop a reference to slot. caller holds swap.lock.
+static void
+slotput(uint slot)
+{
+  if(slot == 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("slotput");
+  if(--swap.ref[slot] == 0 && !swap.busy[slot])
+    swap.nfree++;
+}
+
+// forget the copy of pa in cached[]. caller holds swap.lock.
+static void
+uncache(uint64 pa)
+{
+  uint slot;
+
+  if((slot = swap.cached[PA2CACHE(pa)]) == 0)
+    return;
+  swap.cached[PA2CACHE(pa)] = 0;
+  swap.ncached--;
+  slotput(slot);
+}
+
+// allocate a slot to write a page to, marked busy.
+// returns 0 if swap is full. caller holds swap.lock.
+static uint
+slotalloc(void)
+{
+  uint i, slot;
+
+  if(swap.nfree == 0 && swap.ncached > 0){
+    // make room by forgetting the copies of pages in memory.
+    for(i = 0; i < NELEM(swap.cached) && swap.nfree == 0; i++){
+      if(swap.cached[i])
+        uncache(KERNBASE + (uint64)i * PGSIZE);
+    }
+  }
+  if(swap.nfree == 0)
+    return 0;
+  for(i = 0; i < swap.nslot; i++){
+    slot = swap.next;
+    if(++swap.next == swap.nslot)
+      swap.next = 1;
+    if(slot != 0 && swap.ref[slot] == 0 && !swap.busy[slot]){
+      swap.ref[slot] = 1;
+      swap.busy[slot] = 1;
+      swap.nfree--;
+      return slot;
+    }
+  }
+  panic("slotalloc");
+}
+
+// fork() copied swap PTE pte into a child.
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.lock);
+  swap.ref[PTE2SLOT(pte)]++;
+  release(&swap.lock);
+}
+
+// swap PTE pte was removed from a page table.
+void
+swapput(pte_t pte)
+{
+  acquire(&swap.lock);
+  slotput(PTE2SLOT(pte));
+  release(&swap.lock);
+}
+
+// page pa is being freed; its copy is no use any more.
+// called by kfree().
+void
+swapfree(void *pa)
+{
+  if(swap.nslot == 0 || swap.cached[PA2CACHE(pa)] == 0)
+    return;
+  acquire(&swap.lock);
+  uncache((uint64)pa);
+  release(&swap.lock);
+}
+
+// read back the page p's thread group swapped out at va.
+// returns 0 on success, -1 if va isn't swapped out, or memory
+// is exhausted, or the caller can't sleep.
+int
+swapin(struct proc *p, uint64 va)
+{
+  struct proc *l = p->leader;
+  pte_t *pte, old;
+  uint slot;
+  char *mem;
+  int perm, r = -1;
+
+  if(holdingany())
+    return -1; // must wait for the disk
+  va = PGROUNDDOWN(va);
+  acquire(&l->pglock);
+  if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_SWAP) == 0){
+    r = (pte != 0 && (*pte & PTE_V)) ? 0 : -1; // another thread got there first
+    release(&l->pglock);
+    return r;
+  }
+  old = *pte;
+  slot = PTE2SLOT(old);
+  acquire(&swap.lock);
+  swap.ref[slot]++; // keep it while we read it
+  release(&swap.lock);
+  release(&l->pglock);
+
+  if((mem = kalloc()) == 0)
+    goto out;
+  acquire(&swap.lock);
+  while(swap.busy[slot])
+    sleep(&swap.busy[slot], &swap.lock);
+  release(&swap.lock);
+  virtio_disk_rwraw(SWAPDISK, mem, PGSIZE, (uint64)slot * PGSIZE, 0);
+
+  acquire(&l->pglock);
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || *pte != old){
+    // unmapped, or read back by another thread, while we slept.
+    r = (pte != 0 && (*pte & PTE_V)) ? 0 : -1;
+    release(&l->pglock);
+    kfree(mem);
+    goto out;
+  }
+  perm = PTE_FLAGS(old) & ~PTE_SWAP;
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  vmrss(p->pagetable, va, 1);
+  if(umappages(l->kpagetable, va, PGSIZE, (uint64)mem, perm & ~(PTE_U|PTE_W|PTE_COW)) != 0)
+    panic("swapin");
+  // the swap PTE's reference to the slot is now the cached
+  // copy's.
+  acquire(&swap.lock);
+  swap.cached[PA2CACHE(mem)] = slot;
+  swap.ncached++;
+  swap.nin++;
+  release(&swap.lock);
+  release(&l->pglock);
+  sfence_vma();
+  r = 0;
+
+ out:
+  acquire(&swap.lock);
+  slotput(slot);
+  release(&swap.lock);
+  return r;
+}
+
+struct victim {
+  uint64 pa;
+  uint slot;
+  int write;  // slot doesn't already hold the page
+};
+
+// choose up to n of l's pages from swap.handva on, replacing
+// their PTEs with swap PTEs. caller holds l->lock and l->pglock.
+// returns how many were chosen, and moves the hand on.
+static int
+choose(struct proc *l, struct victim *v, int n)
+{
+  uint64 va, pa, end;
+  pte_t *pte;
+  uint slot;
+  int lvl, nv = 0;
+
+  end = swap.handva + SWAPSCAN*PGSIZE;
+  if(end > PGROUNDUP(l->sz))
+    end = PGROUNDUP(l->sz);
+  for(va = swap.handva; va < end && nv < n; va += PGSIZE){
+    if((pte = walklevel(l->pagetable, va, 0, 0, &lvl)) == 0 || lvl != 0){
+      va = (va & ~(MEGAPGSIZE - 1)) + MEGAPGSIZE - PGSIZE; // no page table, or a megapage
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue; // lazy, swapped out already, or a guard page
+    pa = PTE2PA(*pte);
+    if(krefcnt((void*)pa) != 1)
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A; // used lately; another chance
+      continue;
+    }
+    acquire(&swap.lock);
+    if((*pte & PTE_D) == 0 && (slot = swap.cached[PA2CACHE(pa)]) != 0){
+      // clean since it was read back: the slot still has it.
+      swap.cached[PA2CACHE(pa)] = 0;
+      swap.ncached--;
+      v[nv].write = 0;
+    } else {
+      uncache(pa);
+      if((slot = slotalloc()) == 0){
+        release(&swap.lock);
+        break; // swap is full
+      }
+      v[nv].write = 1;
+    }
+    swap.nout++;
+    release(&swap.lock);
+    v[nv].pa = pa;
+    v[nv].slot = slot;
+    nv++;
+    *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+    vmrss(l->pagetable, va, -1);
+    uvmunmap(l->kpagetable, va, 1, 0);
+  }
+  if(va >= PGROUNDUP(l->sz))
+    va = 0;
+  swap.handva = va;
+  return nv;
+}
+
+// move the clock hand on until n pages have been swapped out,
+// or it has made SWAPVISITS visits; that is round at least
+// twice, clearing PTE_A the first time. returns the number of
+// pages freed.
+// caller must not hold a spinlock.
+int
+swapreclaim(int n)
+{
+  struct victim v[SWAPBATCH];
+  struct proc *p;
+  uint64 gen;
+  int i, nv, visits, freed = 0;
+
+  if(swap.nslot == 0 || myproc() == 0)
+    return 0;
+  if(n > SWAPBATCH)
+    n = SWAPBATCH;
+  acquiresleep(&swap.clock);
+  for(visits = 0; freed < n && visits < SWAPVISITS; visits++){
+    p = &proc[swap.hand];
+    acquire(&p->lock);
+    if(p->state == UNUSED || p->state == ZOMBIE || p->kfn || p->leader != p ||
+       p->pagetable == 0 || swap.handva >= p->sz){
+      release(&p->lock);
+      swap.hand = (swap.hand + 1) % nproc;
+      swap.handva = 0;
+      continue;
+    }
+    acquire(&p->pglock);
+    nv = choose(p, v, n - freed);
+    gen = p->tlbgen;
+    if(nv > 0)
+      gen = ++p->tlbgen;
+    release(&p->pglock);
+    release(&p->lock);
+    if(swap.handva == 0)
+      swap.hand = (swap.hand + 1) % nproc;
+    if(nv == 0)
+      continue;
+
+    // nothing may still be using the pages when they're
+    // written and freed.
+    tlbwait(p, gen);
+    for(i = 0; i < nv; i++){
+      if(v[i].write){
+        virtio_disk_rwraw(SWAPDISK, (void*)v[i].pa, PGSIZE, (uint64)v[i].slot * PGSIZE, 1);
+        acquire(&swap.lock);
+        swap.busy[v[i].slot] = 0;
+        if(swap.ref[v[i].slot] == 0)
+          swap.nfree++; // unmapped while being written
+        wakeup(&swap.busy[v[i].slot]);
+        release(&swap.lock);
+      }
+      kfree((void*)v[i].pa);
+    }
+    freed += nv;
+  }
+  releasesleep(&swap.clock);
+  return freed;
+}
+
+// the swap daemon: keeps some pages free, so that kalloc()
+// seldom has to wait for the disk.
+static void
+kswapd(void)
+{
+  acquire(&swap.lock);
+  for(;;){
+    sleepuntil(ticks + SWAPTICKS, &swap.lock);
+    if(nfreepages() >= SWAPLOW)
+      continue;
+    release(&swap.lock);
+    while(nfreepages() < SWAPHIGH && swapreclaim(SWAPBATCH) > 0)
+      ;
+    acquire(&swap.lock);
+  }
+}
+
+void
+swapstat(struct kmemstat *st)
+{
+  acquire(&swap.lock);
+  st->nswap = swap.nslot ? swap.nslot - 1 : 0;
+  st->nswapfree = swap.nfree;
+  st->nswapin = swap.nin;
+  st->nswapout = swap.nout;
+  release(&swap.lock);
+}
@@ -3,9 +3,11 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
+#include "syshist.h"
 
 // Fetch the uint64 at addr from the current process.
 int
@@ -106,6 +108,35 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_info(void);
+extern uint64 sys_kmemstat(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_biostat(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_getpriority(void);
+extern uint64 sys_procinfo(void);
+extern uint64 sys_traceread(void);
+extern uint64 sys_syshist(void);
+extern uint64 sys_ring_enter(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_getdents(void);
+extern uint64 sys_fstatat(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_shm_create(void);
+extern uint64 sys_shm_attach(void);
+extern uint64 sys_shm_detach(void);
+extern uint64 sys_mount(void);
+extern uint64 sys_profile(void);
+extern uint64 sys_profread(void);
+extern uint64 sys_sendfile(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -131,27 +162,100 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_trace]   sys_trace,
 [SYS_sysinfo]   sys_info,
+[SYS_kmemstat]  sys_kmemstat,
+[SYS_fsync]   sys_fsync,
+[SYS_biostat] sys_biostat,
+[SYS_setpriority] sys_setpriority,
+[SYS_getpriority] sys_getpriority,
+[SYS_procinfo] sys_procinfo,
+[SYS_traceread] sys_traceread,
+[SYS_syshist] sys_syshist,
+[SYS_ring_enter] sys_ring_enter,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_spawn]   sys_spawn,
+[SYS_lockstat] sys_lockstat,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_getdents] sys_getdents,
+[SYS_fstatat] sys_fstatat,
+[SYS_clone]   sys_clone,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_shm_create] sys_shm_create,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_detach] sys_shm_detach,
+[SYS_mount]   sys_mount,
+[SYS_profile] sys_profile,
+[SYS_profread] sys_profread,
+[SYS_sendfile] sys_sendfile,
 };
 
-static char *
-syscall_name[] = {
-  "fork", "exit", "wait", "pipe", "read", "kill", "exec", "fstat", "chdir", "dup", "getpid", "sbrk", 
-  "sleep", "uptime", "open", "write", "mknod", "unlink", "link", "mkdir", "close", "trace", "sys_info"
-};
+// per-CPU latency histograms; each CPU only adds to its own,
+// with interrupts off.
+static struct syshist hist[NCPU];
+
+// count a call to syscall num that took t time CSR cycles.
+static void
+histadd(int num, uint64 t)
+{
+  int b;
+
+  if(num >= NSYSHIST)
+    return;
+  for(b = 0; b < NHBUCKET-1 && (t >> (b+1)) != 0; b++)
+    ;
+  push_off();
+  hist[cpuid()].count[num][b]++;
+  pop_off();
+}
+
+// copy the histograms, summed over all CPUs, to the struct
+// syshist at user address addr, a row at a time. then clear
+// them if reset is set; calls finishing meanwhile may be lost.
+int
+syshist(uint64 addr, int reset)
+{
+  uint64 row[NHBUCKET];
+  int num, b, c;
+
+  for(num = 0; num < NSYSHIST; num++){
+    for(b = 0; b < NHBUCKET; b++){
+      row[b] = 0;
+      for(c = 0; c < NCPU; c++)
+        row[b] += hist[c].count[num][b];
+    }
+    if(copyout(myproc()->pagetable, addr + num*sizeof(row), (char*)row, sizeof(row)) < 0)
+      return -1;
+  }
+  if(reset)
+    memset(hist, 0, sizeof(hist));
+  return 0;
+}
 
 void
 syscall(void)
 {
   int num;
   struct proc *p = myproc();
+  uint64 t0;
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
+    uint64 a0 = p->trapframe->a0;
+    t0 = r_time();
     p->trapframe->a0 = syscalls[num]();
-    int trace_mask = p->trace_mask;
-    if((trace_mask >> num) & 1) {
-        printf("%d: syscall %s -> %d\n", p->pid, syscall_name[num-1], p->trapframe->a0);
+    if(p->fdhold){
+      // see argfd().
+      fileclose(p->fdhold);
+      p->fdhold = 0;
     }
+    histadd(num, r_time() - t0);
+    // record into the trace ring; user/trace.c prints it.
+    if(num < 32 && ((p->trace_mask >> num) & 1))
+      tracerec(num, a0, p->trapframe->a1, p->trapframe->a2, p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
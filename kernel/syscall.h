@@ -22,3 +22,32 @@
 #define SYS_close  21
 #define SYS_trace  22
 #define SYS_sysinfo  23
+#define SYS_kmemstat 24
+#define SYS_fsync  25
+#define SYS_biostat 26
+#define SYS_setpriority 27
+#define SYS_getpriority 28
+#define SYS_procinfo 29
+#define SYS_traceread 30
+#define SYS_syshist 31
+#define SYS_ring_enter 32
+#define SYS_mmap   33
+#define SYS_munmap 34
+#define SYS_spawn  35
+#define SYS_lockstat 36
+#define SYS_pread  37
+#define SYS_pwrite 38
+#define SYS_readv  39
+#define SYS_writev 40
+#define SYS_getdents 41
+#define SYS_fstatat 42
+#define SYS_clone  43
+#define SYS_futex_wait 44
+#define SYS_futex_wake 45
+#define SYS_shm_create 46
+#define SYS_shm_attach 47
+#define SYS_shm_detach 48
+#define SYS_mount  49
+#define SYS_profile 50
+#define SYS_profread 51
+#define SYS_sendfile 52
@@ -10,24 +10,35 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "biostat.h"
+#include "ring.h"
+#include "uio.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// If other threads share the table, one of them may close fd while
+// this system call uses f, so f comes with a reference that syscall()
+// drops when the call returns. sys_sendfile(), the only system call
+// that takes two descriptors, keeps the first one's itself.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
-  int fd;
+  struct proc *p = myproc();
+  int fd, ref = p->leader->nthread > 1;
   struct file *f;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f=fdget(p->fdt, fd, ref)) == 0)
     return -1;
+  if(ref)
+    p->fdhold = f;
   if(pfd)
     *pfd = fd;
   if(pf)
@@ -35,23 +46,6 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
-static int
-fdalloc(struct file *f)
-{
-  int fd;
-  struct proc *p = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
-}
-
 uint64
 sys_dup(void)
 {
@@ -60,9 +54,11 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
-    return -1;
   filedup(f);
+  if((fd=fdalloc(myproc()->fdt, f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -91,6 +87,110 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// read at a given offset, without moving the file's offset.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0)
+    return -1;
+  if(n < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 || argint(3, &off) < 0)
+    return -1;
+  if(n < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// copy n bytes of file in to out inside the kernel, from
+// offset off of in, or from its offset on if off is -1.
+uint64
+sys_sendfile(void)
+{
+  struct proc *p = myproc();
+  struct file *out, *in, *held;
+  int n, off, r;
+
+  if(argfd(0, 0, &out) < 0)
+    return -1;
+  held = p->fdhold; // the second argfd() would overwrite it
+  p->fdhold = 0;
+  r = -1;
+  if(argfd(1, 0, &in) == 0 && argint(2, &off) == 0 && argint(3, &n) == 0 && n >= 0 && off >= -1)
+    r = filesendfile(out, in, off, n);
+  if(held)
+    fileclose(held);
+  return r;
+}
+
+// read or write the iovcnt buffers described by the struct
+// iovec array at user address uiov, in order, as one read()
+// or write() each. stops early at a short transfer. returns
+// the total, or -1 if the first transfer fails.
+static int
+fileiov(struct file *f, uint64 uiov, int iovcnt, int write)
+{
+  struct iovec iov;
+  int i, r, tot;
+
+  if(iovcnt < 0 || iovcnt > IOV_MAX)
+    return -1;
+  tot = 0;
+  for(i = 0; i < iovcnt; i++){
+    if(copyin(myproc()->pagetable, (char*)&iov, uiov + i*sizeof(iov), sizeof(iov)) < 0)
+      return -1;
+    if(iov.len > 0x7fffffff - tot)
+      return -1;
+    if(iov.len == 0)
+      continue;
+    r = write ? filewrite(f, iov.base, iov.len) : fileread(f, iov.base, iov.len);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < iov.len)
+      break;
+  }
+  return tot;
+}
+
+uint64
+sys_readv(void)
+{
+  struct file *f;
+  uint64 iov;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &iov) < 0 || argint(2, &n) < 0)
+    return -1;
+  return fileiov(f, iov, n, 0);
+}
+
+uint64
+sys_writev(void)
+{
+  struct file *f;
+  uint64 iov;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &iov) < 0 || argint(2, &n) < 0)
+    return -1;
+  return fileiov(f, iov, n, 1);
+}
+
 uint64
 sys_close(void)
 {
@@ -99,11 +199,41 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // another thread may have closed fd since.
+  if((f = fdremove(myproc()->fdt, fd)) == 0)
+    return -1;
   fileclose(f);
   return 0;
 }
 
+// wait until everything written so far, through fd or
+// otherwise, is committed to disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// copy the buffer cache counters to user space.
+uint64
+sys_biostat(void)
+{
+  struct biostat st;
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  biostat(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
 uint64
 sys_fstat(void)
 {
@@ -115,6 +245,55 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// read as many entries of directory fd as fit in the buffer.
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  uint64 p;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filegetdents(f, p, n);
+}
+
+// stat path, looked up relative to directory dirfd, or to
+// the current directory if dirfd is AT_FDCWD, without
+// opening it.
+uint64
+sys_fstatat(void)
+{
+  char path[MAXPATH];
+  struct inode *dp, *ip;
+  struct file *f;
+  struct stat st;
+  uint64 ust;
+  int dirfd;
+
+  if(argint(0, &dirfd) < 0 || argstr(1, path, MAXPATH) < 0 || argaddr(2, &ust) < 0)
+    return -1;
+  dp = 0;
+  if(dirfd != AT_FDCWD){
+    if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+      return -1;
+    dp = f->ip;
+  }
+
+  begin_op();
+  if((ip = nameiat(dp, path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  stati(ip, &st);
+  iunlockput(ip);
+  end_op();
+  if(copyout(myproc()->pagetable, ust, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -206,6 +385,10 @@ sys_unlink(void)
 
   if((ip = dirlookup(dp, name, &off)) == 0)
     goto bad;
+  if(mountpoint(ip)){
+    iput(ip);
+    goto bad;
+  }
   ilock(ip);
 
   if(ip->nlink < 1)
@@ -218,6 +401,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -258,8 +442,10 @@ create(char *path, short type, short major, short minor)
     return 0;
   }
 
-  if((ip = ialloc(dp->dev, type)) == 0)
-    panic("create: ialloc");
+  if((ip = ialloc(dp->dev, type)) == 0){
+    iunlockput(dp); // a tmpfs can run out
+    return 0;
+  }
 
   ilock(ip);
   ip->major = major;
@@ -283,17 +469,13 @@ create(char *path, short type, short major, short minor)
   return ip;
 }
 
-uint64
-sys_open(void)
+// open path with mode omode, for open(), ring_enter() and
+// spawn(). returns the new file, or 0.
+static struct file*
+openfile(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
-    return -1;
 
   begin_op();
 
@@ -301,33 +483,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op();
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -348,9 +528,36 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  return f;
+}
+
+// open path in a new file descriptor; returns it, or -1.
+static int
+openpath(char *path, int omode)
+{
+  struct file *f;
+  int fd;
+
+  if((f = openfile(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(myproc()->fdt, f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0)
+    return -1;
+  return openpath(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -412,19 +619,59 @@ sys_chdir(void)
   return 0;
 }
 
+// mount a new file system of type type, such as "tmpfs",
+// on the directory path.
 uint64
-sys_exec(void)
+sys_mount(void)
 {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
-  uint64 uargv, uarg;
+  char path[MAXPATH], type[DIRSIZ];
+  struct inode *ip;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+  if(argstr(0, path, MAXPATH) < 0 || argstr(1, type, DIRSIZ) < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  if(ip->type != T_DIR){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(ip);
+  if(mount(ip, type) < 0){
+    iput(ip);
+    end_op();
     return -1;
   }
-  memset(argv, 0, sizeof(argv));
+  end_op();
+  return 0;
+}
+
+// free the strings fetchargv() fetched.
+static void
+freeargv(char **argv)
+{
+  int i;
+
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// fetch the user argument vector at uargv into argv[MAXARG],
+// one kalloc()ed page per string. returns 0, or -1 with
+// whatever was fetched freed.
+static int
+fetchargv(uint64 uargv, char **argv)
+{
+  int i;
+  uint64 uarg;
+
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -440,18 +687,115 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = exec(path, argv);
 
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// apply the file actions fa[0..nfa) to the table of open
+// files t, a copy of the caller's that a spawn()ed child
+// will start with. returns 0, or -1 having applied some.
+static int
+applyfa(struct fdtable *t, uint64 fa, int nfa)
+{
+  struct spawnfa a;
+  char path[MAXPATH];
+  struct file *f;
+  int i;
+
+  for(i = 0; i < nfa; i++){
+    if(copyin(myproc()->pagetable, (char*)&a, fa + i*sizeof(a), sizeof(a)) < 0)
+      return -1;
+    if(a.fd < 0 || a.fd >= MAXOFILE)
+      return -1;
+    switch(a.op){
+    case SPAWN_CLOSE:
+      if((f = fdremove(t, a.fd)) == 0)
+        return -1;
+      fileclose(f);
+      break;
+    case SPAWN_DUP:
+      if((f = fdget(t, a.fd, 0)) == 0)
+        return -1;
+      if(a.newfd == a.fd)
+        break;
+      if(fdinstall(t, a.newfd, filedup(f)) < 0){
+        fileclose(f);
+        return -1;
+      }
+      break;
+    case SPAWN_OPEN:
+      if(fetchstr(a.path, path, MAXPATH) < 0)
+        return -1;
+      if((f = openfile(path, a.omode)) == 0)
+        return -1;
+      if(fdinstall(t, a.fd, f) < 0){
+        fileclose(f);
+        return -1;
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+  return 0;
+}
+
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct fdtable *fdt;
+  struct proc *p = myproc();
+  uint64 uargv, fa;
+  int nfa, pid;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &fa) < 0 || argint(3, &nfa) < 0)
+    return -1;
+  if(nfa < 0 || nfa > NSPAWNFA)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  // the child's table is too big for the kernel stack.
+  if((fdt = kalloc_zeroed()) == 0){
+    freeargv(argv);
+    return -1;
+  }
+  initlock(&fdt->lock, "fdtable");
+  if(fdcopy(p->fdt, fdt) < 0 || applyfa(fdt, fa, nfa) < 0){
+    fdcloseall(fdt);
+    kfree(fdt);
+    freeargv(argv);
+    return -1;
+  }
+
+  pid = spawn(path, argv, fdt);
+
+  kfree(fdt);
+  freeargv(argv);
+  return pid;
 }
 
 uint64
@@ -467,20 +811,135 @@ sys_pipe(void)
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
-  if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
+  if((fd0 = fdalloc(p->fdt, rf)) < 0 || (fd1 = fdalloc(p->fdt, wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdremove(p->fdt, fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdremove(p->fdt, fd0);
+    fdremove(p->fdt, fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// carry out one ring_enter() operation; returns its result.
+static int
+ringop(struct ringsqe *e)
+{
+  char path[MAXPATH];
+  struct proc *p = myproc();
+  struct file *f, *cf;
+  int r = -1, ref = p->leader->nthread > 1; // see argfd()
+
+  if(e->op == RING_NOP)
+    return 0;
+  if(e->op == RING_OPEN){
+    if(fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    return openpath(path, e->n);
+  }
+  if((f = fdget(p->fdt, e->fd, ref)) == 0)
+    return -1;
+  switch(e->op){
+  case RING_READ:
+    r = e->n < 0 ? -1 : fileread(f, e->addr, e->n);
+    break;
+  case RING_WRITE:
+    r = e->n < 0 ? -1 : filewrite(f, e->addr, e->n);
+    break;
+  case RING_FSTAT:
+    r = filestat(f, e->addr);
+    break;
+  case RING_CLOSE:
+    // another thread may have closed fd, or reused it, since
+    // fdget(): close whatever fdremove() finds, and drop
+    // fdget()'s reference to f below.
+    if((cf = fdremove(p->fdt, e->fd)) != 0){
+      fileclose(cf);
+      r = 0;
+    }
+    break;
+  }
+  if(ref)
+    fileclose(f);
+  return r;
+}
+
+// run the operations queued in the submission queue of the
+// struct ring at user address addr, posting a completion for
+// each, until the submission queue is empty or the completion
+// queue is full. a whole batch costs one trap into the kernel.
+// returns the number of operations carried out.
+uint64
+sys_ring_enter(void)
+{
+  struct proc *p = myproc();
+  struct ring r;
+  struct ringsqe e;
+  struct ringcqe c;
+  uint64 addr;
+  int prev = -1, prevfd = -1, done = 0;
+
+  if(argaddr(0, &addr) < 0 || copyin(p->pagetable, (char*)&r, addr, sizeof(r)) < 0)
+    return -1;
+  if(r.size == 0 || (r.size & (r.size - 1)) != 0 ||
+     r.sqtail - r.sqhead > r.size || r.cqtail - r.cqhead > r.size)
+    return -1;
+
+  while(r.sqhead != r.sqtail && r.cqtail - r.cqhead < r.size && !p->killed){
+    if(copyin(p->pagetable, (char*)&e, r.sq + (r.sqhead & (r.size-1)) * sizeof(e), sizeof(e)) < 0)
+      return -1;
+    if(e.flags & RING_FD_PREV)
+      e.fd = prevfd;
+    if(e.flags & RING_N_PREV)
+      e.n = prev;
+    prev = ringop(&e);
+    prevfd = e.op == RING_OPEN ? prev : e.fd;
+    c.data = e.data;
+    c.res = prev;
+    if(copyout(p->pagetable, r.cq + (r.cqtail & (r.size-1)) * sizeof(c), (char*)&c, sizeof(c)) < 0)
+      return -1;
+    r.sqhead++;
+    r.cqtail++;
+    done++;
+  }
+
+  if(copyout(p->pagetable, addr, (char*)&r, sizeof(r)) < 0)
+    return -1;
+  return done;
+}
+
+// map a file into memory: mmap(addr, length, prot, flags, fd, offset).
+// addr is only a hint, and is ignored.
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
@@ -0,0 +1,10 @@
+#define NSYSHIST 64  // syscall numbers with a histogram
+#define NHBUCKET 32  // log2 latency buckets
+
+// syscall latency histograms, returned by syshist().
+// count[num][b] is the number of calls to syscall num that took
+// at least 2^b and less than 2^(b+1) time CSR cycles; the last
+// bucket also counts anything slower.
+struct syshist {
+  uint64 count[NSYSHIST][NHBUCKET];
+};
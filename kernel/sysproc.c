@@ -5,8 +5,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "sysinfo.h"
+#include "kmemstat.h"
 
 uint64 acquire_freemem();
 uint64 acquire_nproc();
@@ -24,7 +26,8 @@ sys_exit(void)
 uint64
 sys_getpid(void)
 {
-  return myproc()->pid;
+  // a thread's process is its leader's, like ugetpid() reads.
+  return myproc()->leader->pid;
 }
 
 uint64
@@ -33,6 +36,78 @@ sys_fork(void)
   return fork();
 }
 
+// start a thread at fn(arg) on the user stack whose top is
+// stack, sharing the caller's memory and open files.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+// sleep while the int at addr holds val.
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futexwait(addr, val);
+}
+
+// wake up to n processes sleeping on the int at addr.
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futexwake(addr, n);
+}
+
+// create a shared memory segment of n bytes, returning its id.
+uint64
+sys_shm_create(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0 || n <= 0)
+    return -1;
+  return shmcreate(n);
+}
+
+// map shared memory segment id into the caller.
+uint64
+sys_shm_attach(void)
+{
+  struct shmseg *s;
+  uint64 va;
+  int id;
+
+  if(argint(0, &id) < 0 || (s = shmget(id)) == 0)
+    return -1;
+  if((va = mmapshm(s)) == -1)
+    shmput(s);
+  return va;
+}
+
+uint64
+sys_shm_detach(void)
+{
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  return munmapshm(addr);
+}
+
 uint64
 sys_wait(void)
 {
@@ -64,14 +139,16 @@ sys_sleep(void)
 
   if(argint(0, &n) < 0)
     return -1;
+  ticks0 = getticks();
+  if(n <= 0)
+    return 0;
   acquire(&tickslock);
-  ticks0 = ticks;
   while(ticks - ticks0 < n){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleepuntil(ticks0 + n, &tickslock);
   }
   release(&tickslock);
   return 0;
@@ -92,12 +169,33 @@ sys_kill(void)
 uint64
 sys_uptime(void)
 {
-  uint xticks;
+  return getticks();
+}
+
+// set the scheduling priority of process pid,
+// or of the caller if pid is 0.
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  return setpriority(pid, prio);
+}
+
+uint64
+sys_getpriority(void)
+{
+  int pid;
+
+  if(argint(0, &pid) < 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  return getpriority(pid);
 }
 
 uint64
@@ -111,6 +209,67 @@ sys_trace(void)
   return 0;
 }
 
+// drain up to n events from the trace rings
+// into the struct traceent array at addr.
+uint64
+sys_traceread(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return traceread(addr, n);
+}
+
+// sample every CPU's pc rate times a tick, or stop if rate is 0.
+uint64
+sys_profile(void)
+{
+  int rate;
+
+  if(argint(0, &rate) < 0)
+    return -1;
+  return profstart(rate);
+}
+
+// drain up to n samples from the profiler rings
+// into the struct profsample array at addr.
+uint64
+sys_profread(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return profread(addr, n);
+}
+
+// copy the syscall latency histograms to the struct
+// syshist at addr, and clear them if reset is set.
+uint64
+sys_syshist(void)
+{
+  uint64 addr;
+  int reset;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &reset) < 0)
+    return -1;
+  return syshist(addr, reset);
+}
+
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n, reset;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0 || argint(2, &reset) < 0)
+    return -1;
+  return lockstat(addr, n, reset);
+}
+
 uint64
 sys_info(void)
 {
@@ -126,4 +285,32 @@ sys_info(void)
   if(copyout(p->pagetable, addr, (char *)&info, sizeof(info)) < 0)
     return -1;
   return 0;
-}
\ No newline at end of file
+}
+
+// copy accounting for up to n processes to the
+// struct procinfo array at addr; returns how many.
+uint64
+sys_procinfo(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return procinfo(addr, n);
+}
+
+uint64
+sys_kmemstat(void)
+{
+  struct proc *p = myproc();
+  struct kmemstat st;
+  uint64 addr;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
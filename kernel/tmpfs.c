@@ -0,0 +1,213 @@
+// Tmpfs: a file system held in memory.
+//
+// mount("/tmp", "tmpfs") puts an empty one on /tmp. Files in
+// it never touch the log or the disk, so scratch files cost
+// no more than the pages holding them, and vanish at reboot.
+//
+// Inodes live in tmpfs.inode[], indexed by inode number, and
+// are copied to and from the inode cache like disk inodes. A
+// file's contents are pages listed in a page of pointers, so a
+// file holds at most TMPMAXPG pages. Writes never leave holes
+// (writei() refuses to start past the end), so every page
+// below the size is there.
+//
+// A file's pages are only touched holding its ip->lock, like a
+// disk file's blocks. tmpfs.lock protects allocation of inodes.
+// exec() and mmap() take pages through the page cache as they
+// do for disk files, so writes and truncation keep the page
+// cache's copies up to date too.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "stat.h"
+#include "file.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define TMPMAXPG (PGSIZE / sizeof(char*))  // pages in a file
+
+struct tmpinode {
+  short type;         // 0 if free
+  short major;
+  short minor;
+  short nlink;
+  uint size;
+  char **pages;       // TMPMAXPG page pointers, 0 if there are none
+};
+
+struct {
+  struct spinlock lock;
+  uint dev;           // 0 until mounted
+  struct tmpinode inode[NTMPINODE];
+} tmpfs;
+
+void
+tmpfsinit(void)
+{
+  initlock(&tmpfs.lock, "tmpfs");
+}
+
+static struct tmpinode*
+tmpinode(struct inode *ip)
+{
+  if(ip->inum == 0 || ip->inum >= NTMPINODE)
+    panic("tmpinode");
+  return &tmpfs.inode[ip->inum];
+}
+
+static struct inode*
+tmpialloc(uint dev, short type)
+{
+  struct tmpinode *ti;
+
+  acquire(&tmpfs.lock);
+  for(ti = &tmpfs.inode[1]; ti < &tmpfs.inode[NTMPINODE]; ti++){
+    if(ti->type == 0){
+      memset(ti, 0, sizeof(*ti));
+      ti->type = type;
+      release(&tmpfs.lock);
+      return iget(dev, ti - tmpfs.inode);
+    }
+  }
+  release(&tmpfs.lock);
+  return 0;
+}
+
+static void
+tmpiread(struct inode *ip)
+{
+  struct tmpinode *ti = tmpinode(ip);
+
+  ip->type = ti->type;
+  ip->major = ti->major;
+  ip->minor = ti->minor;
+  ip->nlink = ti->nlink;
+  ip->size = ti->size;
+}
+
+// copy ip back to its tmpinode; type 0 frees it.
+static void
+tmpiupdate(struct inode *ip)
+{
+  struct tmpinode *ti = tmpinode(ip);
+
+  ti->major = ip->major;
+  ti->minor = ip->minor;
+  ti->nlink = ip->nlink;
+  ti->size = ip->size;
+  acquire(&tmpfs.lock);
+  ti->type = ip->type;
+  release(&tmpfs.lock);
+}
+
+static void
+tmpitrunc(struct inode *ip)
+{
+  struct tmpinode *ti = tmpinode(ip);
+  int i;
+
+  if(ti->pages){
+    for(i = 0; i < TMPMAXPG; i++){
+      if(ti->pages[i])
+        kfree(ti->pages[i]);
+    }
+    kfree(ti->pages);
+    ti->pages = 0;
+  }
+  ip->size = 0;
+  tmpiupdate(ip);
+  pcache_inval(ip);
+}
+
+static int
+tmpread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  struct tmpinode *ti = tmpinode(ip);
+  uint tot, m;
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(either_copyout(user_dst, dst, ti->pages[off/PGSIZE] + off%PGSIZE, m) == -1)
+      break;
+  }
+  return tot;
+}
+
+// write to ip, adding pages as needed. returns the number of
+// bytes written, less than n if memory ran out.
+static int
+tmpwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  struct tmpinode *ti = tmpinode(ip);
+  uint tot, m;
+  char **pg;
+
+  if(off > ip->size || off + n < off)
+    return -1;
+  if(off + n > TMPMAXPG*PGSIZE)
+    return -1;
+  if(n > 0 && ti->pages == 0 && (ti->pages = kalloc_zeroed()) == 0)
+    return -1;
+
+  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
+    pg = &ti->pages[off/PGSIZE];
+    if(*pg == 0 && (*pg = kalloc()) == 0)
+      break;
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(either_copyin(*pg + off%PGSIZE, user_src, src, m) == -1)
+      break;
+    pcache_update(ip, off, *pg + off%PGSIZE, m);
+  }
+
+  if(off > ip->size)
+    ip->size = off;
+  tmpiupdate(ip);
+  return tot;
+}
+
+// the root directory of the new tmpfs on dev. there's only
+// one tmpfs.
+static int
+tmpmount(uint dev)
+{
+  struct inode *ip;
+
+  acquire(&tmpfs.lock);
+  if(tmpfs.dev != 0){
+    release(&tmpfs.lock);
+    return -1;
+  }
+  tmpfs.dev = dev;
+  tmpfs.inode[ROOTINO].type = T_DIR;
+  tmpfs.inode[ROOTINO].nlink = 1;
+  release(&tmpfs.lock);
+
+  ip = iget(dev, ROOTINO);
+  ilock(ip);
+  if(dirlink(ip, ".", ROOTINO) < 0 || dirlink(ip, "..", ROOTINO) < 0)
+    panic("tmpmount");
+  iunlockput(ip);
+  return 0;
+}
+
+struct fsops tmpfsops = {
+  .name = "tmpfs",
+  .pcache = 0,
+  .mount = tmpmount,
+  .ialloc = tmpialloc,
+  .iread = tmpiread,
+  .iupdate = tmpiupdate,
+  .itrunc = tmpitrunc,
+  .read = tmpread,
+  .write = tmpwrite,
+};
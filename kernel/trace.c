@@ -0,0 +1,118 @@
+// Kernel event tracing.
+//
+// Traced syscalls (selected by p->trace_mask) and user page
+// faults are recorded into a ring per CPU, which traceread()
+// drains, instead of being printed to the console as they
+// happen.
+//
+// Each ring has one producer, its own CPU, which writes with
+// interrupts off and takes no lock: it fills the entry at head
+// and then advances head. Readers serialize on trace.lock and
+// advance tail once they have copied entries out. When a ring
+// is full new events are dropped and counted, and the reader
+// reports the count as a TRACE_LOST event.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "trace.h"
+
+struct tracering {
+  struct traceent ent[NTRACE];
+  uint64 head;     // next entry to fill; written only by this CPU
+  uint64 tail;     // next entry to read; written only by readers
+  uint64 lost;     // events dropped since the last read
+};
+
+struct {
+  struct spinlock lock;  // serializes readers
+  struct tracering ring[NCPU];
+} trace;
+
+void
+traceinit(void)
+{
+  initlock(&trace.lock, "trace");
+}
+
+// record an event for the current process.
+void
+tracerec(int num, uint64 a0, uint64 a1, uint64 a2, uint64 ret)
+{
+  struct tracering *r;
+  struct traceent *e;
+
+  push_off();
+  r = &trace.ring[cpuid()];
+  if(r->head - r->tail >= NTRACE){
+    __sync_fetch_and_add(&r->lost, 1);
+    pop_off();
+    return;
+  }
+  e = &r->ent[r->head % NTRACE];
+  e->time = r_time();
+  e->pid = myproc()->pid;
+  e->cpu = cpuid();
+  e->num = num;
+  e->arg[0] = a0;
+  e->arg[1] = a1;
+  e->arg[2] = a2;
+  e->ret = ret;
+  __sync_synchronize(); // the entry is complete before head moves past it
+  r->head++;
+  pop_off();
+}
+
+// take up to n entries from ring r into ent[]. caller holds trace.lock.
+static int
+ringtake(struct tracering *r, struct traceent *ent, int n)
+{
+  uint64 head, tail, lost;
+  int i = 0;
+
+  if((lost = __sync_lock_test_and_set(&r->lost, 0)) != 0 && n > 0){
+    memset(&ent[0], 0, sizeof(ent[0]));
+    ent[0].time = r_time();
+    ent[0].cpu = r - trace.ring;
+    ent[0].num = TRACE_LOST;
+    ent[0].ret = lost;
+    i = 1;
+  }
+  head = r->head;
+  __sync_synchronize(); // read entries only after seeing head
+  for(tail = r->tail; i < n && tail != head; i++, tail++)
+    ent[i] = r->ent[tail % NTRACE];
+  __sync_synchronize(); // done with the entries before the producer reuses them
+  r->tail = tail;
+  return i;
+}
+
+// copy up to n trace events to user address addr, draining
+// them from the rings. returns the number copied, or -1.
+int
+traceread(uint64 addr, int n)
+{
+  struct traceent ent[8];
+  int c, m, total = 0;
+
+  for(c = 0; c < NCPU && total < n; ){
+    acquire(&trace.lock);
+    m = n - total;
+    if(m > NELEM(ent))
+      m = NELEM(ent);
+    m = ringtake(&trace.ring[c], ent, m);
+    release(&trace.lock);
+    if(m == 0){
+      c++;
+      continue;
+    }
+    if(copyout(myproc()->pagetable, addr + total*sizeof(ent[0]), (char*)ent, m*sizeof(ent[0])) < 0)
+      return -1;
+    total += m;
+  }
+  return total;
+}
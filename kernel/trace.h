@@ -0,0 +1,12 @@
+// one event from the kernel trace rings, returned by traceread().
+struct traceent {
+  uint64 time;      // time CSR when recorded
+  int pid;
+  int cpu;
+  int num;          // syscall number, TRACE_FAULT or TRACE_LOST
+  uint64 arg[3];    // syscall arguments; scause, stval, epc for a fault
+  uint64 ret;       // syscall return value; events dropped for TRACE_LOST
+};
+
+#define TRACE_FAULT 0     // user page fault, recorded if bit 0 of the mask is set
+#define TRACE_LOST  (-1)  // a ring was full; ret events were dropped
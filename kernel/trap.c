@@ -3,11 +3,25 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "seqlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
-
+#include "trace.h"
+
+// ticks counts TICKCYCLES periods of the time CSR since boot.
+// whichever CPU takes a timer interrupt brings it up to date, so
+// it doesn't depend on any one CPU taking an interrupt every tick.
+// tickslock protects ticks and tickwake. clockintr() also
+// writes ticks under tickseq, so that getticks() can read it
+// without tickslock.
 struct spinlock tickslock;
+static struct seqlock tickseq;
 uint ticks;
+static uint tickwake = ~0;  // earliest tick a sleepuntil() sleeper waits for
+static uint64 boottime;     // time CSR at trapinit()
+
+extern uint64 mscratch0[];  // start.c, read by timervec
 
 extern char trampoline[], uservec[], userret[];
 
@@ -20,6 +34,8 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  initseqlock(&tickseq, "tickseq");
+  boottime = r_time();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -29,6 +45,16 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// count a page fault that usertrap() handled, and trace it
+// if bit 0 of the trace mask asks for faults.
+static void
+pagefaulted(struct proc *p)
+{
+  p->npgfault++;
+  if(p->trace_mask & (1 << TRACE_FAULT))
+    tracerec(TRACE_FAULT, r_scause(), r_stval(), p->trapframe->epc, 0);
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -49,6 +75,9 @@ usertrap(void)
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
+
+  // another thread may be waiting in tlbshootdown().
+  tlbsync(p);
   
   if(r_scause() == 8){
     // system call
@@ -65,6 +94,16 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 15 && cowfault(p->pagetable, r_stval()) == 0){
+    // store to a copy-on-write page
+    pagefaulted(p);
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            lazyfault(p->pagetable, p->sz, r_stval()) == 0){
+    // first touch of a lazily allocated heap page
+    pagefaulted(p);
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmresolved(p->pagetable, r_stval(), r_scause())){
+    // another thread of p's got there first
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,6 +115,10 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
+  // pages cowfault() couldn't free while holding a lock.
+  if(p->leader->ntlbfree > 0)
+    tlbshootdown();
+
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2)
     yield();
@@ -106,6 +149,12 @@ usertrapret(void)
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
+  // publish ticks for uuptime(), and the CPU for ugetcpu(); a
+  // process spinning in user space still comes through here on
+  // every timer interrupt.
+  p->leader->usyscall->ticks = ticks;
+  p->leader->usyscall->cpu = cpuid();
+
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
   
@@ -125,7 +174,7 @@ usertrapret(void)
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->tfva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -143,12 +192,19 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if(scause == 13 && copyinfault(r_stval()) == 0){
+    // copyin_new()读到了专属内核页表中还没有映射的用户页
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
+  // another thread may be waiting in tlbshootdown(); ack on
+  // every timer interrupt, the profiling ones too.
+  if((which_dev == 2 || which_dev == 3) && myproc() != 0)
+    tlbsync(myproc());
+
   // give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
     yield();
@@ -162,15 +218,120 @@ kerneltrap()
 void
 clockintr()
 {
+  uint t;
+
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  t = (r_time() - boottime) / TICKCYCLES;
+  if(t > ticks){
+    seqwritebegin(&tickseq);
+    ticks = t;
+    seqwriteend(&tickseq);
+  }
+  if(ticks >= tickwake)
+    tickwake = wakeupticks(ticks);
   release(&tickslock);
 }
 
+// read ticks without taking tickslock, for callers that only
+// want the time and don't sleep on it.
+uint
+getticks(void)
+{
+  uint s, t;
+
+  do {
+    s = seqreadbegin(&tickseq);
+    t = ticks;
+  } while(seqreadretry(&tickseq, s));
+  return t;
+}
+
+// sleep until ticks reaches t. the caller holds lk, which is
+// released while asleep. clockintr() wakes the sleeper only
+// once t has passed, so CPUs don't have to tick for it before.
+void
+sleepuntil(uint t, struct spinlock *lk)
+{
+  if(lk != &tickslock){
+    acquire(&tickslock);
+    release(lk);
+  }
+  myproc()->wakeat = t;
+  if(t < tickwake)
+    tickwake = t;
+  sleep(&ticks, &tickslock);
+  if(lk != &tickslock){
+    release(&tickslock);
+    acquire(lk);
+  }
+}
+
+// ask for this CPU's next timer interrupt at time when.
+// only the scheduler calls this: it runs on the global
+// kernel page table, which maps the CLINT.
+// interrupts must be off.
+static void
+timerset(uint64 when)
+{
+  int id = cpuid();
+
+  mscratch0[32*id + 6] = when;
+  *(uint64*)CLINT_MTIMECMP(id) = when;
+}
+
+// this CPU is about to run a process: make sure it gets
+// a timer interrupt within a tick, to preempt it.
+void
+timerbusy(void)
+{
+  uint64 when = r_time() + TICKCYCLES;
+
+  if(mscratch0[32*cpuid() + 6] > when)
+    timerset(when);
+}
+
+// have busy CPUs take a timer interrupt every cycles, from
+// their next one on. profstart() asks for more than one a tick.
+void
+timerinterval(uint64 cycles)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    mscratch0[32*i + 5] = cycles;
+}
+
+// this CPU has nothing to run: put its timer interrupt
+// off until the earliest sleepuntil() deadline, if any.
+// a busy CPU that sets an earlier one handles it itself.
+void
+timeridle(void)
+{
+  uint64 when = ~0UL;
+
+  acquire(&tickslock);
+  if(tickwake != ~0U)
+    when = boottime + (uint64)tickwake * TICKCYCLES;
+  release(&tickslock);
+  timerset(when);
+}
+
+// wake CPU id, which is idle in the scheduler's wfi with its
+// timer put off: move its deadline and mtimecmp into the past,
+// so timervec there raises a software interrupt right away.
+// any CPU may call this, through the KCLINT alias.
+void
+timerkick(int id)
+{
+  mscratch0[32*id + 6] = 0;
+  __sync_synchronize();
+  *(uint64*)KCLINT_MTIMECMP(id) = 0;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
+// 3 if a timer interrupt that shouldn't preempt,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -188,7 +349,9 @@ devintr()
     if(irq == UART0_IRQ){
       uartintr();
     } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+      virtio_disk_intr(0);
+    } else if(irq == VIRTIO1_IRQ){
+      virtio_disk_intr(1);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
@@ -202,16 +365,19 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // forwarded by timervec in kernelvec.S once this CPU's
+    // deadline passed. timervec has set the next one a tick on.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    clockintr();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // while profiling, timer interrupts come more often
+    // than time slices end.
+    if(profintr() == 0)
+      return 3;
     return 2;
   } else {
     return 0;
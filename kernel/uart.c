@@ -7,6 +7,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -33,19 +34,23 @@
 #define LCR_BAUD_LATCH (1<<7) // special mode to set baud rate
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
-#define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define LSR_TX_IDLE (1<<5)    // THR, and with FIFOs on the whole transmit FIFO, is empty
+
+#define UART_TX_FIFO 16       // bytes the 16550a transmit FIFO holds
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// the transmit output buffer.
+// the transmit output buffer. the indices run freely;
+// uart_tx_w - uart_tx_r bytes are waiting to be sent.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 1024 // power of two
 char uart_tx_buf[UART_TX_BUF_SIZE];
-int uart_tx_w; // write next to uart_tx_buf[uart_tx_w++]
-int uart_tx_r; // read next from uart_tx_buf[uar_tx_r++]
+uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
+uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
 
 extern volatile int panicked; // from printf.c
+extern volatile int panicking; // from printf.c
 
 void uartstart();
 
@@ -77,15 +82,17 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
+// add n bytes from buf to the output buffer and tell the
 // UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
-// from interrupts; it's only suitable for use
-// by write().
+// from interrupts or with other spinlocks held;
+// it's only suitable for use by write().
 void
-uartputc(int c)
+uartwrite(char *buf, int n)
 {
+  int i = 0;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
@@ -93,25 +100,64 @@ uartputc(int c)
       ;
   }
 
-  while(1){
-    if(((uart_tx_w + 1) % UART_TX_BUF_SIZE) == uart_tx_r){
+  while(i < n){
+    if(uart_tx_w - uart_tx_r == UART_TX_BUF_SIZE){
       // buffer is full.
       // wait for uartstart() to open up space in the buffer.
       sleep(&uart_tx_r, &uart_tx_lock);
-    } else {
-      uart_tx_buf[uart_tx_w] = c;
-      uart_tx_w = (uart_tx_w + 1) % UART_TX_BUF_SIZE;
-      uartstart();
-      release(&uart_tx_lock);
-      return;
+      continue;
     }
+    while(i < n && uart_tx_w - uart_tx_r < UART_TX_BUF_SIZE)
+      uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = buf[i++];
+    uartstart();
   }
+
+  release(&uart_tx_lock);
+}
+
+void
+uartputc(int c)
+{
+  char cc = c;
+
+  uartwrite(&cc, 1);
+}
+
+// add a character to the output buffer without sleeping,
+// for kernel printf() and to echo characters. if the
+// buffer is full, spin feeding the UART from it until
+// there's room. keeps printf() output in order with what
+// write() has queued. a panic, or a printf() from inside
+// this driver, goes out synchronously instead.
+void
+uartputc_nosleep(int c)
+{
+  if(panicking || holding(&uart_tx_lock)){
+    uartputc_sync(c);
+    return;
+  }
+
+  acquire(&uart_tx_lock);
+
+  if(panicked){
+    for(;;)
+      ;
+  }
+
+  while(uart_tx_w - uart_tx_r == UART_TX_BUF_SIZE){
+    while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
+      ;
+    uartstart();
+  }
+  uart_tx_buf[uart_tx_w++ % UART_TX_BUF_SIZE] = c;
+  uartstart();
+
+  release(&uart_tx_lock);
 }
 
 // alternate version of uartputc() that doesn't 
-// use interrupts, for use by kernel printf() and
-// to echo characters. it spins waiting for the uart's
-// output register to be empty.
+// use interrupts, for use by panic(). it spins waiting
+// for the uart's output register to be empty.
 void
 uartputc_sync(int c)
 {
@@ -130,13 +176,17 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// if the UART is idle, and characters are waiting
+// in the transmit buffer, send them: once the transmit
+// FIFO is empty it takes UART_TX_FIFO bytes without
+// further checks, so fill it.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
+  int i;
+
   while(1){
     if(uart_tx_w == uart_tx_r){
       // transmit buffer is empty.
@@ -144,19 +194,17 @@ uartstart()
     }
     
     if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
+      // the UART transmit FIFO still holds bytes,
+      // so we don't know how many more it can take.
+      // it will interrupt when it's empty.
       return;
     }
     
-    int c = uart_tx_buf[uart_tx_r];
-    uart_tx_r = (uart_tx_r + 1) % UART_TX_BUF_SIZE;
+    for(i = 0; i < UART_TX_FIFO && uart_tx_r != uart_tx_w; i++)
+      WriteReg(THR, uart_tx_buf[uart_tx_r++ % UART_TX_BUF_SIZE]);
     
-    // maybe uartputc() is waiting for space in the buffer.
+    // maybe uartwrite() is waiting for space in the buffer.
     wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
   }
 }
 
@@ -0,0 +1,8 @@
+// Buffers for readv() and writev().
+
+#define IOV_MAX 64    // most buffers in one call
+
+struct iovec {
+  uint64 base;      // user address of the buffer
+  uint len;         // its length in bytes
+};
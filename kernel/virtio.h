@@ -27,6 +27,10 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
+
+// virtio_blk_config fields, from VIRTIO_MMIO_CONFIG
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES	(VIRTIO_MMIO_CONFIG + 34) // uint16, with VIRTIO_BLK_F_MQ
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -45,7 +49,15 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// with indirect descriptors each request takes one,
+// without them three.
+#define NUM 64
+
+// disks: the file system's, and swap space.
+#define NVDISK 2
+
+// most request queues used on a disk; one per CPU.
+#define NVQUEUE NCPU
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +67,7 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -69,4 +82,5 @@ struct UsedArea {
   uint16 flags;
   uint16 id;
   struct VRingUsedElem elems[NUM];
+  uint16 avail_event; // with VIRTIO_RING_F_EVENT_IDX
 };
@@ -3,7 +3,23 @@
 // uses qemu's mmio interface to virtio.
 // qemu presents a "legacy" virtio interface.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=3
+//
+// disk 0 holds the file system, and must be there. disk 1, at
+// the next mmio slot, is swap space if present (see swap.c);
+// it is read and written by virtio_disk_rwraw() a page at a
+// time, without the buffer cache.
+//
+// a disk that offers VIRTIO_BLK_F_MQ (qemu's num-queues=) gets
+// up to NVQUEUE request queues, each with its own lock, and
+// each CPU submits to its own, so CPUs reading and writing at
+// once don't wait for each other. the device still has a
+// single interrupt, whose handler drains every queue. with
+// VIRTIO_RING_F_EVENT_IDX, the device is only notified when it
+// may have stopped looking at a queue, and only interrupts
+// when the driver has caught up with the completions, so a
+// burst of requests costs a few exits and interrupts instead
+// of one each.
 //
 
 #include "types.h"
@@ -17,108 +33,170 @@
 #include "buf.h"
 #include "virtio.h"
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+// the address of virtio mmio register r of disk d.
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
 
-static struct disk {
- // memory for virtio descriptors &c for queue 0.
- // this is a global instead of allocated because it must
- // be multiple contiguous pages, which kalloc()
- // doesn't support, and page aligned.
-  char pages[2*PGSIZE];
+// one request queue of a disk.
+struct vqueue {
+ // memory for virtio descriptors &c for the queue:
+ // two physically contiguous pages, from kalloc_pages().
+  char *pages;
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used[2..NUM] (not wrapped at NUM).
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;    // or 0 for a request from virtio_disk_rwraw()
+    char *done;       // which sets *done when it finishes
     char status;
   } info[NUM];
-  
-  struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
 
-void
-virtio_disk_init(void)
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_outhdr {
+    uint32 type;
+    uint32 reserved;
+    uint64 sector;
+  } ops[NUM];
+
+  // indirect descriptor tables, one per ring descriptor.
+  struct VRingDesc ind[NUM][3];
+
+  struct spinlock lock;
+  int n;            // queue number, for VIRTIO_MMIO_QUEUE_NOTIFY
+};
+
+struct disk {
+  struct vqueue q[NVQUEUE];
+  int nq;           // queues in use
+  int indirect;     // did the device accept VIRTIO_RING_F_INDIRECT_DESC?
+  int eventidx;     // did the device accept VIRTIO_RING_F_EVENT_IDX?
+  uint64 base;      // mmio registers, 0 if there's no such disk
+  uint64 capacity;  // 512-byte sectors
+};
+
+static struct disk disk[NVDISK];
+
+// set up the disk whose registers are at base.
+// returns -1 if there's no virtio disk there.
+static int
+vdinit(struct disk *d, uint64 base)
 {
   uint32 status = 0;
+  struct vqueue *q;
+  int n;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  d->base = base;
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 1 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
+  if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+     *R(d, VIRTIO_MMIO_VERSION) != 1 ||
+     *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+     *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+    d->base = 0;
+    return -1;
   }
   
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  d->indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  d->eventidx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+  d->nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    d->nq = *(volatile uint16 *)R(d, VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if(d->nq > NVQUEUE)
+      d->nq = NVQUEUE;
+    if(d->nq < 1)
+      d->nq = 1;
+  }
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
-
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+
+  *R(d, VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+
+  // initialize the queues.
+  for(n = 0; n < d->nq; n++){
+    q = &d->q[n];
+    initlock(&q->lock, "virtio_disk");
+    q->n = n;
+    *R(d, VIRTIO_MMIO_QUEUE_SEL) = n;
+    uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if(max == 0)
+      panic("virtio disk has no queue");
+    if(max < NUM)
+      panic("virtio disk max queue too short");
+    *R(d, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+    if((q->pages = kalloc_pages(1)) == 0)
+      panic("virtio disk: no memory for queue");
+    memset(q->pages, 0, 2*PGSIZE);
+    *R(d, VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
+
+    // desc = pages -- num * VRingDesc
+    // avail = pages + 0x40 -- 2 * uint16, then num * uint16, then used_event
+    // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem, then avail_event
+
+    q->desc = (struct VRingDesc *) q->pages;
+    q->avail = (uint16*)(((char*)q->desc) + NUM*sizeof(struct VRingDesc));
+    q->used = (struct UsedArea *) (q->pages + PGSIZE);
+
+    for(int i = 0; i < NUM; i++)
+      q->free[i] = 1;
+  }
 
-  // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // the capacity is the first field of the block device's config.
+  d->capacity = *(volatile uint64 *)R(d, VIRTIO_MMIO_CONFIG);
 
-  disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
+  // plic.c and trap.c arrange for interrupts from VIRTIOn_IRQ.
+  return 0;
+}
 
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+void
+virtio_disk_init(void)
+{
+  if(vdinit(&disk[0], VIRTIO0) < 0)
+    panic("could not find virtio disk");
+  vdinit(&disk[1], VIRTIO1); // optional
+}
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+// the size in bytes of disk n, 0 if there's no such disk.
+uint64
+virtio_disk_size(int n)
+{
+  if(n < 0 || n >= NVDISK || disk[n].base == 0)
+    return 0;
+  return disk[n].capacity * 512;
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vqueue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -127,144 +205,278 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vqueue *q, int i)
 {
   if(i >= NUM)
     panic("virtio_disk_intr 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("virtio_disk_intr 2");
-  disk.desc[i].addr = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->free[i] = 1;
+  wakeup(&q->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vqueue *q, int i)
 {
   while(1){
-    free_desc(i);
-    if(disk.desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk.desc[i].next;
+    free_desc(q, i);
+    if(q->desc[i].flags & VRING_DESC_F_NEXT)
+      i = q->desc[i].next;
     else
       break;
   }
 }
 
 static int
-alloc3_desc(int *idx)
+alloc3_desc(struct vqueue *q, int *idx)
 {
   for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// the queue the current CPU submits to.
+static struct vqueue*
+myqueue(struct disk *d)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  int id;
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  push_off();
+  id = cpuid();
+  pop_off();
+  return &d->q[id % d->nq];
+}
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-  
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+// does the device want to hear that the avail (or used)
+// index has moved from old to new, given that it asked to
+// be told once it passes event? from the virtio spec.
+static int
+need_event(uint16 event, uint16 new, uint16 old)
+{
+  return (uint16)(new - event - 1) < (uint16)(new - old);
+}
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+// fill in the three descriptors of a request to transfer len
+// bytes at data from or to sector: one for type/reserved/sector,
+// one for the data, one for a 1-byte status result. desc[] is
+// either a chain in q's ring, linked through next[], or an
+// indirect table.
+static void
+fill_desc(struct vqueue *q, struct VRingDesc *d, uint16 *next, int head,
+          uint64 sector, void *data, uint len, int write)
+{
+  struct virtio_blk_outhdr *buf0 = &q->ops[head];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  // disk is in the direct-mapped kernel data, so buf0's
+  // virtual address is its physical address.
+  d[next[0]].addr = (uint64) buf0;
+  d[next[0]].len = sizeof(*buf0);
+  d[next[0]].flags = VRING_DESC_F_NEXT;
+  d[next[0]].next = next[1];
+
+  d[next[1]].addr = (uint64) data;
+  d[next[1]].len = len;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    d[next[1]].flags = 0; // device reads data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    d[next[1]].flags = VRING_DESC_F_WRITE; // device writes data
+  d[next[1]].flags |= VRING_DESC_F_NEXT;
+  d[next[1]].next = next[2];
+
+  q->info[head].status = 0xff; // device writes 0 on success
+  d[next[2]].addr = (uint64) &q->info[head].status;
+  d[next[2]].len = 1;
+  d[next[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[next[2]].next = 0;
+}
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+// queue a request to transfer len bytes at data from or to
+// sector of disk d on its queue q, on behalf of b if it is a
+// buffer's, or of whoever waits for *done otherwise. caller
+// holds q->lock; may sleep until a descriptor is free.
+static void
+submit(struct disk *d, struct vqueue *q, uint64 sector, void *data, uint len,
+       int write, struct buf *b, char *done)
+{
+  int idx[3], head;
+  uint16 old;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // allocate the descriptors: one that points to
+  // an indirect table, or a chain of three.
+  while(1){
+    if(d->indirect){
+      if((idx[0] = alloc_desc(q)) >= 0)
+        break;
+    } else if(alloc3_desc(q, idx) == 0) {
+      break;
+    }
+    sleep(&q->free[0], &q->lock);
+  }
+  head = idx[0];
+
+  // format the descriptors.
+  // qemu's virtio-blk.c reads them.
+  if(d->indirect){
+    uint16 next[3] = { 0, 1, 2 };
+    fill_desc(q, q->ind[head], next, head, sector, data, len, write);
+    q->desc[head].addr = (uint64) q->ind[head];
+    q->desc[head].len = sizeof(q->ind[head]);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  } else {
+    uint16 next[3] = { idx[0], idx[1], idx[2] };
+    fill_desc(q, q->desc, next, head, sector, data, len, write);
+  }
+
+  // record the request for virtio_disk_intr().
+  q->info[head].b = b;
+  q->info[head].done = done;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  old = q->avail[1];
+  q->avail[2 + (old % NUM)] = head;
+  __sync_synchronize();
+  q->avail[1] = old + 1;
   __sync_synchronize();
-  disk.avail[1] = disk.avail[1] + 1;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // a device still working through the queue will find this
+  // request without being told.
+  if(!d->eventidx || need_event(q->used->avail_event, old + 1, old))
+    *R(d, VIRTIO_MMIO_QUEUE_NOTIFY) = q->n; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// start reading or writing b, and return without waiting;
+// call virtio_disk_wait(b) to wait for it to finish. b's
+// data must not be touched in between.
+// may sleep until a descriptor is free.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  struct disk *d = &disk[0];
+  struct vqueue *q = myqueue(d);
+
+  acquire(&q->lock);
+  b->disk = 1;
+  b->vq = q->n;
+  submit(d, q, b->blockno * (BSIZE / 512), b->data, BSIZE, write, b, 0);
+  release(&q->lock);
+}
+
+// wait for a request started by virtio_disk_submit() to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct vqueue *q = &disk[0].q[b->vq];
+
+  acquire(&q->lock);
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &q->lock);
   }
+  release(&q->lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
-  release(&disk.vdisk_lock);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
 }
 
+// read or write len bytes at data from or to byte offset off
+// of disk n, a multiple of 512, and wait for it to finish.
 void
-virtio_disk_intr()
+virtio_disk_rwraw(int n, void *data, uint len, uint64 off, int write)
+{
+  struct disk *d = &disk[n];
+  struct vqueue *q;
+  char done = 0;
+
+  if(d->base == 0 || off % 512 != 0)
+    panic("virtio_disk_rwraw");
+  q = myqueue(d);
+  acquire(&q->lock);
+  submit(d, q, off / 512, data, len, write, 0, &done);
+  while(!done)
+    sleep(&done, &q->lock);
+  release(&q->lock);
+}
+
+// finish the requests the device has completed on q.
+static void
+drain(struct disk *d, struct vqueue *q)
 {
-  acquire(&disk.vdisk_lock);
+  acquire(&q->lock);
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  // the device may complete more than one request per
+  // interrupt, even a whole ring's worth, so compare the
+  // unwrapped 16-bit indices.
+  while(q->used_idx != q->used->id){
+    __sync_synchronize();
+    int id = q->used->elems[q->used_idx % NUM].id;
 
-    if(disk.info[id].status != 0)
+    if(q->info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+    struct buf *b = q->info[id].b;
+    char *done = q->info[id].done;
+    q->info[id].b = 0;
+    q->info[id].done = 0;
+    free_chain(q, id);
+    if(b == 0){
+      *done = 1;   // virtio_disk_rwraw() is waiting
+      wakeup(done);
+    } else {
+      b->disk = 0;   // disk is done with buf
+      if(b->async)
+        bdone(b);    // nobody is waiting; release it
+      else
+        wakeup(b);
+    }
+
+    q->used_idx += 1;
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+    if(d->eventidx){
+      // interrupt again once there's something past here;
+      // look once more in case it already is.
+      q->avail[2 + NUM] = q->used_idx; // used_event
+      __sync_synchronize();
+    }
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
-  release(&disk.vdisk_lock);
+  release(&q->lock);
+}
+
+void
+virtio_disk_intr(int n)
+{
+  struct disk *d = &disk[n];
+
+  if(d->base == 0)
+    return;
+
+  // acknowledge first: completions from here on will raise
+  // the interrupt again.
+  *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  __sync_synchronize();
+
+  for(int i = 0; i < d->nq; i++)
+    drain(d, &d->q[i]);
 }
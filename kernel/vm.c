@@ -6,10 +6,13 @@
 #include "defs.h"
 #include "fs.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 
 void vmprint(pagetable_t pagetable, uint64 depth);
-void ukvmmap(pagetable_t kpagetable, uint64 va, uint64 pa, uint64 sz, int perm);
+static void ukvmsync(pagetable_t pagetable, uint64 va, uint64 pa, int perm);
+static void ptcount(pagetable_t root, int n);
+static void vmbind(pagetable_t root, struct vmacct *a, int kernel);
 /*
  * the kernel's page table.
  */
@@ -19,23 +22,27 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// 硬件支持的最大ASID，0表示不支持ASID，每次切换页表都要刷新TLB
+static uint64 asidmax;
+
 /*
  * 为内核创建一个直接映射的页
  */
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t) kalloc(); // 分配内存以存储内核页表
-  memset(kernel_pagetable, 0, PGSIZE); // 将分配的内存清零
+  kernel_pagetable = (pagetable_t) kalloc_zeroed(); // 分配清零的内存以存储内核页表
 
   // uart寄存器
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W); // 将UART0映射到页表
 
   // virtio mmio磁盘接口
   kvmmap(VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W); // 将VIRTIO0映射到页表
+  kvmmap(VIRTIO1, VIRTIO1, PGSIZE, PTE_R | PTE_W); // 交换盘，可能不存在
 
   // CLINT
   kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W); // 将CLINT映射到页表
+  kvmmap(KCLINT, CLINT, 0x10000, PTE_R | PTE_W); // 进程内核页表也能看到的别名，见timerkick()
 
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W); // 将PLIC映射到页表
@@ -52,36 +59,34 @@ kvminit()
 
 /*
  * 为进程创建一个专属内核页
+ * 内核代码和数据、trampoline和内核栈所在的顶层表项直接共享kernel_pagetable的子树，
+ * 只有用户地址所在的第一个1GB区域有进程私有的二级页表：其中PLIC及以上
+ * （PLIC、UART0、VIRTIO0、VIRTIO1）的表项指向kernel_pagetable的三级页表，
+ * PLIC以下留给用户内存的镜像。这里的CLINT只有机器模式和运行在kernel_pagetable上的
+ * 调度程序（timerset()）访问，不再映射；其他地方通过共享的KCLINT别名访问。
+ * 因此kernel_pagetable在第一个进程创建之前必须已经完整（见procinit()）。
+ * 私有的页表页记入a->nkpt。
  */
 pagetable_t
-ukvminit()
+ukvminit(struct vmacct *a)
 {
-  pagetable_t kpagetable = (pagetable_t) kalloc(); // 分配内存以存储内核页表
-    if (kpagetable == 0) {
-    return kpagetable;
-  }
-  memset(kpagetable, 0, PGSIZE); // 将分配的内存清零
-
-  // uart寄存器
-  ukvmmap(kpagetable, UART0, UART0, PGSIZE, PTE_R | PTE_W); // 将UART0映射到页表
-
-  // virtio mmio磁盘接口
-  ukvmmap(kpagetable, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W); // 将VIRTIO0映射到页表
-
-  // CLINT
-  ukvmmap(kpagetable, CLINT, CLINT, 0x10000, PTE_R | PTE_W); // 将CLINT映射到页表
-
-  // PLIC
-  ukvmmap(kpagetable, PLIC, PLIC, 0x400000, PTE_R | PTE_W); // 将PLIC映射到页表
+  pagetable_t kpagetable, l1;
+  pagetable_t kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
 
-  // 映射内核文本（可执行且只读）
-  ukvmmap(kpagetable, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X); // 将内核代码映射
-
-  // 映射内核数据和我们将使用的物理内存RAM
-  ukvmmap(kpagetable, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W); // 映射内核数据区
+  if((kpagetable = (pagetable_t) kalloc_zeroed()) == 0) // 分配清零的内存以存储内核页表
+    return 0;
+  if((l1 = (pagetable_t) kalloc_zeroed()) == 0){
+    kfree(kpagetable);
+    return 0;
+  }
 
-  // 为陷阱入口/出口映射trampoline到内核中的最高虚拟地址
-  ukvmmap(kpagetable, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X); // 映射trampoline代码
+  for(int i = PX(1, PLIC); i < 512; i++)
+    l1[i] = kl1[i];
+  kpagetable[0] = PA2PTE(l1) | PTE_V;
+  for(int i = 1; i < 512; i++)
+    kpagetable[i] = kernel_pagetable[i];
+  vmbind(kpagetable, a, 1);
+  ptcount(kpagetable, 1); // l1
   return kpagetable;
 }
 
@@ -89,22 +94,199 @@ ukvminit()
   * void kvminithart()
   * @brief： 切换到内核页表并启用分页。
   * @brief： Switch h/w page table register to the kernel's page table,and enable paging.
+  *          同时探测satp中可写的ASID位数。
   * @param： 无
   * @retval： 无
   */
 void
 kvminithart()
 {
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);  // 未实现的ASID位读出为0
+  asidmax = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
   w_satp(MAKE_SATP(kernel_pagetable));  // 设置页表寄存器为内核页表。
   sfence_vma();  // 刷新虚拟地址映射。
 }
 
 // refresh the TLB to refer the page as virtual memory mapping table
+// 保留当前的ASID，用于修改了正在使用的进程内核页表之后
 void ukvminithard(pagetable_t page) {
-  w_satp(MAKE_SATP(page));
+  w_satp(MAKE_SATP(page) | (r_satp() & SATP_ASID_MASK));
   sfence_vma();
 }
 
+/**
+  * void ukvmswitch(struct proc *p)
+  * @brief： 调度器切换到进程p的专属内核页表，只有ASID被回收时才刷新TLB。
+  * @brief： ASID按CPU分配：每个CPU的ASID在一代（generation）中只分配一次，
+  *          用完后代数加一并刷新整个TLB，旧代的ASID全部作废。进程换到另一个
+  *          CPU上运行时在那里重新分配，因此以前CPU上残留的TLB项永远不会被使用。
+  *          进程修改自己的页表时只在当前CPU上刷新（ukvminithard()），这正是
+  *          它的ASID唯一有效的CPU。共享页表的线程由tlbshootdown()通知，
+  *          没有运行的线程在这里发现之后刷新。ASID 0留给kernel_pagetable和用户页表，
+  *          trampoline.S在两者之间切换时总是刷新TLB。
+  *          调用者必须关中断。
+  * @param： p - 将要运行的进程
+  * @retval： 无
+  */
+void
+ukvmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int id = cpuid();
+  int flush = 0;
+
+  // 线程组的其他线程在p不运行时修改了共享的页表，见tlbshootdown()
+  if(p->tlbseen != p->leader->tlbgen){
+    p->tlbseen = p->leader->tlbgen;
+    flush = 1;
+  }
+
+  if(asidmax == 0){
+    w_satp(MAKE_SATP(p->kpagetable));
+    sfence_vma();
+    return;
+  }
+
+  if(p->asid_cpu != id || p->asid_gen != c->asid_gen){
+    if(c->asid_next == 0 || c->asid_next > asidmax){
+      c->asid_gen++;
+      c->asid_next = 1;
+      flush = 1;
+    }
+    p->asid = c->asid_next++;
+    p->asid_gen = c->asid_gen;
+    p->asid_cpu = id;
+  }
+  w_satp(MAKE_SATP(p->kpagetable) | (p->asid << SATP_ASID_SHIFT));
+  if(flush)
+    sfence_vma();
+}
+
+/**
+  * void kvmswitch()
+  * @brief： 调度器从进程切换回kernel_pagetable（ASID 0）。
+  *          kernel_pagetable在启动后不再修改，有ASID时不需要刷新TLB。
+  * @param： 无
+  * @retval： 无
+  */
+void
+kvmswitch(void)
+{
+  w_satp(MAKE_SATP(kernel_pagetable));
+  if(asidmax == 0)
+    sfence_vma();
+}
+
+/*
+ * 页表占用的统计
+ * xv6只用Sv39地址空间的低半部分，根页表中256..511项对应的地址永远不会
+ * 被访问。第PTACCT项存放页表所属的struct vmacct的地址：它按8字节对齐，
+ * V位为0，硬件只会把它当作无效的表项。再用PTACCT_K位标记进程的专属内核页表。
+ * 绑定在vmbind()中完成，之后分配和释放页表页、映射和移除用户页时都按根页表
+ * 找到统计结构更新计数；kernel_pagetable没有绑定，不统计。
+ */
+#define PTACCT   511
+#define PTACCT_K 2
+
+/**
+  * static struct vmacct *acctof(pagetable_t root, int *kernel)
+  * @brief： 返回根页表root绑定的统计结构，*kernel为1表示它是专属内核页表。
+  * @param： root - 根页表； kernel - 返回页表的种类。
+  * @retval： 统计结构，没有绑定时返回0。
+  */
+static struct vmacct *
+acctof(pagetable_t root, int *kernel)
+{
+  *kernel = (root[PTACCT] & PTACCT_K) != 0;
+  return (struct vmacct *)(root[PTACCT] & ~(uint64)PTACCT_K);
+}
+
+/**
+  * static void ptcount(pagetable_t root, int n)
+  * @brief： 根页表为root的页表的页表页增加n页（n可以为负）。
+  * @param： root - 根页表； n - 页数。
+  * @retval： 无
+  */
+static void
+ptcount(pagetable_t root, int n)
+{
+  struct vmacct *a;
+  int kernel;
+
+  if((a = acctof(root, &kernel)) != 0)
+    __sync_fetch_and_add(kernel ? &a->nkpt : &a->nupt, n);
+}
+
+/**
+  * static void vmbind(pagetable_t root, struct vmacct *a, int kernel)
+  * @brief： 把刚分配的根页表root的统计记入a，根页表自己算一页。
+  *          槽位复用页表骨架时绑定一直有效（见freeproc()）。
+  * @param： root - 根页表； a - 统计结构； kernel - 是否为专属内核页表。
+  * @retval： 无
+  */
+static void
+vmbind(pagetable_t root, struct vmacct *a, int kernel)
+{
+  root[PTACCT] = (uint64)a | (kernel ? PTACCT_K : 0);
+  ptcount(root, 1);
+}
+
+/**
+  * void vmrss(pagetable_t root, uint64 va, int n)
+  * @brief： 用户页表root在va处映射的用户页增加n页（n可以为负）。
+  *          PLIC以上的trampoline、trapframe和usyscall页不算，
+  *          专属内核页表里的镜像也不算。
+  * @param： root - 根页表； va - 虚拟地址； n - 页数。
+  * @retval： 无
+  */
+void
+vmrss(pagetable_t root, uint64 va, int n)
+{
+  struct vmacct *a;
+  int kernel;
+
+  if((a = acctof(root, &kernel)) != 0 && !kernel && va < PLIC)
+    __sync_fetch_and_add(&a->nrss, n);
+}
+
+/**
+  * pte_t * walklevel(pagetable_t pagetable, uint64 va, int alloc, int level, int *lvl)
+  * @brief： 查找虚拟地址va在第level级页表中的页表项。
+  * @brief： 途中遇到更高级别的叶子（大页）时直接返回它。
+  *          *lvl（不为0时）返回所找到的页表项所在的级别。
+  * @param： pagetable - 页表； va - 虚拟地址； alloc - 是否分配新的页表页；
+  *          level - 目标级别； lvl - 返回实际级别。
+  * @retval： 对应PTE的地址，若未找到则返回0。
+  */
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level, int *lvl)
+{
+  pagetable_t root = pagetable;
+
+  if(va >= MAXVA) // 检查虚拟地址是否超出最大值
+    panic("walk"); // 报错并终止
+
+  for(int l = 2; l > level; l--) { // 遍历页表层级
+    pte_t *pte = &pagetable[PX(l, va)]; // 获取当前层级的PTE
+    if(*pte & PTE_V) { // 如果PTE有效
+      if(PTE_LEAF(*pte)) { // 大页，没有下一层
+        if(lvl)
+          *lvl = l;
+        return pte;
+      }
+      pagetable = (pagetable_t)PTE2PA(*pte); // 进入下一层页表
+    } else {
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0) // 如果需要分配且分配失败
+        return 0; // 返回0表示未找到
+      *pte = PA2PTE(pagetable) | PTE_V; // 设置PTE为新分配的页表页并标记为有效
+      ptcount(root, 1);
+    }
+  }
+  if(lvl)
+    *lvl = level;
+  return &pagetable[PX(level, va)]; // 返回目标层级的PTE
+}
+
 /**
   * pte_t * walk(pagetable_t pagetable, uint64 va, int alloc)
   * @brief： 查找虚拟地址va在页表中的页表项（PTE）。
@@ -120,33 +302,23 @@ void ukvminithard(pagetable_t page) {
              //   21..29 -- 9 bits of level-1 index.
              //   12..20 -- 9 bits of level-0 index.
              //    0..11 -- 12 bits of byte offset within the page.
+             //
+             // If va is covered by a level-1 megapage, the
+             // megapage's PTE is returned.
   * @param： pagetable - 页表； va - 虚拟地址； alloc - 是否分配新的页表页。
   * @retval： 对应PTE的地址，若未找到则返回0。
   */
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
-  if(va >= MAXVA) // 检查虚拟地址是否超出最大值
-    panic("walk"); // 报错并终止
-
-  for(int level = 2; level > 0; level--) { // 遍历页表层级
-    pte_t *pte = &pagetable[PX(level, va)]; // 获取当前层级的PTE
-    if(*pte & PTE_V) { // 如果PTE有效
-      pagetable = (pagetable_t)PTE2PA(*pte); // 进入下一层页表
-    } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0) // 如果需要分配且分配失败
-        return 0; // 返回0表示未找到
-      memset(pagetable, 0, PGSIZE); // 清空分配的页表页
-      *pte = PA2PTE(pagetable) | PTE_V; // 设置PTE为新分配的页表页并标记为有效
-    }
-  }
-  return &pagetable[PX(0, va)]; // 返回最终层级的PTE
+  return walklevel(pagetable, va, alloc, 0, 0);
 }
 
 /**
   * uint64 walkaddr(pagetable_t pagetable, uint64 va)
   * @brief： 查找虚拟地址va对应的物理地址。
   * @brief： Can only be used to look up user pages.
+  *          懒分配还未访问过的页会在这里分配，使copyin/copyout可以直接使用。
   * @param： pagetable - 页表； va - 虚拟地址。
   * @retval： 物理地址，若未映射则返回0。
   */
@@ -160,10 +332,15 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0; // 返回0表示无效
 
   pte = walk(pagetable, va, 0);  // 查找对应的PTE。
-  if(pte == 0)  // 如果未找到PTE。
-    return 0;  // 返回0表示无效。
-  if((*pte & PTE_V) == 0)  // 如果PTE无效。
-    return 0;  // 返回0表示无效。
+  if(pte == 0 || (*pte & PTE_V) == 0){  // 如果未映射，可能是懒分配的页
+    struct proc *p = myproc();
+    if(p == 0 || p->pagetable != pagetable)
+      return 0;  // 返回0表示无效。
+    lazyfault(pagetable, p->sz, va); // 失败时可能是同一线程组的其他线程刚映射了这一页
+    pte = walk(pagetable, va, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      return 0;
+  }
   if((*pte & PTE_U) == 0)  // 如果PTE未标记为用户可访问。
     return 0;  // 返回0表示无效。
   pa = PTE2PA(*pte);  // 获取物理地址。
@@ -186,22 +363,6 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap"); // 如果映射失败，则报错并终止
 }
 
-/**
-  * void ukvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
-  * @brief： 向用户进程内核页表添加映射
-  * @brief： // add a mapping to the user processing kernel page table.
-             // only used when booting.
-             // does not flush TLB or enable paging.
-  * @param： kpagetable - 内核页；va - 虚拟地址； pa - 物理地址； sz - 映射大小； perm - 权限。
-  * @retval： 无
-  */
-void
-ukvmmap(pagetable_t kpagetable, uint64 va, uint64 pa, uint64 sz, int perm)
-{
-  if(mappages(kpagetable, va, sz, pa, perm) != 0) // 调用mappages进行映射
-    panic("ukvmmap"); // 如果映射失败，则报错并终止
-}
-
 /**
   * uint64 kvmpa(uint64 va)
   * @brief： 将内核虚拟地址转换为物理地址，仅在堆栈上需要。
@@ -215,15 +376,17 @@ ukvmmap(pagetable_t kpagetable, uint64 va, uint64 pa, uint64 sz, int perm)
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE; // 计算页内偏移
+  uint64 off; // 页内偏移
   pte_t *pte; // 页表项指针
   uint64 pa; // 物理地址
+  int lvl;
   
-  pte = walk(kernel_pagetable, va, 0); // 查找PTE
+  pte = walklevel(kernel_pagetable, va, 0, 0, &lvl); // 查找PTE
   if(pte == 0)
     panic("kvmpa"); // 如果未找到PTE，则报错并终止
   if((*pte & PTE_V) == 0)
     panic("kvmpa"); // 如果PTE无效，则报错并终止
+  off = va % (lvl == 1 ? MEGAPGSIZE : PGSIZE); // 计算页内偏移
   pa = PTE2PA(*pte); // 获取物理地址
   return pa+off; // 返回物理地址加上页内偏移
 }
@@ -235,27 +398,38 @@ kvmpa(uint64 va)
              // physical addresses starting at pa. va and size might not
              // be page-aligned. Returns 0 on success, -1 if walk() couldn't
              // allocate a needed page-table page.
+             // 2MB对齐且剩余至少2MB的部分用一级页表中的大页叶子映射，
+             // 前提是那里还没有下一级页表。
   * @param： pagetable - 页表； va - 虚拟地址； size - 大小； pa - 物理地址； perm - 权限。
   * @retval： 成功返回0，失败返回-1。
   */
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last; // a为当前地址，last为最后地址
+  uint64 a, last, step; // a为当前地址，last为最后地址
   pte_t *pte; // 页表项指针
+  int lvl;
 
   a = PGROUNDDOWN(va); // 将虚拟地址向下取整到页面边界
   last = PGROUNDDOWN(va + size - 1); // 计算最后一个页面的边界
   for(;;){ // 无限循环，直到所有页面映射完成
-    if((pte = walk(pagetable, a, 1)) == 0) // 查找当前地址的PTE
+    step = PGSIZE;
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+      if((pte = walklevel(pagetable, a, 1, 1, &lvl)) == 0)
+        return -1;
+      if((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+        step = MEGAPGSIZE;
+    }
+    if(step == PGSIZE && (pte = walk(pagetable, a, 1)) == 0) // 查找当前地址的PTE
       return -1; // 如果未找到，返回-1
     if(*pte & PTE_V) // 如果PTE已经有效
       panic("remap"); // 报错并终止
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    vmrss(pagetable, a, step / PGSIZE);
+    if(a + step > last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += step;
+    pa += step;
   }
   return 0;
 }
@@ -286,7 +460,10 @@ umappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   * void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   * @brief: 从虚拟地址 va 开始移除 npages 页的映射。
   * @brief: // Remove npages of mappings starting from va. va must be
-            // page-aligned. The mappings must exist.
+            // page-aligned. Missing mappings are lazily allocated
+            // pages that were never touched; with do_free their
+            // reservation is returned instead. Pages swapped out
+            // give up their swap slot.
             // Optionally free the physical memory.
   * @param: pagetable - 进程的页表
   * @param: va - 起始虚拟地址
@@ -297,73 +474,161 @@ umappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a; // 用于遍历的地址变量
+  uint64 a, i; // 用于遍历的地址变量
+  uint64 nlazy = 0; // 未访问过的懒分配页数
   pte_t *pte; // 页表项指针
+  int lvl;
 
   if((va % PGSIZE) != 0) // 检查虚拟地址是否对齐
     panic("uvmunmap: not aligned"); // 如果未对齐，触发错误
   
   // 遍历要移除的每一页
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // 获取页表项
-      panic("uvmunmap: walk"); // 如果页表项不存在，触发错误
-    if((*pte & PTE_V) == 0) // 检查该页是否被映射
-      panic("uvmunmap: not mapped"); // 如果未映射，触发错误
+    if((pte = walklevel(pagetable, a, 0, 0, &lvl)) != 0 && (*pte & PTE_SWAP)){ // 该页已换出
+      if(do_free)
+        swapput(*pte); // 释放交换槽
+      *pte = 0;
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){ // 该页还没有分配
+      nlazy++;
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V) // 检查是否为叶节点
       panic("uvmunmap: not a leaf"); // 如果不是叶节点，触发错误
+    if(lvl == 1){ // 大页只能整个移除
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: partial megapage");
+      if(do_free)
+        for(i = 0; i < MEGAPGSIZE; i += PGSIZE)
+          kfree((void*)(PTE2PA(*pte) + i));
+      *pte = 0;
+      vmrss(pagetable, a, -(MEGAPGSIZE / PGSIZE));
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free) { // 如果需要释放物理内存
       uint64 pa = PTE2PA(*pte); // 获取物理地址
       kfree((void*)pa); // 释放物理内存
     }
     *pte = 0; // 清空页表项
+    vmrss(pagetable, a, -1);
+  }
+  if(do_free && nlazy > 0)
+    kunreserve(nlazy); // 归还懒分配页的预留
+}
+
+// free the pages uvmunmapsync() collected in batch; an entry
+// with bit 0 set is a whole megapage.
+static void
+freebatch(uint64 *batch, int n)
+{
+  uint64 i;
+
+  while(n-- > 0){
+    if(batch[n] & 1){
+      for(i = 0; i < MEGAPGSIZE; i += PGSIZE)
+        kfree((void*)((batch[n] & ~1UL) + i));
+    } else {
+      kfree((void*)batch[n]);
+    }
   }
 }
 
 /**
-  * void ukvmunmap(pagetable_t pagetable, uint64 va, uint64 npages)
-  * @brief: 从虚拟地址 va 开始移除 npages 页的映射。
-  * @brief: 用于释放进程的专属内核页，不回收内核页表所映射到的物理地址
-  * @param: pagetable - 进程的页表
-  * @param: va - 起始虚拟地址
-  * @param: npages - 要移除的页数
-  * @retval: 无返回值
+  * uint64 uvmunmapsync(struct proc *p, uint64 va, uint64 npages)
+  * @brief: 从p的页表和专属内核页表中移除[va, va+npages*PGSIZE)并释放物理页，
+  *         用于线程组可能共享的页表（sbrk()缩小和munmap()）。
+  * @brief: 其他CPU上运行的线程的TLB里可能还有这些映射，物理页要等tlbshootdown()
+  *         之后才能释放，否则它们还能访问已经给了别人的页。线程在copyout()等中
+  *         通过物理地址访问的页不经过TLB，由uvmpin()的引用保护，这里只放掉页表的引用。
+  *         清除PTE时持有pglock，
+  *         要释放的页攒在一页数组里，攒满一次通知一次；分配不到数组时每页通知一次。
+  *         已换出的页直接释放交换槽。
+  *         调用者持有vmlock，不能持有自旋锁。
+  * @param: p - 当前进程
+  * @param: va - 起始虚拟地址，页对齐
+  * @param: npages - 页数
+  * @retval: 没有映射的页数（懒分配页从未访问），由调用者决定是否归还预留
   */
-void
-ukvmunmap(pagetable_t pagetable, uint64 va, uint64 npages)
+uint64
+uvmunmapsync(struct proc *p, uint64 va, uint64 npages)
 {
-  uint64 a; // 用于遍历的地址变量
-  pte_t *pte; // 页表项指针
+  struct spinlock *lk = &p->leader->pglock;
+  uint64 a, from, end = va + npages*PGSIZE;
+  uint64 one, *batch;
+  uint64 nlazy = 0;
+  int n = 0, max, lvl;
+  pte_t *pte;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmapsync: not aligned");
+  if((batch = (uint64*)kalloc()) != 0){
+    max = PGSIZE / sizeof(uint64);
+  } else {
+    batch = &one;
+    max = 1;
+  }
 
-  if((va % PGSIZE) != 0) // 检查虚拟地址是否对齐
-    panic("ukvmunmap: not aligned"); // 如果未对齐，触发错误
-  
-  // 遍历要移除的每一页
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0) // 获取页表项
-      goto clean;
-    if((*pte & PTE_V) == 0) // 检查该页表项是否有效
-      goto clean;
-    if(PTE_FLAGS(*pte) == PTE_V) // 检查是否为叶节点
-      panic("ukvmunmap: not a leaf"); // 如果不是叶节点，触发错误
-    
-    clean:
-    *pte = 0; // 清空页表项
+  acquire(lk);
+  for(a = from = va; a < end; a += PGSIZE){
+    if((pte = walklevel(p->pagetable, a, 0, 0, &lvl)) != 0 && (*pte & PTE_SWAP)){
+      swapput(*pte);
+      *pte = 0;
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      nlazy++;
+      continue;
+    }
+    if(PTE_FLAGS(*pte) == PTE_V)
+      panic("uvmunmapsync: not a leaf");
+    if(lvl == 1){ // 大页只能整个移除
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > end)
+        panic("uvmunmapsync: partial megapage");
+      batch[n++] = PTE2PA(*pte) | 1;
+      *pte = 0;
+      vmrss(p->pagetable, a, -(MEGAPGSIZE / PGSIZE));
+      a += MEGAPGSIZE - PGSIZE;
+    } else {
+      batch[n++] = PTE2PA(*pte);
+      *pte = 0;
+      vmrss(p->pagetable, a, -1);
+    }
+    if(n == max){
+      uvmunmap(p->kpagetable, from, (a + PGSIZE - from) / PGSIZE, 0);
+      release(lk);
+      tlbshootdown();
+      freebatch(batch, n);
+      n = 0;
+      from = a + PGSIZE;
+      acquire(lk);
+    }
   }
+  if(from < end)
+    uvmunmap(p->kpagetable, from, (end - from) / PGSIZE, 0);
+  release(lk);
+  tlbshootdown();
+  freebatch(batch, n);
+  if(batch != &one)
+    kfree(batch);
+  return nlazy;
 }
 
 /**
-  * pagetable_t uvmcreate()
-  * @brief: 创建一个空的用户页表。
+  * pagetable_t uvmcreate(struct vmacct *a)
+  * @brief: 创建一个空的用户页表，它的页表页和用户页记入a。
+  * @param: a - 统计结构
   * @retval: 返回页表指针，如果内存不足则返回 0
   */
 pagetable_t
-uvmcreate()
+uvmcreate(struct vmacct *a)
 {
   pagetable_t pagetable; // 定义页表变量
-  pagetable = (pagetable_t) kalloc(); // 分配内存
+  pagetable = (pagetable_t) kalloc_zeroed(); // 分配清零的内存
   if(pagetable == 0) // 检查是否分配成功
     return 0; // 如果失败，返回 0
-  memset(pagetable, 0, PGSIZE); // 初始化页表
+  vmbind(pagetable, a, 0);
   return pagetable; // 返回页表指针
 }
 
@@ -385,8 +650,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE) // 检查代码大小是否超过一页
     panic("inituvm: more than a page"); // 如果超过，触发错误
-  mem = kalloc(); // 分配内存
-  memset(mem, 0, PGSIZE); // 初始化分配的内存
+  mem = kalloc_zeroed(); // 分配清零的内存
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U); // 映射页表
   memmove(mem, src, sz); // 将初始化代码复制到分配的内存
 }
@@ -412,12 +676,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz); // 将旧大小向上对齐到页面大小
   for(a = oldsz; a < newsz; a += PGSIZE) { // 遍历新大小
-    mem = kalloc(); // 分配内存
+    mem = kalloc_zeroed(); // 分配清零的内存
     if(mem == 0) { // 检查内存是否分配成功
       uvmdealloc(pagetable, a, oldsz); // 如果失败，撤销分配
       return 0; // 返回 0 表示错误
     }
-    memset(mem, 0, PGSIZE); // 初始化分配的内存
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0) { // 映射到页表
       kfree(mem); // 如果映射失败，释放内存
       uvmdealloc(pagetable, a, oldsz); // 撤销分配
@@ -456,53 +719,43 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 /**
   * void freewalk(pagetable_t pagetable)
   * @brief：递归释放页表页。该函数遍历页表，并递归释放所有的页表页，前提是所有叶子页表项的映射已经被删除。
+  *         pagetable必须是根页表，freetables()释放子树并返回释放的页数。
   * @brief：// Recursively free page-table pages.
             // All leaf mappings must already have been removed.
   * @param：pagetable - 页表指针，指向要释放的页表。
   * @retval：无返回值
   */
-void
-freewalk(pagetable_t pagetable)
+static int
+freetables(pagetable_t pagetable)
 {
+  int n = 1; // 释放的页表页数，包括自己
+
   // 页表中有 2^9 = 512 个 PTE (页表项)
   for(int i = 0; i < 512; i++){
     pte_t pte = pagetable[i];// 获取当前 PTE（页表项）
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){// 检查 PTE 是否有效并且是否指向下一级页表（非叶子节点）
       // 该 PTE 指向一个低一级的页表
       uint64 child = PTE2PA(pte);  // 获取子页表的物理地址
-      freewalk((pagetable_t)child); // 递归调用，释放下一级页表
+      n += freetables((pagetable_t)child); // 递归调用，释放下一级页表
       pagetable[i] = 0;  // 将当前 PTE 清零
     } else if(pte & PTE_V){// 如果 PTE 有效但是叶子节点，触发 panic 错误(PTE_V代表有效)
       panic("freewalk: leaf");// 如果遇到叶子节点，报错
     }
   }
   kfree((void*)pagetable);// 释放当前页表的内存
+  return n;
 }
 
-/**
-  * void ufreewalk(pagetable_t pagetable)
-  * @brief：和freewalk一模一样, 除了不再出panic错当一个page的leaf还没被清除掉
-  * @brief：因为当我们free pagetable和kpagetable的时候
-  * @brief：只有1份物理地址, 且原本free pagetable的函数会负责清空它们
-  * @brief：所以这个函数只需要把在kpagetable里所有间接mapping清除即可
-  * @param：pagetable - 页表指针，指向要释放的页表。
-  * @retval：无返回值
-  */
 void
-ufreewalk(pagetable_t pagetable)
+freewalk(pagetable_t pagetable)
 {
-  // 页表中有 2^9 = 512 个 PTE (页表项)
-  for(int i = 0; i < 512; i++){
-    pte_t pte = pagetable[i];// 获取当前 PTE（页表项）
-    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){// 检查 PTE 是否有效并且是否指向下一级页表（非叶子节点）
-      // 该 PTE 指向一个低一级的页表
-      uint64 child = PTE2PA(pte);  // 获取子页表的物理地址
-      ufreewalk((pagetable_t)child); // 递归调用，释放下一级页表
-      pagetable[i] = 0;  // 将当前 PTE 清零
-    } 
-    pagetable[i] = 0;
-  }
-  kfree((void*)pagetable);// 释放当前页表的内存
+  struct vmacct *a;
+  int kernel, n;
+
+  a = acctof(pagetable, &kernel); // 根页表释放之前取出统计结构
+  n = freetables(pagetable);
+  if(a)
+    __sync_fetch_and_sub(kernel ? &a->nkpt : &a->nupt, n);
 }
 
 /**
@@ -521,40 +774,81 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 }
 
 /**
-  * void freeprockvm(struct proc* p)
-  * @brief: 清理一个进程的 内核页表。
-  * @brief: // helper function to first free all leaf mapping
-            // of a per-process kernel table but do not free the physical address
-            // and then remove all 3-levels indirection and the physical address
-            // for this kernel page itself
-  * @param: p - 需要释放内核页的进程
+  * void uvmreset(pagetable_t pagetable, uint64 sz)
+  * @brief: 释放用户内存[0, sz)和其下的页表页，只留下顶层页表和TRAMPOLINE、
+  *         TRAPFRAME、USYSCALL的映射，供进程槽位的下一个进程继续使用（见freeproc()）。
+  * @param: pagetable - 进程的页表
+  * @param: sz - 用户内存大小
+  * @retval: 无返回值
+  */
+void
+uvmreset(pagetable_t pagetable, uint64 sz)
+{
+  if(sz > 0)
+    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  for(int i = 0; i < PX(2, TRAMPOLINE); i++){
+    pte_t pte = pagetable[i];
+    if(pte & PTE_V){
+      ptcount(pagetable, -freetables((pagetable_t)PTE2PA(pte)));
+      pagetable[i] = 0;
+    }
+  }
+}
+
+/**
+  * void ukvmclear(pagetable_t kpagetable)
+  * @brief: 清除进程内核页表中的用户镜像，释放镜像的三级页表。
+  * @brief: 顶层页表和第一个1GB区域的二级页表保留下来，下一个进程不必再用
+  *         ukvminit()重新建立；共享的内核子树和镜像指向的物理页都不释放。
+  * @param: kpagetable - 进程的内核页表
+  * @retval: 无返回值
+  */
+void
+ukvmclear(pagetable_t kpagetable)
+{
+  pagetable_t l1 = (pagetable_t)PTE2PA(kpagetable[0]);
+  int n = 0;
+
+  for(int i = 0; i < PX(1, PLIC); i++){
+    pte_t pte = l1[i];
+    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
+      kfree((void*)PTE2PA(pte)); // 用户镜像的三级页表
+      n++;
+    }
+    l1[i] = 0;
+  }
+  ptcount(kpagetable, -n);
+}
+
+/**
+  * void ukvmfree(pagetable_t kpagetable)
+  * @brief: 释放进程内核页表私有的页表页：用户镜像的三级页表、第一个1GB区域的
+  *         二级页表和顶层页表。共享的内核子树和用户镜像指向的物理页都不释放。
+  * @param: kpagetable - 进程的内核页表
   * @retval: 无返回值
   */
-void 
-freeprockvm(struct proc* p) {
-  pagetable_t kpagetable = p -> kpagetable;
-  // reverse order of allocation
-  // 按分配顺序的逆序来销毁映射, 但不回收物理地址
-  ukvmunmap(kpagetable, p -> kstack, PGSIZE/PGSIZE);
-  ukvmunmap(kpagetable, TRAMPOLINE, PGSIZE/PGSIZE);
-  ukvmunmap(kpagetable, (uint64)etext, (PHYSTOP-(uint64)etext)/PGSIZE);
-  ukvmunmap(kpagetable, KERNBASE, ((uint64)etext-KERNBASE)/PGSIZE);
-  ukvmunmap(kpagetable, PLIC, 0x400000/PGSIZE);
-  ukvmunmap(kpagetable, CLINT, 0x10000/PGSIZE);
-  ukvmunmap(kpagetable, VIRTIO0, PGSIZE/PGSIZE);
-  ukvmunmap(kpagetable, UART0, PGSIZE/PGSIZE);
-  ufreewalk(kpagetable);
+void
+ukvmfree(pagetable_t kpagetable)
+{
+  ukvmclear(kpagetable);
+  ptcount(kpagetable, -2);
+  kfree((void*)PTE2PA(kpagetable[0]));
+  kfree((void*)kpagetable);
 }
 
 /**
   * int uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
-  * @brief: 将父进程的页表复制到子进程，复制内存和页表。
-  * @brief: // Given a parent process's page table, copy
+  * @brief: 将父进程的页表复制到子进程，父子共享物理页（copy-on-write）。
+  * @brief: // Given a parent process's page table, map
             // its memory into a child's page table.
-            // Copies both the page table and the
-            // physical memory.
+            // Writable pages are shared read-only and
+            // marked PTE_COW in both page tables; the
+            // first store to one is resolved by cowfault().
+            // Lazily allocated pages the parent never
+            // touched stay lazy, reserved for the child.
+            // Pages swapped out share their swap slot.
             // returns 0 on success, -1 on failure.
-            // frees any allocated pages on failure.
+            // drops any references taken on failure.
   * @param: old - 父进程的页表
   * @param: new - 子进程的页表
   * @param: sz - 需要复制的大小
@@ -563,25 +857,30 @@ freeprockvm(struct proc* p) {
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte; // 页表项指针
+  pte_t *pte, *npte; // 页表项指针
   uint64 pa, i; // 物理地址和循环变量
   uint flags; // 页表项标志
-  char *mem; // 用于存储分配的内存
 
   for(i = 0; i < sz; i += PGSIZE) { // 遍历每一页
-    if((pte = walk(old, i, 0)) == 0) // 获取父进程的页表项
-      panic("uvmcopy: pte should exist"); // 如果不存在，触发错误
-    if((*pte & PTE_V) == 0) // 检查页表项是否有效
-      panic("uvmcopy: page not present"); // 如果无效，触发错误
+    if((pte = walk(old, i, 0)) != 0 && (*pte & PTE_SWAP)){ // 已换出的页，子进程共享交换槽
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(*pte);
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){ // 父进程还没有访问过的懒分配页
+      if(kreserve(1) != 0)
+        goto err;
+      continue;
+    }
+    if(*pte & PTE_W) // 可写页改为只读并标记COW，父进程的页表项也一起修改
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte); // 获取物理地址
     flags = PTE_FLAGS(*pte); // 获取页表项标志
-    if((mem = kalloc()) == 0) // 分配内存
-      goto err; // 如果失败，跳转到错误处理
-    memmove(mem, (char*)pa, PGSIZE); // 复制物理内存到新分配的内存
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) { // 映射到子进程页表
-      kfree(mem); // 如果映射失败，释放内存
+    if(mappages(new, i, PGSIZE, pa, flags) != 0) // 映射同一物理页到子进程页表
       goto err; // 跳转到错误处理
-    }
+    krefinc((void*)pa); // 子进程持有一个引用
   }
   return 0; // 返回 0 表示成功
 
@@ -590,31 +889,295 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+/**
+  * int cowfault(pagetable_t pagetable, uint64 va)
+  * @brief: 处理对COW页的写：页面仍被共享时复制一份，否则直接恢复写权限。
+  * @brief: // Resolve a store to a copy-on-write page at va.
+            // If pagetable is the current process's, its kernel
+            // page table mirror is updated to the new page too.
+            // Returns 0 on success, -1 if va is not a COW page
+            // or memory is exhausted.
+  * @brief: 页表是线程组共享的时候持有组长的pglock修改PTE。另一个线程已经处理过
+  *         这一页（PTE已经可写）时直接返回0。其他线程的TLB里可能还有旧页的只读映射，
+  *         旧页的引用要等tlbshootdown()之后才能放掉；持有自旋锁不能等待时
+  *         留在tlbfree[]里，由这次陷入返回用户态之前处理，tlbfree[]满了则失败。
+  * @param: pagetable - 进程的页表
+  * @param: va - 发生写操作的虚拟地址
+  * @retval: 成功返回 0，失败返回 -1
+  */
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct proc *l = 0;
+  pte_t *pte;
+  uint64 pa, old = 0;
+  uint flags;
+  char *mem;
+  int r = -1, canwait = !holdingany();
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(p != 0 && p->pagetable == pagetable){
+    l = p->leader;
+    if(canwait && l->ntlbfree == NTLBFREE)
+      tlbshootdown();
+    acquire(&l->pglock);
+  }
+  pte = walk(pagetable, va, 0);
+  if(pte != 0 && (*pte & (PTE_V|PTE_U|PTE_W)) == (PTE_V|PTE_U|PTE_W)){
+    r = 0; // 另一个线程先复制了
+    goto out;
+  }
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    goto out;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt((void*)pa) == 1){
+    // 其他页表都已放弃这一页，不需要复制
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if(l && l->nthread > 1 && l->ntlbfree == NTLBFREE)
+      goto out;
+    if((mem = kalloc()) == 0)
+      goto out;
+    memmove(mem, (char*)pa, PGSIZE);
+    *pte = PA2PTE(mem) | flags;
+    old = pa;
+    pa = (uint64)mem;
+  }
+
+  // 内核页表中的用户映射必须跟着换到新的物理页
+  ukvmsync(pagetable, va, pa, flags);
+  r = 0;
+  if(old && l && l->nthread > 1){
+    l->tlbfree[l->ntlbfree++] = old; // 等其他线程刷新TLB之后再放掉
+    old = 0;
+  }
+ out:
+  if(l)
+    release(&l->pglock);
+  if(old)
+    kfree((void*)old); // 释放对共享页的引用
+  if(l && l->ntlbfree > 0 && canwait)
+    tlbshootdown();
+  return r;
+}
+
+/**
+  * int lazyfault(pagetable_t pagetable, uint64 sz, uint64 va)
+  * @brief: 为懒分配的地址va映射物理页：程序文件中的页由execfault()提供，mmap()映射的文件页由mmapfault()提供，
+  *         已换出的页由swapin()读回，其他的页分配一个清零的物理页。
+  * @brief: // Back a page of a lazily grown heap, of a program
+            // exec() didn't load, or of an mmap()ed file, on first touch.
+            // Pages below sz were reserved by kreserve() when sbrk() or exec() ran.
+            // Returns 0 on success, -1 if va is outside [0, sz) and
+            // the current process's mappings, already mapped,
+            // or memory is exhausted.
+  * @brief: 线程组共享页表：能睡眠时持有组长的vmlock，查找程序段和映射时它们不会变；
+  *         映射之前持有pglock再检查一次，另一个线程先映射了这一页就放弃自己的页返回0，
+  *         va已经被sbrk()或者munmap()去掉了就返回-1。
+  * @param: pagetable - 进程的页表
+  * @param: sz - 进程的大小
+  * @param: va - 访问的虚拟地址
+  * @retval: 成功返回 0，失败返回 -1
+  */
+int
+lazyfault(pagetable_t pagetable, uint64 sz, uint64 va)
+{
+  pte_t *pte;
+  uint64 mem;
+  int perm = PTE_W|PTE_X|PTE_R|PTE_U;
+  struct proc *p = myproc();
+  struct proc *l = 0;
+  int r = 1, lazy, locked = 0; // r: 1 不属于文件，0 有页，-1 失败
+
+  if(va >= MAXVA)
+    return -1;
+  lazy = va < sz; // [0, sz)中的页是预留的，sz之上只可能是mmap()映射的文件
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte != 0 && (*pte & PTE_SWAP)) // 已换出的页
+    return (p != 0 && p->pagetable == pagetable) ? swapin(p, va) : -1;
+  if(pte != 0 && (*pte & PTE_V)) // 已经映射（例如栈的保护页），不是懒分配页
+    return -1;
+  if(p != 0 && p->pagetable == pagetable){ // 是否属于程序文件中还没有读入的段，或者映射的文件
+    l = p->leader;
+    if(!holdingany() && !holdingsleep(&l->vmlock)){
+      acquiresleep(&l->vmlock);
+      locked = 1;
+    }
+    r = lazy ? execfault(p, va, &mem, &perm) : mmapfault(p, va, &mem, &perm);
+  }
+  if(r < 0 || (r > 0 && !lazy))
+    goto bad;
+  if(r > 0){
+    if((mem = (uint64)kalloc_zeroed()) == 0)
+      goto bad;
+  }
+  if(l){
+    acquire(&l->pglock);
+    pte = walk(pagetable, va, 0);
+    if(pte != 0 && (*pte & (PTE_V|PTE_SWAP))){
+      release(&l->pglock); // 另一个线程先映射了（也许已经又被换出）
+      kfree((void*)mem);
+      r = 0;
+      goto bad;
+    }
+    if(uvmend(p, va) == 0){
+      release(&l->pglock);
+      kfree((void*)mem);
+      r = -1;
+      goto bad;
+    }
+  }
+  if(mappages(pagetable, va, PGSIZE, mem, perm) != 0){
+    if(l)
+      release(&l->pglock);
+    kfree((void*)mem);
+    r = -1;
+    goto bad;
+  }
+  if(lazy)
+    kunreserve(1); // 预留的页已经真正分配
+  ukvmsync(pagetable, va, mem, perm);
+  if(l)
+    release(&l->pglock);
+  if(locked)
+    releasesleep(&l->vmlock);
+  return 0;
+
+ bad:
+  if(locked)
+    releasesleep(&l->vmlock);
+  return r == 0 ? 0 : -1;
+}
+
+/**
+  * int uvmresolved(pagetable_t pagetable, uint64 va, uint64 scause)
+  * @brief: 用户态在va处的缺页（scause为12、13或15）现在是否已经可以重新执行。
+  * @brief: 同一线程组的另一个线程可能刚好先处理了同一页的lazyfault()或cowfault()，
+  *         这时本CPU的TLB里可能还缓存着旧的PTE，刷新后重新执行指令即可。
+  * @param: pagetable - 进程的页表
+  * @param: va - 缺页的虚拟地址
+  * @param: scause - 缺页的原因：12取指，13读，15写
+  * @retval: 可以访问返回 1，否则返回 0
+  */
+int
+uvmresolved(pagetable_t pagetable, uint64 va, uint64 scause)
+{
+  pte_t *pte;
+  uint64 need = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+
+  if(va >= MAXVA || (pte = walk(pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U|need)) != (PTE_V|PTE_U|need))
+    return 0;
+  sfence_vma();
+  return 1;
+}
+
+/**
+  * void uvmtouch(uint64 va, uint64 len)
+  * @brief: 提前为当前进程[va, va+len)中还没有映射的懒分配页和mmap()文件页调用lazyfault()。
+  * @brief: 持有自旋锁时访问用户内存不能睡眠，而从程序文件读入页面需要睡眠，
+  *         所以读写文件和wait()在加锁前先调用这个函数，之后的拷贝一般不会缺页。
+  *         持有自旋锁拷贝的pipe改用uvmhold()钉住用户页。
+  *         失败的页留给拷贝时再处理。
+  * @param: va - 起始虚拟地址
+  * @param: len - 长度
+  * @retval: 无
+  */
+void
+uvmtouch(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a, end, top;
+  pte_t *pte;
+
+  if(len == 0 || (top = uvmend(p, va)) == 0)
+    return;
+  end = va + len;
+  if(end > top || end < va)
+    end = top;
+  for(a = PGROUNDDOWN(va); a < end; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      lazyfault(p->pagetable, p->sz, a);
+  }
+}
+
+/**
+  * void ukvmsync(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+  * @brief: 用户页表在va处新映射了pa后，同步当前进程的专属内核页表。
+  * @brief: 内核页表中的映射去掉 PTE_U 和 PTE_W，与pagecopy()一致。
+  *         pagetable不是当前进程的页表时（例如exec中的新页表）什么也不做。
+  * @param: pagetable - 用户页表
+  * @param: va - 虚拟地址
+  * @param: pa - 新的物理地址
+  * @param: perm - 用户页表中的权限
+  * @retval: 无
+  */
+static void
+ukvmsync(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable || p->kpagetable == 0)
+    return;
+  if(umappages(p->kpagetable, va, PGSIZE, pa, perm & ~(PTE_U|PTE_W|PTE_COW)) != 0)
+    panic("ukvmsync");
+  sfence_vma();
+}
+
 // 将从begin到end的虚拟地址的映射, 从oldpage复制到newpage
 // 将一个页表的用户地址范围映射复制到另一个页表中，并清除 PTE_U 位（用户权限位）
+// 内核只通过这份映射读取用户内存，写入走copyout()，所以同时清除 PTE_W，
+// 这样COW共享的页面在内核页表里也是只读的
+// 按2MB区域遍历：两边的三级页表各只查找一次，然后逐项复制其中最多512个PTE；
+// 源页表中没有三级页表的区域整个跳过，所以开销只和[begin, end)的大小有关
 int
 pagecopy(pagetable_t oldpage, pagetable_t newpage, uint64 begin, uint64 end)
 {
-  pte_t *pte; // 页表项指针
-  uint64 pa, i; // 物理地址和循环变量
-  uint flags; // 页表项标志
-  begin = PGROUNDUP(begin);
-
-  for(i = 0; i < end; i += PGSIZE) { // 遍历每一页
-    if((pte = walk(oldpage, i, 0)) == 0) // 获取父进程的页表项
-      panic("pagecopy walk oldpage nullptr"); // 如果不存在，触发错误
-    if((*pte & PTE_V) == 0) // 检查页表项是否有效
-      panic("pagecopy oldpage pte not valid"); // 如果无效，触发错误
-    pa = PTE2PA(*pte); // 获取物理地址
-    flags = PTE_FLAGS(*pte) & (~PTE_U); // 把U flag抹去
-    if(umappages(newpage, i, PGSIZE, pa, flags) != 0) { // 映射到子进程页表
-      goto err; // 跳转到错误处理
+  pte_t *l1pte, *from, *to; // 源页表的二级页表项，两边三级页表中的第一个页表项
+  uint64 a, next, va, pa; // 当前区域的起止地址
+  int i, n, lvl;
+
+  begin = PGROUNDDOWN(begin);
+  for(a = begin; a < end; a = next) {
+    next = (a + MEGAPGSIZE) & ~(MEGAPGSIZE - 1); // 下一个2MB边界
+    if(next > end)
+      next = PGROUNDUP(end);
+    n = (next - a) / PGSIZE;
+    if((l1pte = walklevel(oldpage, a, 0, 1, &lvl)) == 0 || (*l1pte & PTE_V) == 0) // 懒分配的页首次访问时再同步
+      continue;
+    if(lvl != 1)
+      goto err;
+    if(PTE_LEAF(*l1pte)) {
+      // 大页：内核页表里按4KB页映射其中的这一段
+      pa = PTE2PA(*l1pte) + (a & (MEGAPGSIZE - 1));
+      for(va = a; va < next; va += PGSIZE, pa += PGSIZE)
+        if(umappages(newpage, va, PGSIZE, pa, PTE_FLAGS(*l1pte) & ~(PTE_U|PTE_W|PTE_COW)) != 0)
+          goto err;
+      continue;
+    }
+    from = &((pagetable_t)PTE2PA(*l1pte))[PX(0, a)];
+    if((to = walklevel(newpage, a, 1, 0, &lvl)) == 0 || lvl != 0)
+      goto err;
+    for(i = 0; i < n; i++) {
+      if((from[i] & PTE_V) == 0) // 懒分配的页首次访问时再同步
+        continue;
+      if((from[i] & PTE_U) == 0) // 栈的保护页，内核也不应该通过它读取
+        continue;
+      to[i] = from[i] & ~(PTE_U|PTE_W|PTE_COW); // 把U和W flag抹去
     }
   }
   return 0; // 返回 0 表示成功
 
  err:
-  uvmunmap(newpage, 0, i / PGSIZE, 1); // 解除子进程的映射
+  uvmunmap(newpage, begin, (next - begin) / PGSIZE, 0); // 解除映射，物理页属于用户页表，不能释放
   return -1;
 }
 
@@ -638,12 +1201,92 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U; // 将用户访问标志清除
 }
 
+/**
+  * static uint64 uvmpin(pagetable_t pagetable, uint64 va, int write)
+  * @brief: 持有组长的pglock重新查找va所在的页并增加一个引用，直到调用者kfree()。
+  * @brief: copyout()等通过物理地址访问用户页，TLB的确认保护不了这种访问：
+  *         swapreclaim()只换出引用计数为1的页，另一个线程的munmap()或sbrk()
+  *         也只放掉页表的引用，钉住的页在调用者访问完之前不会被释放。
+  *         write时要求页可写，并在同一把锁下设置PTE_D，不会覆盖choose()刚换上的交换PTE。
+  * @param: pagetable - 进程的页表
+  * @param: va - 页对齐的虚拟地址
+  * @param: write - 是否要写这一页
+  * @retval: 页的物理地址，页已经被换出、去掉或者不可写时返回0
+  */
+static uint64
+uvmpin(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct proc *l = 0;
+  pte_t *pte;
+  uint64 pa = 0;
+  int lvl, perm = PTE_V | PTE_U | (write ? PTE_W : 0);
+
+  if(p != 0 && p->pagetable == pagetable){
+    l = p->leader;
+    acquire(&l->pglock);
+  }
+  pte = walklevel(pagetable, va, 0, 0, &lvl);
+  if(pte != 0 && (*pte & perm) == perm){
+    pa = PTE2PA(*pte);
+    if(lvl == 1)
+      pa += va & (MEGAPGSIZE - 1); // 大页中的这一页，每页有自己的引用计数
+    if(write)
+      *pte |= PTE_D; // 像用户态的写一样标记脏页，munmap()据此写回MAP_SHARED的文件页
+    krefinc((void*)pa);
+  }
+  if(l)
+    release(&l->pglock);
+  return pa;
+}
+
+/**
+  * uint64 uvmhold(pagetable_t pagetable, uint64 va, int write)
+  * @brief: 让va所在的用户页可以访问（读回换出的页、懒分配、写之前处理写时复制）并用uvmpin()钉住，
+  *         用完后调用者kfree()返回的物理页。页在查找之后又被换出或者去掉时重新查找。
+  * @brief: 持有自旋锁时不能读回换出的页，这时失败。pipe在锁外钉住用户页，
+  *         持有pi->lock拷贝时就不会缺页，等待期间页也不会被换出。
+  * @param: pagetable - 进程的页表
+  * @param: va - 虚拟地址
+  * @param: write - 是否要写这一页
+  * @retval: 页的物理地址（页对齐），地址无效、写只读页或者内存耗尽时返回0
+  */
+uint64
+uvmhold(pagetable_t pagetable, uint64 va, int write)
+{
+  uint64 pa;
+  pte_t *pte;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return 0;
+  for(;;){
+    pte = walk(pagetable, va, 0);
+    if(pte && (*pte & PTE_SWAP)){ // 已换出的页先读回
+      if(walkaddr(pagetable, va) == 0)
+        return 0;
+      pte = walk(pagetable, va, 0);
+    }
+    if(write){
+      if(pte && (*pte & PTE_COW) && cowfault(pagetable, va) != 0) // 写COW页之前先复制
+        return 0;
+      if(pte && (*pte & PTE_V) && (*pte & PTE_W) == 0) // 不允许写只读页
+        return 0;
+    }
+    if(walkaddr(pagetable, va) == 0) // 懒分配的页在这里映射
+      return 0;
+    if((pa = uvmpin(pagetable, va, write)) != 0)
+      return pa;
+  }
+}
+
 /**
   * int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   * @brief: 从内核复制数据到用户。
   * @brief: // Copy from kernel to user.
             // Copy len bytes from src to virtual address dstva in a given page table.
             // Return 0 on success, -1 on error.
+  * @brief: 写的时候用uvmhold()钉住目标页。
   * @param: pagetable - 进程的页表
   * @param: dstva - 目标虚拟地址
   * @param: src - 源数据地址
@@ -657,13 +1300,14 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0) { // 当还有剩余字节需要复制
     va0 = PGROUNDDOWN(dstva); // 获取对齐的虚拟地址
-    pa0 = walkaddr(pagetable, va0); // 获取物理地址
+    pa0 = uvmhold(pagetable, va0, 1); // 获取物理地址
     if(pa0 == 0) // 检查物理地址是否有效
       return -1; // 如果无效，返回 -1
     n = PGSIZE - (dstva - va0); // 计算当前页可以复制的字节数
     if(n > len) // 如果可复制字节数大于剩余字节数
       n = len; // 将可复制字节数调整为剩余字节数
     memmove((void *)(pa0 + (dstva - va0)), src, n); // 复制数据
+    kfree((void*)pa0); // 放掉uvmhold()的引用
 
     len -= n; // 更新剩余字节数
     src += n; // 更新源地址
@@ -678,6 +1322,8 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   * @brief: // Copy from user to kernel.
             // Copy len bytes to dst from virtual address srcva in a given page table.
             // Return 0 on success, -1 on error.
+            // 当前进程的页表走copyin_new()，除非编译时定义了COPYIN_WALK。
+            // 通过物理地址读的页同copyout()一样用uvmhold()钉住。
   * @param: pagetable - 进程的页表
   * @param: dst - 目标地址
   * @param: srcva - 源虚拟地址
@@ -689,15 +1335,22 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0; // 用于遍历的字节数、虚拟地址和物理地址
 
+#ifndef COPYIN_WALK
+  struct proc *p = myproc();
+  if(p != 0 && p->pagetable == pagetable) // 当前进程的用户内存在专属内核页表中有映射
+    return copyin_new(pagetable, dst, srcva, len);
+#endif
+
   while(len > 0) { // 当还有剩余字节需要复制
     va0 = PGROUNDDOWN(srcva); // 获取对齐的虚拟地址
-    pa0 = walkaddr(pagetable, va0); // 获取物理地址
+    pa0 = uvmhold(pagetable, va0, 0); // 获取物理地址
     if(pa0 == 0) // 检查物理地址是否有效
       return -1; // 如果无效，返回 -1
     n = PGSIZE - (srcva - va0); // 计算当前页可以复制的字节数
     if(n > len) // 如果可复制字节数大于剩余字节数
       n = len; // 将可复制字节数调整为剩余字节数
     memmove(dst, (void *)(pa0 + (srcva - va0)), n); // 复制数据
+    kfree((void*)pa0); // 放掉uvmhold()的引用
 
     len -= n; // 更新剩余字节数
     dst += n; // 更新目标地址
@@ -713,6 +1366,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
             // Copy bytes to dst from virtual address srcva in a given page table,
             // until a '\0', or max.
             // Return 0 on success, -1 on error.
+            // 当前进程的页表走copyinstr_new()，除非编译时定义了COPYIN_WALK。
   * @param: pagetable - 进程的页表
   * @param: dst - 目标地址
   * @param: srcva - 源虚拟地址
@@ -725,9 +1379,15 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+#ifndef COPYIN_WALK
+  struct proc *p = myproc();
+  if(p != 0 && p->pagetable == pagetable)
+    return copyinstr_new(pagetable, dst, srcva, max);
+#endif
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmhold(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -748,6 +1408,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    kfree((void*)pa0);
 
     srcva = va0 + PGSIZE;
   }
@@ -773,6 +1434,8 @@ void
 vmprint(pagetable_t pagetable, uint64 depth)
 {
   char buf[12]; //用于存储不同级页表前的“..”字符串
+  struct vmacct *a;
+  int kernel;
   if (depth > 2){
     return;
   }
@@ -795,8 +1458,17 @@ vmprint(pagetable_t pagetable, uint64 depth)
     pte_t pte = pagetable[i];// 获取当前 PTE（页表项）
     if(pte & PTE_V){// 如果 PTE 有效
       uint64 child = PTE2PA(pte);  // 获取子页表的物理地址
+      if(depth < 2 && PTE_LEAF(pte)){ // 大页叶子，没有下一级页表
+        printf("%s%d: pte %p pa %p %s\n", buf, i, pte, child, depth == 1 ? "2M" : "1G");
+        continue;
+      }
       printf("%s%d: pte %p pa %p\n", buf, i, pte, child);
       vmprint((pagetable_t)child, depth + 1); // 递归调用，释放下一级页表,depth深度加1
     } 
   }
+  if (depth == 0 && (a = acctof(pagetable, &kernel)) != 0){
+    // 整个进程的汇总：用户页、用户页表和专属内核页表的页表页
+    printf("rss %d pages, page tables %d pages, kernel page tables %d pages\n",
+           (int)a->nrss, (int)a->nupt, (int)a->nkpt);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include "param.h"
+#include "types.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+//
+// 通过进程的专属内核页表直接读取用户内存。
+// pagecopy()、lazyfault()和cowfault()把用户映射（去掉PTE_U和PTE_W）
+// 同步到p->kpagetable，所以内核可以直接用用户虚拟地址访问[0, p->sz)
+// 和mmap()映射的文件（见uvmend()），
+// 不需要为每一页调用walkaddr()。
+// 懒分配还没有访问过的页会在内核中触发缺页，由copyinfault()处理。
+//
+
+int umappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm);
+
+// 无法恢复的内核缺页映射这一页，让正在进行的拷贝读到0后结束
+static char zeropage[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+/**
+  * int copyin_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+  * @brief: 从当前进程的用户地址srcva复制len字节到dst。
+  * @param: pagetable - 当前进程的用户页表
+  * @param: dst - 目标地址
+  * @param: srcva - 源虚拟地址
+  * @param: len - 要复制的字节数
+  * @retval: 成功返回 0，地址越界返回 -1
+  */
+int
+copyin_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 top;
+
+  if(len == 0)
+    return 0;
+  if((top = uvmend(p, srcva)) == 0 || srcva + len > top || srcva + len < srcva)
+    return -1;
+  memmove((void *) dst, (void *)srcva, len);
+  return 0;
+}
+
+/**
+  * int copyinstr_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+  * @brief: 从当前进程的用户地址srcva复制一个以'\0'结尾的字符串，最多max字节。
+  * @param: pagetable - 当前进程的用户页表
+  * @param: dst - 目标地址
+  * @param: srcva - 源虚拟地址
+  * @param: max - 最多复制的字节数
+  * @retval: 成功返回 0，越界或没有遇到'\0'返回 -1
+  */
+int
+copyinstr_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  struct proc *p = myproc();
+  char *s = (char *) srcva;
+  uint64 top;
+
+  if((top = uvmend(p, srcva)) == 0)
+    return -1;
+  for(uint64 i = 0; i < max && srcva + i < top; i++){
+    dst[i] = s[i];
+    if(s[i] == '\0')
+      return 0;
+  }
+  return -1;
+}
+
+/**
+  * int copyinfault(uint64 va)
+  * @brief: 处理内核读用户地址va时的缺页，由kerneltrap()调用。
+  * @brief: 懒分配的页在这里分配。内存耗尽或者页面不允许用户访问（栈的保护页）时
+  *         杀死进程，并映射一个全0的只读页让拷贝结束，进程在返回用户态前退出。
+  * @param: va - 缺页的虚拟地址
+  * @retval: 已处理返回 0，不是当前进程的用户地址返回 -1
+  */
+int
+copyinfault(uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || uvmend(p, va) == 0)
+    return -1;
+  if(lazyfault(p->pagetable, p->sz, va) == 0 || uvmresolved(p->pagetable, va, 13))
+    return 0; // 或者同一线程组的另一个线程刚映射了这一页
+
+  p->killed = 1;
+  if(umappages(p->kpagetable, PGROUNDDOWN(va), PGSIZE, (uint64)zeropage, PTE_R) != 0)
+    return -1;
+  sfence_vma();
+  return 0;
+}
@@ -15,20 +15,27 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
+#define NINODES 200   // unless -i says otherwise
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+//
+// The image is assembled in memory and written out at the end
+// with one write(). Each file's data blocks are laid out one
+// after another, followed by its indirect blocks, so that the
+// kernel reads a file sequentially from the disk.
+
+uint fssize = FSSIZE;  // blocks, unless -s says otherwise
+uint ninodes = NINODES;
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE + 1;  // header block + LOGSIZE data blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
+uchar *img;   // the image, fssize blocks
 uint freeinode = 1;
 uint freeblock;
 
@@ -40,6 +47,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void ifile(uint inum, void *p, uint n);
 
 // convert to intel byte order
 ushort
@@ -67,19 +75,32 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, fd;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
+  off_t size;
+  char *data;
+  struct dirent *dir;
+  int ndir;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(; argc > 2 && argv[1][0] == '-'; argc -= 2, argv += 2){
+    if(strcmp(argv[1], "-s") == 0)
+      fssize = atoi(argv[2]);
+    else if(strcmp(argv[1], "-i") == 0)
+      ninodes = atoi(argv[2]);
+    else
+      break;
+  }
+  if(argc < 2 || argv[1][0] == '-' || ninodes < 2 || ninodes > 65535){
+    fprintf(stderr, "Usage: mkfs [-s blocks] [-i inodes] fs.img files...\n");
     exit(1);
   }
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
@@ -92,24 +113,27 @@ main(int argc, char *argv[])
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  assert(nmeta < fssize);
+  nblocks = fssize - nmeta;
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  if((img = calloc(fssize, BSIZE)) == 0){
+    perror("calloc");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -118,21 +142,22 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  // the root directory is written after the files, so that
+  // its blocks don't end up between theirs.
+  dir = calloc(argc, sizeof(*dir));
+  ndir = 0;
+  dir[ndir].inum = xshort(rootino);
+  strcpy(dir[ndir++].name, ".");
+  dir[ndir].inum = xshort(rootino);
+  strcpy(dir[ndir++].name, "..");
 
   for(i = 2; i < argc; i++){
-    // get rid of "user/"
+    // get rid of "user/" or "kernel/"
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
       shortname = argv[i] + 5;
+    else if(strncmp(argv[i], "kernel/", 7) == 0)
+      shortname = argv[i] + 7;
     else
       shortname = argv[i];
     
@@ -152,17 +177,22 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dir[ndir].inum = xshort(inum);
+    strncpy(dir[ndir++].name, shortname, DIRSIZ);
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    if((size = lseek(fd, 0, SEEK_END)) < 0 || lseek(fd, 0, SEEK_SET) != 0 ||
+       (data = malloc(size + 1)) == 0 || read(fd, data, size) != size){
+      perror(argv[i]);
+      exit(1);
+    }
+    ifile(inum, data, size);
+    free(data);
 
     close(fd);
   }
 
+  ifile(rootino, dir, ndir * sizeof(*dir));
+
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
@@ -172,60 +202,54 @@ main(int argc, char *argv[])
 
   balloc(freeblock);
 
+  for(size = 0; size < (off_t)fssize * BSIZE; size += i){
+    if((i = write(fsfd, img + size, (off_t)fssize * BSIZE - size)) <= 0){
+      perror("write");
+      exit(1);
+    }
+  }
   exit(0);
 }
 
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
-    exit(1);
-  }
+  assert(sec < fssize);
+  memmove(img + (uint64)sec * BSIZE, buf, BSIZE);
+}
+
+// the disk inode inum, in the image.
+struct dinode*
+dinode(uint inum)
+{
+  return (struct dinode*)(img + (uint64)IBLOCK(inum, sb) * BSIZE) + (inum % IPB);
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  *dinode(inum) = *ip;
 }
 
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  *ip = *dinode(inum);
 }
 
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
-    exit(1);
-  }
+  assert(sec < fssize);
+  memmove(buf, img + (uint64)sec * BSIZE, BSIZE);
+}
+
+// the block-number array of block bn, in the image.
+uint*
+bmapblk(uint bn)
+{
+  assert(bn < fssize);
+  return (uint*)(img + (uint64)bn * BSIZE);
 }
 
 uint
@@ -245,17 +269,15 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *bits = img + xint(sb.bmapstart) * BSIZE;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
+  assert(used < nbitmap*BPB);
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bits[i/8] = bits[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: write bitmap blocks at sector %d\n", xint(sb.bmapstart));
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -268,7 +290,7 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, y, dbn;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -281,7 +303,7 @@ iappend(uint inum, void *xp, int n)
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
-    } else {
+    } else if(fbn < NDIRECT + NINDIRECT){
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -291,6 +313,23 @@ iappend(uint inum, void *xp, int n)
         wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
       }
       x = xint(indirect[fbn-NDIRECT]);
+    } else {
+      dbn = fbn - NDIRECT - NINDIRECT;
+      if(xint(din.addrs[NDIRECT+1]) == 0){
+        din.addrs[NDIRECT+1] = xint(freeblock++);
+      }
+      rsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      if(indirect[dbn / NINDIRECT] == 0){
+        indirect[dbn / NINDIRECT] = xint(freeblock++);
+        wsect(xint(din.addrs[NDIRECT+1]), (char*)indirect);
+      }
+      y = xint(indirect[dbn / NINDIRECT]);
+      rsect(y, (char*)indirect);
+      if(indirect[dbn % NINDIRECT] == 0){
+        indirect[dbn % NINDIRECT] = xint(freeblock++);
+        wsect(y, (char*)indirect);
+      }
+      x = xint(indirect[dbn % NINDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
@@ -303,3 +342,42 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// write n bytes at p to the empty file inum: its data blocks
+// one after another, and then the indirect blocks they need.
+void
+ifile(uint inum, void *p, uint n)
+{
+  struct dinode *dip = dinode(inum);
+  uint nb = (n + BSIZE - 1) / BSIZE;
+  uint first = freeblock, fbn, dbn, x;
+  uint *ind;
+
+  assert(xint(dip->size) == 0);
+  assert(nb <= MAXFILE);
+  assert(first + nb <= fssize);
+  memmove(img + (uint64)first * BSIZE, p, n);
+  freeblock += nb;
+
+  for(fbn = 0; fbn < nb; fbn++){
+    x = xint(first + fbn);
+    if(fbn < NDIRECT){
+      dip->addrs[fbn] = x;
+      continue;
+    }
+    if(fbn < NDIRECT + NINDIRECT){
+      if(dip->addrs[NDIRECT] == 0)
+        dip->addrs[NDIRECT] = xint(freeblock++);
+      bmapblk(xint(dip->addrs[NDIRECT]))[fbn - NDIRECT] = x;
+      continue;
+    }
+    dbn = fbn - NDIRECT - NINDIRECT;
+    if(dip->addrs[NDIRECT+1] == 0)
+      dip->addrs[NDIRECT+1] = xint(freeblock++);
+    ind = bmapblk(xint(dip->addrs[NDIRECT+1]));
+    if(ind[dbn / NINDIRECT] == 0)
+      ind[dbn / NINDIRECT] = xint(freeblock++);
+    bmapblk(xint(ind[dbn / NINDIRECT]))[dbn % NINDIRECT] = x;
+  }
+  dip->size = xint(n);
+}
@@ -0,0 +1,366 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/riscv.h"
+#include "kernel/procinfo.h"
+#include "user/user.h"
+
+// bench [-s scale] [name...]: time each microbenchmark, or the
+// named ones, and print a line for each:
+//
+//   name ops ops/s cycles/op
+//
+// separated by tabs, after a "#" header line, so that runs
+// before and after a kernel change can be diffed. ops/s is from
+// the time CSR; cycles/op from the cycles procinfo() charges to
+// bench itself, so it leaves out what children do. -s
+// multiplies the number of operations.
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+#define FILEBLKS 256        // blocks in the file for the read/write benchmarks
+#define MAXRUN   (TICKCYCLES * 50)  // stop a benchmark after about 5 seconds
+
+static char buf[PGSIZE];
+static char *self;          // argv[0], for the exec benchmark
+static int fds[2];          // the pipe benchmarks' pipe
+static int child;           // and the pid at its other end
+static int fd;              // the file benchmarks' file
+static uint seed = 1;
+
+static struct procinfo pi[NPROC];
+
+void
+die(char *what)
+{
+  fprintf(2, "bench: %s failed\n", what);
+  exit(1);
+}
+
+uint
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// cycles charged to this process so far.
+uint64
+mycycles(void)
+{
+  int i, n;
+
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < n; i++)
+    if(pi[i].pid == getpid())
+      return pi[i].cycles;
+  die("procinfo");
+  return 0;
+}
+
+void
+null1(void)
+{
+  uptime();
+}
+
+void
+getpid1(void)
+{
+  getpid();
+}
+
+void
+fork1(void)
+{
+  int pid;
+
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0)
+    exit(0);
+  wait(0);
+}
+
+void
+exec1(void)
+{
+  char *argv[] = { self, "-x", 0 };
+  int pid;
+
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    exec(self, argv);
+    die("exec");
+  }
+  wait(0);
+}
+
+// a child that echoes the pipe's bytes back, for pipelat.
+void
+pipestart(void)
+{
+  int cc;
+
+  if(pipe(fds) < 0)
+    die("pipe");
+  if((child = fork()) < 0)
+    die("fork");
+  if(child == 0){
+    while((cc = read(fds[0], buf, sizeof(buf))) > 0)
+      write(fds[1], buf, cc);
+    exit(0);
+  }
+}
+
+void
+pipestop(void)
+{
+  close(fds[0]);
+  close(fds[1]);
+  kill(child);
+  wait(0);
+}
+
+void
+pipelat1(void)
+{
+  if(write(fds[1], "x", 1) != 1 || read(fds[0], buf, 1) != 1)
+    die("pipe i/o");
+}
+
+// a child that reads and discards, for pipebw.
+void
+sinkstart(void)
+{
+  int pid;
+
+  if(pipe(fds) < 0)
+    die("pipe");
+  if((pid = fork()) < 0)
+    die("fork");
+  if(pid == 0){
+    close(fds[1]);
+    while(read(fds[0], buf, sizeof(buf)) > 0)
+      ;
+    exit(0);
+  }
+  close(fds[0]);
+}
+
+void
+sinkstop(void)
+{
+  close(fds[1]);
+  wait(0);
+}
+
+void
+pipebw1(void)
+{
+  if(write(fds[1], buf, sizeof(buf)) != sizeof(buf))
+    die("pipe write");
+}
+
+void
+sbrk1(void)
+{
+  char *p = sbrk(PGSIZE);
+
+  if(p == (char*)-1)
+    die("sbrk");
+  p[0] = 1;
+  sbrk(-PGSIZE);
+}
+
+void
+filestart(void)
+{
+  int i;
+
+  if((fd = open("benchfile", O_CREATE|O_RDWR|O_TRUNC)) < 0)
+    die("create");
+  for(i = 0; i < FILEBLKS; i++)
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf))
+      die("write");
+}
+
+void
+filestop(void)
+{
+  close(fd);
+  unlink("benchfile");
+}
+
+void
+openclose1(void)
+{
+  int f;
+
+  if((f = open("benchfile", O_RDONLY)) < 0)
+    die("open");
+  close(f);
+}
+
+void
+createunlink1(void)
+{
+  int f;
+
+  if((f = open("benchtmp", O_CREATE|O_RDWR)) < 0)
+    die("create");
+  close(f);
+  if(unlink("benchtmp") < 0)
+    die("unlink");
+}
+
+void
+seqwrite1(void)
+{
+  static int i;
+
+  if(pwrite(fd, buf, sizeof(buf), (i++ % FILEBLKS) * sizeof(buf)) != sizeof(buf))
+    die("pwrite");
+}
+
+void
+seqread1(void)
+{
+  static int i;
+
+  if(pread(fd, buf, sizeof(buf), (i++ % FILEBLKS) * sizeof(buf)) != sizeof(buf))
+    die("pread");
+}
+
+void
+randwrite1(void)
+{
+  if(pwrite(fd, buf, BSIZE, (rnd() % (FILEBLKS * PGSIZE / BSIZE)) * BSIZE) != BSIZE)
+    die("pwrite");
+}
+
+void
+randread1(void)
+{
+  if(pread(fd, buf, BSIZE, (rnd() % (FILEBLKS * PGSIZE / BSIZE)) * BSIZE) != BSIZE)
+    die("pread");
+}
+
+void
+dirstart(void)
+{
+  int f;
+
+  if(mkdir("benchdir") < 0 || mkdir("benchdir/a") < 0 || mkdir("benchdir/a/b") < 0)
+    die("mkdir");
+  if((f = open("benchdir/a/b/f", O_CREATE|O_RDWR)) < 0)
+    die("create");
+  close(f);
+}
+
+void
+dirstop(void)
+{
+  unlink("benchdir/a/b/f");
+  unlink("benchdir/a/b");
+  unlink("benchdir/a");
+  unlink("benchdir");
+}
+
+void
+lookup1(void)
+{
+  struct stat st;
+
+  if(stat("benchdir/a/b/f", &st) < 0)
+    die("stat");
+}
+
+struct bench {
+  char *name;
+  void (*op)(void);
+  int n;                    // operations to time, before -s
+  void (*start)(void);
+  void (*stop)(void);
+} benches[] = {
+  { "null",         null1,         20000, 0, 0 },
+  { "getpid",       getpid1,       20000, 0, 0 },
+  { "fork",         fork1,         200,   0, 0 },
+  { "exec",         exec1,         100,   0, 0 },
+  { "pipelat",      pipelat1,      5000,  pipestart, pipestop },
+  { "pipebw4k",     pipebw1,       2000,  sinkstart, sinkstop },
+  { "sbrk",         sbrk1,         5000,  0, 0 },
+  { "openclose",    openclose1,    2000,  filestart, filestop },
+  { "createunlink", createunlink1, 200,   0, 0 },
+  { "seqwrite4k",   seqwrite1,     FILEBLKS, filestart, filestop },
+  { "seqread4k",    seqread1,      4*FILEBLKS, filestart, filestop },
+  { "randwrite",    randwrite1,    FILEBLKS, filestart, filestop },
+  { "randread",     randread1,     4*FILEBLKS, filestart, filestop },
+  { "lookup",       lookup1,       2000,  dirstart, dirstop },
+};
+
+void
+run(struct bench *b, int scale)
+{
+  uint64 t0, t, c0;
+  int i, n = b->n * scale;
+
+  if(b->start)
+    b->start();
+  c0 = mycycles();
+  t0 = rdtime();
+  for(i = 0; i < n; i++){
+    b->op();
+    if((i & 63) == 63 && rdtime() - t0 > MAXRUN){
+      i++;
+      break;
+    }
+  }
+  t = rdtime() - t0;
+  c0 = mycycles() - c0;
+  if(b->stop)
+    b->stop();
+  if(t == 0)
+    t = 1;
+  printf("%s\t%d\t%l\t%l\n", b->name, i, (uint64)i * TICKCYCLES * 10 / t, c0 / i);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, scale = 1, any = 0;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0); // the exec benchmark's child
+  self = argv[0];
+  if(argc > 2 && strcmp(argv[1], "-s") == 0){
+    scale = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(scale <= 0){
+    fprintf(2, "Usage: bench [-s scale] [name...]\n");
+    exit(1);
+  }
+
+  printf("# bench\tops\tops/s\tcycles/op\n");
+  for(i = 0; i < NELEM(benches); i++){
+    if(argc > 1){
+      for(j = 1; j < argc; j++)
+        if(strcmp(argv[j], benches[i].name) == 0)
+          break;
+      if(j == argc)
+        continue;
+    }
+    run(&benches[i], scale);
+    any = 1;
+  }
+  if(!any){
+    fprintf(2, "bench: no such benchmark\n");
+    exit(1);
+  }
+  exit(0);
+}
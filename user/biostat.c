@@ -0,0 +1,83 @@
+#include "kernel/types.h"
+#include "kernel/biostat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// print the buffer cache counters, in all and for each kind
+// of block. with file arguments, read each file through and
+// print what that cost.
+
+static char buf[4096];
+
+void
+get(struct biostat *st)
+{
+  if(biostat(st) < 0){
+    fprintf(2, "biostat: failed\n");
+    exit(1);
+  }
+}
+
+char *kinds[NBIO] = {
+[BIO_LOG]    "log",
+[BIO_INODE]  "inode",
+[BIO_BITMAP] "bitmap",
+[BIO_DATA]   "data",
+[BIO_OTHER]  "other",
+};
+
+// the per-kind counters of b less those of a.
+void
+bykind(struct biostat *a, struct biostat *b)
+{
+  int k;
+
+  printf("kind\thit\tmiss\tevict\twait\n");
+  for(k = 0; k < NBIO; k++)
+    printf("%s\t%l\t%l\t%l\t%l\n", kinds[k], b->hit[k] - a->hit[k],
+           b->miss[k] - a->miss[k], b->evict[k] - a->evict[k],
+           b->wait[k] - a->wait[k]);
+}
+
+void
+readall(char *path)
+{
+  int fd, n;
+
+  if((fd = open(path, O_RDONLY)) < 0){
+    fprintf(2, "biostat: cannot open %s\n", path);
+    exit(1);
+  }
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    ;
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct biostat a, b;
+  int i, t;
+
+  get(&a);
+  if(argc < 2){
+    printf("%d buffers\n", a.nbuf);
+    printf("hit\tmiss\tra\tra-hit\tra-unused\n");
+    printf("%l\t%l\t%l\t%l\t%l\n", a.nhit, a.nmiss, a.ra_issued, a.ra_hit, a.ra_unused);
+    memset(&b, 0, sizeof(b));
+    bykind(&b, &a);
+    exit(0);
+  }
+
+  t = uptime();
+  for(i = 1; i < argc; i++)
+    readall(argv[i]);
+  t = uptime() - t;
+  get(&b);
+  printf("hit\tmiss\tra\tra-hit\tra-unused\tticks\n");
+  printf("%l\t%l\t%l\t%l\t%l\t%d\n", b.nhit - a.nhit, b.nmiss - a.nmiss,
+         b.ra_issued - a.ra_issued, b.ra_hit - a.ra_hit,
+         b.ra_unused - a.ra_unused, t);
+  bykind(&a, &b);
+  exit(0);
+}
@@ -0,0 +1,67 @@
+//
+// copyin() microbenchmark: a child write()s large buffers into a
+// pipe, so the kernel copies them in from user memory, and the
+// parent drains the pipe. build the kernel with COPYIN_WALK=1 to
+// compare against the page-table walking copyin().
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define BUFSZ (32*1024)
+#define TOTAL (4*1024*1024)
+
+char buf[BUFSZ];
+
+int
+main(int argc, char *argv[])
+{
+  int fds[2], pid, n, total;
+  int t0, t1;
+
+  total = TOTAL;
+  if(argc > 1)
+    total = atoi(argv[1]) * 1024;
+
+  if(pipe(fds) < 0){
+    printf("copybench: pipe failed\n");
+    exit(1);
+  }
+
+  for(int i = 0; i < BUFSZ; i++)
+    buf[i] = i;
+
+  t0 = uuptime();
+  pid = fork();
+  if(pid < 0){
+    printf("copybench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(int left = total; left > 0; left -= n){
+      n = left < BUFSZ ? left : BUFSZ;
+      if(write(fds[1], buf, n) != n){
+        printf("copybench: write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  close(fds[1]);
+  n = 0;
+  for(int cc; (cc = read(fds[0], buf, BUFSZ)) > 0; )
+    n += cc;
+  close(fds[0]);
+  wait(0);
+  t1 = uuptime();
+
+  if(n != total){
+    printf("copybench: read %d bytes, expected %d\n", n, total);
+    exit(1);
+  }
+  printf("copybench: %d KB in %d ticks\n", total / 1024, t1 - t0);
+  exit(0);
+}
@@ -1,8 +1,122 @@
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/fs.h"
 
+// find [-j n] path name：-j 时由 n 个子进程并行遍历目录树。
+// 待遍历的目录放在共享内存中的队列里，每个工作进程取出一个目录，
+// 把其中的子目录放回队列，别的工作进程就可以同时处理它们。
+// 队列满时工作进程自己递归处理子目录，所以不会因队列满而卡住。
+
+#define NQUEUE 256      // 队列中最多的目录数
+#define MAXJOBS NPROC   // 最多的工作进程数
+
+struct queue {
+  struct mutex mu;
+  struct cond cv;      // 有新目录入队，或者遍历已经结束
+  int head, tail;      // 下一个取出和放入的位置，只增不减
+  int busy;            // 正在处理目录的工作进程数
+  char path[NQUEUE][MAXPATH];
+};
+
+struct queue *q;        // 0 表示串行模式
+
+void find(char *path, char *str);
+
+// 输出找到的路径。整行用一次 write() 写出，
+// 这样多个工作进程的输出不会交错在同一行里。
+void
+found(char *path)
+{
+  char line[512+1];
+  int n = strlen(path);
+
+  memmove(line, path, n);
+  line[n++] = '\n';
+  write(1, line, n);
+}
+
+// 把目录 path 放入队列，成功返回 1；队列满或路径太长返回 0，由调用者自己处理。
+int
+push(char *path)
+{
+  if(q == 0 || strlen(path) >= MAXPATH)
+    return 0;
+  mutex_lock(&q->mu);
+  if(q->tail - q->head == NQUEUE){
+    mutex_unlock(&q->mu);
+    return 0;
+  }
+  strcpy(q->path[q->tail % NQUEUE], path);
+  q->tail++;
+  cond_signal(&q->cv);
+  mutex_unlock(&q->mu);
+  return 1;
+}
+
+// 工作进程：不断从队列中取出目录来遍历，直到队列为空且
+// 没有进程在处理目录（也就不会再有新目录入队）。
+void
+worker(char *str)
+{
+  char path[MAXPATH];
+
+  mutex_lock(&q->mu);
+  for(;;){
+    while(q->head == q->tail && q->busy > 0)
+      cond_wait(&q->cv, &q->mu);
+    if(q->head == q->tail)
+      break;
+    strcpy(path, q->path[q->head % NQUEUE]);
+    q->head++;
+    q->busy++;
+    mutex_unlock(&q->mu);
+
+    find(path, str);
+
+    mutex_lock(&q->mu);
+    q->busy--;
+  }
+  cond_broadcast(&q->cv);  // 叫醒其他还在等待的工作进程，让它们也退出
+  mutex_unlock(&q->mu);
+  exit(0);
+}
+
+// 用 n 个工作进程并行遍历 path。
+void
+pfind(char *path, char *str, int n)
+{
+  struct stat st;
+  int id, i, pid;
+
+  if(stat(path, &st) < 0 || st.type != T_DIR){
+    find(path, str); // 不是目录，没什么可并行的
+    return;
+  }
+  if((id = shm_create(sizeof(struct queue))) < 0 ||
+     (q = shm_attach(id)) == (struct queue*)-1){
+    fprintf(2, "find: cannot create work queue\n");
+    exit(1);
+  }
+  mutex_init(&q->mu);
+  cond_init(&q->cv);
+  push(path);
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      fprintf(2, "find: fork failed\n");
+      break;
+    }
+    if(pid == 0)
+      worker(str);
+  }
+  if(i == 0)
+    worker(str); // 一个子进程都没有创建成功，就自己遍历
+  while(wait(0) > 0)
+    ;
+  shm_detach(q);
+}
+
 char*
 fmtname(char *path)
 {
@@ -19,8 +133,8 @@ void
 find(char *path, char* str)
 {
   char buf[512], *p;
-  int fd;
-  struct dirent de; // 目录条目结构，用于读取目录内容
+  int fd, i, n;
+  struct dirent de[8]; // 一批目录条目；find()会递归，用户栈只有一页，不能太大
   struct stat st; // 文件状态结构，用于获取文件信息
 
 // 尝试以只读方式打开 path，若失败则输出错误信息并返回
@@ -41,7 +155,7 @@ find(char *path, char* str)
   case T_FILE:
     // 如果是普通文件，直接输出文件路径
     if(!strcmp(str, fmtname(path))) //当str和fmtname(path)相同时strcmp()返回0
-        printf("%s\n", path);
+        found(path);
     break;
 
   case T_DIR:
@@ -54,23 +168,26 @@ find(char *path, char* str)
     strcpy(buf, path);
     p = buf + strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){ // 逐个读取目录中的条目
-      if(de.inum == 0) // 如果条目无效（inum为0），则跳过
-        continue;
-      memmove(p, de.name, DIRSIZ); // 将目录项的名称复制到 buf 中。
-      p[DIRSIZ] = 0;  // 在 buf 的末尾添加空字符 \0，形成有效的路径。
-      if(stat(buf, &st) < 0){
-        printf("find: cannot stat %s\n", buf);
-        continue;
-      }
-      char* lstname = fmtname(buf);
-      // 跳过当前目录 (".") 和父目录 ("..") 的检查。
-      // 这是因为在 UNIX 和 Linux 文件系统中，每个目录都会包含这两个特殊目录项
-      if(strcmp(".", lstname) == 0 || strcmp("..", lstname) == 0){ 
-        continue;
-      }
-      else{
-        find(buf, str);
+    // 每次getdents()读取一批条目，getdents()已跳过无效（inum为0）的条目
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+      for(i = 0; i < n / sizeof(de[0]); i++){
+        memmove(p, de[i].name, DIRSIZ); // 将目录项的名称复制到 buf 中。
+        p[DIRSIZ] = 0;  // 在 buf 的末尾添加空字符 \0，形成有效的路径。
+        // 跳过当前目录 (".") 和父目录 ("..") 的检查。
+        // 这是因为在 UNIX 和 Linux 文件系统中，每个目录都会包含这两个特殊目录项
+        if(strcmp(".", p) == 0 || strcmp("..", p) == 0)
+          continue;
+        // 相对于已打开的目录直接查看条目，不需要打开它
+        if(fstatat(fd, p, &st) < 0){
+          printf("find: cannot stat %s\n", buf);
+          continue;
+        }
+        // 并行模式下子目录尽量交给队列，队列满了才自己递归
+        if(st.type == T_DIR){
+          if(!push(buf))
+            find(buf, str);
+        } else if(!strcmp(str, p))
+          found(buf);
       }
     }
     break;
@@ -81,13 +198,25 @@ find(char *path, char* str)
 int
 main(int argc, char* argv[])
 {
+  int n = 0;
+
+  if(argc > 2 && strcmp(argv[1], "-j") == 0){
+    n = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+    if(n <= 0 || n > MAXJOBS){
+      fprintf(2, "find: -j takes 1 to %d\n", MAXJOBS);
+      exit(1);
+    }
+  }
   if(argc != 3){
     printf("Parameters are not enough\n");
     exit(1);
   }
-  else{
+  if(n > 0)
+    pfind(argv[1], argv[2], n);
+  else
     find(argv[1], argv[2]);
-  }
   exit(0);
 }
 
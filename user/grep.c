@@ -1,35 +1,205 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled once into a shift-and matcher: bit i
+// of the state is set when the first i pattern elements match
+// the text just read, so one pass over a line, a few word
+// operations a character, tries every starting offset at once.
+// When the pattern starts with a literal string, lines without
+// it are skipped without running the matcher at all. Patterns
+// too long for the state word fall back to the backtracking
+// matcher.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-char buf[1024];
+#define NELEM 63        // pattern elements the state word holds
+
+char buf[16384+1];      // +1 for a newline after a last, unterminated line
+char obuf[4096];
+int on;
+
 int match(char*, char*);
 
+struct {
+  int bol;              // pattern starts with ^
+  int eol;              // and ends with $
+  int n;                // elements; bit n of the state is a match
+  uint64 b[256];        // b[c]: elements that match c
+  uint64 star;          // elements followed by *
+  uint64 init;          // the state before any text
+  int nrun;             // longest run of starred elements
+  char pre[NELEM+1];    // literal prefix every match starts with
+  int npre;
+  char *re;             // the pattern, if it's too long to compile
+} pat;
+
+// parse re into elements: a character or ., each maybe
+// followed by *. returns -1 if there are too many.
+int
+compile(char *re)
+{
+  int i, n, run;
+  uint64 bit;
+
+  if(re[0] == '^'){
+    pat.bol = 1;
+    re++;
+  }
+  for(n = 0; re[0] != '\0'; n++){
+    if(re[0] == '$' && re[1] == '\0'){
+      pat.eol = 1;
+      break;
+    }
+    if(n == NELEM)
+      return -1;
+    bit = 1UL << n;
+    if(re[0] == '.'){
+      for(i = 0; i < 256; i++)
+        pat.b[i] |= bit;
+    } else {
+      pat.b[(uchar)re[0]] |= bit;
+    }
+    if(re[1] == '*'){
+      pat.star |= bit;
+      re += 2;
+    } else {
+      if(re[0] != '.' && n == pat.npre)
+        pat.pre[pat.npre++] = re[0];
+      re += 1;
+    }
+  }
+  pat.n = n;
+
+  // a starred element can match nothing, so a state at one is
+  // also at the next; nrun bounds how far that carries.
+  for(i = run = 0; i < n; i++){
+    run = (pat.star >> i) & 1 ? run + 1 : 0;
+    if(run > pat.nrun)
+      pat.nrun = run;
+  }
+  pat.init = 1;
+  for(i = 0; i < pat.nrun; i++)
+    pat.init |= (pat.init & pat.star) << 1;
+
+  // a prefix only helps if a line can't match without it.
+  if(pat.bol)
+    pat.npre = 0;
+  pat.pre[pat.npre] = '\0';
+  return 0;
+}
+
+// does the line [p, e) match?
+int
+matchline(char *p, char *e)
+{
+  uint64 s, d, acc;
+  int i;
+
+  if(pat.re){
+    *e = '\0';
+    i = match(pat.re, p);
+    *e = '\n';
+    return i;
+  }
+  acc = 1UL << pat.n;
+  s = pat.init;
+  for(;;){
+    if((s & acc) && !pat.eol)
+      return 1;
+    if(p == e)
+      return (s & acc) != 0;
+    d = s & pat.b[(uchar)*p++];
+    s = ((d & ~pat.star) << 1) | (d & pat.star);
+    for(i = 0; i < pat.nrun; i++)
+      s |= (s & pat.star) << 1;
+    if(!pat.bol)
+      s |= pat.init;
+    else if(s == 0)
+      return 0;
+  }
+}
+
 void
-grep(char *pattern, int fd)
+output(char *p, int n)
+{
+  if(on + n > sizeof(obuf)){
+    write(1, obuf, on);
+    on = 0;
+  }
+  if(n > sizeof(obuf)){
+    write(1, p, n);
+    return;
+  }
+  memmove(obuf + on, p, n);
+  on += n;
+}
+
+// the first place in [p, e) the literal prefix starts, or 0.
+char*
+findpre(char *p, char *e)
+{
+  char c = pat.pre[0];
+
+  for(e -= pat.npre - 1; p < e; p++){
+    if(*p == c && memcmp(p, pat.pre, pat.npre) == 0)
+      return p;
+  }
+  return 0;
+}
+
+// print the matching lines of [p, e), which ends in a newline.
+void
+scan(char *p, char *e)
+{
+  char *q;
+
+  while(p < e){
+    if(pat.npre){
+      if((q = findpre(p, e)) == 0)
+        return;
+      while(q > p && q[-1] != '\n')
+        q--;
+      p = q;
+    }
+    for(q = p; *q != '\n'; q++)
+      ;
+    if(matchline(p, q))
+      output(p, q+1 - p);
+    p = q+1;
+  }
+}
+
+void
+grep(int fd)
 {
   int n, m;
-  char *p, *q;
+  char *p;
 
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
-    m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
+  for(;;){
+    n = read(fd, buf+m, sizeof(buf)-1-m);
+    if(n > 0)
+      m += n;
+    // the lines read so far, or at the end of the file or a
+    // line too long for buf, all of it as a line.
+    for(p = buf+m; p > buf && p[-1] != '\n'; p--)
+      ;
+    if(n <= 0 || (p == buf && m == sizeof(buf)-1)){
+      if(m > 0 && p != buf+m){
+        buf[m++] = '\n';
+        p = buf+m;
       }
-      p = q+1;
     }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    scan(buf, p);
+    if(on > 0){
+      write(1, obuf, on);
+      on = 0;
     }
+    m -= p - buf;
+    memmove(buf, p, m);
+    if(n <= 0)
+      break;
   }
 }
 
@@ -37,16 +207,18 @@ int
 main(int argc, char *argv[])
 {
   int fd, i;
-  char *pattern;
 
   if(argc <= 1){
     fprintf(2, "usage: grep pattern [file ...]\n");
     exit(1);
   }
-  pattern = argv[1];
+  if(compile(argv[1]) < 0){
+    memset(&pat, 0, sizeof(pat));
+    pat.re = argv[1];
+  }
 
   if(argc <= 2){
-    grep(pattern, 0);
+    grep(0);
     exit(0);
   }
 
@@ -55,7 +227,7 @@ main(int argc, char *argv[])
       printf("grep: cannot open %s\n", argv[i]);
       exit(1);
     }
-    grep(pattern, fd);
+    grep(fd);
     close(fd);
   }
   exit(0);
@@ -102,4 +274,3 @@ int matchstar(int c, char *re, char *text)
   }while(*text!='\0' && (*text++==c || c=='.'));
   return 0;
 }
-
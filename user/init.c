@@ -23,16 +23,16 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  // scratch files go in memory.
+  mkdir("/tmp");
+  if(mount("/tmp", "tmpfs") < 0)
+    printf("init: mount /tmp failed\n");
+
   for(;;){
     printf("init: starting sh\n");
-    pid = fork();
+    pid = spawn("sh", argv, 0, 0);
     if(pid < 0){
-      printf("init: fork failed\n");
-      exit(1);
-    }
-    if(pid == 0){
-      exec("sh", argv);
-      printf("init: exec sh failed\n");
+      printf("init: spawn sh failed\n");
       exit(1);
     }
 
@@ -0,0 +1,29 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/kmemstat.h"
+#include "user/user.h"
+
+// print the per-cpu page allocator counters, and the free
+// blocks of each size in the buddy allocator.
+int
+main(int argc, char *argv[])
+{
+  struct kmemstat st;
+  int i;
+
+  if(kmemstat(&st) < 0){
+    fprintf(2, "kmemstat: failed\n");
+    exit(1);
+  }
+  printf("cpu\talloc\tfree\tsteal\tpages\n");
+  for(i = 0; i < NCPU; i++)
+    printf("%d\t%l\t%l\t%l\t%l\n", i, st.nalloc[i], st.nfree[i], st.nsteal[i], st.npage[i]);
+  printf("buddy");
+  for(i = 0; i < NBUDDY; i++)
+    printf("\t%l", st.nbuddy[i]);
+  printf("\t(free blocks of 1, 2, 4, ... pages)\n");
+  printf("zeroed\t%l\t(%l allocations served)\n", st.nzero, st.nzerohit);
+  if(st.nswap > 0)
+    printf("swap\t%l\t(%l free, %l in, %l out)\n", st.nswap, st.nswapfree, st.nswapin, st.nswapout);
+  exit(0);
+}
@@ -0,0 +1,89 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+// lockstat [-r | command [args...]]: print the kernel's spin
+// lock statistics, most contended first, and, with -r, clear
+// them. with a command, clear them, run it, and print what it
+// did. hold times are in ns, taking a time CSR cycle as 100ns
+// as in qemu.
+
+static struct lockstat ls[NLOCKSTAT];
+static int n;
+
+#define NS(t) ((t) * 100000000 / TICKCYCLES)
+
+void
+get(int reset)
+{
+  if((n = lockstat(ls, NLOCKSTAT, reset)) < 0){
+    fprintf(2, "lockstat: lockstat failed\n");
+    exit(1);
+  }
+}
+
+void
+show(void)
+{
+  struct lockstat t;
+  int i, j;
+  uint64 tot, totc;
+
+  // insertion sort by contended acquires, then acquires.
+  for(i = 1; i < n; i++){
+    t = ls[i];
+    for(j = i; j > 0; j--){
+      if(ls[j-1].ncontend > t.ncontend ||
+         (ls[j-1].ncontend == t.ncontend && ls[j-1].nacquire >= t.nacquire))
+        break;
+      ls[j] = ls[j-1];
+    }
+    ls[j] = t;
+  }
+
+  tot = totc = 0;
+  printf("lock\t\tacquires\tcontended\tspins\tmaxhold<ns\n");
+  for(i = 0; i < n; i++){
+    if(ls[i].nacquire == 0)
+      continue;
+    printf("%s\t%s%l\t%l\t%l\t%l\n", ls[i].name, strlen(ls[i].name) < 8 ? "\t" : "",
+           ls[i].nacquire, ls[i].ncontend, ls[i].nspin, NS(ls[i].maxhold));
+    tot += ls[i].nacquire;
+    totc += ls[i].ncontend;
+  }
+  printf("total\t\t%l\t%l\n", tot, totc);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pid;
+
+  if(argc < 2){
+    get(0);
+    show();
+    exit(0);
+  }
+  if(strcmp(argv[1], "-r") == 0){
+    get(1);
+    show();
+    exit(0);
+  }
+
+  get(1);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "lockstat: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv+1);
+    fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  get(0);
+  show();
+  exit(0);
+}
@@ -0,0 +1,111 @@
+//
+// malloc() benchmark: runs the same allocation patterns with the
+// size-class bins in umalloc.c and with the first-fit allocator
+// alone (uslab = 0), and prints the ticks (1/10 second) each took.
+// each run is in a fresh child, so neither inherits the other's heap.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NLIVE 2000
+#define ROUNDS 200000
+
+extern int uslab;
+
+void *live[NLIVE];
+static uint seed = 1;
+
+static uint
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// a small size, mostly under 128 bytes, like sh's command trees.
+static uint
+smallsize(void)
+{
+  uint r = rnd();
+
+  if(r % 8 == 0)
+    return 128 + r % 768;
+  return 8 + r % 120;
+}
+
+// allocate and free one block at a time.
+static void
+pairs(int rounds)
+{
+  for(int i = 0; i < rounds; i++){
+    char *p = malloc(smallsize());
+    if(p == 0){
+      printf("mallocbench: out of memory\n");
+      exit(1);
+    }
+    p[0] = 1;
+    free(p);
+  }
+}
+
+// keep NLIVE blocks of mixed sizes live, replacing a random one
+// each round, so that the heap fragments.
+static void
+churn(int rounds)
+{
+  int i, k;
+
+  for(i = 0; i < NLIVE; i++)
+    live[i] = 0;
+  for(i = 0; i < rounds; i++){
+    k = rnd() % NLIVE;
+    if(live[k])
+      free(live[k]);
+    if((live[k] = malloc(smallsize())) == 0){
+      printf("mallocbench: out of memory\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < NLIVE; i++)
+    free(live[i]);
+}
+
+static void
+run(char *name, void (*fn)(int), int rounds)
+{
+  int t0, t[2], slab, xstatus;
+
+  for(slab = 1; slab >= 0; slab--){
+    t0 = uuptime();
+    int pid = fork();
+    if(pid < 0){
+      printf("mallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      uslab = slab;
+      seed = 1;
+      fn(rounds);
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+    t[slab] = uuptime() - t0;
+  }
+  printf("%s: %d rounds, bins %d ticks, first-fit %d ticks\n", name, rounds, t[1], t[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rounds = ROUNDS;
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+  run("pairs", pairs, rounds);
+  run("churn", churn, rounds);
+  exit(0);
+}
@@ -0,0 +1,22 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// nice prio command [args...]: run command at scheduling
+// priority prio, 0 (first) to NPRIO-1 (last).
+int
+main(int argc, char **argv)
+{
+  if(argc < 3){
+    fprintf(2, "usage: nice prio command [args...]\n");
+    exit(1);
+  }
+  if(setpriority(0, atoi(argv[1])) < 0){
+    fprintf(2, "nice: bad priority %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv+2);
+  fprintf(2, "nice: exec %s failed\n", argv[2]);
+  exit(1);
+}
@@ -0,0 +1,81 @@
+//
+// pipe throughput: a child writes TOTAL bytes into a pipe using
+// write()s of several sizes, the parent reads them back, and the
+// rate is printed in MB/s (one tick is 1/10 second).
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define TOTAL (8*1024*1024)
+#define MAXBUF (64*1024)
+
+char buf[MAXBUF];
+
+int
+bench(int bufsz, int total)
+{
+  int fds[2], pid, n, cc;
+  int t0, t1;
+
+  if(pipe(fds) < 0){
+    printf("pipebench: pipe failed\n");
+    exit(1);
+  }
+
+  t0 = uuptime();
+  pid = fork();
+  if(pid < 0){
+    printf("pipebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(int left = total; left > 0; left -= n){
+      n = left < bufsz ? left : bufsz;
+      if(write(fds[1], buf, n) != n){
+        printf("pipebench: write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  close(fds[1]);
+  n = 0;
+  while((cc = read(fds[0], buf, bufsz)) > 0)
+    n += cc;
+  close(fds[0]);
+  wait(0);
+  t1 = uuptime();
+
+  if(n != total){
+    printf("pipebench: read %d bytes, expected %d\n", n, total);
+    exit(1);
+  }
+  return t1 - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int sizes[] = { 1, 512, 4096, 65536 };
+  int total = TOTAL;
+
+  if(argc > 1)
+    total = atoi(argv[1]) * 1024;
+
+  for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    // one-byte writes are slow no matter what; keep that run short.
+    int t = sizes[i] == 1 ? total / 64 : total;
+    int ticks = bench(sizes[i], t);
+    if(ticks == 0)
+      ticks = 1;
+    // tenths of a MB/s
+    int rate = (uint64)t * 10 * 10 / ticks / (1024*1024);
+    printf("pipebench: %d-byte writes: %d KB in %d ticks, %d.%d MB/s\n",
+           sizes[i], t / 1024, ticks, rate / 10, rate % 10);
+  }
+  exit(0);
+}
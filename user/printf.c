@@ -6,14 +6,40 @@
 
 static char digits[] = "0123456789ABCDEF";
 
+// output of one printf() call, collected so that it is
+// written with one write() rather than one per character.
+// output to fds 1 and 2 goes through stdout and stderr, so
+// that it stays in order with what's buffered there.
+struct pbuf {
+  int fd;
+  int n;
+  char buf[128];
+};
+
+static void
+flush(struct pbuf *b)
+{
+  if(b->n > 0){
+    if(b->fd == 1)
+      fwrite(b->buf, 1, b->n, stdout);
+    else if(b->fd == 2)
+      fwrite(b->buf, 1, b->n, stderr);
+    else
+      write(b->fd, b->buf, b->n);
+  }
+  b->n = 0;
+}
+
 static void
-putc(int fd, char c)
+putc(struct pbuf *b, char c)
 {
-  write(fd, &c, 1);
+  if(b->n == sizeof(b->buf))
+    flush(b);
+  b->buf[b->n++] = c;
 }
 
 static void
-printint(int fd, int xx, int base, int sgn)
+printint(struct pbuf *b, int xx, int base, int sgn)
 {
   char buf[16];
   int i, neg;
@@ -35,25 +61,28 @@ printint(int fd, int xx, int base, int sgn)
     buf[i++] = '-';
 
   while(--i >= 0)
-    putc(fd, buf[i]);
+    putc(b, buf[i]);
 }
 
 static void
-printptr(int fd, uint64 x) {
+printptr(struct pbuf *b, uint64 x) {
   int i;
-  putc(fd, '0');
-  putc(fd, 'x');
+  putc(b, '0');
+  putc(b, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
+    putc(b, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the given fd. Only understands %d, %x, %p, %s.
 void
 vprintf(int fd, const char *fmt, va_list ap)
 {
+  struct pbuf pb, *b = &pb;
   char *s;
   int c, i, state;
 
+  b->fd = fd;
+  b->n = 0;
   state = 0;
   for(i = 0; fmt[i]; i++){
     c = fmt[i] & 0xff;
@@ -61,37 +90,38 @@ vprintf(int fd, const char *fmt, va_list ap)
       if(c == '%'){
         state = '%';
       } else {
-        putc(fd, c);
+        putc(b, c);
       }
     } else if(state == '%'){
       if(c == 'd'){
-        printint(fd, va_arg(ap, int), 10, 1);
+        printint(b, va_arg(ap, int), 10, 1);
       } else if(c == 'l') {
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printint(b, va_arg(ap, uint64), 10, 0);
       } else if(c == 'x') {
-        printint(fd, va_arg(ap, int), 16, 0);
+        printint(b, va_arg(ap, int), 16, 0);
       } else if(c == 'p') {
-        printptr(fd, va_arg(ap, uint64));
+        printptr(b, va_arg(ap, uint64));
       } else if(c == 's'){
         s = va_arg(ap, char*);
         if(s == 0)
           s = "(null)";
         while(*s != 0){
-          putc(fd, *s);
+          putc(b, *s);
           s++;
         }
       } else if(c == 'c'){
-        putc(fd, va_arg(ap, uint));
+        putc(b, va_arg(ap, uint));
       } else if(c == '%'){
-        putc(fd, c);
+        putc(b, c);
       } else {
         // Unknown % sequence.  Print it to draw attention.
-        putc(fd, '%');
-        putc(fd, c);
+        putc(b, '%');
+        putc(b, c);
       }
       state = 0;
     }
   }
+  flush(b);
 }
 
 void
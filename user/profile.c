@@ -0,0 +1,256 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/procinfo.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+// profile [-r rate] command [args...]: run command with the
+// kernel sampling every CPU's pc rate times a tick (default
+// 10), then print the kernel functions the samples fell in,
+// most first, named from /kernel.sym. samples of user code
+// are only counted, by process.
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+#define NSHOW 20    // functions printed
+#define NPID  16    // processes whose user samples are counted
+
+struct sym {
+  uint64 addr;
+  char *name;
+  uint n;           // samples in [addr, next symbol's addr)
+};
+
+static struct sym *sym;
+static int nsym;
+
+static struct profsample ev[128];
+static struct procinfo pi[NPROC];
+
+static struct {
+  int pid;
+  uint n;
+} usr[NPID];
+
+static uint total, nuser, nother, nlost;
+
+uint64
+hex(char *s, char **end)
+{
+  uint64 x = 0;
+  int d;
+
+  for(;; s++){
+    if(*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      d = *s - 'a' + 10;
+    else
+      break;
+    x = x*16 + d;
+  }
+  *end = s;
+  return x;
+}
+
+// read the kernel's symbols, "address name" a line, keeping
+// those in the kernel's address range, sorted by address.
+void
+loadsyms(char *path)
+{
+  FILE *f;
+  char line[128], *p, *q;
+  uint64 addr;
+  struct sym t;
+  int fd, max, i, j;
+
+  if((fd = open(path, 0)) < 0){
+    fprintf(2, "profile: cannot open %s\n", path);
+    exit(1);
+  }
+  f = fdopen(fd, "r");
+  max = 0;
+  while(fgets(line, sizeof(line), f)){
+    addr = hex(line, &p);
+    if(addr < 0x80000000L || *p != ' ')
+      continue;
+    p++;
+    for(q = p; *q && *q != '\n'; q++)
+      ;
+    *q = 0;
+    if(nsym == max){
+      struct sym *n = malloc((max = max ? 2*max : 512) * sizeof(*sym));
+      if(n == 0){
+        fprintf(2, "profile: out of memory\n");
+        exit(1);
+      }
+      if(sym){
+        memmove(n, sym, nsym * sizeof(*sym));
+        free(sym);
+      }
+      sym = n;
+    }
+    sym[nsym].addr = addr;
+    sym[nsym].name = malloc(q - p + 1);
+    strcpy(sym[nsym].name, p);
+    sym[nsym].n = 0;
+    nsym++;
+  }
+  fclose(f);
+
+  for(i = 1; i < nsym; i++){
+    t = sym[i];
+    for(j = i; j > 0 && sym[j-1].addr > t.addr; j--)
+      sym[j] = sym[j-1];
+    sym[j] = t;
+  }
+}
+
+// the last symbol at or below pc, or 0.
+struct sym*
+lookup(uint64 pc)
+{
+  int lo = 0, hi = nsym, mid;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(sym[mid].addr <= pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &sym[lo-1] : 0;
+}
+
+void
+count(int n)
+{
+  struct sym *s;
+  int i, j;
+
+  for(i = 0; i < n; i++){
+    if(ev[i].pc == PROF_LOST){
+      nlost += ev[i].pid;
+      continue;
+    }
+    total++;
+    if(ev[i].user){
+      nuser++;
+      for(j = 0; j < NPID && usr[j].pid != 0 && usr[j].pid != ev[i].pid; j++)
+        ;
+      if(j < NPID){
+        usr[j].pid = ev[i].pid;
+        usr[j].n++;
+      }
+    } else if((s = lookup(ev[i].pc)) != 0){
+      s->n++;
+    } else {
+      nother++;
+    }
+  }
+}
+
+void
+show(void)
+{
+  int i, j, best;
+  struct sym t;
+
+  if(total == 0){
+    printf("profile: no samples\n");
+    return;
+  }
+  printf("%d samples, %d in user space\n", total, nuser);
+  if(nlost)
+    printf("%d samples dropped\n", nlost);
+  for(i = 0; i < NSHOW && i < nsym; i++){
+    best = i;
+    for(j = i+1; j < nsym; j++)
+      if(sym[j].n > sym[best].n)
+        best = j;
+    if(sym[best].n == 0)
+      break;
+    t = sym[i];
+    sym[i] = sym[best];
+    sym[best] = t;
+    printf("%d\t%d%%\t%s\n", sym[i].n, sym[i].n * 100 / total, sym[i].name);
+  }
+  if(nother)
+    printf("%d\t%d%%\t(unknown)\n", nother, nother * 100 / total);
+  for(i = 0; i < NPID && usr[i].pid != 0; i++)
+    printf("%d\t%d%%\t(user, pid %d)\n", usr[i].n, usr[i].n * 100 / total, usr[i].pid);
+}
+
+// is pid still running (not yet a zombie)?
+int
+running(int pid)
+{
+  int i, n;
+
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < n; i++)
+    if(pi[i].pid == pid)
+      return pi[i].state != 4; // ZOMBIE
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int rate = 10, pid, n, done;
+
+  if(argc > 2 && strcmp(argv[1], "-r") == 0){
+    rate = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || rate <= 0){
+    fprintf(2, "Usage: profile [-r rate] command [args...]\n");
+    exit(1);
+  }
+  loadsyms("/kernel.sym");
+
+  // throw away samples left from an earlier run.
+  while(profread(ev, NELEM(ev)) > 0)
+    ;
+  if(profile(rate) < 0){
+    fprintf(2, "profile: bad rate %d\n", rate);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "profile: fork failed\n");
+    profile(0);
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv+1);
+    fprintf(2, "profile: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+
+  // drain the rings until the command has exited.
+  done = 0;
+  for(;;){
+    if((n = profread(ev, NELEM(ev))) < 0){
+      fprintf(2, "profile: profread failed\n");
+      break;
+    }
+    if(n > 0){
+      count(n);
+      continue;
+    }
+    if(done)
+      break;
+    if(!running(pid)){
+      profile(0);
+      done = 1; // one more pass for anything recorded meanwhile
+    } else {
+      sleep(1);
+    }
+  }
+  wait(0);
+  show();
+  exit(0);
+}
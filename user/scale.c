@@ -0,0 +1,294 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/riscv.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+// scale [-t ticks] [test...]: for each test, or the named
+// ones, run 1, 2, ... NCPU worker processes at once, each
+// hammering one kernel path on objects of its own, and print
+// the total rate as the workers are added:
+//
+//   test workers cpus ops/s contended lock
+//
+// separated by tabs, after a "#" header line. cpus is how many
+// CPUs the workers were seen on, and contended the number of
+// contended spin lock acquires during the run, with the lock
+// that had the most. A path that scales shows ops/s growing
+// with the workers; a flat line is contention.
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+static char buf[BSIZE];
+static int pfds[2];                 // a worker's own pipe
+static char name[16];               // a worker's own file or directory
+static int dfd;                     // and an fd for it
+static struct lockstat ls[NLOCKSTAT];
+
+void
+die(char *what)
+{
+  fprintf(2, "scale: %s failed\n", what);
+  exit(1);
+}
+
+// kalloc() and kfree(): grow by a page, touch it, shrink.
+void
+sbrk1(void)
+{
+  char *p = sbrk(PGSIZE);
+
+  if(p == (char*)-1)
+    die("sbrk");
+  p[0] = 1;
+  sbrk(-PGSIZE);
+}
+
+// bread() of a block no other worker uses: a directory's
+// contents come through the buffer cache, not the page cache.
+void
+biostart(int w)
+{
+  strcpy(name, "scale.d0");
+  name[7] = '0' + w;
+  unlink(name);
+  if(mkdir(name) < 0 || (dfd = open(name, O_RDONLY)) < 0)
+    die("mkdir");
+}
+
+void
+bio1(void)
+{
+  if(pread(dfd, buf, sizeof(buf), 0) <= 0)
+    die("pread");
+}
+
+void
+biostop(void)
+{
+  close(dfd);
+  unlink(name);
+}
+
+// iget() and iput() of a file no other worker uses.
+void
+igetstart(int w)
+{
+  int fd;
+
+  strcpy(name, "scale.f0");
+  name[7] = '0' + w;
+  if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+    die("create");
+  close(fd);
+}
+
+void
+iget1(void)
+{
+  struct stat st;
+
+  if(stat(name, &st) < 0)
+    die("stat");
+}
+
+void
+igetstop(void)
+{
+  unlink(name);
+}
+
+// a byte through a pipe of the worker's own.
+void
+pipestart(int w)
+{
+  if(pipe(pfds) < 0)
+    die("pipe");
+}
+
+void
+pipe1(void)
+{
+  if(write(pfds[1], "x", 1) != 1 || read(pfds[0], buf, 1) != 1)
+    die("pipe i/o");
+}
+
+void
+pipestop(void)
+{
+  close(pfds[0]);
+  close(pfds[1]);
+}
+
+// sleep() and wakeup(): every worker bounces a byte off a
+// child of its own, so all of them are waking each other's
+// CPUs at once.
+static int tochild[2], fromchild[2], partner;
+
+void
+wakestart(int w)
+{
+  int cc;
+
+  if(pipe(tochild) < 0 || pipe(fromchild) < 0)
+    die("pipe");
+  if((partner = fork()) < 0)
+    die("fork");
+  if(partner == 0){
+    close(tochild[1]);
+    close(fromchild[0]);
+    while((cc = read(tochild[0], buf, 1)) > 0)
+      write(fromchild[1], buf, cc);
+    exit(0);
+  }
+  close(tochild[0]);
+  close(fromchild[1]);
+}
+
+void
+wake1(void)
+{
+  if(write(tochild[1], "x", 1) != 1 || read(fromchild[0], buf, 1) != 1)
+    die("pipe i/o");
+}
+
+void
+wakestop(void)
+{
+  close(tochild[1]);
+  close(fromchild[0]);
+  wait(0);
+}
+
+struct test {
+  char *name;
+  void (*op)(void);
+  void (*start)(int);
+  void (*stop)(void);
+} tests[] = {
+  { "kalloc", sbrk1, 0, 0 },
+  { "bget",   bio1,  biostart, biostop },
+  { "iget",   iget1, igetstart, igetstop },
+  { "pipe",   pipe1, pipestart, pipestop },
+  { "wakeup", wake1, wakestart, wakestop },
+};
+
+// contended acquires since the last call, and the lock with most.
+uint64
+contention(char **top)
+{
+  uint64 tot = 0, most = 0;
+  int i, n;
+
+  *top = "-";
+  if((n = lockstat(ls, NLOCKSTAT, 1)) < 0)
+    die("lockstat");
+  for(i = 0; i < n; i++){
+    tot += ls[i].ncontend;
+    if(ls[i].ncontend > most){
+      most = ls[i].ncontend;
+      *top = ls[i].name;
+    }
+  }
+  return tot;
+}
+
+// one worker: wait for the start tick, run t's operation until
+// the stop tick, and send back the count and the CPUs it saw.
+void
+worker(struct test *t, int w, int start, int stop, int fd)
+{
+  uint64 res[2] = { 0, 0 };
+
+  if(t->start)
+    t->start(w);
+  while(uuptime() < start)
+    ;
+  while(uuptime() < stop){
+    t->op();
+    res[0]++;
+    res[1] |= 1UL << ugetcpu();
+  }
+  if(t->stop)
+    t->stop();
+  write(fd, res, sizeof(res));
+  exit(0);
+}
+
+void
+run(struct test *t, int nw, int ticks)
+{
+  int fds[2], w, pid, start, ncpu;
+  uint64 res[2], ops = 0, cpus = 0, contended;
+  char *top;
+
+  if(pipe(fds) < 0)
+    die("pipe");
+  // leave the workers a tick to get going before they start.
+  start = uptime() + 2;
+  for(w = 0; w < nw; w++){
+    if((pid = fork()) < 0)
+      die("fork");
+    if(pid == 0){
+      close(fds[0]);
+      worker(t, w, start, start + ticks, fds[1]);
+    }
+  }
+  close(fds[1]);
+  while(uptime() < start)
+    sleep(1);
+  contention(&top);
+  for(w = 0; w < nw; w++){
+    if(read(fds[0], res, sizeof(res)) != sizeof(res))
+      die("worker");
+    ops += res[0];
+    cpus |= res[1];
+  }
+  contended = contention(&top);
+  close(fds[0]);
+  for(w = 0; w < nw; w++)
+    wait(0);
+
+  for(ncpu = 0; cpus; cpus &= cpus - 1)
+    ncpu++;
+  printf("%s\t%d\t%d\t%l\t%l\t%s\n", t->name, nw, ncpu,
+         ops * 10 / ticks, contended, top);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, ticks = 10, any = 0;
+
+  if(argc > 2 && strcmp(argv[1], "-t") == 0){
+    ticks = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
+  if(ticks <= 0){
+    fprintf(2, "Usage: scale [-t ticks] [test...]\n");
+    exit(1);
+  }
+
+  printf("# test\tworkers\tcpus\tops/s\tcontended\tlock\n");
+  for(i = 0; i < NELEM(tests); i++){
+    if(argc > 1){
+      for(j = 1; j < argc; j++)
+        if(strcmp(argv[j], tests[i].name) == 0)
+          break;
+      if(j == argc)
+        continue;
+    }
+    for(n = 1; n <= NCPU; n++)
+      run(&tests[i], n, ticks);
+    any = 1;
+  }
+  if(!any){
+    fprintf(2, "scale: no such test\n");
+    exit(1);
+  }
+  exit(0);
+}
@@ -1,8 +1,12 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
+#include "kernel/fs.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,6 +56,11 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
+int isbuiltin(char*);
+int builtin(char**);
+char *lookpath(char*);
+void forget(char*);
 
 // Execute cmd.  Never returns.
 void
@@ -75,7 +84,9 @@ runcmd(struct cmd *cmd)
     ecmd = (struct execcmd*)cmd;
     if(ecmd->argv[0] == 0)
       exit(1);
-    exec(ecmd->argv[0], ecmd->argv);
+    if(isbuiltin(ecmd->argv[0]))
+      exit(builtin(ecmd->argv));
+    exec(lookpath(ecmd->argv[0]), ecmd->argv);
     fprintf(2, "exec %s failed\n", ecmd->argv[0]);
     break;
 
@@ -130,6 +141,417 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Can cmd be run with spawn(), given nfa file actions
+// already needed to set up its standard input and output?
+// Only commands, redirections and pipelines can; lists and
+// background commands need a shell process of their own.
+int
+spawnable(struct cmd *cmd, int nfa)
+{
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    // a bare redirection like "> x" still has to open x.
+    return ecmd->argv[0] != 0 && nfa <= NSPAWNFA;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    return spawnable(rcmd->cmd, nfa+1);
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left, nfa+3) && spawnable(pcmd->right, nfa+3);
+  }
+  return 0;
+}
+
+// Run spawnable cmd without forking the shell: each command
+// is spawn()ed with the file actions fa[0..nfa) that the
+// pipes and redirections around it call for, in the order
+// runcmd() would apply them. Returns the number of children
+// to wait for; lastpid is the last command's, whose exit
+// status is the pipeline's.
+int lastpid;
+
+int
+spawncmd(struct cmd *cmd, struct spawnfa *fa, int nfa)
+{
+  int p[2], n;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  default:
+    panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if((lastpid = spawn(lookpath(ecmd->argv[0]), ecmd->argv, fa, nfa)) < 0){
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      forget(ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    fa[nfa].op = SPAWN_OPEN;
+    fa[nfa].fd = rcmd->fd;
+    fa[nfa].omode = rcmd->mode;
+    fa[nfa].path = (uint64)rcmd->file;
+    return spawncmd(rcmd->cmd, fa, nfa+1);
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0){
+      fprintf(2, "pipe failed\n");
+      return 0;
+    }
+    fa[nfa].op = SPAWN_DUP;
+    fa[nfa].fd = p[1];
+    fa[nfa].newfd = 1;
+    fa[nfa+1].op = SPAWN_CLOSE;
+    fa[nfa+1].fd = p[0];
+    fa[nfa+2].op = SPAWN_CLOSE;
+    fa[nfa+2].fd = p[1];
+    n = spawncmd(pcmd->left, fa, nfa+3);
+    fa[nfa].fd = p[0];
+    fa[nfa].newfd = 0;
+    n += spawncmd(pcmd->right, fa, nfa+3);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
+// The command under cmd's redirections, if it's a builtin.
+struct execcmd*
+builtincmd(struct cmd *cmd)
+{
+  struct execcmd *ecmd;
+
+  while(cmd->type == REDIR)
+    cmd = ((struct redircmd*)cmd)->cmd;
+  if(cmd->type != EXEC)
+    return 0;
+  ecmd = (struct execcmd*)cmd;
+  if(ecmd->argv[0] == 0 || !isbuiltin(ecmd->argv[0]))
+    return 0;
+  return ecmd;
+}
+
+// Run a builtin in the shell itself, with the redirections
+// around it in place for as long as it runs.
+int
+runbuiltin(struct cmd *cmd)
+{
+  struct redircmd *rcmd;
+  int save, status;
+
+  if(cmd->type == EXEC)
+    return builtin(((struct execcmd*)cmd)->argv);
+
+  rcmd = (struct redircmd*)cmd;
+  if((save = dup(rcmd->fd)) < 0){
+    fprintf(2, "dup failed\n");
+    return 1;
+  }
+  close(rcmd->fd);
+  if(open(rcmd->file, rcmd->mode) < 0){
+    fprintf(2, "open %s failed\n", rcmd->file);
+    status = 1;
+  } else {
+    status = runbuiltin(rcmd->cmd);
+    close(rcmd->fd);
+  }
+  // fds 0, 1 and 2 are always open, so this lands on rcmd->fd.
+  dup(save);
+  close(save);
+  return status;
+}
+
+// Run cmd and return its exit status. Lists and builtins are
+// run by the shell itself, and commands and pipelines are
+// spawn()ed, so a script of simple commands never forks the
+// shell; only what needs a shell process of its own, like a
+// background command, gets a forked copy.
+int
+runtop(struct cmd *cmd, struct spawnfa *fa)
+{
+  struct listcmd *lcmd;
+  int n, pid, xstatus, status;
+
+  if(cmd->type == EXEC && ((struct execcmd*)cmd)->argv[0] == 0)
+    return 0; // an empty line
+  if(cmd->type == LIST){
+    lcmd = (struct listcmd*)cmd;
+    runtop(lcmd->left, fa);
+    return runtop(lcmd->right, fa);
+  }
+  if(builtincmd(cmd))
+    return runbuiltin(cmd);
+
+  status = 0;
+  if(spawnable(cmd, 0)){
+    lastpid = -1;
+    n = spawncmd(cmd, fa, 0);
+    if(lastpid < 0)
+      status = 1;
+  } else {
+    lastpid = fork1();
+    if(lastpid == 0)
+      runcmd(cmd);
+    n = 1;
+  }
+  while(n-- > 0){
+    if((pid = wait(&xstatus)) == lastpid)
+      status = xstatus;
+  }
+  return status;
+}
+
+//PAGEBREAK!
+// Builtins
+
+int status;  // of the last command
+
+int
+cd(int argc, char **argv)
+{
+  if(argc != 2 || chdir(argv[1]) < 0){
+    fprintf(2, "cannot cd %s\n", argc > 1 ? argv[1] : "");
+    return 1;
+  }
+  forget(0); // commands found in the old directory
+  return 0;
+}
+
+// Echo with one write(), so the line isn't split up among
+// the output of commands running alongside.
+int
+echo(int argc, char **argv)
+{
+  char out[128];
+  int i, n, m;
+
+  n = 0;
+  for(i = 1; i < argc; i++){
+    m = strlen(argv[i]);
+    if(n + m + 1 > sizeof(out)){
+      write(1, out, n);
+      n = 0;
+    }
+    memmove(out + n, argv[i], m);
+    n += m;
+    if(i + 1 < argc)
+      out[n++] = ' ';
+  }
+  out[n++] = '\n';
+  return write(1, out, n) == n ? 0 : 1;
+}
+
+// test expr, or [ expr ]: a string, a file test, or a
+// comparison, maybe preceded by !. Its status is 0 if the
+// expression is true, 1 if false, and 2 if it can't be read.
+int
+test(int argc, char **argv)
+{
+  struct stat st;
+  int neg = 0, r;
+  char *op;
+
+  if(strcmp(argv[0], "[") == 0){
+    if(strcmp(argv[argc-1], "]") != 0){
+      fprintf(2, "[: missing ]\n");
+      return 2;
+    }
+    argc--;
+  }
+  argc--;
+  argv++;
+  if(argc > 0 && strcmp(argv[0], "!") == 0){
+    neg = 1;
+    argc--;
+    argv++;
+  }
+
+  switch(argc){
+  case 0:
+    r = 0;
+    break;
+  case 1:
+    r = argv[0][0] != 0;
+    break;
+  case 2:
+    op = argv[0];
+    if(strcmp(op, "-n") == 0)
+      r = argv[1][0] != 0;
+    else if(strcmp(op, "-z") == 0)
+      r = argv[1][0] == 0;
+    else if(strcmp(op, "-e") == 0)
+      r = stat(argv[1], &st) == 0;
+    else if(strcmp(op, "-f") == 0)
+      r = stat(argv[1], &st) == 0 && st.type == T_FILE;
+    else if(strcmp(op, "-d") == 0)
+      r = stat(argv[1], &st) == 0 && st.type == T_DIR;
+    else
+      goto bad;
+    break;
+  case 3:
+    op = argv[1];
+    if(strcmp(op, "=") == 0)
+      r = strcmp(argv[0], argv[2]) == 0;
+    else if(strcmp(op, "!=") == 0)
+      r = strcmp(argv[0], argv[2]) != 0;
+    else if(strcmp(op, "-eq") == 0)
+      r = atoi(argv[0]) == atoi(argv[2]);
+    else if(strcmp(op, "-ne") == 0)
+      r = atoi(argv[0]) != atoi(argv[2]);
+    else if(strcmp(op, "-lt") == 0)
+      r = atoi(argv[0]) < atoi(argv[2]);
+    else if(strcmp(op, "-gt") == 0)
+      r = atoi(argv[0]) > atoi(argv[2]);
+    else
+      goto bad;
+    break;
+  default:
+    goto bad;
+  }
+  return r != neg ? 0 : 1;
+
+bad:
+  fprintf(2, "test: bad expression\n");
+  return 2;
+}
+
+// exit [n]: leave the shell, with status n or the last
+// command's.
+int
+exit1(int argc, char **argv)
+{
+  exit(argc > 1 ? atoi(argv[1]) : status);
+  return 0;
+}
+
+struct {
+  char *name;
+  int (*fn)(int, char**);
+} builtins[] = {
+  { "cd",   cd },
+  { "echo", echo },
+  { "test", test },
+  { "[",    test },
+  { "exit", exit1 },
+};
+
+int
+isbuiltin(char *name)
+{
+  int i;
+
+  for(i = 0; i < sizeof(builtins)/sizeof(builtins[0]); i++)
+    if(strcmp(name, builtins[i].name) == 0)
+      return 1;
+  return 0;
+}
+
+int
+builtin(char **argv)
+{
+  int i, argc;
+
+  for(argc = 0; argv[argc]; argc++)
+    ;
+  for(i = 0; i < sizeof(builtins)/sizeof(builtins[0]); i++)
+    if(strcmp(argv[0], builtins[i].name) == 0)
+      return builtins[i].fn(argc, argv);
+  return 1;
+}
+
+//PAGEBREAK!
+// Command paths
+
+// A command without a slash in its name is looked for in the
+// current directory and then in /. Where it was found is
+// remembered in a hash table, so running it again costs no
+// failed lookups; the table is forgotten on cd, and an entry
+// that no longer works is dropped when the command fails.
+
+#define NHASH 31
+
+struct hash {
+  struct hash *next;
+  char name[DIRSIZ+1];
+  char path[DIRSIZ+2];
+} *hashtab[NHASH];
+
+uint
+hashname(char *s)
+{
+  uint h = 0;
+
+  while(*s)
+    h = h*31 + *s++;
+  return h % NHASH;
+}
+
+char*
+lookpath(char *name)
+{
+  static char *dirs[] = { "", "/" };
+  struct hash *h;
+  struct stat st;
+  char path[DIRSIZ+2];
+  int i;
+
+  if(strchr(name, '/') || strlen(name) > DIRSIZ)
+    return name;
+  for(h = hashtab[hashname(name)]; h; h = h->next)
+    if(strcmp(h->name, name) == 0)
+      return h->path;
+
+  for(i = 0; i < sizeof(dirs)/sizeof(dirs[0]); i++){
+    strcpy(path, dirs[i]);
+    strcpy(path + strlen(path), name);
+    if(stat(path, &st) == 0 && st.type == T_FILE)
+      break;
+  }
+  if(i == sizeof(dirs)/sizeof(dirs[0]))
+    return name; // let exec() report it
+  if((h = malloc(sizeof(*h))) == 0)
+    return name;
+  strcpy(h->name, name);
+  strcpy(h->path, path);
+  h->next = hashtab[hashname(name)];
+  hashtab[hashname(name)] = h;
+  return h->path;
+}
+
+// Forget where name was found, or every command if name is 0.
+void
+forget(char *name)
+{
+  struct hash **hp, *h;
+  int i;
+
+  for(i = 0; i < NHASH; i++){
+    for(hp = &hashtab[i]; (h = *hp) != 0; ){
+      if(name == 0 || strcmp(h->name, name) == 0){
+        *hp = h->next;
+        free(h);
+      } else {
+        hp = &h->next;
+      }
+    }
+  }
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -142,9 +564,11 @@ getcmd(char *buf, int nbuf)
 }
 
 int
-main(void)
+main(int argc, char *argv[])
 {
   static char buf[100];
+  struct spawnfa fa[NSPAWNFA];
+  struct cmd *cmd;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -155,18 +579,25 @@ main(void)
     }
   }
 
+  // sh script: read the commands from script.
+  if(argc > 1){
+    close(0);
+    if(open(argv[1], O_RDONLY) != 0){
+      fprintf(2, "sh: cannot open %s\n", argv[1]);
+      exit(1);
+    }
+  }
+
   // Read and run input commands.
   while(getcmd(buf, sizeof(buf)) >= 0){
-    if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' '){
-      // Chdir must be called by the parent, not the child.
-      buf[strlen(buf)-1] = 0;  // chop \n
-      if(chdir(buf+3) < 0)
-        fprintf(2, "cannot cd %s\n", buf+3);
+    // Parse in the shell, so that builtins like cd run in
+    // the shell itself, and simple commands and pipelines can
+    // be spawn()ed straight from the program file rather than
+    // forking a copy of the shell first.
+    if((cmd = parsecmd(buf)) == 0)
       continue;
-    }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    status = runtop(cmd, fa);
+    freecmd(cmd);
   }
   exit(0);
 }
@@ -178,6 +609,19 @@ panic(char *s)
   exit(1);
 }
 
+// Report a syntax error in the command being parsed. The
+// shell parses commands itself now, so this mustn't exit;
+// parsecmd() throws the command away instead.
+int parseerr;
+
+void
+syntax(char *s)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", s);
+  parseerr = 1;
+}
+
 int
 fork1(void)
 {
@@ -331,11 +775,16 @@ parsecmd(char *s)
   struct cmd *cmd;
 
   es = s + strlen(s);
+  parseerr = 0;
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +828,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +856,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +884,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS-1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -491,3 +948,42 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free a command tree. The strings point into the line it
+// was parsed from.
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,90 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/syshist.h"
+#include "user/user.h"
+
+// syslat [-r | command [args...]]: print the kernel's syscall
+// latency histograms and, with -r, clear them. with a command,
+// clear them, run it, and print what it did.
+// times are in ns, taking a time CSR cycle as 100ns as in qemu.
+
+static struct syshist h;
+
+#define NS(t) ((t) * 100000000 / TICKCYCLES)
+
+void
+get(int reset)
+{
+  if(syshist(&h, reset) < 0){
+    fprintf(2, "syslat: syshist failed\n");
+    exit(1);
+  }
+}
+
+void
+show(void)
+{
+  uint64 n, sum, p50, p99, seen;
+  int num, b;
+  char *name;
+
+  printf("syscall\tcalls\tp50<ns\tp99<ns\tmax<ns\n");
+  for(num = 1; num < NSYSHIST; num++){
+    n = 0;
+    for(b = 0; b < NHBUCKET; b++)
+      n += h.count[num][b];
+    if(n == 0)
+      continue;
+    // percentiles, as the upper bound of the bucket they fall in.
+    p50 = p99 = seen = sum = 0;
+    for(b = 0; b < NHBUCKET; b++){
+      if(h.count[num][b] == 0)
+        continue;
+      sum += h.count[num][b];
+      if(p50 == 0 && sum * 2 >= n)
+        p50 = NS(2UL << b);
+      if(p99 == 0 && sum * 100 >= n * 99)
+        p99 = NS(2UL << b);
+      seen = NS(2UL << b);
+    }
+    name = sysname(num);
+    if(name)
+      printf("%s", name);
+    else
+      printf("%d", num);
+    printf("\t%l\t%l\t%l\t%l\n", n, p50, p99, seen);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pid;
+
+  if(argc < 2){
+    get(0);
+    show();
+    exit(0);
+  }
+  if(strcmp(argv[1], "-r") == 0){
+    get(1);
+    show();
+    exit(0);
+  }
+
+  get(1);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "syslat: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv+1);
+    fprintf(2, "syslat: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  get(0);
+  show();
+  exit(0);
+}
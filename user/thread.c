@@ -0,0 +1,94 @@
+// Mutexes and condition variables for threads made by
+// clone(), or for processes sharing memory.
+//
+// Both only enter the kernel when they must: a mutex nobody
+// else wants is taken and released with one atomic
+// instruction, and futex_wake() is only called when the mutex
+// may have waiters.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define MUTEXSPIN 100  // tries before sleeping in mutex_lock()
+
+// mutex states
+#define UNLOCKED  0
+#define LOCKED    1  // and nobody waiting
+#define CONTENDED 2  // and a thread may be sleeping on it
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = UNLOCKED;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+  return __sync_bool_compare_and_swap(&m->state, UNLOCKED, LOCKED);
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int i, c;
+
+  // a mutex is usually held briefly; spin a little first.
+  for(i = 0; i < MUTEXSPIN; i++){
+    if((c = __sync_val_compare_and_swap(&m->state, UNLOCKED, LOCKED)) == UNLOCKED)
+      return;
+    if(c == CONTENDED)
+      break;
+  }
+
+  // say there's a waiter, then sleep until we get it. we can't
+  // know whether others are still waiting, so take it as
+  // CONTENDED, and the unlock will wake one more.
+  while(__sync_lock_test_and_set(&m->state, CONTENDED) != UNLOCKED)
+    futex_wait(&m->state, CONTENDED);
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != LOCKED){
+    __sync_lock_release(&m->state);
+    futex_wake(&m->state, 1);
+  }
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+// release m and sleep until cond_signal() or cond_broadcast(),
+// then take m again. there may be spurious wakeups, so the
+// caller must check its condition in a loop.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  // other waiters may have been woken too; make sure
+  // mutex_unlock() wakes them.
+  while(__sync_lock_test_and_set(&m->state, CONTENDED) != UNLOCKED)
+    futex_wait(&m->state, CONTENDED);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1 << 30); // all of them
+}
@@ -0,0 +1,92 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/procinfo.h"
+#include "user/user.h"
+
+// top [interval [count]]: print per-process accounting. with an
+// interval (in ticks), print it count times (default: forever),
+// with each process's share of a CPU over the interval.
+// times are in milliseconds, taking a tick as 100ms. rss is the
+// resident user memory, kern what the kernel keeps for the
+// process: its page tables, kernel stack and trapframe.
+
+static char *states[] = {
+  "unused", "sleep", "runble", "run", "zombie"
+};
+
+static struct procinfo cur[NPROC], prev[NPROC];
+static int ncur, nprev;
+
+#define MS(t) ((t) * 100 / TICKCYCLES)
+
+void
+snapshot(void)
+{
+  if((ncur = procinfo(cur, NPROC)) < 0){
+    fprintf(2, "top: procinfo failed\n");
+    exit(1);
+  }
+}
+
+// the runtime pi had at the previous snapshot, or 0.
+uint64
+lastrun(struct procinfo *pi)
+{
+  int i;
+
+  for(i = 0; i < nprev; i++)
+    if(prev[i].pid == pi->pid)
+      return prev[i].runtime;
+  return 0;
+}
+
+void
+show(int interval)
+{
+  struct procinfo *pi;
+  char *state;
+  int i;
+
+  printf("pid\tpri\tstate\t%%cpu\trun-ms\twait-ms\tvcsw\tivcsw\tpgflt\tmem-kb\trss-kb\tkern-kb\tname\n");
+  for(i = 0; i < ncur; i++){
+    pi = &cur[i];
+    state = pi->state >= 0 && pi->state < 5 ? states[pi->state] : "???";
+    printf("%d\t%d\t%s\t", pi->pid, pi->priority, state);
+    if(interval > 0)
+      printf("%l", (pi->runtime - lastrun(pi)) * 100 / ((uint64)interval * TICKCYCLES));
+    else
+      printf("-");
+    printf("\t%l\t%l\t%d\t%d\t%d\t%l\t%l\t%l\t%s\n", MS(pi->runtime), MS(pi->waittime),
+           pi->nvcsw, pi->nivcsw, pi->npgfault, pi->sz / 1024, pi->nrss * 4,
+           (pi->nupt + pi->nkpt + pi->nkpages) * 4, pi->name);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int interval = 0, count = -1;
+
+  if(argc > 1 && (interval = atoi(argv[1])) <= 0){
+    fprintf(2, "usage: top [interval [count]]\n");
+    exit(1);
+  }
+  if(argc > 2)
+    count = atoi(argv[2]);
+
+  snapshot();
+  if(interval == 0){
+    show(0);
+    exit(0);
+  }
+  while(count < 0 || count-- > 0){
+    memmove(prev, cur, sizeof(cur));
+    nprev = ncur;
+    sleep(interval);
+    snapshot();
+    show(interval);
+    if(count != 0)
+      printf("\n");
+  }
+  exit(0);
+}
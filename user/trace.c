@@ -1,27 +1,103 @@
 #include "kernel/param.h"
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/procinfo.h"
+#include "kernel/trace.h"
 #include "user/user.h"
 
+// trace mask command [args...]: run command with the syscalls
+// whose bits are set in mask traced (bit 0: page faults), printing
+// the events the kernel records as it goes.
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+static struct traceent ev[64];
+static struct procinfo pi[NPROC];
+
+// is pid still running (not yet a zombie)?
+int
+running(int pid)
+{
+  int i, n;
+
+  n = procinfo(pi, NPROC);
+  for(i = 0; i < n; i++)
+    if(pi[i].pid == pid)
+      return pi[i].state != 4; // ZOMBIE
+  return 0;
+}
+
+// print the events traceread() returned, oldest first;
+// each CPU's ring comes out in order, but not across CPUs.
+void
+print(int n)
+{
+  struct traceent t;
+  int i, j;
+
+  for(i = 1; i < n; i++){
+    t = ev[i];
+    for(j = i; j > 0 && ev[j-1].time > t.time; j--)
+      ev[j] = ev[j-1];
+    ev[j] = t;
+  }
+  for(i = 0; i < n; i++){
+    if(ev[i].num == TRACE_LOST)
+      printf("trace: cpu %d dropped %l events\n", ev[i].cpu, ev[i].ret);
+    else if(ev[i].num == TRACE_FAULT)
+      printf("%d: fault scause %p addr %p pc %p\n", ev[i].pid,
+             ev[i].arg[0], ev[i].arg[1], ev[i].arg[2]);
+    else if(sysname(ev[i].num))
+      printf("%d: syscall %s -> %d\n", ev[i].pid, sysname(ev[i].num), (int)ev[i].ret);
+    else
+      printf("%d: syscall %d -> %d\n", ev[i].pid, ev[i].num, (int)ev[i].ret);
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
-  int i;
-  char *nargv[MAXARG];
+  int pid, n, done;
 
   if(argc < 3 || (argv[1][0] < '0' || argv[1][0] > '9')){
     fprintf(2, "Usage: %s mask command\n", argv[0]);
     exit(1);
   }
 
-  if (trace(atoi(argv[1])) < 0) {
-    fprintf(2, "%s: trace failed\n", argv[0]);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "%s: fork failed\n", argv[0]);
+    exit(1);
+  }
+  if(pid == 0){
+    if(trace(atoi(argv[1])) < 0){
+      fprintf(2, "%s: trace failed\n", argv[0]);
+      exit(1);
+    }
+    exec(argv[2], argv+2);
+    fprintf(2, "%s: exec %s failed\n", argv[0], argv[2]);
     exit(1);
   }
-  
-  for(i = 2; i < argc && i < MAXARG; i++){
-    nargv[i-2] = argv[i];
+
+  // drain the rings until the command has exited and
+  // nothing more is left.
+  done = 0;
+  for(;;){
+    if((n = traceread(ev, NELEM(ev))) < 0){
+      fprintf(2, "%s: traceread failed\n", argv[0]);
+      break;
+    }
+    if(n > 0){
+      print(n);
+      continue;
+    }
+    if(done)
+      break;
+    if(!running(pid))
+      done = 1; // one more pass for anything recorded meanwhile
+    else
+      sleep(1);
   }
-  exec(nargv[0], nargv);
+  wait(0);
   exit(0);
 }
@@ -1,6 +1,9 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/syscall.h"
 #include "user/user.h"
 
 char*
@@ -32,14 +35,39 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memmove and memcmp work a word at a time (eight per
+// iteration where they can) once both pointers are word aligned;
+// see kernel/string.c.
+
+typedef uint64 __attribute__((may_alias)) word;
+
+#define WSIZE sizeof(word)
+#define WMASK (WSIZE - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  word w, *wdst;
+
+  while(n > 0 && ((uint64)cdst & WMASK)){
+    *cdst++ = c;
+    n--;
+  }
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  wdst = (word*)cdst;
+  for(; n >= 8*WSIZE; n -= 8*WSIZE, wdst += 8){
+    wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+    wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE)
+    *wdst++ = w;
+  cdst = (char*)wdst;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -55,12 +83,10 @@ strchr(const char *s, char c)
 char*
 gets(char *buf, int max)
 {
-  int i, cc;
-  char c;
+  int i, c;
 
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
+    if((c = fgetc(stdin)) < 0)
       break;
     buf[i++] = c;
     if(c == '\n' || c == '\r')
@@ -70,18 +96,11 @@ gets(char *buf, int max)
   return buf;
 }
 
+// stat n without opening it.
 int
 stat(const char *n, struct stat *st)
 {
-  int fd;
-  int r;
-
-  fd = open(n, O_RDONLY);
-  if(fd < 0)
-    return -1;
-  r = fstat(fd, st);
-  close(fd);
-  return r;
+  return fstatat(AT_FDCWD, n, st);
 }
 
 int
@@ -100,15 +119,52 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  const word *ws;
+  word *wd;
+  int aligned;
 
   dst = vdst;
   src = vsrc;
+  aligned = (((uint64)src ^ (uint64)dst) & WMASK) == 0;
   if (src > dst) {
+    if(aligned){
+      while(n > 0 && ((uint64)dst & WMASK)){
+        *dst++ = *src++;
+        n--;
+      }
+      ws = (const word*)src;
+      wd = (word*)dst;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      src = (const char*)ws;
+      dst = (char*)wd;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(aligned){
+      while(n > 0 && ((uint64)dst & WMASK)){
+        *--dst = *--src;
+        n--;
+      }
+      ws = (const word*)src;
+      wd = (word*)dst;
+      for(; n >= 8*WSIZE; n -= 8*WSIZE){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      src = (const char*)ws;
+      dst = (char*)wd;
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -119,6 +175,23 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+
+  if((((uint64)p1 ^ (uint64)p2) & WMASK) == 0){
+    while (n > 0 && ((uint64)p1 & WMASK)) {
+      if (*p1 != *p2) {
+        return *p1 - *p2;
+      }
+      p1++;
+      p2++;
+      n--;
+    }
+    // skip equal words; the bytes loop finds the difference.
+    while (n >= WSIZE && *(word*)p1 == *(word*)p2) {
+      p1 += WSIZE;
+      p2 += WSIZE;
+      n -= WSIZE;
+    }
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -134,3 +207,370 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+static char *sysnames[] = {
+[SYS_fork]    "fork",
+[SYS_exit]    "exit",
+[SYS_wait]    "wait",
+[SYS_pipe]    "pipe",
+[SYS_read]    "read",
+[SYS_kill]    "kill",
+[SYS_exec]    "exec",
+[SYS_fstat]   "fstat",
+[SYS_chdir]   "chdir",
+[SYS_dup]     "dup",
+[SYS_getpid]  "getpid",
+[SYS_sbrk]    "sbrk",
+[SYS_sleep]   "sleep",
+[SYS_uptime]  "uptime",
+[SYS_open]    "open",
+[SYS_write]   "write",
+[SYS_mknod]   "mknod",
+[SYS_unlink]  "unlink",
+[SYS_link]    "link",
+[SYS_mkdir]   "mkdir",
+[SYS_close]   "close",
+[SYS_trace]   "trace",
+[SYS_sysinfo] "sys_info",
+[SYS_kmemstat] "kmemstat",
+[SYS_fsync]   "fsync",
+[SYS_biostat] "biostat",
+[SYS_setpriority] "setpriority",
+[SYS_getpriority] "getpriority",
+[SYS_procinfo] "procinfo",
+[SYS_traceread] "traceread",
+[SYS_syshist] "syshist",
+[SYS_ring_enter] "ring_enter",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_spawn]   "spawn",
+[SYS_lockstat] "lockstat",
+[SYS_pread]   "pread",
+[SYS_pwrite]  "pwrite",
+[SYS_readv]   "readv",
+[SYS_writev]  "writev",
+[SYS_getdents] "getdents",
+[SYS_fstatat] "fstatat",
+[SYS_clone]   "clone",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_shm_create] "shm_create",
+[SYS_shm_attach] "shm_attach",
+[SYS_shm_detach] "shm_detach",
+[SYS_mount]   "mount",
+[SYS_profile] "profile",
+[SYS_profread] "profread",
+[SYS_sendfile] "sendfile",
+};
+
+// the name of system call num, or 0.
+char*
+sysname(int num)
+{
+  if(num <= 0 || num >= sizeof(sysnames)/sizeof(sysnames[0]))
+    return 0;
+  return sysnames[num];
+}
+
+// getpid() and uptime() without a syscall, from the
+// USYSCALL page the kernel maps into every process.
+int
+ugetpid(void)
+{
+  return ((volatile struct usyscall*)USYSCALL)->pid;
+}
+
+int
+uuptime(void)
+{
+  return ((volatile struct usyscall*)USYSCALL)->ticks;
+}
+
+// the CPU this process is on; it may move at any moment, so
+// this is only good for seeing where work ran.
+int
+ugetcpu(void)
+{
+  return ((volatile struct usyscall*)USYSCALL)->cpu;
+}
+
+// Buffered streams.
+//
+// A FILE reads or writes its fd a buffer at a time, so that
+// a program handling a byte or a line at a time makes one
+// system call per STREAMBUF bytes. Output to the console is
+// flushed at each newline, output to stderr at once, and
+// other output when the buffer fills. Reading from stdin
+// flushes stdout first, so prompts appear.
+//
+// Buffered output would be lost by exec() and exit(), and
+// written twice if fork() copied it, so those (and spawn(),
+// to keep output in order) flush every stream first; the
+// system calls themselves are _fork() and so on.
+
+#define STREAMBUF 512
+#define NSTREAM   8
+
+#define S_READ  0x1
+#define S_WRITE 0x2
+#define S_LINE  0x4   // flush output at each newline
+#define S_NOBUF 0x8   // write output at once
+#define S_MODE  0x10  // S_LINE has been decided
+#define S_EOF   0x20
+#define S_ERR   0x40
+
+struct iobuf {
+  int fd;
+  int flags;    // 0 if the slot is free
+  int r;        // input: buf[r..n) is still to be read
+  int n;        // output: buf[0..n) is still to be written
+  char buf[STREAMBUF];
+};
+
+static struct iobuf iob[NSTREAM] = {
+  { 0, S_READ },
+  { 1, S_WRITE },
+  { 2, S_WRITE|S_NOBUF },
+};
+
+FILE *stdin = &iob[0];
+FILE *stdout = &iob[1];
+FILE *stderr = &iob[2];
+
+FILE*
+fdopen(int fd, const char *mode)
+{
+  struct iobuf *f;
+
+  for(f = iob; f < iob + NSTREAM; f++){
+    if(f->flags == 0){
+      f->fd = fd;
+      f->flags = mode[0] == 'w' ? S_WRITE : S_READ;
+      f->r = f->n = 0;
+      return f;
+    }
+  }
+  return 0;
+}
+
+// write out f's buffered output; with f 0, every stream's.
+int
+fflush(FILE *f)
+{
+  int i, r;
+
+  if(f == 0){
+    r = 0;
+    for(f = iob; f < iob + NSTREAM; f++)
+      if(f->flags & S_WRITE)
+        r |= fflush(f);
+    return r;
+  }
+  if((f->flags & S_WRITE) == 0)
+    return 0;
+  for(i = 0; i < f->n; i += r){
+    if((r = write(f->fd, f->buf + i, f->n - i)) <= 0){
+      f->flags |= S_ERR;
+      f->n = 0;
+      return -1;
+    }
+  }
+  f->n = 0;
+  return 0;
+}
+
+int
+fclose(FILE *f)
+{
+  int r;
+
+  r = fflush(f);
+  if(close(f->fd) < 0)
+    r = -1;
+  f->flags = 0;
+  return r;
+}
+
+// output to a terminal is line buffered.
+static void
+setmode(FILE *f)
+{
+  struct stat st;
+
+  if(fstat(f->fd, &st) == 0 && st.type == T_DEVICE)
+    f->flags |= S_LINE;
+  f->flags |= S_MODE;
+}
+
+static int
+hasnl(const char *s, int n)
+{
+  while(n-- > 0)
+    if(*s++ == '\n')
+      return 1;
+  return 0;
+}
+
+int
+fwrite(const void *p, int size, int nmemb, FILE *f)
+{
+  const char *s = p;
+  int n = size * nmemb, m, i;
+
+  if((f->flags & S_MODE) == 0)
+    setmode(f);
+  if(n >= STREAMBUF && f->n == 0){
+    // too big to be worth copying.
+    for(i = 0; i < n; i += m){
+      if((m = write(f->fd, s + i, n - i)) <= 0){
+        f->flags |= S_ERR;
+        return size ? i / size : 0;
+      }
+    }
+    return nmemb;
+  }
+  for(i = 0; i < n; i += m){
+    if(f->n == STREAMBUF && fflush(f) < 0)
+      return size ? i / size : 0;
+    m = n - i;
+    if(m > STREAMBUF - f->n)
+      m = STREAMBUF - f->n;
+    memmove(f->buf + f->n, s + i, m);
+    f->n += m;
+  }
+  if((f->flags & S_NOBUF) || ((f->flags & S_LINE) && hasnl(s, n)))
+    if(fflush(f) < 0)
+      return 0;
+  return nmemb;
+}
+
+int
+fputc(int c, FILE *f)
+{
+  char cc = c;
+
+  if(fwrite(&cc, 1, 1, f) != 1)
+    return -1;
+  return (uchar)cc;
+}
+
+int
+fputs(const char *s, FILE *f)
+{
+  int n = strlen(s);
+
+  if(fwrite(s, 1, n, f) != n)
+    return -1;
+  return n;
+}
+
+// refill f's buffer. returns the number of bytes now in it.
+static int
+fill(FILE *f)
+{
+  int n;
+
+  if(f == stdin)
+    fflush(stdout);
+  f->r = f->n = 0;
+  if((n = read(f->fd, f->buf, STREAMBUF)) <= 0){
+    f->flags |= n < 0 ? S_ERR : S_EOF;
+    return 0;
+  }
+  f->n = n;
+  return n;
+}
+
+int
+fgetc(FILE *f)
+{
+  if(f->r == f->n && fill(f) == 0)
+    return -1;
+  return (uchar)f->buf[f->r++];
+}
+
+// read a line, up to max-1 bytes, into buf, keeping the
+// newline. returns 0 at end of file.
+char*
+fgets(char *buf, int max, FILE *f)
+{
+  int i, c;
+
+  for(i = 0; i+1 < max; ){
+    if((c = fgetc(f)) < 0)
+      break;
+    buf[i++] = c;
+    if(c == '\n')
+      break;
+  }
+  buf[i] = '\0';
+  return i > 0 ? buf : 0;
+}
+
+int
+fread(void *p, int size, int nmemb, FILE *f)
+{
+  char *d = p;
+  int n = size * nmemb, m, i;
+
+  for(i = 0; i < n; i += m){
+    if(f->r == f->n){
+      if(n - i >= STREAMBUF){
+        // read straight into the caller's buffer.
+        if((m = read(f->fd, d + i, n - i)) <= 0){
+          f->flags |= m < 0 ? S_ERR : S_EOF;
+          break;
+        }
+        continue;
+      }
+      if(fill(f) == 0)
+        break;
+    }
+    m = f->n - f->r;
+    if(m > n - i)
+      m = n - i;
+    memmove(d + i, f->buf + f->r, m);
+    f->r += m;
+  }
+  return size ? i / size : 0;
+}
+
+int
+feof(FILE *f)
+{
+  return (f->flags & S_EOF) != 0;
+}
+
+int
+ferror(FILE *f)
+{
+  return (f->flags & S_ERR) != 0;
+}
+
+int
+fork(void)
+{
+  fflush(0);
+  return _fork();
+}
+
+int
+exec(char *path, char **argv)
+{
+  fflush(0);
+  return _exec(path, argv);
+}
+
+int
+spawn(char *path, char **argv, struct spawnfa *fa, int nfa)
+{
+  fflush(0);
+  return _spawn(path, argv, fa, nfa);
+}
+
+int
+exit(int status)
+{
+  fflush(0);
+  _exit(status);
+}
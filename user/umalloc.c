@@ -5,6 +5,15 @@
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+//
+// Small blocks come from size-class bins in front of it: each
+// bin keeps a free list of equal-sized blocks carved out of
+// SLABSIZE chunks that the first-fit allocator hands out, so
+// allocating and freeing one is O(1) and never walks or
+// fragments the big free list. Bin blocks have a header like
+// any other, with size 0 (which no first-fit block has) and
+// ptr pointing at the bin, or at the next free block while on
+// the bin's free list. Bins never give their chunks back.
 
 typedef long Align;
 
@@ -21,12 +30,24 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+#define NBIN     6     // block sizes 32, 64, ... 1024 bytes, header included
+#define MINBLOCK 32
+#define SLABSIZE 4096
+
+struct bin {
+  uint size;           // bytes per block, header included
+  Header *free;        // free blocks, linked through s.ptr
+};
+
+static struct bin bins[NBIN];
+
+int uslab = 1;         // use the bins; mallocbench turns this off to compare
+
+static void
+krfree(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,6 +64,22 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  Header *bp;
+  struct bin *b;
+
+  bp = (Header*)ap - 1;
+  if(bp->s.size == 0){
+    b = (struct bin*)bp->s.ptr;
+    bp->s.ptr = b->free;
+    b->free = bp;
+    return;
+  }
+  krfree(bp);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,12 +93,12 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  krfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+static void*
+krmalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -88,3 +125,41 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// carve a new chunk into blocks for b.
+static int
+binfill(struct bin *b)
+{
+  char *chunk, *p;
+
+  if((chunk = krmalloc(SLABSIZE - sizeof(Header))) == 0)
+    return -1;
+  for(p = chunk; p + b->size <= chunk + SLABSIZE - sizeof(Header); p += b->size){
+    ((Header*)p)->s.ptr = b->free;
+    b->free = (Header*)p;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  struct bin *b;
+  Header *bp;
+  uint size;
+
+  if(!uslab || nbytes > (MINBLOCK << (NBIN-1)) - sizeof(Header))
+    return krmalloc(nbytes);
+
+  b = bins;
+  for(size = MINBLOCK; size - sizeof(Header) < nbytes; size <<= 1)
+    b++;
+  b->size = size;
+  if(b->free == 0 && binfill(b) < 0)
+    return 0;
+  bp = b->free;
+  b->free = bp->s.ptr;
+  bp->s.ptr = (Header*)b;
+  bp->s.size = 0;
+  return (void*)(bp + 1);
+}
@@ -1,6 +1,17 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct kmemstat;
+struct biostat;
+struct procinfo;
+struct traceent;
+struct profsample;
+struct syshist;
+struct ring;
+struct spawnfa;
+struct lockstat;
+struct iovec;
+typedef struct iobuf FILE;
 
 // system calls
 int fork(void);
@@ -26,8 +37,85 @@ int sleep(int);
 int uptime(void);
 int trace(int);
 int sysinfo(struct sysinfo *);
+int kmemstat(struct kmemstat *);
+int fsync(int);
+int biostat(struct biostat *);
+int setpriority(int, int);
+int getpriority(int);
+int procinfo(struct procinfo *, int);
+int traceread(struct traceent *, int);
+int syshist(struct syshist *, int);
+int ring_enter(struct ring *);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int spawn(char*, char**, struct spawnfa*, int);
+int lockstat(struct lockstat*, int, int);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int getdents(int, void*, int);
+int fstatat(int, const char*, struct stat*);
+int clone(void (*)(void*), void*, void*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int shm_create(uint);
+void *shm_attach(int);
+int shm_detach(void*);
+int mount(char*, char*);
+int profile(int);
+int profread(struct profsample*, int);
+int sendfile(int, int, int, int);
+
+// the counter CSRs, which start.c lets user code read. they
+// count for the CPU, not the process: a difference is only
+// the program's own if nothing else ran in between on that
+// CPU. procinfo() has per-process totals.
+static inline uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+static inline uint64
+rdinstret(void)
+{
+  uint64 x;
+  asm volatile("rdinstret %0" : "=r" (x));
+  return x;
+}
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+// thread.c
+struct mutex {
+  int state;
+};
+struct cond {
+  int seq;
+};
+void mutex_init(struct mutex*);
+int mutex_trylock(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
 
 // ulib.c
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _exec(char*, char**);
+int _spawn(char*, char**, struct spawnfa*, int);
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
 void *memmove(void*, const void*, int);
@@ -43,3 +131,19 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+char* sysname(int);
+int ugetpid(void);
+int uuptime(void);
+int ugetcpu(void);
+extern FILE *stdin, *stdout, *stderr;
+FILE* fdopen(int, const char*);
+int fclose(FILE*);
+int fflush(FILE*);
+int fgetc(FILE*);
+int fputc(int, FILE*);
+int fputs(const char*, FILE*);
+char* fgets(char*, int, FILE*);
+int fread(void*, int, int, FILE*);
+int fwrite(const void*, int, int, FILE*);
+int feof(FILE*);
+int ferror(FILE*);
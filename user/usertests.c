@@ -7,6 +7,13 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/procinfo.h"
+#include "kernel/ring.h"
+#include "kernel/spawn.h"
+#include "kernel/lockstat.h"
+#include "kernel/uio.h"
+#include "kernel/prof.h"
+#include "kernel/kmemstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -233,6 +240,1652 @@ copyinstr3(char *s)
   }
 }
 
+// fsync() waits for the log writer; it must accept
+// any open fd, reject bad ones, and leave data readable.
+void
+fsynctest(char *s)
+{
+  char buf[16];
+  int fd;
+
+  unlink("fsyncfile");
+  fd = open("fsyncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsyncfile failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "hello", 5) != 5){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("fsyncfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 5 || memcmp(buf, "hello", 5) != 0){
+    printf("%s: fsyncfile has wrong contents\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("fsyncfile");
+}
+
+// setpriority() checks its range and pid, and fork()
+// children start at their parent's priority.
+void
+prioritytest(char *s)
+{
+  int old, pid, xstatus;
+
+  old = getpriority(0);
+  if(old < 0 || old >= NPRIO){
+    printf("%s: getpriority returned %d\n", s, old);
+    exit(1);
+  }
+  if(setpriority(0, NPRIO) != -1 || setpriority(0, -1) != -1){
+    printf("%s: setpriority accepted a bad priority\n", s);
+    exit(1);
+  }
+  if(setpriority(999999, 0) != -1 || getpriority(999999) != -1){
+    printf("%s: setpriority accepted a bad pid\n", s);
+    exit(1);
+  }
+  if(setpriority(0, NPRIO-1) != 0 || getpriority(getpid()) != NPRIO-1){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(getpriority(0) == NPRIO-1 ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit priority\n", s);
+    exit(1);
+  }
+  setpriority(0, old);
+}
+
+// find this process in procinfo()'s output.
+static void
+myinfo(char *s, struct procinfo *me)
+{
+  static struct procinfo all[NPROC];
+  int i, n;
+
+  n = procinfo(all, NPROC);
+  for(i = 0; i < n; i++){
+    if(all[i].pid == getpid()){
+      *me = all[i];
+      return;
+    }
+  }
+  printf("%s: procinfo has no entry for pid %d\n", s, getpid());
+  exit(1);
+}
+
+// procinfo() counts sleeps, lazy page faults, cycles and
+// instructions.
+void
+procinfotest(char *s)
+{
+  struct procinfo a, b;
+  char *p;
+
+  myinfo(s, &a);
+  if(a.state != 3 || a.runtime == 0 || a.instret == 0){ // RUNNING
+    printf("%s: bad state %d or runtime\n", s, a.state);
+    exit(1);
+  }
+  sleep(1);
+  p = sbrk(PGSIZE);
+  p[0] = 1;
+  myinfo(s, &b);
+  if(b.nvcsw <= a.nvcsw || b.npgfault <= a.npgfault || b.runtime < a.runtime ||
+     b.cycles <= a.cycles || b.instret <= a.instret){
+    printf("%s: counters did not advance\n", s);
+    exit(1);
+  }
+  sbrk(-PGSIZE);
+}
+
+// the "pipe" locks' acquires, an entry for every lock name,
+// and a reset that clears the counts.
+void
+lockstattest(char *s)
+{
+  static struct lockstat ls[NLOCKSTAT];
+  int fds[2], i, n;
+  uint64 before;
+  char c;
+
+  before = 0;
+  n = lockstat(ls, NLOCKSTAT, 0);
+  for(i = 0; i < n; i++){
+    if(strcmp(ls[i].name, "pipe") == 0)
+      before = ls[i].nacquire;
+  }
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++){
+    if(write(fds[1], "x", 1) != 1 || read(fds[0], &c, 1) != 1){
+      printf("%s: pipe i/o failed\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  n = lockstat(ls, NLOCKSTAT, 0);
+  for(i = 0; i < n; i++){
+    if(strcmp(ls[i].name, "pipe") == 0)
+      break;
+  }
+  if(i == n || ls[i].nacquire < before + 20 || ls[i].ncontend > ls[i].nacquire){
+    printf("%s: bad pipe lock counts\n", s);
+    exit(1);
+  }
+  if(lockstat(ls, 1, 1) != 1 || lockstat(ls, NLOCKSTAT, 0) != n){
+    printf("%s: lockstat reset failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(ls[i].nacquire > 1000000){
+      printf("%s: %s not cleared\n", s, ls[i].name);
+      exit(1);
+    }
+  }
+}
+
+// a file created, written, read back, examined and closed
+// with one ring_enter().
+void
+ringtest(char *s)
+{
+  struct ringsqe sq[8];
+  struct ringcqe cq[8];
+  struct ring r;
+  struct stat st;
+  char buf[8];
+  int i;
+
+  unlink("ringfile");
+  memset(&r, 0, sizeof(r));
+  memset(sq, 0, sizeof(sq));
+  r.sq = (uint64)sq;
+  r.cq = (uint64)cq;
+  r.size = 3;
+  if(ring_enter(&r) != -1){
+    printf("%s: ring_enter accepted a bad size\n", s);
+    exit(1);
+  }
+  r.size = 8;
+
+  sq[0].op = RING_OPEN;
+  sq[0].addr = (uint64)"ringfile";
+  sq[0].n = O_CREATE|O_RDWR;
+  sq[1].op = RING_WRITE;
+  sq[1].flags = RING_FD_PREV;
+  sq[1].addr = (uint64)"ringring";
+  sq[1].n = 8;
+  sq[2].op = RING_CLOSE;
+  sq[2].flags = RING_FD_PREV;
+  sq[3].op = RING_OPEN;
+  sq[3].addr = (uint64)"ringfile";
+  sq[3].n = O_RDONLY;
+  sq[4].op = RING_READ;
+  sq[4].flags = RING_FD_PREV;
+  sq[4].addr = (uint64)buf;
+  sq[4].n = sizeof(buf);
+  sq[5].op = RING_FSTAT;
+  sq[5].flags = RING_FD_PREV;
+  sq[5].addr = (uint64)&st;
+  sq[6].op = RING_CLOSE;
+  sq[6].flags = RING_FD_PREV;
+  sq[7].op = RING_READ;
+  sq[7].fd = -1;
+  for(i = 0; i < 8; i++)
+    sq[i].data = i;
+  r.sqtail = 8;
+
+  if(ring_enter(&r) != 8 || r.sqhead != 8 || r.cqtail != 8){
+    printf("%s: ring_enter did not run the batch\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8; i++){
+    if(cq[i].data != i){
+      printf("%s: completion %d out of order\n", s, i);
+      exit(1);
+    }
+  }
+  if(cq[0].res < 0 || cq[1].res != 8 || cq[4].res != 8 || cq[5].res != 0 ||
+     cq[7].res != -1 || memcmp(buf, "ringring", 8) != 0 || st.size != 8){
+    printf("%s: wrong results\n", s);
+    exit(1);
+  }
+
+  // a full completion queue stops the batch.
+  r.sqtail += 1;
+  sq[0].op = RING_NOP;
+  if(ring_enter(&r) != 0){
+    printf("%s: ran with a full completion queue\n", s);
+    exit(1);
+  }
+  r.cqhead = r.cqtail;
+  if(ring_enter(&r) != 1 || cq[0].res != 0){
+    printf("%s: nop failed\n", s);
+    exit(1);
+  }
+  unlink("ringfile");
+}
+
+// ugetpid() and uuptime() agree with the syscalls, in
+// a fork child too, and the page is read-only.
+void
+usyscalltest(char *s)
+{
+  int pid, xstatus, t;
+
+  if(ugetpid() != getpid()){
+    printf("%s: ugetpid %d != getpid %d\n", s, ugetpid(), getpid());
+    exit(1);
+  }
+  t = uptime();
+  if(uuptime() > t || uuptime() < t - 1){
+    printf("%s: uuptime %d, uptime %d\n", s, uuptime(), t);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(ugetpid() == getpid() ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child's ugetpid is wrong\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    ((struct usyscall*)USYSCALL)->pid = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote the USYSCALL page\n", s);
+    exit(1);
+  }
+}
+
+// copy file src to dst.
+static void
+copyfile(char *s, char *src, char *dst)
+{
+  char buf[512];
+  int fd0, fd1, n;
+
+  if((fd0 = open(src, O_RDONLY)) < 0 ||
+     (fd1 = open(dst, O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    printf("%s: copy %s to %s failed\n", s, src, dst);
+    exit(1);
+  }
+  while((n = read(fd0, buf, sizeof(buf))) > 0){
+    if(write(fd1, buf, n) != n){
+      printf("%s: write %s failed\n", s, dst);
+      exit(1);
+    }
+  }
+  close(fd0);
+  close(fd1);
+}
+
+// run prog with an empty stdin, and read what it prints into buf.
+static int
+runout(char *s, char *prog, char *buf, int n)
+{
+  int in[2], out[2], pid, xstatus, m, tot;
+  char *argv[] = { prog, "hello", 0 };
+
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    exec(prog, argv);
+    exit(1);
+  }
+  close(in[0]);
+  close(in[1]);
+  close(out[1]);
+  for(tot = 0; tot < n && (m = read(out[0], buf + tot, n - tot)) > 0; tot += m)
+    ;
+  close(out[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: %s failed\n", s, prog);
+    exit(1);
+  }
+  return tot;
+}
+
+// exec() pages programs in from the file as they run, sharing
+// the pages through a cache; rewriting the program must not
+// leave its old pages in the cache.
+void
+execpagetest(char *s)
+{
+  char buf[16];
+  int n;
+
+  unlink("pcx");
+  copyfile(s, "echo", "pcx");
+  if((n = runout(s, "pcx", buf, sizeof(buf))) != 6 || memcmp(buf, "hello\n", 6) != 0){
+    printf("%s: pcx printed %d bytes, not hello\n", s, n);
+    exit(1);
+  }
+  if(runout(s, "pcx", buf, sizeof(buf)) != 6){
+    printf("%s: second run of pcx was wrong\n", s);
+    exit(1);
+  }
+  copyfile(s, "grep", "pcx");
+  if((n = runout(s, "pcx", buf, sizeof(buf))) != 0){
+    printf("%s: ran the old pcx after rewriting it (%d bytes)\n", s, n);
+    exit(1);
+  }
+  unlink("pcx");
+}
+
+// run argv with in, if not 0, on its standard input, and read
+// what it prints into buf.
+static int
+runargs(char *s, char **argv, char *in, char *buf, int n)
+{
+  int fds[2], out[2], pid, xstatus, m, tot;
+
+  if(pipe(out) < 0 || (in && pipe(fds) < 0)){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(in){
+      close(0);
+      dup(fds[0]);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    close(1);
+    dup(out[1]);
+    close(out[0]);
+    close(out[1]);
+    exec(argv[0], argv);
+    exit(1);
+  }
+  if(in){
+    close(fds[0]);
+    write(fds[1], in, strlen(in));
+    close(fds[1]);
+  }
+  close(out[1]);
+  for(tot = 0; tot < n && (m = read(out[0], buf + tot, n - tot)) > 0; tot += m)
+    ;
+  close(out[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: %s %s failed\n", s, argv[0], argv[1]);
+    exit(1);
+  }
+  return tot;
+}
+
+// grep's compiled matcher must pick the same lines as the
+// backtracking one it replaced, past its buffer's end too.
+void
+greptest(char *s)
+{
+  static struct {
+    char *pattern;
+    char *out;
+  } t[] = {
+    { "needle",   "a needle\nneedles\n" },
+    { "^needle",  "needles\n" },
+    { "needle$",  "a needle\n" },
+    { "ne*dl",    "a needle\nneedles\nndl\n" },
+    { "^n.*s$",   "needles\n" },
+    { "l.*e",     "a needle\nneedles\nend, no newline\n" },
+    { "newline$", "end, no newline\n" },
+  };
+  char buf[64], *argv[] = { "grep", 0, "grepfile", 0 };
+  int fd, i, n;
+
+  unlink("grepfile");
+  if((fd = open("grepfile", O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create grepfile failed\n", s);
+    exit(1);
+  }
+  write(fd, "a needle\n", 9);
+  for(i = 0; i < 2000; i++)
+    write(fd, "hay, hay\n", 9);
+  write(fd, "needles\nndl\nend, no newline", 27);
+  close(fd);
+
+  for(i = 0; i < sizeof(t)/sizeof(t[0]); i++){
+    argv[1] = t[i].pattern;
+    n = runargs(s, argv, 0, buf, sizeof(buf));
+    if(n != strlen(t[i].out) || memcmp(buf, t[i].out, n) != 0){
+      printf("%s: grep %s printed %d bytes\n", s, t[i].pattern, n);
+      exit(1);
+    }
+  }
+  unlink("grepfile");
+}
+
+// find -j must find what plain find does, however the
+// directories get split among its workers.
+#define FINDFAN 3
+#define FINDDEPTH 3
+
+static int
+mkfindtree(char *s, char *path, int depth)
+{
+  int fd, i, n, len = strlen(path);
+
+  if(mkdir(path) < 0){
+    printf("%s: mkdir %s failed\n", s, path);
+    exit(1);
+  }
+  strcpy(path + len, "/target");
+  if((fd = open(path, O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create %s failed\n", s, path);
+    exit(1);
+  }
+  close(fd);
+  n = 1;
+  for(i = 0; depth > 0 && i < FINDFAN; i++){
+    path[len] = '/';
+    path[len+1] = 'a' + i;
+    path[len+2] = 0;
+    n += mkfindtree(s, path, depth - 1);
+  }
+  path[len] = 0;
+  return n;
+}
+
+static void
+rmfindtree(char *path, int depth)
+{
+  int i, len = strlen(path);
+
+  for(i = 0; depth > 0 && i < FINDFAN; i++){
+    path[len] = '/';
+    path[len+1] = 'a' + i;
+    path[len+2] = 0;
+    rmfindtree(path, depth - 1);
+  }
+  strcpy(path + len, "/target");
+  unlink(path);
+  path[len] = 0;
+  unlink(path);
+}
+
+void
+findtest(char *s)
+{
+  static char buf[4096];
+  char path[64], *jobs[] = { 0, "1", "4" };
+  char *argv[] = { "find", "-j", 0, "findtree", "target", 0 };
+  char *serial[] = { "find", "findtree", "target", 0 };
+  int i, n, want, lines;
+  char *p;
+
+  strcpy(path, "findtree");
+  want = mkfindtree(s, path, FINDDEPTH);
+  for(i = 0; i < sizeof(jobs)/sizeof(jobs[0]); i++){
+    argv[2] = jobs[i];
+    n = runargs(s, jobs[i] ? argv : serial, 0, buf, sizeof(buf));
+    lines = 0;
+    for(p = buf; p < buf + n; p++)
+      lines += *p == '\n';
+    if(lines != want){
+      printf("%s: find -j %s found %d, not %d\n", s, jobs[i] ? jobs[i] : "0", lines, want);
+      exit(1);
+    }
+  }
+  rmfindtree(path, FINDDEPTH);
+}
+
+// xargs -n puts at most n lines on each command line, and
+// -P runs that many at once; every line is used exactly once.
+void
+xargstest(char *s)
+{
+  static struct {
+    char *n, *p;
+    int lines;      // command lines run for the input below
+  } t[] = {
+    { "1", "1", 5 },
+    { "2", "1", 3 },
+    { "2", "3", 3 },
+    { "9", "2", 1 },
+  };
+  char buf[128], *argv[] = { "xargs", "-n", 0, "-P", 0, "echo", "x", 0 };
+  int i, j, n, lines, args;
+
+  for(i = 0; i < sizeof(t)/sizeof(t[0]); i++){
+    argv[2] = t[i].n;
+    argv[4] = t[i].p;
+    n = runargs(s, argv, "a\nb\nc\nd\ne", buf, sizeof(buf));
+    lines = args = 0;
+    for(j = 0; j < n; j++){
+      if(buf[j] == '\n')
+        lines++;
+      else if(buf[j] >= 'a' && buf[j] <= 'e')
+        args++;
+    }
+    if(lines != t[i].lines || args != 5){
+      printf("%s: xargs -n %s -P %s ran %d lines with %d args\n",
+             s, t[i].n, t[i].p, lines, args);
+      exit(1);
+    }
+  }
+}
+
+// sh runs cd, echo, test and exit itself, carries on after a
+// cd by finding commands in /, and exits with the status of the
+// last command.
+void
+shtest(char *s)
+{
+  char buf[64], *argv[] = { "sh", 0 };
+  char *want = "one two\nthree\nin shdir\n";
+  int n;
+
+  unlink("shdir/f");
+  unlink("shdir");
+  unlink("shfile");
+  n = runargs(s, argv,
+              "echo one two\n"
+              "echo three > shfile\n"
+              "mkdir shdir\n"
+              "cd shdir\n"
+              "cat ../shfile; echo in shdir > f\n"
+              "cat f\n"
+              "cd ..\n"
+              "[ x != y ]\n"
+              "test -f shdir/f\n"
+              "exit\n"
+              "echo not reached\n",
+              buf, sizeof(buf));
+  if(n != strlen(want) || memcmp(buf, want, n) != 0){
+    printf("%s: sh printed %d bytes, not what it should\n", s, n);
+    exit(1);
+  }
+  unlink("shdir/f");
+  unlink("shdir");
+  unlink("shfile");
+}
+
+// wc counts eight bytes at a time, and with -j in pieces; the
+// counts must come out the same as a byte at a time.
+void
+wctest(char *s)
+{
+  char buf[1200], out[64], *want = "12000 24001 144005 wcfile\n";
+  char *argv[] = { "wc", "wcfile", 0 }, *jargv[] = { "wc", "-j", "4", "wcfile", 0 };
+  int fd, i, n;
+
+  for(i = 0; i < sizeof(buf); i += 12)
+    memmove(buf + i, "hello world\n", 12);
+  unlink("wcfile");
+  if((fd = open("wcfile", O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create wcfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 120; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write wcfile failed\n", s);
+      exit(1);
+    }
+  }
+  write(fd, "  end", 5);
+  close(fd);
+
+  n = runargs(s, argv, 0, out, sizeof(out));
+  if(n != strlen(want) || memcmp(out, want, n) != 0){
+    printf("%s: wc counted wrong\n", s);
+    exit(1);
+  }
+  n = runargs(s, jargv, 0, out, sizeof(out));
+  if(n != strlen(want) || memcmp(out, want, n) != 0){
+    printf("%s: wc -j 4 counted wrong\n", s);
+    exit(1);
+  }
+  unlink("wcfile");
+}
+
+// pages freed after a big allocation must go back to the buddy
+// allocator and merge again, rather than stay scattered on the
+// per-cpu free lists.
+#define BUDDYMB 32
+
+void
+buddytest(char *s)
+{
+  struct kmemstat st;
+  uint64 before;
+  char *p;
+  int i;
+
+  if(kmemstat(&st) < 0){
+    printf("%s: kmemstat failed\n", s);
+    exit(1);
+  }
+  before = st.nbuddy[NBUDDY-1];
+  if(before < BUDDYMB * 3 / 4)
+    return; // memory is too fragmented or scarce to tell
+  if((p = sbrk(BUDDYMB * 1024 * 1024)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BUDDYMB * 1024 * 1024; i += PGSIZE)
+    p[i] = 1;
+  sbrk(-BUDDYMB * 1024 * 1024);
+  if(kmemstat(&st) < 0){
+    printf("%s: kmemstat failed\n", s);
+    exit(1);
+  }
+  // each cpu's free list may keep a few pages that still split
+  // a block or two.
+  if(st.nbuddy[NBUDDY-1] + NCPU < before){
+    printf("%s: %d largest blocks before, %d after\n", s,
+           (int)before, (int)st.nbuddy[NBUDDY-1]);
+    exit(1);
+  }
+}
+
+// procinfo() counts the pages of the page tables, and resident
+// user pages as they are faulted in and freed.
+void
+memacctest(char *s)
+{
+  struct procinfo a, b, c;
+  char *p;
+  int i;
+
+  myinfo(s, &a);
+  if(a.nrss == 0 || a.nupt < 3 || a.nkpt < 2 || a.nkpages != 3){
+    printf("%s: bad counts rss %l pt %l kpt %l kpages %l\n", s,
+           a.nrss, a.nupt, a.nkpt, a.nkpages);
+    exit(1);
+  }
+  p = sbrk(64*PGSIZE);
+  if(p == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 64; i++)
+    p[i*PGSIZE] = 1;
+  myinfo(s, &b);
+  if(b.nrss < a.nrss + 64){
+    printf("%s: rss %l after touching 64 pages, was %l\n", s, b.nrss, a.nrss);
+    exit(1);
+  }
+  sbrk(-64*PGSIZE);
+  myinfo(s, &c);
+  if(c.nrss > b.nrss - 64){
+    printf("%s: rss %l after freeing 64 pages, was %l\n", s, c.nrss, b.nrss);
+    exit(1);
+  }
+}
+
+// mmap() a file privately and shared, and check each sees
+// and makes the changes it should.
+void
+mmaptest(char *s)
+{
+  char buf[32], *p, *q;
+  int fd, fd1, i, pid, xstatus;
+  int n = PGSIZE + PGSIZE/2;
+
+  unlink("mmapfile");
+  if((fd = open("mmapfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    buf[0] = 'a' + i % 23;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write mmapfile failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap MAP_PRIVATE failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*PGSIZE; i++){
+    if(p[i] != (i < n ? 'a' + i % 23 : 0)){
+      printf("%s: mmap byte %d is %d\n", s, i, p[i]);
+      exit(1);
+    }
+  }
+  p[0] = 'Z';
+  if((fd1 = open("mmapfile", O_RDONLY)) < 0 || read(fd1, buf, 1) != 1 || buf[0] != 'a'){
+    printf("%s: store to a MAP_PRIVATE page reached the file\n", s);
+    exit(1);
+  }
+  close(fd1);
+  if(munmap(p, 2*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  q = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(q == (char*)-1){
+    printf("%s: mmap MAP_SHARED failed\n", s);
+    exit(1);
+  }
+  q[1] = 'Y';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    q[PGSIZE] = 'X';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(q[PGSIZE] != 'X'){
+    printf("%s: child's store to a MAP_SHARED page is lost\n", s);
+    exit(1);
+  }
+  if((fd1 = open("mmapfile", O_RDONLY)) < 0 || read(fd1, buf, 2) != 2 || buf[1] != 'Y'){
+    printf("%s: read() doesn't see a store to a MAP_SHARED page\n", s);
+    exit(1);
+  }
+  close(fd1);
+  // the kernel reads from the mapping too.
+  if((fd1 = open("mmapfile2", O_CREATE|O_RDWR)) < 0 || write(fd1, q, 2) != 2){
+    printf("%s: write() from a mapping failed\n", s);
+    exit(1);
+  }
+  close(fd1);
+  unlink("mmapfile2");
+  if(munmap(q, n) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid == 0){
+    buf[0] = q[0];
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: read an unmapped page\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable MAP_SHARED mapping of a read-only fd\n", s);
+    exit(1);
+  }
+  for(i = 0; i < PGSIZE; i += sizeof(buf)){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: read mmapfile failed\n", s);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, 1) != 1 || buf[0] != 'X'){
+    printf("%s: store through MAP_SHARED didn't reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// getdents() returns only the live entries of a directory,
+// in batches; fstatat() looks names up in it.
+void
+getdentstest(char *s)
+{
+  struct dirent de[4];
+  struct stat st;
+  char name[16];
+  int fd, i, n, seen, tot;
+
+  if(mkdir("gdd") != 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  name[0] = 'f';
+  name[2] = 0;
+  for(i = 0; i < 10; i++){
+    name[1] = '0' + i;
+    if(chdir("gdd") != 0 || (fd = open(name, O_CREATE|O_RDWR)) < 0 || chdir("..") != 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+    write(fd, name, i);
+    close(fd);
+  }
+  unlink("gdd/f3");
+
+  if((fd = open("gdd", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  seen = tot = 0;
+  while((n = getdents(fd, de, sizeof(de))) > 0){
+    if(n % sizeof(de[0]) != 0 || n > sizeof(de)){
+      printf("%s: getdents returned %d\n", s, n);
+      exit(1);
+    }
+    for(i = 0; i < n / sizeof(de[0]); i++){
+      if(de[i].inum == 0){
+        printf("%s: getdents returned an empty entry\n", s);
+        exit(1);
+      }
+      tot++;
+      if(de[i].name[0] != 'f')
+        continue;
+      seen |= 1 << (de[i].name[1] - '0');
+      if(fstatat(fd, de[i].name, &st) != 0 || st.type != T_FILE || st.size != de[i].name[1] - '0'){
+        printf("%s: fstatat %s failed\n", s, de[i].name);
+        exit(1);
+      }
+    }
+  }
+  if(n != 0 || tot != 11 || seen != (0x3ff & ~(1 << 3))){
+    printf("%s: getdents saw %d entries\n", s, tot);
+    exit(1);
+  }
+  if(fstatat(fd, "f3", &st) != -1 || fstatat(AT_FDCWD, "gdd/f4", &st) != 0 || st.size != 4 ||
+     fstatat(fd, "..", &st) != 0 || st.type != T_DIR){
+    printf("%s: fstatat wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("gdd/f4", O_RDONLY)) < 0 || getdents(fd, de, sizeof(de)) != -1){
+    printf("%s: getdents on a file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < 10; i++){
+    name[1] = '0' + i;
+    if(chdir("gdd") != 0 || (i != 3 && unlink(name) != 0) || chdir("..") != 0){
+      printf("%s: unlink failed\n", s);
+      exit(1);
+    }
+  }
+  if(unlink("gdd") != 0){
+    printf("%s: unlink gdd failed\n", s);
+    exit(1);
+  }
+}
+
+// threads made by clone() share memory and file descriptors.
+#define NCLONE 4
+static int clonefds[2];
+static int clonepid;
+static volatile int clonecount;
+static char * volatile clonebrk;
+
+void
+clonethread(void *arg)
+{
+  int i = (int)(uint64)arg;
+  char c = 'a' + i;
+
+  if(getpid() != clonepid)
+    exit(1);
+  if(i == 0){
+    if((clonebrk = sbrk(PGSIZE)) == (char*)-1)
+      exit(1);
+    clonebrk[0] = 'z';
+  }
+  __sync_fetch_and_add(&clonecount, 1);
+  if(write(clonefds[1], &c, 1) != 1)
+    exit(1);
+  exit(0);
+}
+
+void
+clonetest(char *s)
+{
+  char *stacks[NCLONE], *top, buf[NCLONE];
+  int i, n, xst;
+
+  if(pipe(clonefds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  clonepid = getpid();
+  clonecount = 0;
+  clonebrk = 0;
+
+  stacks[0] = malloc(PGSIZE);
+  if(clone(clonethread, 0, stacks[0] + 1) != -1){
+    printf("%s: clone took an unaligned stack\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCLONE; i++){
+    if(i > 0)
+      stacks[i] = malloc(PGSIZE);
+    top = (char*)(((uint64)stacks[i] + PGSIZE) & ~15);
+    if(clone(clonethread, (void*)(uint64)i, top) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+
+  for(n = 0; n < NCLONE; n += i){
+    if((i = read(clonefds[0], buf + n, NCLONE - n)) <= 0){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NCLONE; i++){
+    if(wait(&xst) < 0 || xst != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: too many children\n", s);
+    exit(1);
+  }
+  if(clonecount != NCLONE){
+    printf("%s: count %d, not %d\n", s, clonecount, NCLONE);
+    exit(1);
+  }
+  // the heap a thread grew is the whole process's.
+  if(clonebrk == 0 || sbrk(0) < clonebrk + PGSIZE || clonebrk[0] != 'z'){
+    printf("%s: sbrk in a thread not shared\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCLONE; i++)
+    free(stacks[i]);
+  close(clonefds[0]);
+  close(clonefds[1]);
+}
+
+// threads contend for a mutex, and the last to finish
+// signals a condition variable main is waiting on.
+#define NFUTEXT 4
+#define FUTEXN 500
+static struct mutex futexmu;
+static struct cond futexcv;
+static int futexsum, futexdone;
+
+void
+futexthread(void *arg)
+{
+  int i;
+
+  for(i = 0; i < FUTEXN; i++){
+    mutex_lock(&futexmu);
+    futexsum++;
+    if(i % 50 == 0)
+      sleep(0); // give the others a chance to find it held
+    mutex_unlock(&futexmu);
+  }
+  mutex_lock(&futexmu);
+  if(++futexdone == NFUTEXT)
+    cond_signal(&futexcv);
+  mutex_unlock(&futexmu);
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  char *stacks[NFUTEXT];
+  int i, xst, word = 7;
+
+  if(futex_wait(&word, 8) != 0 || futex_wake(&word, 1) != 0){
+    printf("%s: futex with nobody waiting failed\n", s);
+    exit(1);
+  }
+  if(futex_wait((int*)((char*)&word + 1), 7) != -1){
+    printf("%s: futex_wait took an unaligned address\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  futexsum = futexdone = 0;
+  mutex_lock(&futexmu);
+  for(i = 0; i < NFUTEXT; i++){
+    stacks[i] = malloc(PGSIZE);
+    if(clone(futexthread, 0, (char*)(((uint64)stacks[i] + PGSIZE) & ~15)) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  while(futexdone < NFUTEXT)
+    cond_wait(&futexcv, &futexmu);
+  if(futexsum != NFUTEXT * FUTEXN){
+    printf("%s: sum %d, not %d\n", s, futexsum, NFUTEXT * FUTEXN);
+    exit(1);
+  }
+  mutex_unlock(&futexmu);
+
+  for(i = 0; i < NFUTEXT; i++){
+    if(wait(&xst) < 0 || xst != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+    free(stacks[i]);
+  }
+}
+
+// processes attached to a shared memory segment see each
+// other's stores, and fork() keeps attachments.
+void
+shmtest(char *s)
+{
+  char *a, *b;
+  int id, pid, xst;
+
+  if((id = shm_create(2*PGSIZE)) < 0){
+    printf("%s: shm_create failed\n", s);
+    exit(1);
+  }
+  if((a = shm_attach(id)) == (char*)-1){
+    printf("%s: shm_attach failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 0 || a[2*PGSIZE-1] != 0){
+    printf("%s: segment not zeroed\n", s);
+    exit(1);
+  }
+  a[0] = 'p';
+  a[PGSIZE] = 'q';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // the inherited attachment and a new one are the same pages.
+    if((b = shm_attach(id)) == (char*)-1 || b == a)
+      exit(1);
+    if(a[0] != 'p' || b[PGSIZE] != 'q')
+      exit(1);
+    b[1] = 'c';
+    a[PGSIZE+1] = 'd';
+    if(shm_detach(b) != 0)
+      exit(1);
+    exit(0);
+  }
+  if(wait(&xst) != pid || xst != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+  if(a[1] != 'c' || a[PGSIZE+1] != 'd'){
+    printf("%s: child's stores not seen\n", s);
+    exit(1);
+  }
+  if(shm_detach(&xst) != -1){
+    printf("%s: detached a non-segment\n", s);
+    exit(1);
+  }
+  if(shm_detach(a + PGSIZE) != 0){
+    printf("%s: shm_detach failed\n", s);
+    exit(1);
+  }
+  // the last attachment is gone, and the segment with it.
+  if(shm_attach(id) != (char*)-1){
+    printf("%s: segment outlived its attachments\n", s);
+    exit(1);
+  }
+}
+
+// grow memory for as long as sbrk() allows, or well past
+// physical memory, touch every page, and check that each
+// still holds what was stored, in the process and in a forked
+// child. with a swap disk most of it has been swapped out and
+// back; without one this just fills memory.
+#define SWAPSTEP (1024*1024)
+#define SWAPMAX (160*1024*1024)
+
+void
+swaptest(char *s)
+{
+  char *base, *a;
+  uint64 n;
+  int pid, xst;
+
+  base = sbrk(0);
+  for(n = 0; n < SWAPMAX; n += SWAPSTEP){
+    if(sbrk(SWAPSTEP) == (char*)-1)
+      break;
+  }
+  if(n == 0){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < base + n; a += PGSIZE)
+    *(uint64*)a = (uint64)a ^ 0x5a5a;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < base + n; a += PGSIZE){
+    if(*(uint64*)a != ((uint64)a ^ 0x5a5a)){
+      printf("%s: %s lost page %p\n", s, pid == 0 ? "child" : "parent", a);
+      exit(1);
+    }
+  }
+  if(pid == 0)
+    exit(0);
+  if(wait(&xst) != pid || xst != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+}
+
+// files in the tmpfs init mounts on /tmp: contents, ".." out
+// of its root, and what can't cross between file systems.
+void
+tmpfstest(char *s)
+{
+  struct stat root, tmp, st;
+  char buf[512];
+  int fd, i, j;
+
+  if(stat("/", &root) < 0 || stat("/tmp", &tmp) < 0){
+    printf("%s: stat failed\n", s);
+    exit(1);
+  }
+  if(tmp.dev == root.dev || tmp.type != T_DIR){
+    printf("%s: /tmp isn't a mounted file system\n", s);
+    exit(1);
+  }
+
+  unlink("/tmp/tf");
+  if((fd = open("/tmp/tf", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create /tmp/tf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if((fd = open("/tmp/tf", O_RDONLY)) < 0){
+    printf("%s: open /tmp/tf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < sizeof(buf); j++){
+      if(buf[j] != 'a' + i){
+        printf("%s: wrong contents\n", s);
+        exit(1);
+      }
+    }
+  }
+  if(read(fd, buf, sizeof(buf)) != 0){
+    printf("%s: read past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(link("/tmp/tf", "tmpfslink") == 0){
+    printf("%s: linked across file systems\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp") == 0){
+    printf("%s: unlinked a mount point\n", s);
+    exit(1);
+  }
+
+  if(mkdir("/tmp/td") < 0 || chdir("/tmp/td") < 0){
+    printf("%s: mkdir/chdir /tmp/td failed\n", s);
+    exit(1);
+  }
+  if(chdir("../..") < 0 || stat(".", &st) < 0 ||
+     st.dev != root.dev || st.ino != root.ino){
+    printf("%s: .. didn't leave /tmp\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp/td") < 0 || unlink("/tmp/tf") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+  if(open("/tmp/tf", O_RDONLY) >= 0){
+    printf("%s: /tmp/tf still there\n", s);
+    exit(1);
+  }
+}
+
+// profiling a process spinning in user space samples it there,
+// and a bad rate is refused.
+void
+proftest(char *s)
+{
+  static struct profsample ps[64];
+  int i, n, mine, t0;
+
+  if(profile(-1) != -1 || profile(1000000) != -1){
+    printf("%s: bad rate accepted\n", s);
+    exit(1);
+  }
+  while(profread(ps, 64) > 0)
+    ;
+  if(profile(20) < 0){
+    printf("%s: profile failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  while(uptime() < t0 + 5)
+    ;
+  mine = 0;
+  while((n = profread(ps, 64)) > 0){
+    for(i = 0; i < n; i++){
+      if(ps[i].pc != PROF_LOST && ps[i].user && ps[i].pid == getpid())
+        mine++;
+    }
+  }
+  profile(0);
+  if(n < 0 || mine == 0){
+    printf("%s: no samples of this process\n", s);
+    exit(1);
+  }
+}
+
+// pwrite() and pread() at offsets leave the file offset
+// alone; writev() and readv() gather and scatter.
+void
+preadtest(char *s)
+{
+  struct iovec iov[3];
+  char a[4], b[6], buf[16];
+  int fd, fds[2];
+
+  unlink("preadfile");
+  if((fd = open("preadfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  iov[0].base = (uint64)"abc";
+  iov[0].len = 3;
+  iov[1].base = (uint64)"";
+  iov[1].len = 0;
+  iov[2].base = (uint64)"defghij";
+  iov[2].len = 7;
+  if(writev(fd, iov, 3) != 10){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "XY", 2, 4) != 2 || pwrite(fd, "Z", 1, 11) != -1){
+    printf("%s: pwrite wrong\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, sizeof(buf), 2) != 8 || memcmp(buf, "cdXYghij", 8) != 0){
+    printf("%s: pread wrong\n", s);
+    exit(1);
+  }
+  // the offset is still at the end of the writev().
+  if(write(fd, "k", 1) != 1 || pread(fd, buf, 1, 10) != 1 || buf[0] != 'k'){
+    printf("%s: pwrite moved the offset\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("preadfile", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  iov[0].base = (uint64)a;
+  iov[0].len = sizeof(a);
+  iov[1].base = (uint64)b;
+  iov[1].len = sizeof(b);
+  if(readv(fd, iov, 2) != 10 || memcmp(a, "abcd", 4) != 0 || memcmp(b, "XYghij", 6) != 0){
+    printf("%s: readv wrong\n", s);
+    exit(1);
+  }
+  if(readv(fd, iov, 2) != 1 || a[0] != 'k' || readv(fd, iov, 2) != 0){
+    printf("%s: readv at end wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadfile");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(pread(fds[0], buf, 1, 0) != -1 || pwrite(fds[1], "x", 1, 0) != -1){
+    printf("%s: positional i/o on a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// sendfile() copies a file to a file and to a pipe, from and
+// leaving the file's offset, or from a given one, but not a
+// file to itself from its offset.
+#define SENDN (3*PGSIZE + 100)
+
+void
+sendfiletest(char *s)
+{
+  static char buf[SENDN];
+  int i, n, in, out, fds[2];
+
+  for(i = 0; i < SENDN; i++)
+    buf[i] = i * 7;
+  unlink("sendsrc");
+  unlink("senddst");
+  if((in = open("sendsrc", O_CREATE|O_RDWR)) < 0 || write(in, buf, SENDN) != SENDN){
+    printf("%s: create sendsrc failed\n", s);
+    exit(1);
+  }
+  close(in);
+  if((in = open("sendsrc", O_RDONLY)) < 0 || (out = open("senddst", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if((n = sendfile(out, in, -1, SENDN + 50)) != SENDN || sendfile(out, in, -1, 10) != 0){
+    printf("%s: sendfile to a file returned %d\n", s, n);
+    exit(1);
+  }
+  close(out);
+  memset(buf, 0, SENDN);
+  if((out = open("senddst", O_RDONLY)) < 0 || read(out, buf, SENDN) != SENDN){
+    printf("%s: read senddst failed\n", s);
+    exit(1);
+  }
+  close(out);
+  for(i = 0; i < SENDN; i++){
+    if(buf[i] != (char)(i * 7)){
+      printf("%s: senddst wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  close(in);
+  if((in = open("sendsrc", O_RDONLY)) < 0 || sendfile(fds[1], in, PGSIZE - 10, 1000) != 1000){
+    printf("%s: sendfile to a pipe failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf, 1000) != 1000 || read(in, buf + 1000, 1) != 1 || buf[1000] != 0){
+    printf("%s: read back failed, or the offset moved\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 1000; i++){
+    if(buf[i] != (char)((PGSIZE - 10 + i) * 7)){
+      printf("%s: pipe data wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(sendfile(in, fds[0], -1, 10) != -1){
+    printf("%s: sendfile from a pipe worked\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(in);
+
+  // a file to itself, from its own offset: the offset
+  // would have to move for the read and the write both.
+  if((in = open("sendsrc", O_RDWR)) < 0 || (out = dup(in)) < 0){
+    printf("%s: reopen sendsrc failed\n", s);
+    exit(1);
+  }
+  if(sendfile(in, in, -1, 10) != -1 || sendfile(out, in, -1, 10) != -1){
+    printf("%s: sendfile of a file to itself worked\n", s);
+    exit(1);
+  }
+  close(out);
+  close(in);
+  unlink("sendsrc");
+  unlink("senddst");
+}
+
+// many more descriptors than fit in struct proc: dup() hands
+// out the lowest free one, fork() copies them all, and they
+// run out at MAXOFILE.
+void
+manyfds(char *s)
+{
+  int fds[2], fd, i, pid, xstatus;
+  char c;
+
+  for(i = 3; i < 600; i++){
+    if((fd = dup(0)) != i){
+      printf("%s: dup returned %d, expected %d\n", s, fd, i);
+      exit(1);
+    }
+  }
+  close(17);
+  close(500);
+  if(dup(0) != 17 || dup(0) != 500){
+    printf("%s: dup did not reuse the lowest fd\n", s);
+    exit(1);
+  }
+  if(pipe(fds) != 0 || fds[0] != 600 || fds[1] != 601){
+    printf("%s: pipe fds %d %d\n", s, fds[0], fds[1]);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    exit(write(fds[1], "x", 1) == 1 ? 0 : 1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0 || read(fds[0], &c, 1) != 1 || c != 'x'){
+    printf("%s: child could not write to a high fd\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // fds 0 through 600 are open.
+    for(i = 0; dup(0) >= 0; i++)
+      ;
+    exit(i == MAXOFILE - 601 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: dup did not run out\n", s);
+    exit(1);
+  }
+  for(i = 3; i <= 600; i++)
+    close(i);
+}
+
+// spawn() echo with its output redirected to a pipe and to a
+// file, and check that a bad program or action fails cleanly.
+void
+spawntest(char *s)
+{
+  char *args[] = { "echo", "spawned", 0 };
+  struct spawnfa fa[3];
+  char buf[16];
+  int p[2], fd, n, pid;
+
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fa[0].op = SPAWN_DUP;
+  fa[0].fd = p[1];
+  fa[0].newfd = 1;
+  fa[1].op = SPAWN_CLOSE;
+  fa[1].fd = p[0];
+  fa[2].op = SPAWN_CLOSE;
+  fa[2].fd = p[1];
+  if((pid = spawn("echo", args, fa, 3)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(p[1]);
+  n = read(p[0], buf, sizeof(buf));
+  close(p[0]);
+  if(wait(0) != pid || n != 8 || memcmp(buf, "spawned\n", 8) != 0){
+    printf("%s: spawned echo printed %d bytes\n", s, n);
+    exit(1);
+  }
+
+  unlink("spawnout");
+  fa[0].op = SPAWN_OPEN;
+  fa[0].fd = 1;
+  fa[0].omode = O_WRONLY|O_CREATE;
+  fa[0].path = (uint64)"spawnout";
+  if((pid = spawn("echo", args, fa, 1)) < 0 || wait(0) != pid){
+    printf("%s: spawn echo > spawnout failed\n", s);
+    exit(1);
+  }
+  if((fd = open("spawnout", O_RDONLY)) < 0 || read(fd, buf, sizeof(buf)) != 8){
+    printf("%s: spawnout is wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("spawnout");
+
+  if(spawn("nosuchprogram", args, 0, 0) >= 0){
+    printf("%s: spawned a program that doesn't exist\n", s);
+    exit(1);
+  }
+  fa[0].op = SPAWN_CLOSE;
+  fa[0].fd = NOFILE - 1;
+  if(spawn("echo", args, fa, 1) >= 0){
+    printf("%s: spawn closed a file that isn't open\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: a failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// write a file through a buffered stream and read it back
+// a line at a time and in bulk.
+void
+stdiotest(char *s)
+{
+  char buf[64];
+  FILE *f;
+  int fd, i, n;
+
+  unlink("stdiofile");
+  if((fd = open("stdiofile", O_CREATE|O_WRONLY)) < 0 || (f = fdopen(fd, "w")) == 0){
+    printf("%s: create stdiofile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 200; i++)
+    if(fputs("line\n", f) != 5){
+      printf("%s: fputs failed\n", s);
+      exit(1);
+    }
+  fputc('x', f);
+  if(fclose(f) != 0){
+    printf("%s: fclose failed\n", s);
+    exit(1);
+  }
+
+  if((fd = open("stdiofile", O_RDONLY)) < 0 || (f = fdopen(fd, "r")) == 0){
+    printf("%s: open stdiofile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; fgets(buf, sizeof(buf), f) != 0; i++){
+    if(strcmp(buf, i < 200 ? "line\n" : "x") != 0){
+      printf("%s: line %d is %s\n", s, i, buf);
+      exit(1);
+    }
+  }
+  if(i != 201 || !feof(f)){
+    printf("%s: read %d lines\n", s, i);
+    exit(1);
+  }
+  fclose(f);
+
+  if((fd = open("stdiofile", O_RDONLY)) < 0 || (f = fdopen(fd, "r")) == 0){
+    printf("%s: reopen stdiofile failed\n", s);
+    exit(1);
+  }
+  if(fgetc(f) != 'l' || fread(buf, 1, 4, f) != 4 || memcmp(buf, "ine\n", 4) != 0){
+    printf("%s: fread after fgetc failed\n", s);
+    exit(1);
+  }
+  n = 0;
+  while((i = fread(buf, 1, sizeof(buf), f)) > 0)
+    n += i;
+  if(n != 199*5 + 1){
+    printf("%s: fread read %d bytes\n", s, n);
+    exit(1);
+  }
+  fclose(f);
+  unlink("stdiofile");
+}
+
 // test O_TRUNC.
 void
 truncate1(char *s)
@@ -1737,6 +3390,64 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// appended blocks get their disk blocks only when the log
+// commits. read them back, overwrite them, truncate them and
+// unlink them before and after that happens.
+void
+delayalloc(char *s)
+{
+  enum { N = NDIRECT+4 };
+  int fd, i, pass;
+
+  unlink("delayalloc");
+  for(pass = 0; pass < 3; pass++){
+    fd = open("delayalloc", O_CREATE | O_TRUNC | O_RDWR);
+    if(fd < 0){
+      printf("%s: cannot create delayalloc\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      memset(buf, pass*N + i, BSIZE);
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write delayalloc failed\n", s);
+        exit(1);
+      }
+    }
+    // rewrite part of a block that may still be waiting.
+    memset(buf, 0xff, 10);
+    if(pwrite(fd, buf, 10, NDIRECT*BSIZE + 100) != 10){
+      printf("%s: rewrite delayalloc failed\n", s);
+      exit(1);
+    }
+    if(pass == 1 && fsync(fd) < 0){
+      printf("%s: fsync delayalloc failed\n", s);
+      exit(1);
+    }
+    close(fd);
+
+    fd = open("delayalloc", O_RDONLY);
+    for(i = 0; i < N; i++){
+      if(read(fd, buf, BSIZE) != BSIZE){
+        printf("%s: read delayalloc failed\n", s);
+        exit(1);
+      }
+      if(buf[0] != (char)(pass*N + i) || buf[BSIZE-1] != (char)(pass*N + i)){
+        printf("%s: delayalloc block %d wrong\n", s, i);
+        exit(1);
+      }
+      if(i == NDIRECT && (buf[100] != (char)0xff || buf[109] != (char)0xff)){
+        printf("%s: delayalloc rewrite lost\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  if(unlink("delayalloc") < 0){
+    printf("%s: unlink delayalloc failed\n", s);
+    exit(1);
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -2644,6 +4355,33 @@ main(int argc, char *argv[])
     {copyinstr1, "copyinstr1"},
     {copyinstr2, "copyinstr2"},
     {copyinstr3, "copyinstr3"},
+    {fsynctest, "fsynctest"},
+    {prioritytest, "prioritytest"},
+    {procinfotest, "procinfotest"},
+    {ringtest, "ringtest"},
+    {lockstattest, "lockstattest"},
+    {usyscalltest, "usyscalltest"},
+    {execpagetest, "execpagetest"},
+    {greptest, "greptest"},
+    {findtest, "findtest"},
+    {xargstest, "xargstest"},
+    {shtest, "shtest"},
+    {wctest, "wctest"},
+    {buddytest, "buddytest"},
+    {memacctest, "memacctest"},
+    {mmaptest, "mmaptest"},
+    {manyfds, "manyfds"},
+    {preadtest, "preadtest"},
+    {sendfiletest, "sendfiletest"},
+    {getdentstest, "getdentstest"},
+    {clonetest, "clonetest"},
+    {futextest, "futextest"},
+    {shmtest, "shmtest"},
+    {swaptest, "swaptest"},
+    {tmpfstest, "tmpfstest"},
+    {proftest, "proftest"},
+    {spawntest, "spawntest"},
+    {stdiotest, "stdiotest"},
     {truncate1, "truncate1"},
     {truncate2, "truncate2"},
     {truncate3, "truncate3"},
@@ -2668,6 +4406,7 @@ main(int argc, char *argv[])
     {exectest, "exectest"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
+    {delayalloc, "delayalloc"},
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
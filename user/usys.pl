@@ -6,24 +6,27 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# entry("name", "label") makes the stub for SYS_name
+# called label, for ulib.c to wrap.
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $label = shift || $name;
+    print ".global $label\n";
+    print "${label}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
 }
 	
-entry("fork");
-entry("exit");
+entry("fork", "_fork");
+entry("exit", "_exit");
 entry("wait");
 entry("pipe");
 entry("read");
 entry("write");
 entry("close");
 entry("kill");
-entry("exec");
+entry("exec", "_exec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -37,4 +40,33 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("trace");
-entry("sysinfo");
\ No newline at end of file
+entry("sysinfo");
+entry("kmemstat");
+entry("fsync");
+entry("biostat");
+entry("setpriority");
+entry("getpriority");
+entry("procinfo");
+entry("traceread");
+entry("syshist");
+entry("ring_enter");
+entry("mmap");
+entry("munmap");
+entry("spawn", "_spawn");
+entry("lockstat");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("getdents");
+entry("fstatat");
+entry("clone");
+entry("futex_wait");
+entry("futex_wake");
+entry("shm_create");
+entry("shm_attach");
+entry("shm_detach");
+entry("mount");
+entry("profile");
+entry("profread");
+entry("sendfile");
@@ -2,43 +2,193 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 
-char buf[512];
+// wc [-j n] [file...]
+//
+// Bytes are classified eight at a time: a 64-bit word is
+// compared against each white space character at once, leaving
+// the top bit of each byte that matched, so newlines and word
+// starts (a non-space byte after a space) are counted with a few
+// word operations rather than a test per byte. Whatever is left
+// over at the end of a read goes through a table.
+//
+// With -j, each file is split into n pieces, which forked
+// children count with pread() at the same time, each told
+// whether the byte before its piece was a space.
 
+#define ONES  0x0101010101010101UL
+#define HIGHS 0x8080808080808080UL
+#define LOWS  0x7f7f7f7f7f7f7f7fUL
+
+#define MAXJOBS 16
+
+uint64 buf[4096];       // 32 KiB, word aligned
+char isspace[256];
+
+struct count {
+  uint64 l, w, c;
+};
+
+// the top bit of each byte of x that equals c.
+static inline uint64
+eq(uint64 x, int c)
+{
+  uint64 t = x ^ (ONES * c);
+
+  return ~(((t & LOWS) + LOWS) | t | LOWS);
+}
+
+// the number of bytes of m, a set of top bits, that are set.
+static inline int
+nbytes(uint64 m)
+{
+  return ((m >> 7) * ONES) >> 56;
+}
+
+// count n bytes of p into k. *sp says whether the byte before
+// p was white space, and is left saying whether the last was.
 void
-wc(int fd, char *name)
+count(char *p, int n, struct count *k, int *sp)
 {
-  int i, n;
-  int l, w, c, inword;
-
-  l = w = c = 0;
-  inword = 0;
-  while((n = read(fd, buf, sizeof(buf))) > 0){
-    for(i=0; i<n; i++){
-      c++;
-      if(buf[i] == '\n')
-        l++;
-      if(strchr(" \r\t\n\v", buf[i]))
-        inword = 0;
-      else if(!inword){
-        w++;
-        inword = 1;
+  uint64 x, s, *wp = (uint64*)p;
+  int i, nw = n / 8;
+  uint64 prev = *sp ? 0x80 : 0;
+
+  for(i = 0; i < nw; i++){
+    x = wp[i];
+    s = eq(x, ' ') | eq(x, '\n') | eq(x, '\t') | eq(x, '\r') | eq(x, '\v');
+    k->l += nbytes(eq(x, '\n'));
+    // a word starts at each non-space byte whose predecessor,
+    // the next byte down, or the last of the word before, is
+    // a space.
+    k->w += nbytes(~s & HIGHS & ((s << 8) | prev));
+    prev = s >> 56;
+  }
+  *sp = prev != 0;
+  for(i = nw * 8; i < n; i++){
+    if(p[i] == '\n')
+      k->l++;
+    if(isspace[(uchar)p[i]])
+      *sp = 1;
+    else if(*sp){
+      k->w++;
+      *sp = 0;
+    }
+  }
+  k->c += n;
+}
+
+// count at most len bytes of fd from off, or all that's left
+// if len is -1, with read() if off is -1.
+void
+countfd(int fd, int off, int len, struct count *k, int sp)
+{
+  int n, m;
+
+  for(;;){
+    m = sizeof(buf);
+    if(len >= 0 && len < m)
+      m = len;
+    if(m == 0)
+      break;
+    n = off < 0 ? read(fd, buf, m) : pread(fd, buf, m, off);
+    if(n <= 0){
+      if(n < 0){
+        printf("wc: read error\n");
+        exit(1);
       }
+      break;
     }
+    count((char*)buf, n, k, &sp);
+    if(off >= 0)
+      off += n;
+    if(len >= 0)
+      len -= n;
   }
-  if(n < 0){
-    printf("wc: read error\n");
+}
+
+// count the file fd with nj children, each taking a piece.
+void
+pcount(int fd, int nj, struct count *k)
+{
+  struct stat st;
+  struct count part;
+  int p[2], j, pid, off, len, piece, sp;
+  char c;
+
+  if(fstat(fd, &st) < 0 || st.type != T_FILE || st.size < nj * sizeof(buf)){
+    countfd(fd, -1, -1, k, 1); // not worth splitting
+    return;
+  }
+  if(pipe(p) < 0){
+    printf("wc: pipe failed\n");
     exit(1);
   }
-  printf("%d %d %d %s\n", l, w, c, name);
+  piece = (st.size / nj + sizeof(buf) - 1) / sizeof(buf) * sizeof(buf);
+  for(j = 0; j < nj; j++){
+    off = j * piece;
+    len = j == nj - 1 ? st.size - off : piece;
+    if(off >= st.size)
+      break;
+    if((pid = fork()) < 0){
+      printf("wc: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(p[0]);
+      sp = 1;
+      if(off > 0 && pread(fd, &c, 1, off - 1) == 1)
+        sp = isspace[(uchar)c];
+      memset(&part, 0, sizeof(part));
+      countfd(fd, off, len, &part, sp);
+      write(p[1], &part, sizeof(part));
+      exit(0);
+    }
+  }
+  close(p[1]);
+  while(read(p[0], &part, sizeof(part)) == sizeof(part)){
+    k->l += part.l;
+    k->w += part.w;
+    k->c += part.c;
+  }
+  close(p[0]);
+  while(j-- > 0)
+    wait(0);
+}
+
+void
+wc(int fd, char *name, int nj)
+{
+  struct count k;
+
+  memset(&k, 0, sizeof(k));
+  if(nj > 1)
+    pcount(fd, nj, &k);
+  else
+    countfd(fd, -1, -1, &k, 1);
+  printf("%l %l %l %s\n", k.l, k.w, k.c, name);
 }
 
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, nj = 1;
+  char *s;
+
+  for(s = " \r\t\n\v"; *s; s++)
+    isspace[(uchar)*s] = 1;
+
+  if(argc > 2 && strcmp(argv[1], "-j") == 0){
+    nj = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+    if(nj <= 0 || nj > MAXJOBS){
+      printf("wc: -j takes 1 to %d\n", MAXJOBS);
+      exit(1);
+    }
+  }
 
   if(argc <= 1){
-    wc(0, "");
+    wc(0, "", 1);
     exit(0);
   }
 
@@ -47,7 +197,7 @@ main(int argc, char *argv[])
       printf("wc: cannot open %s\n", argv[i]);
       exit(1);
     }
-    wc(fd, argv[i]);
+    wc(fd, argv[i], nj);
     close(fd);
   }
   exit(0);
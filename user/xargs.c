@@ -1,47 +1,128 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/param.h"
+#include "kernel/riscv.h"
 #include "user/user.h"
 #include "kernel/fs.h"
 
-#define MSGSIZE 16 // 缓冲区的大小是16字节
+// xargs [-n max] [-P procs] command [args...]
+// 标准输入的每一行是一个参数，接在 command 的参数后面执行。
+// 一次执行最多带 max 个输入参数（默认为 exec() 允许的最多个数），
+// 同时最多有 procs 个子进程在运行（默认 1 个），
+// 所以 find | xargs -P 4 grep 既少执行很多次，又能用上多个 CPU。
+//
+// echo hello too | xargs echo bye
+
+#define ARGBYTES (PGSIZE/2) // 一次执行的输入参数最多占用的字节数，exec()要把它们放进一页栈里
+
+char buf[1024];            // 从标准输入读入的数据
+char line[ARGBYTES];       // 正在拼接的一行
+int nline;
+char pool[ARGBYTES];       // 本批输入参数的字符串
+int npool;
+char *xargv[MAXARG];       // 存储执行命令的参数，类似于argv[]
+int base;                  // 命令本身的参数个数
+int xargc;                 // 当前的参数个数，包括本批的输入参数
+int maxn = MAXARG - 1;     // -n：一次执行最多带的输入参数
+int maxp = 1;              // -P：最多同时运行的子进程
+int running;               // 正在运行的子进程数
+int status;                // 有子进程失败则为 1
+
+// 等一个子进程结束
+void
+waitone(void)
+{
+  int xst;
+
+  if(wait(&xst) < 0)
+    return;
+  running--;
+  if(xst != 0)
+    status = 1;
+}
+
+// 用本批参数执行命令，子进程太多时先等一个结束
+void
+run(void)
+{
+  if(xargc == base)
+    return;
+  xargv[xargc] = 0;
+  while(running >= maxp)
+    waitone();
+  // spawn()在返回前已经把参数复制进内核，pool 可以马上重用
+  if(spawn(xargv[0], xargv, 0, 0) < 0){
+    fprintf(2, "xargs: spawn %s failed\n", xargv[0]);
+    status = 1;
+  } else {
+    running++;
+  }
+  xargc = base;
+  npool = 0;
+}
+
+// 把一行加入本批参数，放不下时先执行已有的
+void
+addarg(char *s, int n)
+{
+  if(n == 0)
+    return;
+  if(xargc - base >= maxn || xargc >= MAXARG - 1 || npool + n + 1 > sizeof(pool))
+    run();
+  memmove(pool + npool, s, n);
+  pool[npool + n] = 0;
+  xargv[xargc++] = pool + npool;
+  npool += n + 1;
+}
 
-// echo hello too | echo  bye
 int
-main(int argc, char *argv[]){
-    // sleep(10);
-    // Q1:获取前一个命令的标准化输出"hello too"（即此命令的标准化输入）
-    char buf[MSGSIZE]; 
-    read(0, buf, MSGSIZE); // 从标准输入读取数据，并将其存储在 buf 中
-
-    // Q2:获取到自己的命令行参数"bye""
-    char *xargv[MAXARG]; // 存储执行命令的参数，类似于argv[]
-    int xargc = 0; // 参数个数，类似于argc
-    for (int i = 1; i < argc; i++){ //将命令行参数（除了程序名argv[0]）都复制到 xargv 中
-        xargv[xargc] = argv[i];
-        xargc ++;
-    }
-    char *p = buf; //p 指向读取的数据 buf 的起始位置
-    for (int i = 0; i < MSGSIZE; i++){
-        if (buf[i] == '\n'){ //在buff寻找到一行完整的输入
-            int pid = fork();
-            if (pid > 0){
-                p = &buf[i+1];
-                wait(0);
-            }
-            else{
-                // Q3:执行exec()将hello too和bye拼接
-                buf[i] = 0; //将\n替换为\0
-                xargv[xargc] = p; //将当前行内容的起始地址赋值给xargv数组的下一个空位置
-                xargc ++;
-                xargv[xargc] = 0;
-                xargc ++;
-
-                exec(xargv[0], xargv);
-                exit(0);
-            }
-        }
+main(int argc, char *argv[])
+{
+  int i, n, toolong = 0;
+
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-n") == 0)
+      maxn = atoi(argv[2]);
+    else if(strcmp(argv[1], "-P") == 0)
+      maxp = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || argv[1][0] == '-' || maxn <= 0 || maxp <= 0 || argc - 1 >= MAXARG - 1){
+    fprintf(2, "Usage: xargs [-n max] [-P procs] command [args...]\n");
+    exit(1);
+  }
+  if(maxn > MAXARG - 1)
+    maxn = MAXARG - 1;
+
+  // 将命令行参数（除了程序名argv[0]）都复制到 xargv 中
+  for(i = 1; i < argc; i++)
+    xargv[base++] = argv[i];
+  xargc = base;
+
+  // 成块读入标准输入，而不是一次一个字符
+  while((n = read(0, buf, sizeof(buf))) > 0){
+    for(i = 0; i < n; i++){
+      if(buf[i] == '\n'){
+        if(!toolong)
+          addarg(line, nline);
+        nline = 0;
+        toolong = 0;
+      } else if(nline < sizeof(line) - 1){
+        line[nline++] = buf[i];
+      } else if(!toolong){
+        fprintf(2, "xargs: line too long\n");
+        toolong = 1;
+        status = 1;
+      }
     }
-    wait(0);
-    exit(0);
-}
\ No newline at end of file
+  }
+  if(!toolong)
+    addarg(line, nline); // 最后一行可能没有换行符
+  run();
+  while(running > 0)
+    waitone();
+  exit(status);
+}